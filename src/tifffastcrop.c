@@ -24,6 +24,13 @@
 #include <tiffio.h>
 #include <jpeglib.h>
 #include <math.h> /* lroundl */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 
 #include "config.h"
 
@@ -55,22 +62,35 @@ static uint32_t requestedxmin = 0;
 static uint32_t requestedymin = 0;
 static uint32_t requestedwidth = 0;
 static uint32_t requestedlength = 0;
+struct region {
+	uint32_t xmin, ymin, width, length;
+	char * outfilename; /* NULL if not given */
+};
+static uint32_t number_of_regions = 0;
+static struct region * regions = NULL;
+static int64_t extractgeometryregion = -1; /* the region of option -E */
 static uint64_t diroff = 0;
 static uint16_t number_of_dirnum_ranges = 0;
 static uint16_t * dirnum_ranges_starts = NULL;
 static uint16_t * dirnum_ranges_ends = NULL;
 static int verbose = 0;
+static int number_of_threads = 1;
 
 #define OUTPUT_FORMAT_TIFF 0
 #define OUTPUT_FORMAT_JPEG 1
 #define OUTPUT_FORMAT_PNG  2
 static int output_format = -1;
+static int guess_output_format_of_each_region = 0;
 static const char TIFF_SUFFIX[] = "tif";
 static const char JPEG_SUFFIX[] = "jpg";
 static const char PNG_SUFFIX[] = "png";
 static const char * OUTPUT_SUFFIX[]= {TIFF_SUFFIX, JPEG_SUFFIX, PNG_SUFFIX};
 
 static int big_tiff = 0;
+static uint32_t outtilewidth = 0, outtilelength = 0; /* 0: stripped */
+static uint32_t outrowsperstrip = 0; /* 0: a single strip */
+static int jpeg_dct_copy = 0; /* JPEG output by copy of DCT coefficients */
+static double requested_scale = 0; /* 0: extracts at full resolution */
 static uint32_t defg3opts = (uint32_t)-1;
 static int jpeg_quality = -1, default_jpeg_quality = 75; /* JPEG quality */
 static int png_quality = -1, default_png_quality = 6; /* PNG quality */
@@ -80,6 +100,43 @@ static uint16_t defpredictor = (uint16_t) -1;
 static int defpreset = -1;
 /*static uint16_t defphotometric = (uint16_t) -1;*/
 
+	/* Cache of decoded tiles, shared by all extracts made from the same
+	 input file. Tiles are identified by the offset of their directory
+	 and their number in it; the least recently used ones are dropped
+	 when the budget is exceeded. */
+struct cached_tile {
+	uint64_t diroff;
+	uint32_t tile;
+	tmsize_t size;
+	unsigned char * data;
+	struct cached_tile * newer, * older; /* LRU list */
+	struct cached_tile * nextinbucket;
+};
+static uint64_t tile_cache_budget = 0; /* in bytes; 0 means no cache */
+static uint64_t tile_cache_used = 0;
+static uint64_t tile_cache_hits = 0, tile_cache_misses = 0;
+static struct cached_tile * tile_cache_newest = NULL;
+static struct cached_tile * tile_cache_oldest = NULL;
+static struct cached_tile ** tile_cache_buckets = NULL;
+static uint32_t tile_cache_number_of_buckets = 0;
+
+	/* Dry run (option -y): instead of writing the extracts, their plan
+	 is reported on stdout as JSON, with what each one reads from the
+	 tiles or strips ("units") of the input file. Decodes are counted
+	 as redundant when a unit was decoded for a previous extract of the
+	 same directory, and would not still be in the tile cache (estimated
+	 as if the cache held all the tiles decoded since). */
+static int dryrun = 0;
+static uint32_t dryrun_number_of_extracts = 0;
+static uint64_t dryrun_diroff = 0; /* directory of dryrun_lastdecode */
+static uint64_t * dryrun_lastdecode = NULL; /* per unit, 1 + value of
+			dryrun_decodedbytes after its last decode; 0: never */
+static uint64_t dryrun_decodedbytes = 0;
+static uint64_t dryrun_total_units = 0, dryrun_total_compressedbytes = 0;
+static uint64_t dryrun_total_decodedpixels = 0;
+static uint64_t dryrun_total_redundantdecodes = 0;
+static uint64_t dryrun_peak_buffer_bytes = 0;
+
 
 static void my_asprintf(char ** ret, const char * format, ...)
 {
@@ -245,6 +302,365 @@ static tsize_t computeWidthInBytes(uint32_t width_in_pixels, uint16_t bitsperpix
 }
 
 
+static const uint8_t left_masks[] =
+    { 0x00, 0x80, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe, 0xff };
+
+
+	/* Kernels making n bytes out of the bit string starting at bit
+	 bitoffset (1 to 7) of in: out[j] = in[j] << bitoffset |
+	 in[j+1] >> (8 - bitoffset). They read in[0] to in[n]. */
+static void shiftMergeBytesScalar(uint8_t* out, const uint8_t* in,
+	uint32_t n, int bitoffset)
+{
+	uint32_t j;
+
+	for (j = 0 ; j < n ; j++)
+		out[j] = (uint8_t) (in[j] << bitoffset) |
+		    (in[j+1] >> (8 - bitoffset));
+}
+
+#ifdef HAVE_X86_SIMD_KERNELS
+	/* Bytes are shifted as pairs (16-bit lanes), and the bits which
+	 moved from one byte to its neighbour are masked out */
+__attribute__((target("sse2")))
+static void shiftMergeBytesSSE2(uint8_t* out, const uint8_t* in,
+	uint32_t n, int bitoffset)
+{
+	const __m128i lshift = _mm_cvtsi32_si128(bitoffset);
+	const __m128i rshift = _mm_cvtsi32_si128(8 - bitoffset);
+	const __m128i lmask = _mm_set1_epi8((char) (0xff << bitoffset));
+	const __m128i rmask = _mm_set1_epi8((char) (0xff >> (8 - bitoffset)));
+	uint32_t j = 0;
+
+	for ( ; j + 16 <= n ; j += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (in + j));
+		__m128i b = _mm_loadu_si128((const __m128i *) (in + j + 1));
+
+		a = _mm_and_si128(_mm_sll_epi16(a, lshift), lmask);
+		b = _mm_and_si128(_mm_srl_epi16(b, rshift), rmask);
+		_mm_storeu_si128((__m128i *) (out + j), _mm_or_si128(a, b));
+	}
+	shiftMergeBytesScalar(out + j, in + j, n - j, bitoffset);
+}
+
+__attribute__((target("avx2")))
+static void shiftMergeBytesAVX2(uint8_t* out, const uint8_t* in,
+	uint32_t n, int bitoffset)
+{
+	const __m128i lshift = _mm_cvtsi32_si128(bitoffset);
+	const __m128i rshift = _mm_cvtsi32_si128(8 - bitoffset);
+	const __m256i lmask = _mm256_set1_epi8((char) (0xff << bitoffset));
+	const __m256i rmask = _mm256_set1_epi8((char) (0xff >> (8 - bitoffset)));
+	uint32_t j = 0;
+
+	for ( ; j + 32 <= n ; j += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (in + j));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (in + j + 1));
+
+		a = _mm256_and_si256(_mm256_sll_epi16(a, lshift), lmask);
+		b = _mm256_and_si256(_mm256_srl_epi16(b, rshift), rmask);
+		_mm256_storeu_si256((__m256i *) (out + j), _mm256_or_si256(a, b));
+	}
+	shiftMergeBytesSSE2(out + j, in + j, n - j, bitoffset);
+}
+#endif
+
+static void (*shiftMergeBytes)(uint8_t* out, const uint8_t* in,
+	uint32_t n, int bitoffset) = shiftMergeBytesScalar;
+
+
+	/* Kernels of the vertical pass of scaling (see cpScaledRows), over
+	 the n samples of a row: sums[i] += row[i] for box filtering, and
+	 blend[i] = row[i] + weight * (row2[i] - row[i]) for bilinear
+	 interpolation. The vectorized versions compute exactly the same
+	 values as the scalar ones. */
+static void accumulateRow8Scalar(uint32_t* sums, const uint8_t* row,
+	size_t n)
+{
+	size_t i;
+
+	for (i = 0 ; i < n ; i++)
+		sums[i] += row[i];
+}
+
+static void accumulateRow16Scalar(uint32_t* sums, const uint16_t* row,
+	size_t n)
+{
+	size_t i;
+
+	for (i = 0 ; i < n ; i++)
+		sums[i] += row[i];
+}
+
+static void blendRows8Scalar(float* blend, const uint8_t* row,
+	const uint8_t* row2, float weight, size_t n)
+{
+	size_t i;
+
+	for (i = 0 ; i < n ; i++)
+		blend[i] = row[i] + weight * (row2[i] - row[i]);
+}
+
+static void blendRows16Scalar(float* blend, const uint16_t* row,
+	const uint16_t* row2, float weight, size_t n)
+{
+	size_t i;
+
+	for (i = 0 ; i < n ; i++)
+		blend[i] = row[i] + weight * (row2[i] - row[i]);
+}
+
+#ifdef HAVE_X86_SIMD_KERNELS
+	/* Samples are widened to 32 bits by interleaving them with zeros */
+__attribute__((target("sse2")))
+static void accumulateRow8SSE2(uint32_t* sums, const uint8_t* row,
+	size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for ( ; i + 16 <= n ; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i w[4];
+		int k;
+
+		w[0] = _mm_unpacklo_epi16(lo, zero);
+		w[1] = _mm_unpackhi_epi16(lo, zero);
+		w[2] = _mm_unpacklo_epi16(hi, zero);
+		w[3] = _mm_unpackhi_epi16(hi, zero);
+		for (k = 0 ; k < 4 ; k++) {
+			__m128i * p = (__m128i *) (sums + i + 4 * k);
+			_mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p),
+			    w[k]));
+		}
+	}
+	accumulateRow8Scalar(sums + i, row + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void accumulateRow16SSE2(uint32_t* sums, const uint16_t* row,
+	size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for ( ; i + 8 <= n ; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+		__m128i * p0 = (__m128i *) (sums + i);
+		__m128i * p1 = (__m128i *) (sums + i + 4);
+
+		_mm_storeu_si128(p0, _mm_add_epi32(_mm_loadu_si128(p0),
+		    _mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128(p1, _mm_add_epi32(_mm_loadu_si128(p1),
+		    _mm_unpackhi_epi16(v, zero)));
+	}
+	accumulateRow16Scalar(sums + i, row + i, n - i);
+}
+
+	/* blend[0..3] from 4 samples of each row widened to 32 bits */
+__attribute__((target("sse2")))
+static inline void blend4SSE2(float* blend, __m128i a, __m128i b,
+	__m128 weight)
+{
+	__m128 fa = _mm_cvtepi32_ps(a), fb = _mm_cvtepi32_ps(b);
+
+	_mm_storeu_ps(blend, _mm_add_ps(fa,
+	    _mm_mul_ps(weight, _mm_sub_ps(fb, fa))));
+}
+
+__attribute__((target("sse2")))
+static void blendRows8SSE2(float* blend, const uint8_t* row,
+	const uint8_t* row2, float weight, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 w = _mm_set1_ps(weight);
+	size_t i = 0;
+
+	for ( ; i + 16 <= n ; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (row + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (row2 + i));
+		__m128i alo = _mm_unpacklo_epi8(a, zero);
+		__m128i ahi = _mm_unpackhi_epi8(a, zero);
+		__m128i blo = _mm_unpacklo_epi8(b, zero);
+		__m128i bhi = _mm_unpackhi_epi8(b, zero);
+
+		blend4SSE2(blend + i, _mm_unpacklo_epi16(alo, zero),
+		    _mm_unpacklo_epi16(blo, zero), w);
+		blend4SSE2(blend + i + 4, _mm_unpackhi_epi16(alo, zero),
+		    _mm_unpackhi_epi16(blo, zero), w);
+		blend4SSE2(blend + i + 8, _mm_unpacklo_epi16(ahi, zero),
+		    _mm_unpacklo_epi16(bhi, zero), w);
+		blend4SSE2(blend + i + 12, _mm_unpackhi_epi16(ahi, zero),
+		    _mm_unpackhi_epi16(bhi, zero), w);
+	}
+	blendRows8Scalar(blend + i, row + i, row2 + i, weight, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blendRows16SSE2(float* blend, const uint16_t* row,
+	const uint16_t* row2, float weight, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 w = _mm_set1_ps(weight);
+	size_t i = 0;
+
+	for ( ; i + 8 <= n ; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (row + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (row2 + i));
+
+		blend4SSE2(blend + i, _mm_unpacklo_epi16(a, zero),
+		    _mm_unpacklo_epi16(b, zero), w);
+		blend4SSE2(blend + i + 4, _mm_unpackhi_epi16(a, zero),
+		    _mm_unpackhi_epi16(b, zero), w);
+	}
+	blendRows16Scalar(blend + i, row + i, row2 + i, weight, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulateRow8AVX2(uint32_t* sums, const uint8_t* row,
+	size_t n)
+{
+	size_t i = 0;
+
+	for ( ; i + 8 <= n ; i += 8) {
+		__m256i v = _mm256_cvtepu8_epi32(
+		    _mm_loadl_epi64((const __m128i *) (row + i)));
+		__m256i * p = (__m256i *) (sums + i);
+
+		_mm256_storeu_si256(p, _mm256_add_epi32(
+		    _mm256_loadu_si256(p), v));
+	}
+	accumulateRow8Scalar(sums + i, row + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulateRow16AVX2(uint32_t* sums, const uint16_t* row,
+	size_t n)
+{
+	size_t i = 0;
+
+	for ( ; i + 8 <= n ; i += 8) {
+		__m256i v = _mm256_cvtepu16_epi32(
+		    _mm_loadu_si128((const __m128i *) (row + i)));
+		__m256i * p = (__m256i *) (sums + i);
+
+		_mm256_storeu_si256(p, _mm256_add_epi32(
+		    _mm256_loadu_si256(p), v));
+	}
+	accumulateRow16Scalar(sums + i, row + i, n - i);
+}
+
+	/* blend[0..7] from 8 samples of each row widened to 32 bits */
+__attribute__((target("avx2")))
+static inline void blend8AVX2(float* blend, __m256i a, __m256i b,
+	__m256 weight)
+{
+	__m256 fa = _mm256_cvtepi32_ps(a), fb = _mm256_cvtepi32_ps(b);
+
+	_mm256_storeu_ps(blend, _mm256_add_ps(fa,
+	    _mm256_mul_ps(weight, _mm256_sub_ps(fb, fa))));
+}
+
+__attribute__((target("avx2")))
+static void blendRows8AVX2(float* blend, const uint8_t* row,
+	const uint8_t* row2, float weight, size_t n)
+{
+	const __m256 w = _mm256_set1_ps(weight);
+	size_t i = 0;
+
+	for ( ; i + 8 <= n ; i += 8)
+		blend8AVX2(blend + i, _mm256_cvtepu8_epi32(
+		    _mm_loadl_epi64((const __m128i *) (row + i))),
+		    _mm256_cvtepu8_epi32(
+		    _mm_loadl_epi64((const __m128i *) (row2 + i))), w);
+	blendRows8Scalar(blend + i, row + i, row2 + i, weight, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blendRows16AVX2(float* blend, const uint16_t* row,
+	const uint16_t* row2, float weight, size_t n)
+{
+	const __m256 w = _mm256_set1_ps(weight);
+	size_t i = 0;
+
+	for ( ; i + 8 <= n ; i += 8)
+		blend8AVX2(blend + i, _mm256_cvtepu16_epi32(
+		    _mm_loadu_si128((const __m128i *) (row + i))),
+		    _mm256_cvtepu16_epi32(
+		    _mm_loadu_si128((const __m128i *) (row2 + i))), w);
+	blendRows16Scalar(blend + i, row + i, row2 + i, weight, n - i);
+}
+#endif
+
+static void (*accumulateRow8)(uint32_t* sums, const uint8_t* row,
+	size_t n) = accumulateRow8Scalar;
+static void (*accumulateRow16)(uint32_t* sums, const uint16_t* row,
+	size_t n) = accumulateRow16Scalar;
+static void (*blendRows8)(float* blend, const uint8_t* row,
+	const uint8_t* row2, float weight, size_t n) = blendRows8Scalar;
+static void (*blendRows16)(float* blend, const uint16_t* row,
+	const uint16_t* row2, float weight, size_t n) = blendRows16Scalar;
+
+
+	/* Choose the fastest kernels the processor supports. To be called
+	 before any thread is started. */
+static void selectKernels()
+{
+#ifdef HAVE_X86_SIMD_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		shiftMergeBytes = shiftMergeBytesAVX2;
+		accumulateRow8 = accumulateRow8AVX2;
+		accumulateRow16 = accumulateRow16AVX2;
+		blendRows8 = blendRows8AVX2;
+		blendRows16 = blendRows16AVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		shiftMergeBytes = shiftMergeBytesSSE2;
+		accumulateRow8 = accumulateRow8SSE2;
+		accumulateRow16 = accumulateRow16SSE2;
+		blendRows8 = blendRows8SSE2;
+		blendRows16 = blendRows16SSE2;
+	}
+	if (verbose && shiftMergeBytes != shiftMergeBytesScalar)
+		fprintf(stderr, "Using %s kernels for sub-byte copies and "
+			"scaling.\n",
+			shiftMergeBytes == shiftMergeBytesAVX2 ? "AVX2" :
+			"SSE2");
+#endif
+}
+
+
+	/* Get nbits (1 to 8) bits starting at bit bitposition of in, as the
+	 most significant bits of the result, reading no byte which holds
+	 none of them */
+static uint8_t getBitsAt(const uint8_t* in, uint32_t bitposition,
+	int nbits)
+{
+	const uint8_t* p = in + bitposition / 8;
+	int s = bitposition % 8;
+	uint8_t v = (uint8_t) (p[0] << s);
+
+	if (s + nbits > 8)
+		v |= p[1] >> (8 - s);
+	return v & left_masks[nbits];
+}
+
+
+	/* Set nbits (1 to 8) bits of out starting at bit bitposition, which
+	 must lie in a single byte, to the most significant bits of v */
+static void setBitsAt(uint8_t* out, uint32_t bitposition, int nbits,
+	uint8_t v)
+{
+	uint8_t* p = out + bitposition / 8;
+	int s = bitposition % 8;
+	uint8_t mask = left_masks[nbits] >> s;
+
+	*p = (*p & ~mask) | ((v >> s) & mask);
+}
+
+
 static void cpBufToBuf(uint8_t* out_beginningofline, uint32_t out_x,
 	uint8_t* in_beginningofline, uint32_t in_x,
 	uint32_t widthtocopyinsamples, uint16_t bitspersample,
@@ -261,142 +677,57 @@ static void cpBufToBuf(uint8_t* out_beginningofline, uint32_t out_x,
 		return;
 	}
 
-	/* Hard case. Do computations to prepare steps 1, 2, 3: */
-	static const uint8_t left_masks[] =
-	    { 0x00, 0x80, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe, 0xff };
-
+	/* Hard case. Do computations to prepare steps 1, 2, 3 (in bits;
+	 the same for all rows): */
 	assert(8 % bitspersample == 0);
-	int samplesperbyte = 8/bitspersample;
-	int out_x_start_whole_outbytes = out_x;
-	int in_x_start_whole_outbytes  = in_x;
-	uint32_t in_skew  = in_linewidthinbytes;
-	uint32_t out_skew = out_linewidthinbytes;
-
-	 /* 1. Copy samples to complete the first byte (if incomplete) of dest. */
-	int out_startpositioninincompletefirstbyte = out_x % samplesperbyte;
-	int in_startpositioninfirstbyte = in_x % samplesperbyte;
-	int out_samplesinincompletefirstbyte = 0;
-	int shift_first_inbyte_to_first_incompl_outbyte =
-		(out_startpositioninincompletefirstbyte -
-		in_startpositioninfirstbyte) * bitspersample;
-	int shift_second_inbyte_to_first_incompl_outbyte = 0;
-	uint8_t mask_of_first_inbyte_to_first_incompl_outbyte = 0;
-	uint8_t mask_of_second_inbyte_to_first_incompl_outbyte = 0;
-
-	if (out_startpositioninincompletefirstbyte) {
-		out_samplesinincompletefirstbyte =
-		    samplesperbyte - out_startpositioninincompletefirstbyte;
-		if (out_samplesinincompletefirstbyte > widthtocopyinsamples)
-			out_samplesinincompletefirstbyte = widthtocopyinsamples;
-		int samples_available_in_first_inbyte =
-		    samplesperbyte - in_startpositioninfirstbyte;
-
-		if (samples_available_in_first_inbyte >= out_samplesinincompletefirstbyte) {
-			mask_of_first_inbyte_to_first_incompl_outbyte =
-			    left_masks[out_samplesinincompletefirstbyte * bitspersample] >>
-				(in_startpositioninfirstbyte * bitspersample);
-		} else {
-			mask_of_first_inbyte_to_first_incompl_outbyte =
-			    left_masks[samples_available_in_first_inbyte *
-					bitspersample] >>
-				(in_startpositioninfirstbyte * bitspersample);
-			mask_of_second_inbyte_to_first_incompl_outbyte =
-			    left_masks[(out_samplesinincompletefirstbyte -
-				samples_available_in_first_inbyte) * bitspersample];
-			shift_second_inbyte_to_first_incompl_outbyte =
-			    samples_available_in_first_inbyte * bitspersample;
-			in_skew--;
-		}
-
-		in_x_start_whole_outbytes += out_samplesinincompletefirstbyte;
-		out_x_start_whole_outbytes += out_samplesinincompletefirstbyte;
-	}
-
-	/* 2. Write as many whole bytes as possible in dest. */
-	/* Examples of bits in in_bytes:
-	  6+2|8|1+7 -> (6+)2|6+2|6(+2)  11 bits -> 2 bytes, 1 whole byte
-	  6+2|8|7+1 -> (6+)2|6+2|6+2    17 bits -> 3 bytes, 2 whole bytes
-	   Strategy: copy whole bytes. Then make an additional,
-	  incomplete byte (which shall have
-	  out_samplesinincompletelastbyte samples) with the remaining (not
-	  yet copied) bits of current byte in input and, if these bits
-	  are not enough, the first in_bitstoreadinlastbyte bits of next
-	  byte in input. */
-	uint8_t* out_wholeoutbytes = out_beginningofline +
-		out_x_start_whole_outbytes / samplesperbyte;
-	uint8_t* in = in_beginningofline + in_x / samplesperbyte;
-	uint32_t wholebytesperline =
-	    ((widthtocopyinsamples-out_samplesinincompletefirstbyte) *
-		bitspersample) / 8;
-	int in_bitoffset = (in_x_start_whole_outbytes % samplesperbyte) * bitspersample;
-	if (in_bitoffset) {
-		in_skew -= wholebytesperline + 1;
-		out_skew -= wholebytesperline;
-	}
-
-	/* 3. Copy samples to complete the last byte (if incomplete) of dest. */
-	int out_samplesinincompletelastbyte =
-		(out_x + widthtocopyinsamples) % samplesperbyte;
-	if (out_samplesinincompletelastbyte) {
-		if (in_bitoffset == 0)
-			wholebytesperline++; /* Let memcpy start writing last byte */
-		else
-			out_skew--;
-	}
-	int in_bitstoreadinlastbyte =
-	    out_samplesinincompletelastbyte * bitspersample - (8-in_bitoffset);
-	if (in_bitstoreadinlastbyte < 0)
-		in_bitstoreadinlastbyte = 0;
+	uint32_t out_bit = out_x * bitspersample;
+	uint32_t in_bit = in_x * bitspersample;
+	uint32_t bitstocopy = widthtocopyinsamples * bitspersample;
+
+	 /* 1. Bits to complete the first byte (if incomplete) of dest. */
+	int firstbits = out_bit % 8 ? 8 - out_bit % 8 : 0;
+	if (firstbits > bitstocopy)
+		firstbits = bitstocopy;
+
+	/* 2. Whole bytes of dest, copied with memcpy if the bits are
+	 aligned in source, else made by shifting and merging pairs of
+	 source bytes. */
+	uint32_t wholebytes_out_bit = out_bit + firstbits;
+	uint32_t wholebytes_in_bit = in_bit + firstbits;
+	uint32_t wholebytesperline = (bitstocopy - firstbits) / 8;
+	int in_bitoffset = wholebytes_in_bit % 8;
+
+	/* 3. Bits to complete the last byte (if incomplete) of dest. */
+	int lastbits = (bitstocopy - firstbits) % 8;
+	uint32_t lastbyte_in_bit = wholebytes_in_bit + wholebytesperline * 8;
 
 	/* Perform steps 1, 2, 3: */
 	while (rows-- > 0) {
-		/* 1. */
-		if (out_startpositioninincompletefirstbyte) {
-			uint8_t a = (*in) & mask_of_first_inbyte_to_first_incompl_outbyte;
-			if (shift_first_inbyte_to_first_incompl_outbyte >= 0)
-				a >>= shift_first_inbyte_to_first_incompl_outbyte;
-			else
-				a <<= -shift_first_inbyte_to_first_incompl_outbyte;
-			if (shift_second_inbyte_to_first_incompl_outbyte) {
-				in++;
-				a |= ((*in) & mask_of_second_inbyte_to_first_incompl_outbyte)
-				    >> shift_second_inbyte_to_first_incompl_outbyte;
-			}
-
-			*(out_wholeoutbytes-1) &=
-			    left_masks[
-				out_startpositioninincompletefirstbyte *
-				bitspersample];
-			*(out_wholeoutbytes-1) |= a;
-		}
-
-		/* 2. & 3. */
-		if (in_bitoffset == 0) {
-			memcpy(out_wholeoutbytes, in, wholebytesperline);
-			/* out_samplesinincompletelastbyte =
-			 in_bitstoreadinlastbyte / bitspersample in this case */
-			if (in_bitstoreadinlastbyte)
-				*(out_wholeoutbytes + wholebytesperline) |=
-				    (*(in+wholebytesperline))
-				    >> (8-in_bitstoreadinlastbyte);
-		} else {
-			uint32_t j = wholebytesperline;
-			uint8_t acc = (*in++) << in_bitoffset;
+		uint8_t* wholeoutbytes = out_beginningofline +
+		    wholebytes_out_bit / 8;
+		const uint8_t* wholeinbytes = in_beginningofline +
+		    wholebytes_in_bit / 8;
 
-			while (j-- > 0) {
-				acc |= (*in) >> (8-in_bitoffset);
-				*out_wholeoutbytes++ = acc;
-				acc = (*in++) << in_bitoffset;
-			}
-			if (out_samplesinincompletelastbyte) {
-				if (in_bitstoreadinlastbyte)
-					acc |= (*in) >> (8-in_bitstoreadinlastbyte);
-				*out_wholeoutbytes++ = acc;
-			}
-		}
+		/* 1. */
+		if (firstbits)
+			setBitsAt(out_beginningofline, out_bit, firstbits,
+			    getBitsAt(in_beginningofline, in_bit, firstbits));
 
-		in += in_skew;
-		out_wholeoutbytes += out_skew;
+		/* 2. */
+		if (in_bitoffset == 0)
+			memcpy(wholeoutbytes, wholeinbytes, wholebytesperline);
+		else if (wholebytesperline)
+			shiftMergeBytes(wholeoutbytes, wholeinbytes,
+			    wholebytesperline, in_bitoffset);
+
+		/* 3. */
+		if (lastbits)
+			setBitsAt(wholeoutbytes, wholebytesperline * 8,
+			    lastbits, getBitsAt(in_beginningofline,
+			    lastbyte_in_bit, lastbits));
+
+		in_beginningofline += in_linewidthinbytes;
+		out_beginningofline += out_linewidthinbytes;
 	}
 }
 
@@ -543,86 +874,370 @@ static int testAndFixOutTIFFPhotoAndCompressionParameters(TIFF* in,
 }
 
 
-static int cpTiles2Strip(TIFF* in, uint32_t xmin, uint32_t ymin,
+static uint32_t tileCacheBucket(uint64_t diroff, uint32_t tile)
+{
+	uint64_t h = (diroff * 0x9E3779B97F4A7C15ULL) ^ tile;
+	h ^= h >> 29;
+	return (uint32_t) (h % tile_cache_number_of_buckets);
+}
+
+
+static void tileCacheUnlinkFromList(struct cached_tile * c)
+{
+	if (c->newer != NULL)
+		c->newer->older = c->older;
+	else
+		tile_cache_newest = c->older;
+	if (c->older != NULL)
+		c->older->newer = c->newer;
+	else
+		tile_cache_oldest = c->newer;
+}
+
+
+static void tileCachePushNewest(struct cached_tile * c)
+{
+	c->newer = NULL;
+	c->older = tile_cache_newest;
+	if (tile_cache_newest != NULL)
+		tile_cache_newest->newer = c;
+	tile_cache_newest = c;
+	if (tile_cache_oldest == NULL)
+		tile_cache_oldest = c;
+}
+
+
+static void tileCacheDropOldest()
+{
+	struct cached_tile * c = tile_cache_oldest, ** pc;
+
+	tileCacheUnlinkFromList(c);
+	for (pc = &(tile_cache_buckets[tileCacheBucket(c->diroff, c->tile)]) ;
+	    *pc != c ; pc = &((*pc)->nextinbucket))
+		;
+	*pc = c->nextinbucket;
+	tile_cache_used -= c->size;
+	_TIFFfree(c->data);
+	free(c);
+}
+
+
+	/* Return the decoded tile if it is in the cache, NULL otherwise */
+static unsigned char * tileCacheLookup(uint64_t diroff, uint32_t tile)
+{
+	struct cached_tile * c;
+
+	if (tile_cache_buckets == NULL)
+		return NULL;
+	for (c = tile_cache_buckets[tileCacheBucket(diroff, tile)] ;
+	    c != NULL ; c = c->nextinbucket)
+		if (c->diroff == diroff && c->tile == tile) {
+			tileCacheUnlinkFromList(c);
+			tileCachePushNewest(c);
+			return c->data;
+		}
+	return NULL;
+}
+
+
+	/* Give the decoded tile in data (allocated with _TIFFmalloc) to the
+	 cache. Return 0 if the cache did not take it (the caller keeps it) */
+static int tileCacheInsert(uint64_t diroff, uint32_t tile,
+	unsigned char * data, tmsize_t size)
+{
+	struct cached_tile * c;
+	uint32_t b;
+
+	if ((uint64_t) size > tile_cache_budget)
+		return 0;
+
+	if (tile_cache_buckets == NULL) {
+		uint64_t n = 2 * (tile_cache_budget / size) + 1;
+		if (n > (1U << 24))
+			n = 1U << 24;
+		tile_cache_number_of_buckets = n;
+		tile_cache_buckets = calloc(n, sizeof(*tile_cache_buckets));
+		if (tile_cache_buckets == NULL)
+			return 0;
+	}
+
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		return 0;
+	while (tile_cache_used + size > tile_cache_budget)
+		tileCacheDropOldest();
+
+	c->diroff = diroff;
+	c->tile = tile;
+	c->size = size;
+	c->data = data;
+	b = tileCacheBucket(diroff, tile);
+	c->nextinbucket = tile_cache_buckets[b];
+	tile_cache_buckets[b] = c;
+	tileCachePushNewest(c);
+	tile_cache_used += size;
+	return 1;
+}
+
+
+static void tileCacheFree()
+{
+	if (verbose && tile_cache_budget)
+		fprintf(stderr, "Tile cache: " UINT64_FORMAT " hits, "
+			UINT64_FORMAT " misses.\n",
+			tile_cache_hits, tile_cache_misses);
+	while (tile_cache_oldest != NULL)
+		tileCacheDropOldest();
+	free(tile_cache_buckets);
+	tile_cache_buckets = NULL;
+	tile_cache_number_of_buckets = 0;
+}
+
+
+	/* Open another handle on the directory of the input file being
+	 read, for a worker thread. Decoding parameters are set as on the
+	 main handle. */
+static TIFF* openInputHandleForThread(TIFF* in)
+{
+	uint64_t diroff = TIFFCurrentDirOffset(in);
+	uint16_t compression;
+	TIFF* tin = TIFFOpen(TIFFFileName(in), "r");
+
+	if (tin == NULL)
+		return NULL;
+	if (!TIFFSetSubDirectory(tin, diroff)) {
+		TIFFClose(tin);
+		return NULL;
+	}
+	TIFFGetFieldDefaulted(tin, TIFFTAG_COMPRESSION, &compression);
+	if (compression == COMPRESSION_JPEG)
+		TIFFSetField(tin, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	return tin;
+}
+
+
+	/* Open the handles through which the threads of cpTiles2Strip
+	 read the tiles of in, once for all the bands of an extract: the
+	 first one is in itself. Return NULL on error. */
+static TIFF** openInputHandlesForThreads(TIFF* in)
+{
+	TIFF** tins = calloc(number_of_threads, sizeof(TIFF*));
+	int t;
+
+	if (tins == NULL) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't allocate space for input handles");
+		return NULL;
+	}
+	tins[0] = in;
+	for (t = 1 ; t < number_of_threads ; t++)
+		if ((tins[t] = openInputHandleForThread(in)) == NULL) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't open the file again for thread %d",
+			    t);
+			while (--t > 0)
+				TIFFClose(tins[t]);
+			free(tins);
+			return NULL;
+		}
+	return tins;
+}
+
+
+static void closeInputHandlesForThreads(TIFF** tins)
+{
+	int t;
+
+	if (tins == NULL)
+		return;
+	for (t = 1 ; t < number_of_threads ; t++)
+		TIFFClose(tins[t]);
+	free(tins);
+}
+
+
+	/* Copy the part of the tile at (xminoftile, yminoftile) which is
+	 inside the region to its place in outbuf. *inbuf is a work buffer
+	 of size inbufsize, replaced by a new one if given to the cache. */
+static int cpTileToStrip(TIFF* in, uint64_t indiroff,
+	uint32_t xminoftile, uint32_t yminoftile,
+	uint32_t xmin, uint32_t ymin, uint32_t width, uint32_t length,
+	unsigned char * outbuf, tsize_t outscanlinesizeinbytes,
+	uint16_t bitspersample, uint16_t samplesperpixel,
+	uint32_t intilewidth, uint32_t intilelength,
+	tsize_t intilewidthinbytes, unsigned char ** inbuf, tmsize_t inbufsize)
+{
+	uint32_t xmintocopyintile = xmin > xminoftile ? xmin : xminoftile;
+	uint32_t xmaxplusone = xminoftile + intilewidth;
+	uint32_t ymintocopy = ymin > yminoftile ? ymin : yminoftile;
+	uint32_t ymaxplusone = yminoftile + intilelength;
+	uint32_t tile = TIFFComputeTile(in, xminoftile, yminoftile, 0, 0);
+	unsigned char * bufp = outbuf +
+	    outscanlinesizeinbytes * (ymintocopy - ymin);
+	tsize_t inbufrowoffset =
+	    intilewidthinbytes * (ymintocopy - yminoftile);
+	uint32_t out_x = xmintocopyintile - xmin;
+	uint32_t widthtocopyinpixels, lengthtocopy;
+	int hit = 0;
+
+	if (xmaxplusone > xmin + width)
+		xmaxplusone = xmin + width;
+	if (ymaxplusone > ymin + length)
+		ymaxplusone = ymin + length;
+	widthtocopyinpixels = xmaxplusone - xmintocopyintile;
+	lengthtocopy = ymaxplusone - ymintocopy;
+
+	if (tile_cache_budget) {
+		/* The copy is done inside the critical section, so that the
+		 tile can't be dropped from the cache meanwhile by another
+		 thread. */
+		#pragma omp critical (tile_cache)
+		{
+		unsigned char * cached = tileCacheLookup(indiroff, tile);
+		if (cached != NULL) {
+			cpBufToBuf(bufp, out_x * samplesperpixel,
+			    cached + inbufrowoffset,
+			    (xmintocopyintile-xminoftile) * samplesperpixel,
+			    widthtocopyinpixels * samplesperpixel,
+			    bitspersample, lengthtocopy,
+			    outscanlinesizeinbytes, intilewidthinbytes);
+			tile_cache_hits++;
+			hit = 1;
+		} else
+			tile_cache_misses++;
+		}
+		if (hit)
+			return 0;
+	}
+
+	if (TIFFReadEncodedTile(in, tile, *inbuf, inbufsize) < 0) {
+		TIFFError(TIFFFileName(in),
+		    "Error, can't read tile at "
+		    UINT32_FORMAT ", " UINT32_FORMAT,
+		    xminoftile, yminoftile);
+		return EXIT_IO_ERROR;
+	}
+	cpBufToBuf(bufp, out_x * samplesperpixel, *inbuf + inbufrowoffset,
+	    (xmintocopyintile-xminoftile) * samplesperpixel,
+	    widthtocopyinpixels * samplesperpixel,
+	    bitspersample, lengthtocopy, outscanlinesizeinbytes,
+	    intilewidthinbytes);
+
+	if (tile_cache_budget) {
+		int taken;
+
+		#pragma omp critical (tile_cache)
+		taken = tileCacheInsert(indiroff, tile, *inbuf, inbufsize);
+		if (taken) {
+			*inbuf = (unsigned char *)_TIFFmalloc(inbufsize);
+			if (!*inbuf) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't allocate space for image buffer");
+				return EXIT_INSUFFICIENT_MEMORY;
+			}
+		}
+	}
+	return 0;
+}
+
+
+	/* With more than one thread, each thread decodes whole tiles
+	 through its own handle on the input file, taken from tins (see
+	 openInputHandlesForThreads; NULL: in only, no threads), and copies
+	 them to disjoint parts of outbuf. When pixels are not a whole number of
+	 bytes, two tiles of a tile row may share output bytes, so the work
+	 is then split by tile rows only. */
+static int cpTiles2Strip(TIFF* in, TIFF** tins, uint32_t xmin, uint32_t ymin,
 	uint32_t width, uint32_t length, unsigned char * outbuf,
 	tsize_t outscanlinesizeinbytes, uint16_t bitspersample,
 	uint16_t samplesperpixel)
 {
-	tmsize_t inbufsize;
+	tmsize_t inbufsize = TIFFTileSize(in);
 	uint32_t intilewidth = (uint32_t) -1, intilelength = (uint32_t) -1;
 	tsize_t intilewidthinbytes = TIFFTileRowSize(in);
-	uint32_t y;
-	unsigned char * inbuf, * bufp= outbuf;
+	uint64_t indiroff = TIFFCurrentDirOffset(in);
+	uint32_t firsttilecol, firsttilerow, numberoftilecols, numberoftilerows;
+	int64_t numberofunits;
+	int tilerowsonly = (bitspersample * samplesperpixel) % 8 != 0;
 	int error = 0;
 
 	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
 	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+	if (width == 0 || length == 0)
+		return 0;
+	firsttilecol = xmin / intilewidth;
+	firsttilerow = ymin / intilelength;
+	numberoftilecols = (xmin + width - 1) / intilewidth - firsttilecol + 1;
+	numberoftilerows = (ymin + length - 1) / intilelength - firsttilerow + 1;
+	numberofunits = tilerowsonly ? numberoftilerows :
+	    (int64_t) numberoftilerows * numberoftilecols;
+
+#ifdef _OPENMP
+	#pragma omp parallel num_threads(number_of_threads) \
+	    if (tins != NULL && number_of_threads > 1 && numberofunits > 1)
+#endif
+	{
+	TIFF* tin = in;
+	unsigned char * inbuf;
+	int64_t unit;
 
-	inbufsize= TIFFTileSize(in);
+#ifdef _OPENMP
+	if (tins != NULL)
+		tin = tins[omp_get_thread_num()];
+#endif
 	inbuf = (unsigned char *)_TIFFmalloc(inbufsize); /* not malloc
 	    because TIFFTileSize returns a tmsize_t */
 	if (!inbuf) {
 		TIFFError(TIFFFileName(in),
-				"Error, can't allocate space for image buffer");
-		return (EXIT_INSUFFICIENT_MEMORY);
+		    "Error, can't allocate space for image buffer");
+		#pragma omp critical (cptiles_error)
+		error = EXIT_INSUFFICIENT_MEMORY;
 	}
 
-	for (y = ymin ; y < ymin + length + intilelength ; y += intilelength) {
-		uint32_t x, out_x = 0;
-		uint32_t yminoftile = (y/intilelength) * intilelength;
-		uint32_t ymintocopy = ymin > yminoftile ? ymin : yminoftile;
-		uint32_t ymaxplusone = yminoftile + intilelength;
-		uint32_t lengthtocopy;
-		unsigned char * inbufrow = inbuf +
-		    intilewidthinbytes * (ymintocopy-yminoftile);
+	#pragma omp for schedule(dynamic)
+	for (unit = 0 ; unit < numberofunits ; unit++) {
+		uint32_t tilerow, tilecol, lasttilecol;
+		int e = 0, stop;
 
-		if (ymaxplusone > ymin + length)
-			ymaxplusone = ymin + length;
-		if (ymaxplusone <= yminoftile)
-			break;
-		lengthtocopy = ymaxplusone - ymintocopy;
-
-		for (x = xmin ; x < xmin + width + intilewidth ;
-		    x += intilewidth) {
-			uint32_t xminoftile = (x/intilewidth) * intilewidth;
-			uint32_t xmintocopyintile = xmin > xminoftile ?
-			    xmin : xminoftile;
-			uint32_t xmaxplusone = xminoftile + intilewidth;
-
-			if (xmaxplusone > xmin + width)
-				xmaxplusone = xmin + width;
-			if (xmaxplusone <= xminoftile)
-				break;
-
-			uint32_t widthtocopyinpixels =
-			    xmaxplusone - xmintocopyintile;
-
-			if (TIFFReadTile(in, inbuf, xminoftile,
-			    yminoftile, 0, 0) < 0) {
-				TIFFError(TIFFFileName(in),
-				    "Error, can't read tile at "
-				    UINT32_FORMAT ", " UINT32_FORMAT,
-				    xminoftile, yminoftile);
-				error = EXIT_IO_ERROR;
-				goto done;
-			}
-
-			cpBufToBuf(bufp, out_x * samplesperpixel, inbufrow,
-			    (xmintocopyintile-xminoftile) * samplesperpixel,
-			    widthtocopyinpixels * samplesperpixel,
-			    bitspersample,
-			    lengthtocopy, outscanlinesizeinbytes,
-			    intilewidthinbytes);
-			out_x += widthtocopyinpixels;
+		#pragma omp critical (cptiles_error)
+		stop = error != 0;
+		if (stop || inbuf == NULL)
+			continue;
+		if (tilerowsonly) {
+			tilerow = firsttilerow + unit;
+			tilecol = firsttilecol;
+			lasttilecol = firsttilecol + numberoftilecols - 1;
+		} else {
+			tilerow = firsttilerow + unit / numberoftilecols;
+			tilecol = lasttilecol =
+			    firsttilecol + unit % numberoftilecols;
+		}
+		for ( ; tilecol <= lasttilecol && !e ; tilecol++)
+			e = cpTileToStrip(tin, indiroff,
+			    tilecol * intilewidth, tilerow * intilelength,
+			    xmin, ymin, width, length,
+			    outbuf, outscanlinesizeinbytes,
+			    bitspersample, samplesperpixel,
+			    intilewidth, intilelength, intilewidthinbytes,
+			    &inbuf, inbufsize);
+		if (e) {
+			#pragma omp critical (cptiles_error)
+			if (!error)
+				error = e;
 		}
-		bufp += outscanlinesizeinbytes * lengthtocopy;
 	}
 
-	done:
-	_TIFFfree(inbuf);
+	if (inbuf != NULL)
+		_TIFFfree(inbuf);
+	}
+
 	return error;
 }
 
+	/* Strips whose decoded size is above this limit are not loaded at once
+	 in memory; they are read scanline by scanline instead. */
+#define MAX_STRIP_BUFFER_SIZE ((tsize_t) 64 << 20)
+
 static int cpStrips2Strip(TIFF* in,
 	uint32_t xmin, uint32_t ymin, uint32_t width, uint32_t length,
 	unsigned char * outbuf, tsize_t outscanlinesizeinbytes,
@@ -630,115 +1245,1486 @@ static int cpStrips2Strip(TIFF* in,
 	uint32_t * y_of_last_read_scanline, uint32_t inimagelength)
 {
 	tsize_t inbufsize;
-	uint16_t input_compression;
 	tsize_t inwidthinbytes = TIFFScanlineSize(in);
+	uint32_t rowsperstrip = (uint32_t) -1;
 	uint32_t y;
 	unsigned char * inbuf, * bufp= outbuf;
+	int read_whole_strips;
 	int error = 0;
 
-	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &input_compression);
-	inbufsize= TIFFScanlineSize(in);  /* not malloc because
-	    TIFFScanlineSize returns a tmsize_t */
-	inbuf = (unsigned char *)_TIFFmalloc(inbufsize);
+	TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+	if (rowsperstrip > inimagelength)
+		rowsperstrip = inimagelength;
+
+	/* Jump directly to the strip which contains ymin: only the strips
+	 which overlap the requested rows are decoded. */
+	inbufsize= TIFFStripSize(in);
+	read_whole_strips = inbufsize <= MAX_STRIP_BUFFER_SIZE;
+	if (!read_whole_strips)
+		inbufsize= inwidthinbytes;
+	inbuf = (unsigned char *)_TIFFmalloc(inbufsize); /* not malloc
+	    because TIFFStripSize returns a tmsize_t */
 	if (!inbuf) {
 		TIFFError(TIFFFileName(in),
 				"Error, can't allocate space for image buffer");
 		return (EXIT_INSUFFICIENT_MEMORY);
 	}
 
-	/* When compression method doesn't support random access: */
-	if (input_compression != COMPRESSION_NONE) {
-		uint32_t y;
+	if (read_whole_strips) {
+		for (y = ymin ; y < ymin + length ; ) {
+			uint32_t strip = TIFFComputeStrip(in, y, 0);
+			uint32_t yminofstrip = (y/rowsperstrip) * rowsperstrip;
+			uint32_t ymaxplusone = yminofstrip + rowsperstrip;
+
+			if (ymaxplusone > ymin + length)
+				ymaxplusone = ymin + length;
+
+			/* Decode only up to the last row we need */
+			if (TIFFReadEncodedStrip(in, strip, inbuf,
+			    inwidthinbytes * (ymaxplusone-yminofstrip)) < 0) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read strip " UINT32_FORMAT
+				    " for copying", strip);
+				error = EXIT_IO_ERROR;
+				goto done;
+			}
+
+			cpBufToBuf(bufp, 0,
+			    inbuf + inwidthinbytes * (y-yminofstrip),
+			    xmin * samplesperpixel,
+			    width * samplesperpixel, bitspersample,
+			    ymaxplusone - y, outscanlinesizeinbytes,
+			    inwidthinbytes);
+			bufp += outscanlinesizeinbytes * (ymaxplusone - y);
+			y = ymaxplusone;
+		}
+		goto done;
+	}
+
+	/* When compression method doesn't support random access inside a
+	 * strip: restart from the first row of the strip containing ymin,
+	 * unless we already are in that strip before ymin */
+	y = (ymin/rowsperstrip) * rowsperstrip;
+	if (*y_of_last_read_scanline != (uint32_t) -1 &&
+	    *y_of_last_read_scanline >= y && *y_of_last_read_scanline < ymin)
+		y = *y_of_last_read_scanline + 1;
+	for ( ; y < ymin ; y++)
+		if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't read scanline at "
+			    UINT32_FORMAT " for exhausting", y);
+			error = EXIT_IO_ERROR;
+			goto done;
+		} else
+			*y_of_last_read_scanline= y;
+
+	for (y = ymin ; y < ymin + length ; y++) {
+		if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't read scanline at "
+			    UINT32_FORMAT " for copying", y);
+			error = EXIT_IO_ERROR;
+			goto done;
+		} else
+			*y_of_last_read_scanline= y;
+
+		cpBufToBuf(bufp, 0, inbuf,
+		    xmin * samplesperpixel,
+		    width * samplesperpixel, bitspersample, 1,
+		    outscanlinesizeinbytes, inwidthinbytes);
+		bufp += outscanlinesizeinbytes;
+	}
+
+	done:
+	_TIFFfree(inbuf);
+	return error;
+}
+
+
+static int cpRows2Strip(TIFF* in, TIFF** tins, uint32_t xmin, uint32_t ymin,
+	uint32_t width, uint32_t length, unsigned char * outbuf,
+	tsize_t outscanlinesizeinbytes, uint16_t bitspersample,
+	uint16_t samplesperpixel, uint32_t * y_of_last_read_scanline,
+	uint32_t inimagelength)
+{
+	if (TIFFIsTiled(in))
+		return cpTiles2Strip(in, tins, xmin, ymin, width, length,
+		    outbuf, outscanlinesizeinbytes, bitspersample,
+		    samplesperpixel);
+	else
+		return cpStrips2Strip(in, xmin, ymin, width, length,
+		    outbuf, outscanlinesizeinbytes, bitspersample,
+		    samplesperpixel, y_of_last_read_scanline,
+		    inimagelength);
+}
+
+
+	/* Number of rows of the bands in which an extract is produced when
+	 it is streamed to the output file: bands follow the tile rows (as
+	 many as threads) or the strips of the input, so that each tile or
+	 strip is decoded only once. */
+static uint32_t computeBandLength(TIFF* in)
+{
+	uint32_t bandlength = 1;
+
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &bandlength);
+		if (bandlength <= UINT32_MAX / number_of_threads)
+			bandlength *= number_of_threads;
+	} else if (TIFFStripSize(in) <= MAX_STRIP_BUFFER_SIZE)
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &bandlength);
+	else {
+		tsize_t inscanlinesize = TIFFScanlineSize(in);
+		if (inscanlinesize > 0 &&
+		    MAX_STRIP_BUFFER_SIZE / inscanlinesize > 1)
+			bandlength = MAX_STRIP_BUFFER_SIZE / inscanlinesize;
+	}
+	return bandlength > 0 ? bandlength : 1;
+}
+
+
+	/* Number of rows of the band of an extract starting at row y of
+	 the input */
+static uint32_t computeRowsInBand(uint32_t y, uint32_t bandlength,
+	uint32_t ymaxplusone)
+{
+	uint32_t rowsinband = bandlength - y % bandlength;
+
+	if (rowsinband > ymaxplusone - y)
+		rowsinband = ymaxplusone - y;
+	return rowsinband;
+}
+
+
+	/* Return 0 if the requested memory size exceeds the machine's
+	  addressing size type (size_t) capacity or if bitspersample is
+	  unhandled */
+static size_t computeMemorySize(uint16_t spp, uint16_t bitspersample,
+	uint32_t outwidth, uint32_t outlength)
+{
+	uint16_t bitsperpixel = spp * bitspersample;
+	uint64_t memorysize = outlength;
+	if (bitsperpixel % 8 == 0)
+		memorysize *= (uint64_t) outwidth * (bitsperpixel/8);
+	else /*if (8 % bitsperpixel == 0)*/ {
+		int pixelsperbyte = 8/bitsperpixel;
+		int bytesperrow = (outwidth * bitsperpixel + 7) / 8;
+		memorysize *= bytesperrow;
+	} /*else
+		return 0;*/
+
+	if ((size_t) memorysize != memorysize)
+		return 0;
+	return memorysize;
+}
+
+
+	/* When option --scale is given, the regions are given in the
+	 coordinates of the handled directory (level 0 of a pyramid), the
+	 extracts are made from the directory with the lowest resolution
+	 that is sufficient (see selectPyramidLevel), and the remaining
+	 factor is applied while the rows of the extract are produced. */
+struct scaling {
+	uint32_t level0width, level0length;
+	uint32_t xmin, ymin, width, length; /* region in level-0 pixels */
+	uint32_t outwidth, outlength; /* dimensions of the extract */
+	double x0, y0; /* position of the extract's top left corner in
+			the region read from the level (requested*) */
+	double stepx, stepy; /* level pixels per extract pixel */
+	int resample; /* 0 if the region of the level is the extract */
+	int boxx, boxy; /* box (area) filter along x, y if set, bilinear
+			interpolation else */
+	uint32_t maxrowsinbox; /* rows which may be summed without
+			overflowing rowsums */
+	uint32_t * colfirst; /* first level column of each extract column */
+	uint32_t * colsecond; /* end of box, or second column to blend */
+	float * colweight; /* weight of the second column (bilinear) */
+	uint32_t inbandlength; /* the level is read in bands of these rows */
+	unsigned char * srcbuf; /* rows of the level read so far... */
+	uint32_t srcbuffirstrow, srcbufrows, srcbufcapacity; /* ...which */
+	tsize_t srcscanlinesizeinbytes;
+	uint32_t * rowsums; /* one row of sums of rows (box along y) */
+	float * rowblend; /* one row filtered along y, unless boxx && boxy */
+};
+
+
+	/* Make current the directory of in with the lowest resolution that
+	 is still at least requested_scale times that of the current
+	 directory, among the directories which look like reduced versions
+	 of it (same samples, same aspect ratio). The current directory
+	 stays current if there is none. */
+static void selectPyramidLevel(TIFF* in)
+{
+	uint64_t level0diroff = TIFFCurrentDirOffset(in);
+	uint64_t bestdiroff = level0diroff;
+	uint32_t level0width, level0length, bestwidth;
+	uint16_t level0spp, level0bps, level0photometric;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &level0width);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &level0length);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &level0spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &level0bps);
+	if (!TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &level0photometric))
+		level0photometric = (uint16_t) -1;
+	bestwidth = level0width;
+
+	if (TIFFSetDirectory(in, 0)) do {
+		uint32_t width, length, subfiletype = 0;
+		uint16_t spp, bps, photometric;
+		double fx, fy;
+
+		TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(in, TIFFTAG_IMAGELENGTH, &length);
+		TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+		TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bps);
+		if (!TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric))
+			photometric = (uint16_t) -1;
+		TIFFGetField(in, TIFFTAG_SUBFILETYPE, &subfiletype);
+		if (TIFFCurrentDirOffset(in) == level0diroff ||
+		    width == 0 || length == 0 || width >= bestwidth ||
+		    length > level0length || spp != level0spp ||
+		    bps != level0bps || photometric != level0photometric ||
+		    (subfiletype & FILETYPE_MASK))
+			continue;
+		if (width < floor(level0width * requested_scale) ||
+		    length < floor(level0length * requested_scale))
+			continue; /* resolution too low */
+		fx = (double) level0width / width;
+		fy = (double) level0length / length;
+		if (fabs(fx - fy) > 0.02 * fx)
+			continue; /* not the same picture (label, macro...) */
+		bestdiroff = TIFFCurrentDirOffset(in);
+		bestwidth = width;
+	} while (TIFFReadDirectory(in));
+
+	TIFFSetSubDirectory(in, bestdiroff);
+	if (verbose && bestdiroff != level0diroff)
+		fprintf(stderr, "Extracts will be made from directory at "
+			"offset 0x" UINT64_HEX_FORMAT ", of width "
+			UINT32_FORMAT ".\n", bestdiroff, bestwidth);
+}
+
+
+	/* Range of source pixels (along one axis) making extract pixel o:
+	 the box [first, second) or, for bilinear interpolation, pixels first
+	 and second to be blended with weight of second */
+static void computeSourceRange(double origin, double step, int box,
+	uint32_t sourcesize, uint32_t o, uint32_t * first, uint32_t * second,
+	float * weight)
+{
+	if (box) {
+		double a = origin + o * step;
+		uint32_t f = (uint32_t) floor(a), e = (uint32_t) ceil(a + step);
+
+		if (f >= sourcesize)
+			f = sourcesize - 1;
+		if (e > sourcesize)
+			e = sourcesize;
+		if (e <= f)
+			e = f + 1;
+		*first = f; *second = e; *weight = 0;
+	} else {
+		double c = origin + (o + 0.5) * step - 0.5;
+
+		if (c < 0)
+			c = 0;
+		if (c > sourcesize - 1)
+			c = sourcesize - 1;
+		*first = (uint32_t) floor(c);
+		*second = *first + 1 < sourcesize ? *first + 1 : *first;
+		*weight = (float) (c - *first);
+	}
+}
+
+
+	/* Clamp the requested region, given in the coordinates of a level 0
+	 of size level0width x level0length, map it to the current
+	 directory of in and prepare *s to resample it to requested_scale.
+	 On success, requested* hold the region of the current directory to
+	 be read. */
+static int prepareScaling(TIFF* in, struct scaling * s,
+	uint32_t level0width, uint32_t level0length)
+{
+	uint32_t levelwidth, levellength, outwidth, outlength, ox;
+	uint16_t bitspersample, spp;
+	double fx, fy, x0, x1, y0, y1;
+
+	memset(s, 0, sizeof(*s));
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &levelwidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &levellength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	if (bitspersample != 8 && bitspersample != 16) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't scale image with bits-per-sample %u "
+			"(not 8 or 16)", bitspersample);
+		return EXIT_UNHANDLED_INPUT_IMAGE_TYPE;
+	}
+
+	if (requestedxmin >= level0width || requestedymin >= level0length) {
+		fprintf(stderr, "Requested top left corner is outside the image. Aborting.\n");
+		return EXIT_GEOMETRY_ERROR;
+	}
+	if (requestedwidth > level0width - requestedxmin)
+		requestedwidth = level0width - requestedxmin;
+	if (requestedlength > level0length - requestedymin)
+		requestedlength = level0length - requestedymin;
+	s->level0width = level0width; s->level0length = level0length;
+	s->xmin = requestedxmin; s->ymin = requestedymin;
+	s->width = requestedwidth; s->length = requestedlength;
+	outwidth = (uint32_t) (requestedwidth * requested_scale + 0.5);
+	outlength = (uint32_t) (requestedlength * requested_scale + 0.5);
+	if (outwidth == 0)
+		outwidth = 1;
+	if (outlength == 0)
+		outlength = 1;
+	s->outwidth = outwidth; s->outlength = outlength;
+
+	fx = (double) level0width / levelwidth;
+	fy = (double) level0length / levellength;
+	x0 = requestedxmin / fx; x1 = (requestedxmin + requestedwidth) / fx;
+	y0 = requestedymin / fy; y1 = (requestedymin + requestedlength) / fy;
+	requestedxmin = (uint32_t) floor(x0);
+	requestedymin = (uint32_t) floor(y0);
+	requestedwidth = (uint32_t) ceil(x1) - requestedxmin;
+	requestedlength = (uint32_t) ceil(y1) - requestedymin;
+	if (requestedxmin + requestedwidth > levelwidth)
+		requestedwidth = levelwidth - requestedxmin;
+	if (requestedymin + requestedlength > levellength)
+		requestedlength = levellength - requestedymin;
+	if (requestedwidth == 0)
+		requestedwidth = 1;
+	if (requestedlength == 0)
+		requestedlength = 1;
+	s->x0 = x0 - requestedxmin; s->y0 = y0 - requestedymin;
+	s->stepx = (x1 - x0) / outwidth; s->stepy = (y1 - y0) / outlength;
+	s->resample = !(s->stepx == 1 && s->stepy == 1 && s->x0 == 0 &&
+	    s->y0 == 0);
+	s->boxx = s->stepx >= 2;
+	s->boxy = s->stepy >= 2;
+	s->maxrowsinbox = UINT32_MAX / (bitspersample == 8 ? 0xff : 0xffff);
+	s->inbandlength = computeBandLength(in);
+	s->srcscanlinesizeinbytes = (tsize_t) requestedwidth * spp *
+	    (bitspersample / 8);
+
+	s->colfirst = malloc(outwidth * sizeof(uint32_t));
+	s->colsecond = malloc(outwidth * sizeof(uint32_t));
+	s->colweight = malloc(outwidth * sizeof(float));
+	if (s->boxy)
+		s->rowsums = malloc((size_t) requestedwidth * spp *
+		    sizeof(uint32_t));
+	if (!s->boxx || !s->boxy)
+		s->rowblend = malloc((size_t) requestedwidth * spp *
+		    sizeof(float));
+	if (s->colfirst == NULL || s->colsecond == NULL ||
+	    s->colweight == NULL || (s->boxy && s->rowsums == NULL) ||
+	    ((!s->boxx || !s->boxy) && s->rowblend == NULL)) {
+		fprintf(stderr, "Unable to allocate enough memory to "
+			"scale extract.\n");
+		return EXIT_INSUFFICIENT_MEMORY;
+	}
+	for (ox = 0 ; ox < outwidth ; ox++)
+		computeSourceRange(s->x0, s->stepx, s->boxx, requestedwidth, ox,
+		    &s->colfirst[ox], &s->colsecond[ox], &s->colweight[ox]);
+
+	if (verbose && s->resample)
+		fprintf(stderr, "Scaling region " UINT32_FORMAT "x"
+			UINT32_FORMAT " of the directory to " UINT32_FORMAT
+			"x" UINT32_FORMAT " pixels with a %s filter along x "
+			"and a %s filter along y.\n",
+			requestedwidth, requestedlength, outwidth, outlength,
+			s->boxx ? "box" : "bilinear",
+			s->boxy ? "box" : "bilinear");
+	return 0;
+}
+
+
+static void freeScaling(struct scaling * s)
+{
+	free(s->colfirst);
+	free(s->colsecond);
+	free(s->colweight);
+	free(s->srcbuf);
+	free(s->rowsums);
+	free(s->rowblend);
+	memset(s, 0, sizeof(*s));
+}
+
+
+
+	/* Make sure rows [first, end) of the region of the level are in
+	 s->srcbuf, keeping the rows already read and reading ahead up to
+	 the end of a band of the input so that each tile or strip is decoded
+	 once */
+static int loadSourceRows(TIFF* in, TIFF** tins, struct scaling * s,
+	uint32_t first, uint32_t end, uint16_t bitspersample, uint16_t spp,
+	uint32_t * y_of_last_read_scanline, uint32_t inimagelength)
+{
+	uint32_t kept = 0, bandend;
+
+	if (first >= s->srcbuffirstrow &&
+	    end <= s->srcbuffirstrow + s->srcbufrows)
+		return 0;
+	bandend = requestedymin + end;
+	if (bandend % s->inbandlength != 0)
+		bandend += s->inbandlength - bandend % s->inbandlength;
+	end = bandend - requestedymin < requestedlength ?
+	    bandend - requestedymin : requestedlength;
+
+	if (first >= s->srcbuffirstrow &&
+	    first < s->srcbuffirstrow + s->srcbufrows) {
+		kept = s->srcbuffirstrow + s->srcbufrows - first;
+		memmove(s->srcbuf, s->srcbuf + (size_t)
+		    (first - s->srcbuffirstrow) * s->srcscanlinesizeinbytes,
+		    (size_t) kept * s->srcscanlinesizeinbytes);
+	}
+	if (end - first > s->srcbufcapacity) {
+		unsigned char * b = realloc(s->srcbuf, (size_t) (end - first) *
+		    s->srcscanlinesizeinbytes);
+
+		if (b == NULL) {
+			fprintf(stderr, "Unable to allocate enough memory to "
+				"scale extract.\n");
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
+		s->srcbuf = b;
+		s->srcbufcapacity = end - first;
+	}
+	s->srcbuffirstrow = first;
+	s->srcbufrows = kept;
+	if (cpRows2Strip(in, tins, requestedxmin, requestedymin + first + kept,
+	    requestedwidth, end - first - kept, s->srcbuf + (size_t) kept *
+	    s->srcscanlinesizeinbytes, s->srcscanlinesizeinbytes,
+	    bitspersample, spp, y_of_last_read_scanline, inimagelength))
+		return EXIT_IO_ERROR;
+	s->srcbufrows = end - first;
+	return 0;
+}
+
+
+	/* Produce rows [y, y+length) of the scaled extract into outbuf.
+	 Each row is filtered along y first, over the contiguous samples of
+	 the source rows with the kernels chosen by selectKernels, then along
+	 x. The pass along x gathers the samples of each channel with a
+	 stride of spp and stays scalar. When both axes use a box filter,
+	 integer sums are kept so that the averages are exactly rounded. A
+	 box of more than s->maxrowsinbox rows is averaged over its first
+	 s->maxrowsinbox rows only. */
+static int cpScaledRows(TIFF* in, TIFF** tins, struct scaling * s,
+	uint32_t y, uint32_t length, unsigned char * outbuf,
+	tsize_t outscanlinesizeinbytes, uint16_t bitspersample,
+	uint16_t spp, uint32_t * y_of_last_read_scanline,
+	uint32_t inimagelength)
+{
+	size_t n = (size_t) requestedwidth * spp, i;
+	uint32_t first, second, dummy, oy, ox;
+	float weight;
+	int r;
+
+	computeSourceRange(s->y0, s->stepy, s->boxy, requestedlength, y,
+	    &first, &dummy, &weight);
+	computeSourceRange(s->y0, s->stepy, s->boxy, requestedlength,
+	    y + length - 1, &dummy, &second, &weight);
+	r = loadSourceRows(in, tins, s, first, s->boxy ? second : second + 1,
+	    bitspersample, spp, y_of_last_read_scanline, inimagelength);
+	if (r)
+		return r;
+
+	for (oy = y ; oy < y + length ; oy++) {
+		unsigned char * outrow = outbuf + (size_t) (oy - y) *
+		    outscanlinesizeinbytes;
+		const unsigned char * row;
+		uint32_t rowsinbox = 1;
+		uint16_t sample;
+
+		computeSourceRange(s->y0, s->stepy, s->boxy, requestedlength,
+		    oy, &first, &second, &weight);
+		row = s->srcbuf + (size_t) (first - s->srcbuffirstrow) *
+		    s->srcscanlinesizeinbytes;
+		if (s->boxy) {
+			uint32_t row_n;
+
+			rowsinbox = second - first;
+			if (rowsinbox > s->maxrowsinbox)
+				rowsinbox = s->maxrowsinbox;
+			memset(s->rowsums, 0, n * sizeof(uint32_t));
+			for (row_n = 0 ; row_n < rowsinbox ; row_n++,
+			    row += s->srcscanlinesizeinbytes) {
+				if (bitspersample == 8)
+					accumulateRow8(s->rowsums, row, n);
+				else
+					accumulateRow16(s->rowsums,
+					    (const uint16_t *) row, n);
+			}
+		} else {
+			const unsigned char * row2 = s->srcbuf + (size_t)
+			    (second - s->srcbuffirstrow) *
+			    s->srcscanlinesizeinbytes;
+
+			if (bitspersample == 8)
+				blendRows8(s->rowblend, row, row2, weight, n);
+			else
+				blendRows16(s->rowblend, (const uint16_t *) row,
+				    (const uint16_t *) row2, weight, n);
+		}
+
+		if (s->boxx && s->boxy) {
+			for (ox = 0 ; ox < s->outwidth ; ox++) {
+				uint32_t c0 = s->colfirst[ox],
+				    c1 = s->colsecond[ox];
+				uint64_t area = (uint64_t) (c1 - c0) * rowsinbox;
+
+				for (sample = 0 ; sample < spp ; sample++) {
+					uint64_t sum = 0;
+					uint32_t c;
+
+					for (c = c0 ; c < c1 ; c++)
+						sum += s->rowsums[c * spp +
+						    sample];
+					sum = (sum + area / 2) / area;
+					if (bitspersample == 8)
+						outrow[ox * spp + sample] = sum;
+					else
+						((uint16_t *) outrow)[ox * spp +
+						    sample] = sum;
+				}
+			}
+			continue;
+		}
+
+		if (s->boxy) {
+			float scale = 1.0f / rowsinbox;
+
+			for (i = 0 ; i < n ; i++)
+				s->rowblend[i] = s->rowsums[i] * scale;
+		}
+		for (ox = 0 ; ox < s->outwidth ; ox++) {
+			const float * p0 = s->rowblend + (size_t)
+			    s->colfirst[ox] * spp,
+			    * p1 = s->rowblend + (size_t) s->colsecond[ox] * spp;
+			float w = s->colweight[ox];
+
+			for (sample = 0 ; sample < spp ; sample++) {
+				float v;
+
+				if (s->boxx) {
+					const float * p;
+					double sum = 0;
+
+					for (p = p0 ; p < p1 ; p += spp)
+						sum += p[sample];
+					v = sum / (s->colsecond[ox] -
+					    s->colfirst[ox]) + 0.5;
+				} else
+					v = p0[sample] + w *
+					    (p1[sample] - p0[sample]) + 0.5f;
+				if (bitspersample == 8)
+					outrow[ox * spp + sample] = v;
+				else
+					((uint16_t *) outrow)[ox * spp +
+					    sample] = v;
+			}
+		}
+	}
+	return 0;
+}
+
+
+	/* Produce rows [y, y+length) of the extract (y relative to the top
+	 of the extract), scaled if s is not NULL */
+static int cpExtractRows(TIFF* in, TIFF** tins, struct scaling * s,
+	uint32_t y, uint32_t length, unsigned char * outbuf,
+	tsize_t outscanlinesizeinbytes, uint16_t bitspersample,
+	uint16_t spp, uint32_t * y_of_last_read_scanline,
+	uint32_t inimagelength)
+{
+	if (s != NULL && s->resample)
+		return cpScaledRows(in, tins, s, y, length, outbuf,
+		    outscanlinesizeinbytes, bitspersample, spp,
+		    y_of_last_read_scanline, inimagelength);
+	return cpRows2Strip(in, tins, requestedxmin, requestedymin + y,
+	    requestedwidth, length, outbuf, outscanlinesizeinbytes,
+	    bitspersample, spp, y_of_last_read_scanline, inimagelength);
+}
+
+
+	/* Number of rows of the band of the extract starting at its row y:
+	 unscaled bands follow those of the input */
+static uint32_t computeExtractRowsInBand(const struct scaling * s,
+	uint32_t y, uint32_t bandlength, uint32_t outlength)
+{
+	if (s == NULL || !s->resample)
+		return computeRowsInBand(requestedymin + y, bandlength,
+		    requestedymin + outlength);
+	return bandlength < outlength - y ? bandlength : outlength - y;
+}
+
+
+	/* Tell whether the region can be extracted into a TIFF file by
+	 copying the compressed tiles of in: the region must lie on the tile
+	 grid of in, the output must keep the compression (without new
+	 options) and be tiled like in (or no output layout be requested). */
+static int canCopyRawTiles(TIFF* in, uint32_t xmin, uint32_t ymin,
+	uint32_t width, uint32_t length)
+{
+	uint32_t inimagewidth, inimagelength, intilewidth, intilelength;
+	uint16_t compression;
+
+	if (!TIFFIsTiled(in))
+		return 0;
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &inimagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &inimagelength);
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+
+	if (compression == COMPRESSION_OJPEG)
+		return 0;
+	if (defcompression != (uint16_t) -1 &&
+	    (defcompression != compression ||
+	     compression == COMPRESSION_JPEG ||
+	     compression == COMPRESSION_CCITTFAX3 ||
+	     defpredictor != (uint16_t) -1 || defpreset != -1))
+		return 0;
+	if (outrowsperstrip || (outtilewidth &&
+	    (outtilewidth != intilewidth || outtilelength != intilelength)))
+		return 0;
+	return width > 0 && length > 0 &&
+	    xmin % intilewidth == 0 && ymin % intilelength == 0 &&
+	    (width % intilewidth == 0 || xmin + width == inimagewidth) &&
+	    (length % intilelength == 0 || ymin + length == inimagelength);
+}
+
+
+	/* Set the fields of out which are needed to store in it tiles
+	 copied from in without decoding, as in tiffsplittiles */
+static void tiffCopyFieldsForRawTiles(TIFF* in, TIFF* TIFFout)
+{
+	uint16_t compression, photometric, shortv, shortv2;
+	uint32_t longv;
+	float * floatav;
+
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &photometric);
+	CopyField(TIFFTAG_TILEWIDTH, longv);
+	CopyField(TIFFTAG_TILELENGTH, longv);
+	if (compression == COMPRESSION_JPEG) {
+		uint32_t count = 0;
+		void *table = NULL;
+		if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &count, &table)
+		    && count > 0 && table)
+			TIFFSetField(TIFFout, TIFFTAG_JPEGTABLES, count, table);
+	} else if (compression == COMPRESSION_CCITTFAX3) {
+		CopyField(TIFFTAG_GROUP3OPTIONS, longv);
+	} else if (compression == COMPRESSION_CCITTFAX4)
+		CopyField(TIFFTAG_GROUP4OPTIONS, longv);
+	if (photometric == PHOTOMETRIC_YCBCR) {
+		CopyField2(TIFFTAG_YCBCRSUBSAMPLING, shortv, shortv2);
+		CopyField(TIFFTAG_YCBCRPOSITIONING, shortv);
+		CopyField(TIFFTAG_REFERENCEBLACKWHITE, floatav);
+	}
+}
+
+
+	/* Copy the tiles of in which make the region to out, which has the
+	 same tiles and compression, without decoding them */
+static int cpRawTiles(TIFF* in, TIFF* out, uint32_t xmin, uint32_t ymin,
+	uint32_t width, uint32_t length)
+{
+	uint32_t intilewidth, intilelength, x, y;
+	uint64_t * bytecounts;
+	tmsize_t bufsize = 0;
+	unsigned char * buf = NULL;
+	int error = 0;
+
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+	if (!TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts)) {
+		TIFFError(TIFFFileName(in), "Error, can't get tile sizes");
+		return EXIT_IO_ERROR;
+	}
+
+	for (y = ymin ; y < ymin + length && !error ; y += intilelength)
+		for (x = xmin ; x < xmin + width && !error ;
+		    x += intilewidth) {
+			uint32_t tile = TIFFComputeTile(in, x, y, 0, 0);
+			tmsize_t size = bytecounts[tile];
+
+			if (size == 0) /* missing tile */
+				continue;
+			if (size > bufsize) {
+				unsigned char * newbuf = _TIFFrealloc(buf, size);
+				if (newbuf == NULL) {
+					TIFFError(TIFFFileName(in),
+					    "Error, can't allocate space for image buffer");
+					error = EXIT_INSUFFICIENT_MEMORY;
+					break;
+				}
+				buf = newbuf;
+				bufsize = size;
+			}
+			size = TIFFReadRawTile(in, tile, buf, size);
+			if (size < 0) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read tile at "
+				    UINT32_FORMAT ", " UINT32_FORMAT, x, y);
+				error = EXIT_IO_ERROR;
+			} else if (TIFFWriteRawTile(out, TIFFComputeTile(out,
+			    x - xmin, y - ymin, 0, 0), buf, size) < 0) {
+				TIFFError(TIFFFileName(out),
+				    "Error, can't write tile");
+				error = EXIT_IO_ERROR;
+			}
+		}
+
+	if (buf != NULL)
+		_TIFFfree(buf);
+	return error;
+}
+
+
+	/* Tell whether a JPEG file of the region can be assembled from the
+	 DCT coefficients of the tiles of in, without decoding them: in must
+	 be a tiled TIFF with JPEG-compressed tiles, and the top left corner
+	 of the region must be on the grid of JPEG MCUs. */
+static int canCopyDCTCoefficients(TIFF* in, uint32_t xmin, uint32_t ymin)
+{
+	uint16_t compression, photometric, spp, bitspersample;
+	uint16_t subsamplinghor = 1, subsamplingver = 1;
+	uint32_t intilewidth, intilelength;
+
+	if (!TIFFIsTiled(in))
+		return 0;
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &photometric);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	if (compression != COMPRESSION_JPEG || bitspersample != 8 ||
+	    spp != 3 || (photometric != PHOTOMETRIC_YCBCR &&
+	    photometric != PHOTOMETRIC_RGB))
+		return 0;
+	if (photometric == PHOTOMETRIC_YCBCR)
+		TIFFGetFieldDefaulted(in, TIFFTAG_YCBCRSUBSAMPLING,
+		    &subsamplinghor, &subsamplingver);
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+	return xmin % (8 * subsamplinghor) == 0 &&
+	    ymin % (8 * subsamplingver) == 0 &&
+	    intilewidth % (8 * subsamplinghor) == 0 &&
+	    intilelength % (8 * subsamplingver) == 0;
+}
+
+
+	/* libjpeg source manager reading from a buffer in memory */
+static void jpegMemoryInitSource(j_decompress_ptr cinfo)
+{
+	(void) cinfo;
+}
+
+
+static boolean jpegMemoryFillInputBuffer(j_decompress_ptr cinfo)
+{
+	/* Premature end of data: insert a fake EOI marker */
+	static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+
+static void jpegMemorySkipInputData(j_decompress_ptr cinfo, long n)
+{
+	if (n <= 0)
+		return;
+	if ((size_t) n > cinfo->src->bytes_in_buffer)
+		jpegMemoryFillInputBuffer(cinfo);
+	else {
+		cinfo->src->next_input_byte += n;
+		cinfo->src->bytes_in_buffer -= n;
+	}
+}
+
+
+static void jpegMemoryTermSource(j_decompress_ptr cinfo)
+{
+	(void) cinfo;
+}
+
+
+static void jpegMemorySource(j_decompress_ptr cinfo,
+	struct jpeg_source_mgr * src, const void * data, size_t size)
+{
+	src->init_source = jpegMemoryInitSource;
+	src->fill_input_buffer = jpegMemoryFillInputBuffer;
+	src->skip_input_data = jpegMemorySkipInputData;
+	src->resync_to_restart = jpeg_resync_to_restart;
+	src->term_source = jpegMemoryTermSource;
+	src->next_input_byte = (const JOCTET *) data;
+	src->bytes_in_buffer = size;
+	cinfo->src = src;
+}
+
+
+	/* Write to out a JPEG file of the region, assembled from the DCT
+	 coefficients of the JPEG-compressed tiles of in (the way jpegtran
+	 crops), so that it is exactly the same as in the source. */
+static int makeJPEGFromDCTCoefficients(TIFF* in, FILE* out,
+	uint32_t xmin, uint32_t ymin, uint32_t width, uint32_t length)
+{
+	struct jpeg_decompress_struct srcinfo;
+	struct jpeg_compress_struct dstinfo;
+	struct jpeg_error_mgr jsrcerr, jdsterr;
+	struct jpeg_source_mgr srcmgr;
+	jvirt_barray_ptr dst_coef_arrays[MAX_COMPONENTS];
+	uint32_t intilewidth, intilelength, x, y;
+	uint16_t photometric;
+	uint64_t * bytecounts;
+	uint32_t count = 0;
+	void * jpegtables = NULL;
+	tmsize_t bufsize = 0;
+	unsigned char * buf = NULL;
+	int started = 0, error = 0;
+
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &photometric);
+	if (!TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts)) {
+		TIFFError(TIFFFileName(in), "Error, can't get tile sizes");
+		return EXIT_IO_ERROR;
+	}
+
+	srcinfo.err = jpeg_std_error(&jsrcerr);
+	jpeg_create_decompress(&srcinfo);
+	dstinfo.err = jpeg_std_error(&jdsterr);
+	jpeg_create_compress(&dstinfo);
+
+		/* Tiles are abbreviated JPEG datastreams: their tables are
+		 in the JPEGTABLES tag */
+	if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &count, &jpegtables) &&
+	    count > 0 && jpegtables != NULL) {
+		jpegMemorySource(&srcinfo, &srcmgr, jpegtables, count);
+		jpeg_read_header(&srcinfo, FALSE);
+	}
+
+	for (y = (ymin / intilelength) * intilelength ;
+	    y < ymin + length && !error ; y += intilelength)
+	    for (x = (xmin / intilewidth) * intilewidth ;
+		x < xmin + width && !error ; x += intilewidth) {
+		uint32_t tile = TIFFComputeTile(in, x, y, 0, 0);
+		tmsize_t size = bytecounts[tile];
+		jvirt_barray_ptr * src_coef_arrays;
+		int c;
+
+		if (size == 0) /* missing tile: left blank */
+			continue;
+		if (size > bufsize) {
+			unsigned char * newbuf = _TIFFrealloc(buf, size);
+			if (newbuf == NULL) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't allocate space for image buffer");
+				error = EXIT_INSUFFICIENT_MEMORY;
+				break;
+			}
+			buf = newbuf;
+			bufsize = size;
+		}
+		size = TIFFReadRawTile(in, tile, buf, size);
+		if (size < 0) {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't read tile at "
+			    UINT32_FORMAT ", " UINT32_FORMAT, x, y);
+			error = EXIT_IO_ERROR;
+			break;
+		}
+
+		jpegMemorySource(&srcinfo, &srcmgr, buf, size);
+		jpeg_read_header(&srcinfo, TRUE);
+			/* TIFF's JPEG datastreams have no JFIF nor Adobe
+			 marker telling their color space */
+		srcinfo.jpeg_color_space = photometric == PHOTOMETRIC_RGB ?
+		    JCS_RGB : JCS_YCbCr;
+		src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+
+		if (!started) {
+			if ((uint32_t) srcinfo.max_h_samp_factor * DCTSIZE *
+			    (xmin / (srcinfo.max_h_samp_factor * DCTSIZE))
+			    != xmin ||
+			    (uint32_t) srcinfo.max_v_samp_factor * DCTSIZE *
+			    (ymin / (srcinfo.max_v_samp_factor * DCTSIZE))
+			    != ymin) {
+				TIFFError(TIFFFileName(in), "Error, extract "
+				    "is not aligned on JPEG MCUs");
+				error = EXIT_GEOMETRY_ERROR;
+				jpeg_abort_decompress(&srcinfo);
+				break;
+			}
+			jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+			dstinfo.image_width = width;
+			dstinfo.image_height = length;
+			for (c = 0 ; c < dstinfo.num_components ; c++) {
+				jpeg_component_info * comp =
+				    dstinfo.comp_info + c;
+				JDIMENSION wib = ((uint64_t) width *
+				    comp->h_samp_factor + DCTSIZE *
+				    srcinfo.max_h_samp_factor - 1) /
+				    (DCTSIZE * srcinfo.max_h_samp_factor);
+				JDIMENSION hib = ((uint64_t) length *
+				    comp->v_samp_factor + DCTSIZE *
+				    srcinfo.max_v_samp_factor - 1) /
+				    (DCTSIZE * srcinfo.max_v_samp_factor);
+				wib += (comp->h_samp_factor -
+				    wib % comp->h_samp_factor) %
+				    comp->h_samp_factor;
+				hib += (comp->v_samp_factor -
+				    hib % comp->v_samp_factor) %
+				    comp->v_samp_factor;
+				dst_coef_arrays[c] =
+				    (*dstinfo.mem->request_virt_barray)
+				    ((j_common_ptr) &dstinfo, JPOOL_IMAGE,
+				    TRUE, wib, hib, comp->v_samp_factor);
+			}
+			jpeg_stdio_dest(&dstinfo, out);
+			jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
+			started = 1;
+		}
+
+			/* Copy the blocks of the tile which are in the
+			 region, component by component */
+		for (c = 0 ; c < dstinfo.num_components ; c++) {
+			jpeg_component_info * comp = dstinfo.comp_info + c;
+			uint32_t hfactor = DCTSIZE * srcinfo.max_h_samp_factor
+			    / comp->h_samp_factor;
+			uint32_t vfactor = DCTSIZE * srcinfo.max_v_samp_factor
+			    / comp->v_samp_factor;
+			/* in blocks of this component: */
+			int64_t tilex = (int64_t) (x / hfactor) - xmin / hfactor;
+			int64_t tiley = (int64_t) (y / vfactor) - ymin / vfactor;
+			int64_t tilew = intilewidth / hfactor;
+			int64_t tileh = intilelength / vfactor;
+			/* The region is made of whole MCUs */
+			int64_t regionw = comp->width_in_blocks +
+			    (comp->h_samp_factor - comp->width_in_blocks %
+			    comp->h_samp_factor) % comp->h_samp_factor;
+			int64_t regionh = comp->height_in_blocks +
+			    (comp->v_samp_factor - comp->height_in_blocks %
+			    comp->v_samp_factor) % comp->v_samp_factor;
+			int64_t bxmin = tilex > 0 ? tilex : 0;
+			int64_t bxmax = tilex + tilew < regionw ?
+			    tilex + tilew : regionw;
+			int64_t by, bymax = tiley + tileh < regionh ?
+			    tiley + tileh : regionh;
+
+			if (bxmin >= bxmax)
+				continue;
+			for (by = tiley > 0 ? tiley : 0 ; by < bymax ; by++) {
+				JBLOCKARRAY dstrow =
+				    (*dstinfo.mem->access_virt_barray)
+				    ((j_common_ptr) &dstinfo,
+				    dst_coef_arrays[c], by, 1, TRUE);
+				JBLOCKARRAY srcrow =
+				    (*srcinfo.mem->access_virt_barray)
+				    ((j_common_ptr) &srcinfo,
+				    src_coef_arrays[c], by - tiley, 1, FALSE);
+				memcpy(dstrow[0] + bxmin,
+				    srcrow[0] + (bxmin - tilex),
+				    (bxmax - bxmin) * sizeof(JBLOCK));
+			}
+		}
+		jpeg_abort_decompress(&srcinfo);
+	    }
+
+	if (started) {
+		if (error)
+			jpeg_abort_compress(&dstinfo);
+		else
+			jpeg_finish_compress(&dstinfo);
+	} else if (!error) {
+		fprintf(stderr, "Error, no tile to copy.\n");
+		error = EXIT_IO_ERROR;
+	}
+	jpeg_destroy_compress(&dstinfo);
+	jpeg_destroy_decompress(&srcinfo);
+	if (buf != NULL)
+		_TIFFfree(buf);
+	return error;
+}
+
+
+	/* Memory files, in which tiles or strips of the output TIFF file
+	 are compressed in parallel, each in its own TIFF */
+struct memory_file {
+	unsigned char * data;
+	toff_t size, allocated, position;
+};
+
+
+static tmsize_t memoryFileRead(thandle_t handle, void * buf, tmsize_t size)
+{
+	struct memory_file * m = (struct memory_file *) handle;
+
+	if (m->position >= m->size)
+		return 0;
+	if ((toff_t) size > m->size - m->position)
+		size = m->size - m->position;
+	memcpy(buf, m->data + m->position, size);
+	m->position += size;
+	return size;
+}
+
+
+static tmsize_t memoryFileWrite(thandle_t handle, void * buf, tmsize_t size)
+{
+	struct memory_file * m = (struct memory_file *) handle;
+
+	if (m->position + size > m->allocated) {
+		toff_t newallocated = m->allocated ? m->allocated : 65536;
+		unsigned char * newdata;
+
+		while (newallocated < m->position + size)
+			newallocated *= 2;
+		newdata = realloc(m->data, newallocated);
+		if (newdata == NULL)
+			return -1;
+		m->data = newdata;
+		m->allocated = newallocated;
+	}
+	if (m->position > m->size)
+		memset(m->data + m->size, 0, m->position - m->size);
+	memcpy(m->data + m->position, buf, size);
+	m->position += size;
+	if (m->position > m->size)
+		m->size = m->position;
+	return size;
+}
+
+
+static toff_t memoryFileSeek(thandle_t handle, toff_t offset, int whence)
+{
+	struct memory_file * m = (struct memory_file *) handle;
+
+	switch (whence) {
+		case SEEK_SET: m->position = offset; break;
+		case SEEK_CUR: m->position += offset; break;
+		case SEEK_END: m->position = m->size + offset; break;
+		default: return (toff_t) -1;
+	}
+	return m->position;
+}
+
+
+static int memoryFileClose(thandle_t handle)
+{
+	(void) handle;
+	return 0;
+}
+
+
+static toff_t memoryFileSize(thandle_t handle)
+{
+	return ((struct memory_file *) handle)->size;
+}
+
+
+static int memoryFileMap(thandle_t handle, void ** base, toff_t * size)
+{
+	(void) handle; (void) base; (void) size;
+	return 0;
+}
+
+
+static void memoryFileUnmap(thandle_t handle, void * base, toff_t size)
+{
+	(void) handle; (void) base; (void) size;
+}
+
+
+	/* Copy from the (set up) output file in to TIFFout the fields
+	 which govern how tiles or strips are encoded */
+static void tiffCopyEncodingFields(TIFF* in, TIFF* TIFFout)
+{
+	uint16_t compression, shortv, shortv2, *shortav;
+	uint32_t longv;
+	int intv;
+
+	CopyField(TIFFTAG_BITSPERSAMPLE, shortv);
+	CopyField(TIFFTAG_SAMPLESPERPIXEL, shortv);
+	CopyField(TIFFTAG_COMPRESSION, compression);
+	CopyField(TIFFTAG_PHOTOMETRIC, shortv);
+	CopyField(TIFFTAG_PLANARCONFIG, shortv);
+	CopyField(TIFFTAG_FILLORDER, shortv);
+	CopyField(TIFFTAG_SAMPLEFORMAT, shortv);
+	CopyField2(TIFFTAG_EXTRASAMPLES, shortv, shortav);
+	CopyField2(TIFFTAG_YCBCRSUBSAMPLING, shortv, shortv2);
+	switch (compression) {
+		case COMPRESSION_JPEG:
+		CopyField(TIFFTAG_JPEGCOLORMODE, intv);
+		CopyField(TIFFTAG_JPEGQUALITY, intv);
+		break;
+
+		case COMPRESSION_ADOBE_DEFLATE:
+		case COMPRESSION_DEFLATE:
+		CopyField(TIFFTAG_ZIPQUALITY, intv);
+		/* fall through */
+		case COMPRESSION_LZW:
+#ifdef HAVE_ZSTD
+		case COMPRESSION_ZSTD:
+#endif
+#ifdef HAVE_WEBP
+		case COMPRESSION_WEBP:
+#endif
+		CopyField(TIFFTAG_PREDICTOR, shortv);
+		break;
+
+		case COMPRESSION_CCITTFAX3:
+		CopyField(TIFFTAG_GROUP3OPTIONS, longv);
+		break;
+
+		case COMPRESSION_CCITTFAX4:
+		CopyField(TIFFTAG_GROUP4OPTIONS, longv);
+		break;
+	}
+}
+
+
+	/* A tile or strip of the output file, compressed in memory */
+struct encoded_unit {
+	uint32_t index;
+	struct memory_file file;
+	TIFF* tif;
+	uint64_t offset, bytecount;
+};
+
+
+	/* Write the rows y to y+rows-1 of the extract, which are in
+	 bandbuf, as tiles or strips of out. rows is a multiple of the tile
+	 length or of the number of rows per strip, except at the bottom of
+	 the extract. With several threads, the tiles or strips are
+	 compressed concurrently, each in a TIFF file in memory, then their
+	 compressed data are appended in order to out. */
+static int writeBandToTIFF(TIFF* out, unsigned char * bandbuf,
+	tsize_t bandscanlinesizeinbytes, uint32_t y, uint32_t rows,
+	uint32_t outwidth, uint16_t bitspersample, uint16_t samplesperpixel,
+	int * jpegtablesset)
+{
+	int tiled = TIFFIsTiled(out);
+	uint32_t unitwidth = outwidth, unitlength, rowsperstrip;
+	uint32_t numberofunitsperrow = 1, numberofunits, u;
+	tmsize_t unitsize;
+	tsize_t unitrowsizeinbytes;
+	struct encoded_unit * units = NULL;
+	int error = 0;
+
+	if (tiled) {
+		TIFFGetField(out, TIFFTAG_TILEWIDTH, &unitwidth);
+		TIFFGetField(out, TIFFTAG_TILELENGTH, &unitlength);
+		numberofunitsperrow = (outwidth + unitwidth - 1) / unitwidth;
+		unitsize = TIFFTileSize(out);
+		unitrowsizeinbytes = TIFFTileRowSize(out);
+	} else {
+		TIFFGetFieldDefaulted(out, TIFFTAG_ROWSPERSTRIP,
+		    &rowsperstrip);
+		unitlength = rowsperstrip;
+		unitsize = 0; /* depends on the strip */
+		unitrowsizeinbytes = bandscanlinesizeinbytes;
+	}
+	numberofunits = numberofunitsperrow *
+	    ((rows + unitlength - 1) / unitlength);
+
+	if (number_of_threads > 1 && numberofunits > 1) {
+		char mode[3] = { 'w', TIFFIsBigEndian(out) ? 'b' : 'l', 0 };
 
-		if (*y_of_last_read_scanline > ymin) {
-		/* If we need to go back, finish reading to the end,
-		 * then a restart will be automatic */
-			for (y = *y_of_last_read_scanline + 1 ;
-			     y < inimagelength ; y++)
-				if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
-					TIFFError(TIFFFileName(in),
-					    "Error, can't read scanline at "
-					    UINT32_FORMAT " for exhausting",
-					    y);
-					error = EXIT_IO_ERROR;
-					goto done;
-				} else
-					*y_of_last_read_scanline= y;
+		units = calloc(numberofunits, sizeof(struct encoded_unit));
+		if (units == NULL) {
+			fprintf(stderr, "Error, can't allocate space for "
+			    "encoding tiles or strips.\n");
+			return EXIT_INSUFFICIENT_MEMORY;
 		}
-
-		/* Then read up to the point we want to start
-		 * copying at */
-		for (y = 0 ; y < ymin ; y++)
-			if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
-				TIFFError(TIFFFileName(in),
-				    "Error, can't read scanline at "
-				    UINT32_FORMAT " for exhausting", y);
-				error = EXIT_IO_ERROR;
-				goto done;
+		for (u = 0 ; u < numberofunits ; u++) {
+			uint32_t unity = y + (u / numberofunitsperrow) *
+			    unitlength;
+			uint32_t unitrows = tiled || unity + unitlength <=
+			    y + rows ? unitlength : y + rows - unity;
+			TIFF* tif = TIFFClientOpen(TIFFFileName(out), mode,
+			    (thandle_t) &units[u].file,
+			    memoryFileRead, memoryFileWrite,
+			    memoryFileSeek, memoryFileClose,
+			    memoryFileSize, memoryFileMap, memoryFileUnmap);
+
+			if (tif == NULL) {
+				error = EXIT_INSUFFICIENT_MEMORY;
+				break;
+			}
+			units[u].tif = tif;
+			tiffCopyEncodingFields(out, tif);
+			TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, unitwidth);
+			TIFFSetField(tif, TIFFTAG_IMAGELENGTH, unitrows);
+			if (tiled) {
+				TIFFSetField(tif, TIFFTAG_TILEWIDTH,
+				    unitwidth);
+				TIFFSetField(tif, TIFFTAG_TILELENGTH,
+				    unitlength);
 			} else
-				*y_of_last_read_scanline= y;
+				TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP,
+				    unitrows);
+		}
 	}
 
-	for (y = ymin ; y < ymin + length ; y++) {
-		uint32_t xmintocopyinscanline = xmin;
+#ifdef _OPENMP
+	#pragma omp parallel num_threads(number_of_threads) if (units != NULL)
+#endif
+	{
+	unsigned char * tilebuf = NULL;
+	int64_t uu;
+
+	if (tiled) {
+		tilebuf = _TIFFmalloc(unitsize);
+		if (tilebuf == NULL) {
+			#pragma omp critical (writeband_error)
+			error = EXIT_INSUFFICIENT_MEMORY;
+		}
+	}
 
-		if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
-			TIFFError(TIFFFileName(in),
-			    "Error, can't read scanline at "
-			    UINT32_FORMAT " for copying", y);
-			error = EXIT_IO_ERROR;
-			goto done;
+	#pragma omp for schedule(dynamic)
+	for (uu = 0 ; uu < numberofunits ; uu++) {
+		uint32_t unitx = (uu % numberofunitsperrow) * unitwidth;
+		uint32_t unity = (uu / numberofunitsperrow) * unitlength;
+		uint32_t unitrows = unity + unitlength <= rows ?
+		    unitlength : rows - unity;
+		unsigned char * data = bandbuf +
+		    bandscanlinesizeinbytes * unity;
+		TIFF* tif = units != NULL ? units[uu].tif : out;
+		tmsize_t written;
+
+		if (error)
+			continue;
+		if (tiled) {
+			uint32_t unitcols = unitx + unitwidth <= outwidth ?
+			    unitwidth : outwidth - unitx;
+			if (unitcols < unitwidth || unitrows < unitlength)
+				_TIFFmemset(tilebuf, 0, unitsize);
+			cpBufToBuf(tilebuf, 0, data,
+			    unitx * samplesperpixel,
+			    unitcols * samplesperpixel, bitspersample,
+			    unitrows, unitrowsizeinbytes,
+			    bandscanlinesizeinbytes);
+			written = TIFFWriteEncodedTile(tif, units != NULL ?
+			    0 : TIFFComputeTile(out, unitx, y + unity, 0, 0),
+			    tilebuf, unitsize);
 		} else
-			*y_of_last_read_scanline= y;
+			written = TIFFWriteEncodedStrip(tif, units != NULL ?
+			    0 : TIFFComputeStrip(out, y + unity, 0),
+			    data, unitrowsizeinbytes * unitrows);
+		if (written < 0) {
+			#pragma omp critical (writeband_error)
+			error = EXIT_IO_ERROR;
+		} else if (units != NULL) {
+			uint64_t * offsets, * bytecounts;
+			TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets);
+			TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS,
+			    &bytecounts);
+			units[uu].offset = offsets[0];
+			units[uu].bytecount = bytecounts[0];
+			units[uu].index = tiled ?
+			    TIFFComputeTile(out, unitx, y + unity, 0, 0) :
+			    TIFFComputeStrip(out, y + unity, 0);
+		}
+	}
 
-		cpBufToBuf(bufp, 0, inbuf,
-		    xmintocopyinscanline * samplesperpixel,
-		    requestedwidth * samplesperpixel, bitspersample, 1,
-		    outscanlinesizeinbytes, inwidthinbytes);
-		bufp += outscanlinesizeinbytes;
+	if (tilebuf != NULL)
+		_TIFFfree(tilebuf);
+	}
+
+	if (units == NULL)
+		goto done;
+
+	if (!error && !*jpegtablesset) {
+		uint16_t compression;
+
+		TIFFGetField(out, TIFFTAG_COMPRESSION, &compression);
+		if (compression == COMPRESSION_JPEG) {
+			/* TIFFWriteRaw* don't set up the encoder of out,
+			 so copy what it would have set */
+			uint32_t count;
+			void * jpegtables;
+			float * refbw;
+
+			if (TIFFGetField(units[0].tif, TIFFTAG_JPEGTABLES,
+			    &count, &jpegtables))
+				TIFFSetField(out, TIFFTAG_JPEGTABLES, count,
+				    jpegtables);
+			if (TIFFGetField(units[0].tif,
+			    TIFFTAG_REFERENCEBLACKWHITE, &refbw))
+				TIFFSetField(out,
+				    TIFFTAG_REFERENCEBLACKWHITE, refbw);
+		}
+		*jpegtablesset = 1;
+	}
+
+	for (u = 0 ; u < numberofunits ; u++) {
+		if (!error && units[u].offset + units[u].bytecount <=
+		    units[u].file.size) {
+			if ((tiled ? TIFFWriteRawTile(out, units[u].index,
+			    units[u].file.data + units[u].offset,
+			    units[u].bytecount) :
+			    TIFFWriteRawStrip(out, units[u].index,
+			    units[u].file.data + units[u].offset,
+			    units[u].bytecount)) < 0)
+				error = EXIT_IO_ERROR;
+		} else if (!error)
+			error = EXIT_IO_ERROR;
+		if (units[u].tif != NULL)
+			TIFFClose(units[u].tif);
+		free(units[u].file.data);
 	}
+	free(units);
 
 	done:
-	_TIFFfree(inbuf);
+	if (error)
+		TIFFError(TIFFFileName(out), "Error, can't write %s",
+		    tiled ? "tile" : "strip");
 	return error;
 }
 
 
-	/* Return 0 if the requested memory size exceeds the machine's
-	  addressing size type (size_t) capacity or if bitspersample is
-	  unhandled */
-static size_t computeMemorySize(uint16_t spp, uint16_t bitspersample,
-	uint32_t outwidth, uint32_t outlength)
+static void printJSONString(const char * s)
 {
-	uint16_t bitsperpixel = spp * bitspersample;
-	uint64_t memorysize = outlength;
-	if (bitsperpixel % 8 == 0)
-		memorysize *= (uint64_t) outwidth * (bitsperpixel/8);
-	else /*if (8 % bitsperpixel == 0)*/ {
-		int pixelsperbyte = 8/bitsperpixel;
-		int bytesperrow = (outwidth * bitsperpixel + 7) / 8;
-		memorysize *= bytesperrow;
-	} /*else
-		return 0;*/
+	putchar('"');
+	for ( ; *s ; s++)
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", (unsigned) (unsigned char) *s);
+		else
+			putchar(*s);
+	putchar('"');
+}
 
-	if ((size_t) memorysize != memorysize)
-		return 0;
-	return memorysize;
+
+	/* Report the plan of the extract of the requested region of the
+	 current directory of in, which would be written to outfilename
+	 with the given mode, decoding the units it touches if decodes is
+	 set, with peakbytes of buffers */
+static int reportExtract(TIFF* in, uint16_t dirnum, const char * outfilename,
+	uint32_t outwidth, uint32_t outlength, const char * mode, int decodes,
+	uint64_t peakbytes)
+{
+	uint32_t imagewidth, imagelength, unitwidth, unitlength, ux, uy;
+	uint32_t x = requestedxmin, width = requestedwidth;
+	uint64_t * bytecounts = NULL;
+	uint64_t units = 0, compressedbytes = 0, decodedpixels = 0,
+	    redundantdecodes = 0, unitsize;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &imagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &imagelength);
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &unitwidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &unitlength);
+		TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts);
+		unitsize = TIFFTileSize(in);
+	} else {
+		unitwidth = imagewidth;
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &unitlength);
+		if (unitlength == 0 || unitlength > imagelength)
+			unitlength = imagelength;
+		TIFFGetField(in, TIFFTAG_STRIPBYTECOUNTS, &bytecounts);
+		unitsize = TIFFStripSize(in);
+		x = 0; /* strips are decoded whole */
+		width = imagewidth;
+	}
+
+	if (dryrun_lastdecode == NULL ||
+	    dryrun_diroff != TIFFCurrentDirOffset(in)) {
+		uint32_t n = TIFFIsTiled(in) ? TIFFNumberOfTiles(in) :
+		    TIFFNumberOfStrips(in);
+
+		free(dryrun_lastdecode);
+		dryrun_lastdecode = calloc(n, sizeof(uint64_t));
+		if (dryrun_lastdecode == NULL) {
+			fprintf(stderr, "Unable to allocate enough memory to"
+				" report the plan.\n");
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
+		dryrun_diroff = TIFFCurrentDirOffset(in);
+	}
+
+	for (uy = requestedymin / unitlength ;
+	    uy <= (requestedymin + requestedlength - 1) / unitlength ; uy++)
+		for (ux = x / unitwidth ; ux <= (x + width - 1) / unitwidth ;
+		    ux++) {
+			uint32_t unit = TIFFIsTiled(in) ?
+			    TIFFComputeTile(in, ux * unitwidth,
+			    uy * unitlength, 0, 0) :
+			    TIFFComputeStrip(in, uy * unitlength, 0);
+			uint32_t rows = !TIFFIsTiled(in) &&
+			    imagelength - uy * unitlength < unitlength ?
+			    imagelength - uy * unitlength : unitlength;
+			uint64_t last = dryrun_lastdecode[unit];
+
+			units++;
+			if (bytecounts != NULL)
+				compressedbytes += bytecounts[unit];
+			if (!decodes)
+				continue;
+			if (last != 0 && TIFFIsTiled(in) &&
+			    dryrun_decodedbytes - (last - 1) + unitsize <=
+			    tile_cache_budget)
+				continue; /* still in the cache */
+			decodedpixels += (uint64_t) unitwidth * rows;
+			if (last != 0)
+				redundantdecodes++;
+			dryrun_decodedbytes += unitsize;
+			dryrun_lastdecode[unit] = dryrun_decodedbytes + 1;
+		}
+	if (decodes && TIFFIsTiled(in))
+		peakbytes += number_of_threads * unitsize + tile_cache_budget;
+	else
+		peakbytes += unitsize;
+
+	printf("%s\n  {\"output\": ", dryrun_number_of_extracts++ ? "," : "");
+	printJSONString(outfilename);
+	printf(", \"directory\": %u, \"x\": " UINT32_FORMAT ", \"y\": "
+	    UINT32_FORMAT ", \"width\": " UINT32_FORMAT ", \"length\": "
+	    UINT32_FORMAT ", \"output_width\": " UINT32_FORMAT
+	    ", \"output_length\": " UINT32_FORMAT ", \"mode\": \"%s\""
+	    ", \"units\": \"%s\", \"units_touched\": " UINT64_FORMAT
+	    ", \"compressed_bytes\": " UINT64_FORMAT
+	    ", \"decoded_pixels\": " UINT64_FORMAT
+	    ", \"redundant_decodes\": " UINT64_FORMAT
+	    ", \"peak_buffer_bytes\": " UINT64_FORMAT "}",
+	    dirnum, requestedxmin, requestedymin, requestedwidth,
+	    requestedlength, outwidth, outlength, mode,
+	    TIFFIsTiled(in) ? "tiles" : "strips", units, compressedbytes,
+	    decodedpixels, redundantdecodes, peakbytes);
+	dryrun_total_units += units;
+	dryrun_total_compressedbytes += compressedbytes;
+	dryrun_total_decodedpixels += decodedpixels;
+	dryrun_total_redundantdecodes += redundantdecodes;
+	if (peakbytes > dryrun_peak_buffer_bytes)
+		dryrun_peak_buffer_bytes = peakbytes;
+	return 0;
 }
 
 
+	/* If outfilename is NULL or if alwayssuffix is set, the name of
+	 the output file is made from outfilename or infilename by
+	 appending the geometry of the extract */
 static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
         uint64_t diroff, uint16_t dirnum, uint16_t numberdirs,
-        const char * outfilename)
+        const char * outfilename, int alwayssuffix, struct scaling * scaled)
 {
 	uint32_t inimagewidth, inimagelength;
 	uint32_t outwidth = 0, outlength = 0;
 	uint16_t planarconfig, spp, bitspersample;
-	size_t outmemorysize;
+	uint32_t bandlength, bufferlength, y, rowsperstrip;
+	uint32_t outunitlength = 1;
+	int copyrawtiles, copydctcoefficients;
+	size_t outmemorysize = 0;
 	char * ouroutfilename = NULL;
 	unsigned char * outbuf = NULL;
 	void * out; /* TIFF* or FILE* */
-	uint32_t y_of_last_read_scanline = 0;
+	TIFF** tins = NULL; /* handles of the threads decoding tiles */
+	uint32_t y_of_last_read_scanline = (uint32_t) -1;
 	int return_code = 0; /* Success */
 
 	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &inimagewidth);
@@ -843,55 +2829,155 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 		return EXIT_UNHANDLED_INPUT_IMAGE_TYPE;
 	}
 
+	if (scaled != NULL) {
+		outwidth = scaled->outwidth; outlength = scaled->outlength;
+	} else {
+		outwidth = requestedwidth; outlength = requestedlength;
+	}
 	if (output_format == OUTPUT_FORMAT_JPEG &&
-	    ( (requestedwidth >= JPEG_MAX_DIMENSION) ||
-	      (requestedlength >= JPEG_MAX_DIMENSION) ) ) {
+	    ( (outwidth >= JPEG_MAX_DIMENSION) ||
+	      (outlength >= JPEG_MAX_DIMENSION) ) ) {
 		fprintf(stderr, "At least one requested extract dimension is too large for JPEG files.\n");
 		return EXIT_UNABLE_TO_ACHIEVE_TILE_DIMENSIONS;
 	}
 
-	outwidth = requestedwidth; outlength = requestedlength;
-	outmemorysize= computeMemorySize(spp, bitspersample, outwidth,
-		outlength);
-	outbuf= outmemorysize == 0 ? NULL : malloc(outmemorysize);
-	if (outbuf == NULL) {
-		fprintf(stderr, "Unable to allocate enough memory to"
-			" prepare extract (%zu bytes needed).\n",
-		        outmemorysize);
-		return EXIT_INSUFFICIENT_MEMORY;
+	rowsperstrip = outlength;
+	copyrawtiles = output_format == OUTPUT_FORMAT_TIFF &&
+	    (scaled == NULL || !scaled->resample) &&
+	    canCopyRawTiles(in, requestedxmin, requestedymin,
+	    requestedwidth, requestedlength);
+	copydctcoefficients = output_format == OUTPUT_FORMAT_JPEG &&
+	    jpeg_dct_copy && (scaled == NULL || !scaled->resample) &&
+	    canCopyDCTCoefficients(in, requestedxmin, requestedymin);
+	if (jpeg_dct_copy && output_format == OUTPUT_FORMAT_JPEG &&
+	    !copydctcoefficients)
+		fprintf(stderr, "Warning: can't copy the DCT coefficients "
+			"of the tiles of \"%s\" (not JPEG-compressed "
+			"tiles, extract not aligned on JPEG MCUs, or "
+			"scaled). Decoding and encoding again.\n",
+			infilename);
+		/* JPEG and PNG files are written row by row, so the extract
+		 is prepared band by band in a buffer of bandlength rows */
+		/* TIFF files are written in bands of whole tiles or strips,
+		 at least as long as the bands in which the input is read;
+		 the input is still read on its own grid of bands, the rows
+		 of an unfinished tile or strip of the output being kept in
+		 the buffer until the next band */
+	bandlength = computeBandLength(in);
+	if (scaled != NULL && scaled->resample) /* about as many input rows */
+		bandlength = bandlength / scaled->stepy >= 1 ?
+		    bandlength / scaled->stepy : 1;
+	if (output_format == OUTPUT_FORMAT_TIFF) {
+		uint16_t compression = defcompression;
+		uint32_t unitlength, inbandlength = bandlength;
+		uint64_t readlength;
+
+		if (compression == (uint16_t) -1)
+			TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION,
+			    &compression);
+		if (outrowsperstrip && outrowsperstrip < outlength) {
+			rowsperstrip = outrowsperstrip;
+			if (compression == COMPRESSION_JPEG &&
+			    rowsperstrip % 16 != 0) {
+				/* Required by libtiff's JPEG codec */
+				rowsperstrip += 16 - rowsperstrip % 16;
+				if (verbose)
+					fprintf(stderr, "Using " UINT32_FORMAT
+					    " rows per strip, a multiple of "
+					    "16 as required for JPEG "
+					    "compression.\n", rowsperstrip);
+			}
+			if (rowsperstrip > outlength)
+				rowsperstrip = outlength;
+		}
+		unitlength = outtilelength ? outtilelength : rowsperstrip;
+		uint32_t units = bandlength / unitlength;
+
+		if (units < (uint32_t) number_of_threads)
+			units = number_of_threads;
+		if ((uint64_t) units * unitlength < bandlength)
+			units++;
+		bandlength = (uint64_t) units * unitlength < outlength ?
+		    units * unitlength : outlength;
+		readlength = (bandlength + (uint64_t) inbandlength - 1) /
+		    inbandlength * inbandlength;
+		if (readlength <= UINT32_MAX)
+			bandlength = readlength;
+		outunitlength = unitlength;
+		bufferlength = (uint64_t) bandlength + unitlength - 1 <
+		    outlength ? bandlength + unitlength - 1 : outlength;
+	} else if (bandlength > outlength)
+		bandlength = outlength;
+	if (output_format != OUTPUT_FORMAT_TIFF)
+		bufferlength = bandlength;
+	if (!copyrawtiles && !copydctcoefficients) {
+		outmemorysize= computeMemorySize(spp, bitspersample, outwidth,
+			bufferlength);
+		outbuf= outmemorysize == 0 || dryrun ? NULL :
+		    malloc(outmemorysize);
+		if (outbuf == NULL && !dryrun) {
+			fprintf(stderr, "Unable to allocate enough memory to"
+				" prepare extract (%zu bytes needed).\n",
+				outmemorysize);
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
 	}
 
 	{
 	char * prefix = searchPrefixBeforeLastDot(outfilename != NULL ?
 			    outfilename : infilename);
-	if (outfilename == NULL || diroff || numberdirs > 1) {
-		uint32_t ndigitsx = searchNumberOfDigits(inimagewidth),
-		    ndigitsy = searchNumberOfDigits(inimagelength);
+	if (outfilename == NULL || alwayssuffix || diroff || numberdirs > 1) {
+		    /* Scaled extracts are named after their level-0 region */
+		uint32_t namexmin = scaled ? scaled->xmin : requestedxmin,
+		    nameymin = scaled ? scaled->ymin : requestedymin,
+		    namewidth = scaled ? scaled->width : requestedwidth,
+		    namelength = scaled ? scaled->length : requestedlength;
+		uint32_t ndigitsx = searchNumberOfDigits(scaled ?
+		    scaled->level0width : inimagewidth),
+		    ndigitsy = searchNumberOfDigits(scaled ?
+		    scaled->level0length : inimagelength);
+		char scalesuffix[32] = "";
+
+		if (scaled)
+			snprintf(scalesuffix, sizeof(scalesuffix), "-s%g",
+			    requested_scale);
 		if (diroff)
-			my_asprintf(&ouroutfilename, "%s-d0x" UINT64_HEX_FORMAT "-%0*u-%0*u-%0*ux%0*u.%s",
-			    prefix, diroff, ndigitsx, requestedxmin,
-			    ndigitsy, requestedymin, ndigitsx,
-			    requestedwidth, ndigitsy, requestedlength,
+			my_asprintf(&ouroutfilename, "%s-d0x" UINT64_HEX_FORMAT "-%0*u-%0*u-%0*ux%0*u%s.%s",
+			    prefix, diroff, ndigitsx, namexmin,
+			    ndigitsy, nameymin, ndigitsx,
+			    namewidth, ndigitsy, namelength, scalesuffix,
 			    OUTPUT_SUFFIX[output_format]);
 		else if (numberdirs > 1) {
 			uint32_t ndigitsdirnum = searchNumberOfDigits(numberdirs);
-			my_asprintf(&ouroutfilename, "%s-d%0*u-%0*u-%0*u-%0*ux%0*u.%s",
+			my_asprintf(&ouroutfilename, "%s-d%0*u-%0*u-%0*u-%0*ux%0*u%s.%s",
 			    prefix, ndigitsdirnum, dirnum,
-			    ndigitsx, requestedxmin,
-			    ndigitsy, requestedymin, ndigitsx,
-			    requestedwidth, ndigitsy, requestedlength,
+			    ndigitsx, namexmin,
+			    ndigitsy, nameymin, ndigitsx,
+			    namewidth, ndigitsy, namelength, scalesuffix,
 			    OUTPUT_SUFFIX[output_format]);
 		} else
-			my_asprintf(&ouroutfilename, "%s-%0*u-%0*u-%0*ux%0*u.%s",
-			    prefix, ndigitsx, requestedxmin, ndigitsy,
-			    requestedymin, ndigitsx,
-			    requestedwidth, ndigitsy, requestedlength,
+			my_asprintf(&ouroutfilename, "%s-%0*u-%0*u-%0*ux%0*u%s.%s",
+			    prefix, ndigitsx, namexmin, ndigitsy,
+			    nameymin, ndigitsx,
+			    namewidth, ndigitsy, namelength, scalesuffix,
 			    OUTPUT_SUFFIX[output_format]);
 		outfilename = ouroutfilename;
 	}
 	free(prefix);
 	}
 
+	if (dryrun) {
+		return_code = reportExtract(in, dirnum, outfilename, outwidth,
+		    outlength, copyrawtiles ? "raw tile copy" :
+		    copydctcoefficients ? "DCT coefficient copy" : "decode",
+		    !copyrawtiles && !copydctcoefficients, copydctcoefficients ?
+		    (uint64_t) outwidth * outlength * spp * sizeof(JCOEF) :
+		    outmemorysize);
+		if (ouroutfilename != NULL)
+			free(ouroutfilename);
+		return return_code;
+	}
+
 	char tiffOpenMode[6] = "w";
 	if (TIFFIsBigEndian(in)) {
 		strcat(tiffOpenMode, "b");
@@ -915,7 +3001,7 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 					UINT32_FORMAT " x "
 					UINT32_FORMAT ".\n",
 					outfilename,
-					requestedwidth, requestedlength);
+					outwidth, outlength);
 	}
 	if (ouroutfilename != NULL)
 		free(ouroutfilename);
@@ -939,6 +3025,17 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 	if (png_quality <= 0)
 		png_quality = default_png_quality;
 
+	if (TIFFIsTiled(in) && number_of_threads > 1 && !copyrawtiles &&
+	    !copydctcoefficients && (tins = openInputHandlesForThreads(in))
+	    == NULL) {
+		if (output_format == OUTPUT_FORMAT_TIFF)
+			TIFFClose((TIFF *) out);
+		else
+			fclose((FILE *) out);
+		free(outbuf);
+		return EXIT_IO_ERROR;
+	}
+
 	switch(output_format) {
 	case OUTPUT_FORMAT_JPEG:
 		{
@@ -946,14 +3043,25 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 		struct jpeg_error_mgr jerr;
 		uint16_t bitsperpixel = bitspersample * spp;
 		tsize_t outscanlinesizeinbytes =
-		    (requestedwidth * bitsperpixel + 7) / 8;
+		    (outwidth * bitsperpixel + 7) / 8;
 		int error = 0;
 
+		if (copydctcoefficients) {
+			if (verbose)
+				fprintf(stderr, "Copying DCT coefficients "
+				    "of the tiles without decoding them.\n");
+			return_code = makeJPEGFromDCTCoefficients(in, out,
+			    requestedxmin, requestedymin,
+			    requestedwidth, requestedlength);
+			fclose(out);
+			break;
+		}
+
 		cinfo.err = jpeg_std_error(&jerr);
 		jpeg_create_compress(&cinfo);
 		jpeg_stdio_dest(&cinfo, out);
-		cinfo.image_width = requestedwidth;
-		cinfo.image_height = requestedlength;
+		cinfo.image_width = outwidth;
+		cinfo.image_height = outlength;
 		cinfo.input_components = spp; /* # of color comp. per pixel */
 		cinfo.in_color_space = JCS_RGB; /* colorspace of input image */
 		jpeg_set_defaults(&cinfo);
@@ -962,49 +3070,45 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 				jpeg_quality);
 		jpeg_set_quality(&cinfo, jpeg_quality,
 		    TRUE /* limit to baseline-JPEG values */);
-		jpeg_start_compress(&cinfo, TRUE);
 
-		if (((TIFFIsTiled(in) &&
-		      !(error = cpTiles2Strip(in,
-			    requestedxmin, requestedymin,
-			    requestedwidth, requestedlength,
-			    outbuf, outscanlinesizeinbytes,
-			    bitspersample, spp))) ||
-		     (!TIFFIsTiled(in) &&
-		      !(error = cpStrips2Strip(in,
-			    requestedxmin, requestedymin,
-			    requestedwidth, requestedlength,
-			    outbuf, outscanlinesizeinbytes,
-			    bitspersample, spp,
-			    &y_of_last_read_scanline,
-			    inimagelength))))) {
-			if (verbose)
-				fprintf(stderr, "Extract prepared.\n");
+		JSAMPROW row_pointer;
+		JSAMPROW* row_pointers = malloc(bandlength * sizeof(JSAMPROW));
 
-			uint32_t y;
-			JSAMPROW row_pointer;
-			JSAMPROW* row_pointers =
-				malloc(requestedlength * sizeof(JSAMPROW));
+		if (row_pointers == NULL) {
+			fprintf(stderr, "Error, can't allocate space for row_pointers.\n");
+			jpeg_destroy_compress(&cinfo);
+			fclose(out);
+			free(outbuf);
+			closeInputHandlesForThreads(tins);
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
+		for (y = 0, row_pointer = outbuf ; y < bandlength ;
+		    y++, row_pointer += outscanlinesizeinbytes)
+			row_pointers[y]= row_pointer;
 
-			if (row_pointers == NULL) {
-				fprintf(stderr, "Error, can't allocate space for row_pointers.\n");
-				fclose(out);
-				free(outbuf);
-				return EXIT_INSUFFICIENT_MEMORY;
-			}
+		jpeg_start_compress(&cinfo, TRUE);
 
-			for (y = 0, row_pointer = outbuf ; y < requestedlength ;
-			    y++, row_pointer += outscanlinesizeinbytes)
-				row_pointers[y]= row_pointer;
+		for (y = 0 ; y < outlength && !error ; ) {
+			uint32_t rowsinband = computeExtractRowsInBand(scaled,
+			    y, bandlength, outlength);
 
-			jpeg_write_scanlines(&cinfo, row_pointers, requestedlength);
-			free(row_pointers);
-		} else {
-			fprintf(stderr, "Error, can't write extract.\n");
-			return_code = error;
+			error = cpExtractRows(in, tins, scaled, y, rowsinband,
+			    outbuf, outscanlinesizeinbytes,
+			    bitspersample, spp, &y_of_last_read_scanline,
+			    inimagelength);
+			if (!error)
+				jpeg_write_scanlines(&cinfo, row_pointers,
+				    rowsinband);
+			y += rowsinband;
 		}
+		free(row_pointers);
 
-		jpeg_finish_compress(&cinfo);
+		if (error) {
+			fprintf(stderr, "Error, can't write extract.\n");
+			return_code = error;
+			jpeg_abort_compress(&cinfo);
+		} else
+			jpeg_finish_compress(&cinfo);
 		fclose(out);
 		jpeg_destroy_compress(&cinfo);
 		}
@@ -1015,16 +3119,20 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 		{
 		uint16_t bitsperpixel = bitspersample * spp;
 		tsize_t outscanlinesizeinbytes = computeWidthInBytes(
-		    requestedwidth, bitsperpixel);
+		    outwidth, bitsperpixel);
 		int error = 0;
 
 		png_structp png_ptr = png_create_write_struct(
 		    PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (!png_ptr)
-			{ fclose(out); return EXIT_INSUFFICIENT_MEMORY; }
+		if (!png_ptr) {
+			fclose(out);
+			closeInputHandlesForThreads(tins);
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
 		png_infop info_ptr = png_create_info_struct(png_ptr);
 		if (!info_ptr) {
 			fclose(out);
+			closeInputHandlesForThreads(tins);
 			png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
 			return EXIT_INSUFFICIENT_MEMORY;
 		}
@@ -1033,12 +3141,13 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 			png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
 			png_destroy_write_struct(&png_ptr, (png_infopp) &info_ptr);
 			fprintf(stderr, "Error, can't write extract.\n");
+			closeInputHandlesForThreads(tins);
 			return EXIT_INSUFFICIENT_MEMORY;
 		}
 		png_init_io(png_ptr, out);
 
-		png_set_IHDR(png_ptr, info_ptr, requestedwidth,
-		    requestedlength, bitspersample,
+		png_set_IHDR(png_ptr, info_ptr, outwidth,
+		    outlength, bitspersample,
 		    spp == 4 ? PNG_COLOR_TYPE_RGB_ALPHA :
 		    (spp == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY),
 		    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
@@ -1070,29 +3179,24 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 		/*png_set_packing(png_ptr);*/ /* Use *only* if bits are
 		 not yet packed */
 
-		if (((TIFFIsTiled(in) &&
-		      !(error = cpTiles2Strip(in,
-			    requestedxmin, requestedymin,
-			    requestedwidth, requestedlength,
-			    outbuf, outscanlinesizeinbytes,
-			    bitspersample, spp))) ||
-		     (!TIFFIsTiled(in) &&
-		      !(error = cpStrips2Strip(in,
-			    requestedxmin, requestedymin,
-			    requestedwidth, requestedlength,
-			    outbuf, outscanlinesizeinbytes,
-			    bitspersample, spp,
-			    &y_of_last_read_scanline,
-			    inimagelength))))) {
-			if (verbose)
-				fprintf(stderr, "Extract prepared.\n");
+		for (y = 0 ; y < outlength && !error ; ) {
+			uint32_t rowsinband = computeExtractRowsInBand(scaled,
+			    y, bandlength, outlength);
 
-			png_const_bytep row_pointer = outbuf;
-			uint32_t y;
-			for (y = 0 ; y < requestedlength ;
-			    y++, row_pointer += outscanlinesizeinbytes)
-				png_write_row(png_ptr, row_pointer);
-		} else
+			error = cpExtractRows(in, tins, scaled, y, rowsinband,
+			    outbuf, outscanlinesizeinbytes,
+			    bitspersample, spp, &y_of_last_read_scanline,
+			    inimagelength);
+			if (!error) {
+				png_const_bytep row_pointer = outbuf;
+				uint32_t row;
+				for (row = 0 ; row < rowsinband ;
+				    row++, row_pointer += outscanlinesizeinbytes)
+					png_write_row(png_ptr, row_pointer);
+			}
+			y += rowsinband;
+		}
+		if (error)
 			return_code = error;
 
 		png_write_end(png_ptr, info_ptr);
@@ -1105,45 +3209,67 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 
 	case OUTPUT_FORMAT_TIFF:
 		{
-		uint16_t bitsperpixel = bitspersample * spp;
 		tsize_t outscanlinesizeinbytes;
+		int jpegtablesset = 0;
+		uint32_t pendingrows;
 		int error = 0;
 
 		tiffCopyFieldsButDimensions(in, out);
-		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, requestedwidth);
-		TIFFSetField(out, TIFFTAG_IMAGELENGTH, requestedlength);
-		TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, requestedlength);
+		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, outwidth);
+		TIFFSetField(out, TIFFTAG_IMAGELENGTH, outlength);
+		if (copyrawtiles) {
+			if (verbose)
+				fprintf(stderr, "Extract lies on the tile grid: "
+				    "copying tiles without decoding them.\n");
+			tiffCopyFieldsForRawTiles(in, out);
+			error = cpRawTiles(in, out, requestedxmin,
+			    requestedymin, requestedwidth, requestedlength);
+			goto tiffwritten;
+		}
+		if (outtilewidth) {
+			TIFFSetField(out, TIFFTAG_TILEWIDTH, outtilewidth);
+			TIFFSetField(out, TIFFTAG_TILELENGTH, outtilelength);
+		} else
+			TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
 
 		testAndFixOutTIFFPhotoAndCompressionParameters(in, out);
 			/* To be done *after* setting compression --
 			 * otherwise, ScanlineSize may be wrong */
 		outscanlinesizeinbytes = TIFFScanlineSize(out);
 
-		if (((TIFFIsTiled(in) &&
-		      !(error = cpTiles2Strip(in, requestedxmin,
-			requestedymin, requestedwidth, requestedlength,
-			outbuf, outscanlinesizeinbytes, bitspersample,
-			spp))) ||
-		     (!TIFFIsTiled(in) &&
-		      !(error = cpStrips2Strip(in, requestedxmin,
-			requestedymin, requestedwidth, requestedlength,
-			outbuf, outscanlinesizeinbytes,
-			bitspersample, spp, &y_of_last_read_scanline,
-			inimagelength))))) {
-			if (verbose)
-				fprintf(stderr, "Extract prepared.\n");
+		for (y = 0, pendingrows = 0 ; y < outlength && !error ; ) {
+			uint32_t rowsinband = computeExtractRowsInBand(scaled,
+			    y, bandlength, outlength);
+			uint32_t rows = pendingrows + rowsinband, rowstowrite;
+
+			error = cpExtractRows(in, tins, scaled, y, rowsinband,
+			    outbuf + (size_t) pendingrows *
+			    outscanlinesizeinbytes, outscanlinesizeinbytes,
+			    bitspersample, spp, &y_of_last_read_scanline,
+			    inimagelength);
+			y += rowsinband;
+			rowstowrite = y == outlength ? rows :
+			    rows - rows % outunitlength;
+			if (!error && rowstowrite > 0)
+				error = writeBandToTIFF(out, outbuf,
+				    outscanlinesizeinbytes, y - rows,
+				    rowstowrite, outwidth, bitspersample, spp,
+				    &jpegtablesset);
+			pendingrows = rows - rowstowrite;
+			if (pendingrows > 0)
+				memmove(outbuf, outbuf + (size_t) rowstowrite *
+				    outscanlinesizeinbytes,
+				    (size_t) pendingrows *
+				    outscanlinesizeinbytes);
+		}
 
-			if (TIFFWriteEncodedStrip(out,
-				TIFFComputeStrip(out, 0, 0), outbuf,
-				TIFFStripSize(out)) < 0) {
-				TIFFError(TIFFFileName(out),
-					"Error, can't write strip");
-			} else if (verbose)
-				fprintf(stderr, "Extract written to "
-					"output file \"%s\".\n",
-					TIFFFileName(out));
-		} else
+		tiffwritten:
+		if (error)
 			return_code = error;
+		else if (verbose)
+			fprintf(stderr, "Extract written to "
+				"output file \"%s\".\n",
+				TIFFFileName(out));
 
 		TIFFClose(out);
 		}
@@ -1152,27 +3278,106 @@ static int makeExtractFromTIFFDirectory(const char * infilename, TIFF * in,
 	default:
 		fprintf(stderr, "Unsupported output file format.\n");
 		free(outbuf);
+		closeInputHandlesForThreads(tins);
 		return EXIT_UNHANDLED_OUTPUT_FILE_TYPE;
 	}
 
 	if (return_code == 0 && verbose)
 		fprintf(stderr, "Extract written.\n");
 	free(outbuf);
+	closeInputHandlesForThreads(tins);
+	return return_code;
+}
+
+
+static int guessOutputFormatFromFileName(const char * filename)
+{
+	const char * suffix = searchSuffix(filename);
+
+	if (strcasecmp(suffix, "png") == 0)
+		return OUTPUT_FORMAT_PNG;
+	else if (strcasecmp(suffix, "jpeg") == 0 ||
+		 strcasecmp(suffix, "jpg") == 0)
+		return OUTPUT_FORMAT_JPEG;
+	return OUTPUT_FORMAT_TIFF;
+}
+
+
+	/* Make the extracts of all requested regions from the current
+	 directory of in */
+static int makeExtractsFromTIFFDirectory(const char * infilename, TIFF * in,
+        uint64_t diroff, uint16_t dirnum, uint16_t numberdirs,
+        const char * outfilename)
+{
+	int default_output_format = output_format;
+	int return_code = 0; /* Success */
+	uint64_t level0diroff = TIFFCurrentDirOffset(in);
+	uint32_t level0width, level0length;
+	uint32_t rn;
+
+	if (requested_scale > 0) {
+		TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &level0width);
+		TIFFGetField(in, TIFFTAG_IMAGELENGTH, &level0length);
+		selectPyramidLevel(in);
+	}
+
+	for (rn = 0 ; rn < number_of_regions ; rn++) {
+		struct scaling scaling;
+		const char * ouroutfilename = outfilename;
+		int r;
+
+		if (regions[rn].width == 0 || regions[rn].length == 0) {
+			fprintf(stderr, "Requested extract number " UINT32_FORMAT
+				" is empty. Can't do it.\n", rn+1);
+			if (!return_code)
+				return_code = EXIT_GEOMETRY_ERROR;
+			continue;
+		}
+
+		requestedxmin = regions[rn].xmin;
+		requestedymin = regions[rn].ymin;
+		requestedwidth = regions[rn].width;
+		requestedlength = regions[rn].length;
+		if (regions[rn].outfilename != NULL) {
+			ouroutfilename = regions[rn].outfilename;
+			if (guess_output_format_of_each_region)
+				output_format = guessOutputFormatFromFileName(
+				    ouroutfilename);
+		}
+
+		if (requested_scale > 0) {
+			r = prepareScaling(in, &scaling, level0width,
+			    level0length);
+			if (!r)
+				r = makeExtractFromTIFFDirectory(infilename,
+				    in, diroff, dirnum, numberdirs,
+				    ouroutfilename, number_of_regions > 1 &&
+				    regions[rn].outfilename == NULL, &scaling);
+			freeScaling(&scaling);
+		} else
+			r = makeExtractFromTIFFDirectory(infilename, in,
+			    diroff, dirnum, numberdirs, ouroutfilename,
+			    number_of_regions > 1 &&
+			    regions[rn].outfilename == NULL, NULL);
+		output_format = default_output_format;
+		if (r && !return_code) /* error code = 1st error */
+			return_code = r;
+	}
+
+	if (requested_scale > 0) /* back to level 0 for TIFFReadDirectory */
+		TIFFSetSubDirectory(in, level0diroff);
 	return return_code;
 }
 
 
+	/* The file is opened and each directory is read only once, whatever
+	 the number of requested regions */
 static int makeExtractFromTIFFFile(const char * infilename,
 	const char * outfilename)
 {
 	TIFF * in;
 	int return_code = 0; /* Success */
 
-	if (requestedwidth == 0 || requestedlength == 0) {
-		fprintf(stderr, "Requested extract is empty. Can't do it. Aborting.\n");
-		return EXIT_GEOMETRY_ERROR;
-	}
-
 	in = TIFFOpen(infilename, "r");
 	if (in == NULL) {
 		if (verbose)
@@ -1183,17 +3388,24 @@ static int makeExtractFromTIFFFile(const char * infilename,
 
 	if (verbose)
 		fprintf(stderr, "File \"%s\" open.\n", infilename);
+	if (dryrun) {
+		printf("{\"input\": ");
+		printJSONString(infilename);
+		printf(", \"extracts\": [");
+	}
 
 	if (diroff != 0) {
 		if (TIFFSetSubDirectory(in, diroff))
-			makeExtractFromTIFFDirectory(infilename, in,
-			    diroff, 0, 0, outfilename);
-	} else if (number_of_dirnum_ranges == 1 &&
-	    dirnum_ranges_starts[0] == 0 && dirnum_ranges_ends[0] == 0) {
-		 /* special case for speed (?) */
-		if (TIFFSetDirectory(in, (tdir_t) dirnum_ranges_starts[0]))
-			makeExtractFromTIFFDirectory(infilename, in,
-			    0, 0, 1, outfilename);
+			return_code = makeExtractsFromTIFFDirectory(
+			    infilename, in, diroff, 0, 0, outfilename);
+	} else if ((number_of_dirnum_ranges == 1 &&
+	    dirnum_ranges_starts[0] == 0 && dirnum_ranges_ends[0] == 0) ||
+	    (number_of_dirnum_ranges == 0 && requested_scale > 0)) {
+		 /* special case for speed (?); by default, scaled extracts
+		  are made only from the first directory (level 0) */
+		if (TIFFSetDirectory(in, 0))
+			return_code = makeExtractsFromTIFFDirectory(
+			    infilename, in, 0, 0, 1, outfilename);
 	} else {
 		uint16_t numberofdirectories= TIFFNumberOfDirectories(in);
 
@@ -1203,14 +3415,30 @@ static int makeExtractFromTIFFFile(const char * infilename,
 
 		uint16_t curdir= 0;
 		do {
-			if (shouldBeHandled(curdir))
-				makeExtractFromTIFFDirectory(infilename, in,
-				    0, curdir, numberofdirectories,
-				    outfilename);
+			if (shouldBeHandled(curdir)) {
+				int r = makeExtractsFromTIFFDirectory(
+				    infilename, in, 0, curdir,
+				    numberofdirectories, outfilename);
+				if (r && !return_code)
+					return_code = r;
+			}
 			curdir++;
 		} while (TIFFReadDirectory(in));
 	}
+	tileCacheFree();
 	TIFFClose(in);
+	if (dryrun) {
+		printf("],\n \"units_touched\": " UINT64_FORMAT
+		    ", \"compressed_bytes\": " UINT64_FORMAT
+		    ", \"decoded_pixels\": " UINT64_FORMAT
+		    ", \"redundant_decodes\": " UINT64_FORMAT
+		    ", \"peak_buffer_bytes\": " UINT64_FORMAT "}\n",
+		    dryrun_total_units, dryrun_total_compressedbytes,
+		    dryrun_total_decodedpixels, dryrun_total_redundantdecodes,
+		    dryrun_peak_buffer_bytes);
+		free(dryrun_lastdecode);
+		dryrun_lastdecode = NULL;
+	}
 	return return_code;
 }
 
@@ -1222,10 +3450,19 @@ static void usage()
 	fprintf(stderr, "Usage: tifffastcrop [options] input.tif [output_name]\n\n");
 	fprintf(stderr, " Extracts (crops), without loading the full image input.tif into memory, a\nrectangular region from it, and saves it. Output file name is output_name if\ngiven, otherwise a name derived from input.tif. Output file format is guessed\nfrom output_name's extension if possible. Options:\n");
 	fprintf(stderr, " -v                verbose monitoring\n");
+	fprintf(stderr, " -y                dry run: write no file, report on stdout in JSON the\n");
+	fprintf(stderr, "                   tiles or strips each extract reads and the memory needed\n");
 	fprintf(stderr, " -B                write a BigTIFF format file\n");
 	fprintf(stderr, " -T                report TIFF errors/warnings on stderr (no dialog boxes)\n");
 	fprintf(stderr, " -E x,y,w,l        region to extract/crop (x,y: coordinates of top left corner,\n");
-	fprintf(stderr, "   w,l: width and length in pixels)\n");
+	fprintf(stderr, "   w,l: width and length in pixels; if given several times, the last wins)\n");
+	fprintf(stderr, " -R file           extract all regions listed in file, one per line as\n");
+	fprintf(stderr, "   x,y,w,l[,output_name] (the input file is opened only once)\n");
+	fprintf(stderr, " --tile-cache-mb # keep up to # MiB of decoded tiles in memory, to avoid\n");
+	fprintf(stderr, "                   decoding them again for overlapping or adjacent regions\n");
+	fprintf(stderr, " -t #              decode tiles of tiled input files with # threads\n");
+	fprintf(stderr, " --scale s         make extracts scaled by factor s (0 < s <= 1, like 0.25 or\n");
+	fprintf(stderr, "                   1/4) from the lowest sufficient level of a pyramidal file\n");
 	fprintf(stderr, " -o offset         extracts only from directory at position offset in file\n");
 	fprintf(stderr, " -d range1[,range2...] extracts from dir. having numbers in the given ranges\n");
 	fprintf(stderr, "                   (numbers start at 0; ranges are like 3-3, 5:8, 4-, -0)\n");
@@ -1233,8 +3470,13 @@ static void usage()
 #ifdef HAVE_PNG
 	fprintf(stderr, " -p[#]             output PNG file (with quality #, 0-9, default 6)\n");
 #endif
+	fprintf(stderr, " --jpeg-dct        make JPEG file from the DCT coefficients of the JPEG tiles\n");
+	fprintf(stderr, "                   of input.tif without decoding them (lossless, if extract\n");
+	fprintf(stderr, "                   is aligned on 8 or 16 pixels)\n");
 	fprintf(stderr, " -c none[:opts]    output TIFF file with no compression \n");
 	fprintf(stderr, " -c x[:opts]       output TIFF compressed with encoding x (jpeg, lzw, zip,...)\n");
+	fprintf(stderr, " --out-tile WxH    output tiled TIFF file with tiles of WxH pixels\n");
+	fprintf(stderr, " --out-strip #     output TIFF file with strips of # rows\n");
 	fprintf(stderr, "When output file format can't be guessed from the output filename extension, it is TIFF with same compression as input.\n\n");
 	fprintf(stderr, "JPEG-compressed TIFF options:\n");
 	fprintf(stderr, " #   set compression quality level (0-100, default 75)\n");
@@ -1366,6 +3608,28 @@ static int processCompressOptions(char* opt)
 }
 
 
+static void addRegion(uint32_t xmin, uint32_t ymin, uint32_t width,
+	uint32_t length, const char * outfilename)
+{
+	struct region * r;
+
+	regions = realloc(regions, sizeof(*regions) * (number_of_regions+1));
+	if (regions == NULL) {
+		perror("Insufficient memory for regions ");
+		exit(EXIT_INSUFFICIENT_MEMORY);
+	}
+
+	r = &(regions[number_of_regions++]);
+	r->xmin = xmin;
+	r->ymin = ymin;
+	r->width = width;
+	r->length = length;
+	r->outfilename = NULL;
+	if (outfilename != NULL)
+		my_asprintf(&(r->outfilename), "%s", outfilename);
+}
+
+
 static int processExtractGeometryOptions(char* cp)
 {
 	while (*cp == ' ')
@@ -1375,12 +3639,90 @@ static int processExtractGeometryOptions(char* cp)
 	    &requestedxmin, &requestedymin, &requestedwidth,
 	    &requestedlength) != 4)
 		return 0;
+	/* As before option -R existed, the last -E wins */
+	if (extractgeometryregion >= 0) {
+		struct region * r = &regions[extractgeometryregion];
+
+		r->xmin = requestedxmin;
+		r->ymin = requestedymin;
+		r->width = requestedwidth;
+		r->length = requestedlength;
+		return 1;
+	}
+	extractgeometryregion = number_of_regions;
+	addRegion(requestedxmin, requestedymin, requestedwidth,
+	    requestedlength, NULL);
 	return 1;
 }
 
 
- /* Add dirnum ranges to ranges that have already been stored */
-static unsigned parseDirnumRanges(const char* c, int dryrun)
+	/* Each non-empty line of the file is "x,y,w,l" or
+	 "x,y,w,l,output_name"; lines starting with '#' are ignored */
+static int processRegionsFile(const char* filename)
+{
+	FILE * f;
+	char line[4096];
+	unsigned linenumber = 0;
+	int success = 1;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to open regions file \"%s\".\n",
+			filename);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		uint32_t xmin, ymin, width, length;
+		char * cp = line, * name = NULL;
+		int n = 0, l;
+
+		linenumber++;
+		l = strlen(line);
+		while (l > 0 && isspace((unsigned char) line[l-1]))
+			line[--l] = 0;
+		while (isspace((unsigned char) *cp))
+			cp++;
+		if (*cp == 0 || *cp == '#')
+			continue;
+
+		if (sscanf(cp, UINT32_FORMAT " ," UINT32_FORMAT " ,"
+		    UINT32_FORMAT " ," UINT32_FORMAT "%n",
+		    &xmin, &ymin, &width, &length, &n) != 4 || n == 0) {
+			fprintf(stderr, "Syntax error in regions file "
+				"\"%s\" at line %u: expected x,y,w,l"
+				"[,output_name].\n", filename, linenumber);
+			success = 0;
+			break;
+		}
+		cp += n;
+		while (isspace((unsigned char) *cp))
+			cp++;
+		if (*cp == ',') {
+			cp++;
+			while (isspace((unsigned char) *cp))
+				cp++;
+			if (*cp != 0)
+				name = cp;
+		} else if (*cp != 0) {
+			fprintf(stderr, "Syntax error in regions file "
+				"\"%s\" at line %u: unexpected \"%s\".\n",
+				filename, linenumber, cp);
+			success = 0;
+			break;
+		}
+
+		addRegion(xmin, ymin, width, length, name);
+	}
+
+	fclose(f);
+	return success;
+}
+
+
+ /* Add dirnum ranges to ranges that have already been stored, or only
+   count them if countonly is set */
+static unsigned parseDirnumRanges(const char* c, int countonly)
 {
 	const char* c_depart = c;
 	uint16_t number_of_read_ranges = 0;
@@ -1395,7 +3737,7 @@ static unsigned parseDirnumRanges(const char* c, int dryrun)
 		if (*c == ',' || *c == 0) {
 			c++;
 			if (premier_nombre_lu) {
-				if (! dryrun) {
+				if (! countonly) {
 					dirnum_ranges_starts[number_of_dirnum_ranges + number_of_read_ranges] =
 					    debut_de_plage_courante;
 					dirnum_ranges_ends[number_of_dirnum_ranges + number_of_read_ranges]=
@@ -1437,7 +3779,7 @@ static unsigned parseDirnumRanges(const char* c, int dryrun)
 		return 0;
 	} while (! fin_de_la_chaine);
 
-	if (! dryrun)
+	if (! countonly)
 		number_of_dirnum_ranges += number_of_read_ranges;
 
 	return number_of_read_ranges;
@@ -1501,7 +3843,104 @@ int main(int argc, char * argv[])
 
 		if (argv[arg][1] == 'v')
 			verbose = 1;
-		else if (argv[arg][1] == 'B') {
+		else if (argv[arg][1] == 'y')
+			dryrun = 1;
+		else if (strcmp(argv[arg], "--tile-cache-mb") == 0) {
+			char * end;
+			unsigned long long u;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --tile-cache-mb "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			errno = 0;
+			u = strtoull(argv[arg+1], &end, 10);
+			if (errno || *end != 0 || end == argv[arg+1] ||
+			    u > (UINT64_MAX >> 20)) {
+				fprintf(stderr, "Expected a number of MiB "
+					"after --tile-cache-mb, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			tile_cache_budget = (uint64_t) u << 20;
+			arg++;
+		} else if (strcmp(argv[arg], "--jpeg-dct") == 0) {
+			jpeg_dct_copy = 1;
+		} else if (strcmp(argv[arg], "--scale") == 0) {
+			char * end;
+			double d = 0;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --scale "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			if (strncmp(argv[arg+1], "1/", 2) == 0) {
+				d = strtod(argv[arg+1] + 2, &end);
+				d = d > 0 ? 1 / d : 0;
+			} else
+				d = strtod(argv[arg+1], &end);
+			if (*end != 0 || !(d > 0 && d <= 1)) {
+				fprintf(stderr, "Expected a scale factor "
+					"between 0 and 1 (like 0.25 or 1/4) "
+					"after --scale, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			requested_scale = d;
+			arg++;
+		} else if (strcmp(argv[arg], "--out-tile") == 0) {
+			char * end;
+			unsigned long w = 0, l = 0;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --out-tile "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			w = strtoul(argv[arg+1], &end, 10);
+			if (*end == 'x')
+				l = strtoul(end+1, &end, 10);
+			if (*end != 0 || w == 0 || l == 0 || w % 16 != 0 ||
+			    l % 16 != 0 || w > UINT32_MAX || l > UINT32_MAX) {
+				fprintf(stderr, "Expected tile dimensions "
+					"WxH, multiples of 16, after "
+					"--out-tile, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			outtilewidth = w;
+			outtilelength = l;
+			arg++;
+		} else if (strcmp(argv[arg], "--out-strip") == 0) {
+			char * end;
+			unsigned long r;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --out-strip "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			r = strtoul(argv[arg+1], &end, 10);
+			if (*end != 0 || end == argv[arg+1] || r == 0 ||
+			    r > UINT32_MAX) {
+				fprintf(stderr, "Expected a number of rows "
+					"after --out-strip, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			outrowsperstrip = r;
+			arg++;
+		} else if (argv[arg][1] == 'B') {
 			big_tiff = 1;
 		} else if (argv[arg][1] == 'T') {
 			TIFFSetErrorHandler(stderrErrorHandler);
@@ -1518,6 +3957,45 @@ int main(int argc, char * argv[])
 			}
 			seen_extract_geometry_on_the_command_line = 1;
 			arg++;
+		} else if (argv[arg][1] == 'R') {
+			if (arg+1 >= argc ||
+			    !processRegionsFile(argv[arg+1])) {
+				fprintf(stderr, "Syntax error in the "
+					"specification of regions to "
+					"extract (option -R).\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			seen_extract_geometry_on_the_command_line = 1;
+			arg++;
+		} else if (argv[arg][1] == 't') {
+			char * end;
+			long n;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option -t requires "
+					"an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			n = strtol(argv[arg+1], &end, 10);
+			if (*end != 0 || end == argv[arg+1] || n < 1 ||
+			    n > 4096) {
+				fprintf(stderr, "Expected a positive number "
+					"of threads after -t, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+#ifdef _OPENMP
+			number_of_threads = n;
+#else
+			if (n > 1)
+				fprintf(stderr, "Warning: tifffastcrop was "
+					"compiled without OpenMP support, "
+					"option -t ignored.\n");
+#endif
+			arg++;
 		} else if (argv[arg][1] == 'o') {
 			if (arg+1 >= argc) {
 				fprintf(stderr, "Option -o requires "
@@ -1589,24 +4067,30 @@ int main(int argc, char * argv[])
 	}
 
 	if (argc > 1 && !seen_extract_geometry_on_the_command_line) {
-		fprintf(stderr, "The extract's position and size must be specified on the command line as argument to the '-E' option. Aborting.\n");
+		fprintf(stderr, "The extract's position and size must be specified on the command line as argument to the '-E' option (or in a file given to the '-R' option). Aborting.\n");
+		return EXIT_GEOMETRY_ERROR;
+	}
+	if (argc > 1 && number_of_regions == 0) {
+		fprintf(stderr, "No region to extract. Aborting.\n");
 		return EXIT_GEOMETRY_ERROR;
 	}
+	if (outtilewidth && outrowsperstrip) {
+		fprintf(stderr, "Options --out-tile and --out-strip are "
+			"mutually exclusive. Aborting.\n");
+		return EXIT_SYNTAX_ERROR;
+	}
 
 	if (output_format < 0) {
 		output_format = OUTPUT_FORMAT_TIFF;
-		if (argc >= arg+2) { /* Try to guess from output file name */
-			const char * suffix = searchSuffix(argv[arg+1]);
-			if (strcasecmp(suffix, "png") == 0)
-				output_format = OUTPUT_FORMAT_PNG;
-			else if (strcasecmp(suffix, "jpeg") == 0 ||
-				 strcasecmp(suffix, "jpg") == 0)
-				output_format = OUTPUT_FORMAT_JPEG;
-		}
+		if (argc >= arg+2) /* Try to guess from output file name */
+			output_format = guessOutputFormatFromFileName(
+			    argv[arg+1]);
+		guess_output_format_of_each_region = 1;
 	}
 	if (verbose)
 		fprintf(stderr, "Output file will have format %s.\n",
 			OUTPUT_SUFFIX[output_format]);
+	selectKernels();
 
 	if (argc >= arg+2) {
 		return makeExtractFromTIFFFile(argv[arg], argv[arg+1]);
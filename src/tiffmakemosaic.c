@@ -24,6 +24,22 @@
 #include <tiffio.h>
 #include <jpeglib.h>
 #include <math.h> /* lroundl */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h> /* mkdir */
+#ifndef _WIN32
+# include <sys/resource.h> /* getrlimit */
+#endif
+#ifdef _WIN32
+# include <direct.h>
+# define mkdir(path, mode) _mkdir(path)
+#endif
 
 #include "config.h"
 
@@ -35,6 +51,16 @@
 #define EXIT_INSUFFICIENT_MEMORY 4
 #define EXIT_UNABLE_TO_ACHIEVE_PIECE_DIMENSIONS 5
 
+	/* Rows of stripped files read at once when all the pieces of a row
+	 of pieces are made at the same time */
+#define ROWS_PER_BAND 64
+
+	/* Cost of making one more piece, in decoded pixels, and maximum
+	 number of pieces along a direction, when planning the dimensions of
+	 pieces */
+#define PIECE_OVERHEAD_PIXELS 65536
+#define MAX_PIECES_PER_DIRECTION 4096
+
 #define CopyField(tag, v) \
     if (TIFFGetField(in, tag, &v)) TIFFSetField(out, tag, v)
 #define CopyField2(tag, v1, v2) \
@@ -45,6 +71,13 @@
 static const char TIFF_SUFFIX[] = ".tif";
 static const char JPEG_SUFFIX[] = ".jpg";
 static uint64_t mosaicpiecesize = 1 << 30; /* 1 GiB */
+static uint64_t memorybudget = (uint64_t) -1; /* default: mosaicpiecesize */
+static int number_of_threads = 1;
+static uint32_t outtilewidth = 0, outtilelength = 0; /* 0: stripped */
+static uint32_t outrowsperstrip = 0; /* 0: a single strip */
+static int big_tiff = 0;
+static int copy_tiles = 0;
+static uint32_t dzitilesize = 0; /* 0: a mosaic, not a Deep Zoom pyramid */
 static uint32_t overlapinpixels = 0;
 static long double overlapinpercent = 0;
 static uint32_t requestedpiecewidth = 0;
@@ -57,6 +90,9 @@ static int paddinginx = 0;
 static int paddinginy = 0;
 static uint16_t numberpaddingvalues = 0;
 static char ** paddingvalues = NULL;
+static uint16_t numberbackgroundvalues = 0; /* 0: background not skipped */
+static char ** backgroundvalues = NULL;
+static uint64_t backgroundtolerance = 8;
 
 
 #ifndef TIFFMAKEMOSAIC_OUTPUTJPEGFILES
@@ -200,6 +236,120 @@ tiffCopyFieldsButDimensions(TIFF* in, TIFF* out)
 }
 
 
+	/* Kernels writing n bytes made of the pixel of bytesperpixel
+	 bytes repeated. The scalar one copies the pixels already written
+	 onto the following ones, doubling the amount each time. */
+static void fillPixelsScalar(uint8_t* out, const uint8_t* pixel,
+	size_t n, uint16_t bytesperpixel)
+{
+	size_t done = bytesperpixel < n ? bytesperpixel : n;
+
+	memcpy(out, pixel, done);
+	while (done < n) {
+		size_t c = done < n - done ? done : n - done;
+
+		memcpy(out + done, out, c);
+		done += c;
+	}
+}
+
+#ifdef HAVE_X86_SIMD_KERNELS
+	/* The pixel is repeated over lcm(bytesperpixel, register size)
+	 bytes held in a few registers, which are stored in turn */
+#define MAX_BYTESPERPIXEL_OF_FILL_KERNELS 8
+__attribute__((target("sse2")))
+static void fillPixelsSSE2(uint8_t* out, const uint8_t* pixel,
+	size_t n, uint16_t bytesperpixel)
+{
+	uint8_t pattern[MAX_BYTESPERPIXEL_OF_FILL_KERNELS * 16];
+	__m128i v[MAX_BYTESPERPIXEL_OF_FILL_KERNELS];
+	size_t period = bytesperpixel, j;
+	int k, nv;
+
+	if (bytesperpixel > MAX_BYTESPERPIXEL_OF_FILL_KERNELS) {
+		fillPixelsScalar(out, pixel, n, bytesperpixel);
+		return;
+	}
+	while (period % 16 != 0)
+		period += bytesperpixel;
+	for (j = 0 ; j < period ; j++)
+		pattern[j] = pixel[j % bytesperpixel];
+	nv = period / 16;
+	for (k = 0 ; k < nv ; k++)
+		v[k] = _mm_loadu_si128((const __m128i *) (pattern + 16*k));
+
+	for (j = 0 ; j + period <= n ; j += period)
+		for (k = 0 ; k < nv ; k++)
+			_mm_storeu_si128((__m128i *) (out + j + 16*k), v[k]);
+	memcpy(out + j, pattern, n - j);
+}
+
+__attribute__((target("avx2")))
+static void fillPixelsAVX2(uint8_t* out, const uint8_t* pixel,
+	size_t n, uint16_t bytesperpixel)
+{
+	uint8_t pattern[MAX_BYTESPERPIXEL_OF_FILL_KERNELS * 32];
+	__m256i v[MAX_BYTESPERPIXEL_OF_FILL_KERNELS];
+	size_t period = bytesperpixel, j;
+	int k, nv;
+
+	if (bytesperpixel > MAX_BYTESPERPIXEL_OF_FILL_KERNELS) {
+		fillPixelsScalar(out, pixel, n, bytesperpixel);
+		return;
+	}
+	while (period % 32 != 0)
+		period += bytesperpixel;
+	for (j = 0 ; j < period ; j++)
+		pattern[j] = pixel[j % bytesperpixel];
+	nv = period / 32;
+	for (k = 0 ; k < nv ; k++)
+		v[k] = _mm256_loadu_si256((const __m256i *) (pattern + 32*k));
+
+	for (j = 0 ; j + period <= n ; j += period)
+		for (k = 0 ; k < nv ; k++)
+			_mm256_storeu_si256((__m256i *) (out + j + 32*k),
+			    v[k]);
+	memcpy(out + j, pattern, n - j);
+}
+#endif
+
+static void (*fillPixelsKernel)(uint8_t* out, const uint8_t* pixel,
+	size_t n, uint16_t bytesperpixel) = fillPixelsScalar;
+
+
+	/* Choose the fastest kernels the processor supports. To be called
+	 before any thread is started. */
+static void selectFillKernels()
+{
+#ifdef HAVE_X86_SIMD_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fillPixelsKernel = fillPixelsAVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		fillPixelsKernel = fillPixelsSSE2;
+	if (verbose && fillPixelsKernel != fillPixelsScalar)
+		fprintf(stderr, "Using %s kernels for padding.\n",
+			fillPixelsKernel == fillPixelsAVX2 ? "AVX2" :
+			"SSE2");
+#endif
+}
+
+
+	/* Write npixels copies of the pixel */
+static void fillPixels(uint8_t* out, const uint8_t* pixel,
+	uint32_t npixels, uint16_t bytesperpixel)
+{
+	size_t n = (size_t) npixels * bytesperpixel;
+
+	if (bytesperpixel == 1)
+		memset(out, pixel[0], n);
+	else if (n < 64)
+		fillPixelsScalar(out, pixel, n, bytesperpixel);
+	else
+		fillPixelsKernel(out, pixel, n, bytesperpixel);
+}
+
+
 	/* cols resp. rows do not include rightpaddinginpixels resp. 
 	bottompadding */
 static void cpBufToBuf(uint8_t* out, uint8_t* in, uint8_t* paddingbytes,
@@ -207,27 +357,25 @@ static void cpBufToBuf(uint8_t* out, uint8_t* in, uint8_t* paddingbytes,
 	uint32_t rightpaddinginpixels, uint16_t bytesperpixel,
 	int outskew, int inskew)
 {
+	size_t colsinbytes = (size_t) cols * bytesperpixel;
+	size_t paddinginbytes = (size_t) rightpaddinginpixels * bytesperpixel;
+
 	while (rows-- > 0) {
-		uint32_t jb = cols * bytesperpixel;
-		uint32_t jp = rightpaddinginpixels;
-		while (jb-- > 0)
-			*out++ = *in++;
-		while (jp-- > 0) {
-			uint16_t k;
-			for (k = 0 ; k < bytesperpixel ; k++)
-				*out++ = paddingbytes[k];
+		memcpy(out, in, colsinbytes);
+		out += colsinbytes;
+		in += colsinbytes;
+		if (rightpaddinginpixels > 0) {
+			fillPixels(out, paddingbytes, rightpaddinginpixels,
+			    bytesperpixel);
+			out += paddinginbytes;
 		}
 		out += outskew;
 		in += inskew;
 	}
 	while (bottompadding-- > 0) {
-		uint32_t jp = cols + rightpaddinginpixels;
-		while (jp-- > 0) {
-			uint32_t k;
-			for (k = 0 ; k < bytesperpixel ; k++)
-				*out++ = paddingbytes[k];
-		}
-		out += outskew;
+		fillPixels(out, paddingbytes, cols + rightpaddinginpixels,
+		    bytesperpixel);
+		out += colsinbytes + paddinginbytes + outskew;
 	}
 }
 
@@ -504,6 +652,7 @@ cpTiles2Strip(TIFF* in, void * ambiguous_out,
 			row_pointers[y]= row_pointer;
 
 		jpeg_write_scanlines(p_cinfo, row_pointers, length);
+		_TIFFfree(row_pointers);
 	} else {
 		if (TIFFWriteEncodedStrip(TIFFout,
 			TIFFComputeStrip(TIFFout, 0, 0), outbuf,
@@ -524,7 +673,7 @@ static int
 cpStrips2Strip(TIFF* in, void * ambiguous_out,
 	int output_to_jpeg_rather_than_tiff,
 	uint32_t xmin, uint32_t ymin, uint32_t width, uint32_t length,
-	uint32_t rightpadding, uint32_t bottompadding,
+	uint32_t rightpadding, uint32_t bottompadding, uint8_t* paddingbytes,
 	unsigned char * outbuf, uint32_t * y_of_last_read_scanline,
 	uint32_t inimagelength)
 {
@@ -559,8 +708,6 @@ cpStrips2Strip(TIFF* in, void * ambiguous_out,
 		return (EXIT_INSUFFICIENT_MEMORY);
 	}
 
-fprintf(stderr, "cpStrips2Strip warning: padding is yet to be implemented\n");
-
 	/* when compression method doesn't support random access: */
 	if (input_compression != COMPRESSION_NONE) {
 		uint32_t y;
@@ -594,10 +741,11 @@ fprintf(stderr, "cpStrips2Strip warning: padding is yet to be implemented\n");
 				*y_of_last_read_scanline= y;
 	}
 
-	for (y = ymin ; y < ymin + length ; y++) {
+	for (y = ymin ; y < ymin + length - bottompadding ; y++) {
 		unsigned char * inbufrow = inbuf;
 		uint32_t xmintocopyinscanline = xmin;
-		tsize_t widthtocopyinbytes = outscanlinesizeinbytes;
+		tsize_t widthtocopyinbytes =
+		    (tsize_t) (width - rightpadding) * bytesperpixel;
 
 		if (TIFFReadScanline(in, inbuf, y, 0) < 0) {
 			TIFFError(TIFFFileName(in),
@@ -610,12 +758,15 @@ fprintf(stderr, "cpStrips2Strip warning: padding is yet to be implemented\n");
 
 		cpBufToBuf(bufp,
 		    inbufrow + xmintocopyinscanline * bytesperpixel,
-		    NULL,
-		    1, 0, widthtocopyinbytes, 0, bytesperpixel,
-		    outscanlinesizeinbytes - widthtocopyinbytes,
+		    paddingbytes,
+		    1, 0, width - rightpadding, rightpadding, bytesperpixel,
+		    outscanlinesizeinbytes - (tsize_t) width * bytesperpixel,
 		    inwidthinbytes - widthtocopyinbytes);
 		bufp += outscanlinesizeinbytes;
 	}
+	cpBufToBuf(bufp, NULL, paddingbytes,
+	    0, bottompadding, width - rightpadding, rightpadding, bytesperpixel,
+	    outscanlinesizeinbytes - (tsize_t) width * bytesperpixel, 0);
 
 	if (output_to_jpeg_rather_than_tiff) {
 		JSAMPROW row_pointer;
@@ -634,6 +785,7 @@ fprintf(stderr, "cpStrips2Strip warning: padding is yet to be implemented\n");
 			row_pointers[y]= row_pointer;
 
 		jpeg_write_scanlines(p_cinfo, row_pointers, length);
+		_TIFFfree(row_pointers);
 	} else {
 		if (TIFFWriteEncodedStrip(TIFFout,
 			TIFFComputeStrip(TIFFout, 0, 0), outbuf,
@@ -711,510 +863,2624 @@ computeMaxPieceMemorySize(uint32_t inimagewidth, uint32_t inimagelength,
 }
 
 
-static int
-makeMosaicFromTIFFFile(char * infilename)
+	/* Compute, along one direction, the span [*spanstart, *spanstart +
+	 *spansize) of the piece whose part without overlap starts at
+	 position start, including overlaps and the amount of padding
+	 (*amountofpadding, which is included in *spansize) at its end */
+static void
+computePieceSpan(uint32_t start, uint32_t piecesize, uint32_t overlap,
+	uint32_t imagesize, int padding, uint32_t * spanstart,
+	uint32_t * spansize, uint32_t * amountofpadding)
 {
-	TIFF * in;
-	uint32_t inimagewidth, inimagelength, outwidth, outlength;
-	uint32_t hoverlap, voverlap;
-	uint32_t hnpieces, vnpieces;
-	uint32_t ndigitshtilenumber, ndigitsvtilenumber, x, y;
-	uint16_t planarconfig, spp, bitspersample, sampleformat;
-	uint64_t outmemorysize, ouroutmemorysize;
-	char * prefix;
-	unsigned char * outbuf = NULL;
-	int return_code = 0;
-
-	in = TIFFOpen(infilename, "r");
-	if (in == NULL) {
-		if (verbose)
-			fprintf(stderr, "Unable to open file \"%s\".\n",
-				infilename);
-		return EXIT_IO_ERROR;
+	uint32_t startoverlap = start < overlap ? start : overlap;
+	uint32_t sizewithendoverlap = piecesize + overlap;
+	uint32_t endboundary = start + sizewithendoverlap;
+	    /* equal to *spanstart + piecesize + 2*overlap */
+	assert(endboundary >= start); /* detect overflows */
+	/* At this point the computed end boundary of the piece may lie
+	 * outside the input image for three (mutually nonexclusive)
+	 * reasons (explained here for the right boundary):
+	 * - The user requested a specific piece width which is
+	 * not a divisor of the input image width, and this
+	 * piece is the last piece in the row: x + outwidth >
+	 * inimagewidth. This piece must have a smaller width:
+	 * outwidth must be chosen as inimagewidth-x.
+	 * - The user requested an overlap that is larger than
+	 * the distance between the right boundary of the piece
+	 * without overlap and the right boundary of the input
+	 * image: x + outwidth + hoverlap > inimagewidth. The
+	 * right overlap must be restricted to
+	 * inimagewidth-x-outwidth.
+	 * - We use padding in x to achieve a constraint (e.g. 
+	 * piece width is a multiple of some integer number). This 
+	 * piece must not have a smaller width and we should 
+	 * complete it with padding values.
+	 * In cases 1 and 2, xrightboundary > inimagewidth and
+	 * outwidthwithrightoverlap must be taken equal to
+	 * inimagewidth-x; otherwise, it can be taken equal to
+	 * outwidth+hoverlap. */
+	*amountofpadding = 0;
+	if (endboundary > imagesize) {
+		if (padding)
+			*amountofpadding = endboundary - imagesize;
+		else
+			sizewithendoverlap = imagesize - start;
 	}
+	*spanstart = start - startoverlap;
+	*spansize = startoverlap + sizewithendoverlap;
 
-	if (verbose)
-		fprintf(stderr, "File \"%s\" open.\n", infilename);
+	assert(*spanstart < imagesize); /* spanstart would be < 0 */
+	assert(*spanstart + *spansize <= imagesize + *amountofpadding);
+}
 
-	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &inimagewidth);
-	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &inimagelength);
-	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
-	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
-	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLEFORMAT, &sampleformat);
 
-	if (output_JPEG_files && bitspersample != 8 && spp != 3) {
-		TIFFError(TIFFFileName(in),
-			"Error, can't output JPEG files from file with "
-			"bits-per-sample %d (not 8) or "
-			"samples-per-pixel %d (not 3)",
-			bitspersample, spp);
-		TIFFClose(in);
-		return EXIT_UNHANDLED_FILE_TYPE;
-	} else if (bitspersample % 8 != 0) {
-		TIFFError(TIFFFileName(in),
-			"Error, can't deal with file with "
-			"bits-per-sample %d (not a multiple of 8)",
-			bitspersample);
-		TIFFClose(in);
-		return EXIT_UNHANDLED_FILE_TYPE;
-	}
+	/* Sizes of pieces along one direction considered by
+	 planPieceGeometry, with what making the pieces one after another
+	 would decode along this direction */
+struct piecesizecandidate {
+	uint32_t size, overlap, npieces, maxspan;
+	uint64_t decoded; /* sum over pieces of the units they touch */
+	int halving; /* size obtained by halving the image size */
+};
 
-	if (verbose)
-		fprintf(stderr, "File \"%s\" has %u bits per sample.\n",
-			infilename, (unsigned) bitspersample);
 
-	outwidth= requestedpiecewidth ? requestedpiecewidth : inimagewidth;
-	outlength= requestedpiecelength ? requestedpiecelength :
-		inimagelength;
-	computeMaxPieceMemorySize(inimagewidth, inimagelength, spp,
-		bitspersample, outwidth, outlength, overlapinpixels,
-		overlapinpercent, &outmemorysize, &ouroutmemorysize,
-		&hnpieces, &vnpieces, &hoverlap, &voverlap);
-	if (verbose)
-		fprintf(stderr, "File \"%s\": dimensions " UINT32_FORMAT
-			" x " UINT32_FORMAT "; "
-			"%u bits per sample and %u samples per pixel; "
-			"takes %.3f MiB of memory (" UINT64_FORMAT
-                        " bytes) to open fully.\n",
-			infilename, inimagewidth, inimagelength,
-			bitspersample, spp,
-			outmemorysize / 1048576.0, outmemorysize);
-	if (!output_JPEG_files &&
-	    (requestedpiecewidth == 0 || inimagewidth <= requestedpiecewidth) &&
-	    (requestedpiecelength == 0 ||
-		inimagelength <= requestedpiecelength) &&
-	    (mosaicpiecesize == 0 || outmemorysize <= mosaicpiecesize)) {
-		/* nothing to do */
-		TIFFClose(in);
-		if (verbose) {
-			if (mosaicpiecesize)
-				fprintf(stderr, "File \"%s\": nothing to do. "
-				"Its memory requirement is already "
-				"below the limit %.3f MiB.\n",
-				infilename, mosaicpiecesize / 1048576.0);
-			else
-				fprintf(stderr, "File \"%s\": nothing"
-				" to do.\n", infilename);
+static void
+addPieceSizeCandidate(struct piecesizecandidate * c, uint32_t * n,
+	uint32_t size, int halving)
+{
+	uint32_t k;
+
+	for (k = 0 ; k < *n ; k++)
+		if (c[k].size == size) {
+			c[k].halving |= halving;
+			return;
 		}
-		return 0;
-	}
+	c[*n].size = size;
+	c[*n].halving = halving;
+	(*n)++;
+}
 
-	TIFFGetField(in, TIFFTAG_PLANARCONFIG, &planarconfig);
-	if (planarconfig != PLANARCONFIG_CONTIG) {
-		TIFFError(TIFFFileName(in),
-			"Error, can't deal with file with "
-			"planar configuration %d (non contiguous)",
-			planarconfig);
-		TIFFClose(in);
-		return EXIT_UNHANDLED_FILE_TYPE;
-	}
 
-	if (output_JPEG_files &&
-	    ( (requestedpiecewidth >= JPEG_MAX_DIMENSION) ||
-	      (requestedpiecelength >= JPEG_MAX_DIMENSION) ) ) {
-		if (verbose)
-			fprintf(stderr, "File \"%s\": at least one requested piece dimension is too large for JPEG files.\n",
-				infilename);
-		return EXIT_UNABLE_TO_ACHIEVE_PIECE_DIMENSIONS;
-	}
+	/* Fill c with the sizes of pieces along a direction of size
+	 imagesize, and return their number: the requested size if any;
+	 otherwise the sizes obtained by halving the image size (which was
+	 the only choice of former versions), and, for each number of
+	 pieces, the smallest size which is a multiple of the decoding unit
+	 of the input file (tile width or length) and of the divisor. Unless
+	 padding is allowed, sizes which are multiples of a divisor must
+	 divide imagesize. Then compute their overlaps, numbers of pieces and
+	 decoding costs. */
+static uint32_t
+pieceSizeCandidates(uint32_t imagesize, uint32_t requested, uint32_t divisor,
+	int padding, uint32_t unit, struct piecesizecandidate * c)
+{
+	uint32_t n = 0, k, size, previous;
+	uint64_t gridunits[2];
+	int g;
+
+	if (requested)
+		addPieceSizeCandidate(c, &n, requested, 0);
+	else {
+		size = imagesize;
+		if (divisor == 0 || !padding || size % divisor == 0)
+			addPieceSizeCandidate(c, &n, size, 1);
+		while (size > 1 && (size % 2 == 0 || padding) &&
+		    (divisor == 0 || padding || (size/2) % divisor == 0)) {
+			previous = size;
+			size = (size + 1) / 2;
+			if (divisor != 0 && size % divisor != 0)
+				size += divisor - size % divisor;
+			if (size >= previous)
+				break;
+			addPieceSizeCandidate(c, &n, size, 1);
+		}
 
-	if (requestedpiecewidth == 0 || requestedpiecelength == 0)
-		while ( (mosaicpiecesize &&
-			 outmemorysize > mosaicpiecesize) ||
-		    (output_JPEG_files &&
-		    (outwidth >= JPEG_MAX_DIMENSION ||
-		    outlength >= JPEG_MAX_DIMENSION) ) ) {
-			if (outlength > outwidth && (outlength % 2 == 0 || paddinginy) &&
-			    requestedpiecelength == 0 &&
-			    (requestedpiecelengthdivisor == 0 || paddinginy ||
-			    (outlength/2) % requestedpiecelengthdivisor == 0)) {
-				if (outlength % 2 != 0)
-					outlength++; /* use padding */
-				outlength /= 2;
-				if (requestedpiecelengthdivisor != 0 &&
-				    outlength % requestedpiecelengthdivisor != 0)
-					outlength += requestedpiecelengthdivisor -
-					    outlength % requestedpiecelengthdivisor; /* use padding */
-			} else if ((outwidth % 2 == 0 || paddinginx) &&
-			    requestedpiecewidth == 0 &&
-			    (requestedpiecewidthdivisor == 0 || paddinginx ||
-			    (outwidth/2) % requestedpiecewidthdivisor == 0)) {
-				if (outwidth % 2 != 0)
-					outwidth++; /* use padding */
-				outwidth /= 2;
-				if (requestedpiecewidthdivisor != 0 &&
-				    outwidth % requestedpiecewidthdivisor != 0)
-				outwidth += requestedpiecewidthdivisor -
-				    outwidth % requestedpiecewidthdivisor; /* use padding */
-			} else if ((outlength % 2 == 0 || paddinginy) &&
-			    requestedpiecelength == 0 &&
-			    (requestedpiecelengthdivisor == 0 || paddinginy ||
-			     (outlength/2) % requestedpiecelengthdivisor == 0)) {
-			     	if (outlength % 2 != 0)
-			     		outlength++; /* use padding */
-			     	outlength /= 2;
-  				if (requestedpiecelengthdivisor != 0 &&
-  				    outlength % requestedpiecelengthdivisor != 0)
-  					outlength += requestedpiecelengthdivisor -
-  					    outlength % requestedpiecelengthdivisor; /* use padding */
-			} else {
-				outwidth = 0;
-				outlength = 0;
-				break; /* can't divide any dimension by 2 */
+		/* pieces on the grid of units, and pieces which are only
+		 multiples of the divisor */
+		gridunits[0] = unit;
+		gridunits[1] = divisor != 0 ? divisor : 1;
+		if (divisor != 0) { /* least common multiple */
+			uint64_t x = unit, y = divisor;
+
+			while (y != 0) {
+				uint64_t r = x % y;
+				x = y;
+				y = r;
+			}
+			gridunits[0] = unit / x * divisor;
+		}
+		for (g = 0 ; g < 2 ; g++) {
+			previous = 0;
+			for (k = 1 ; k <= MAX_PIECES_PER_DIRECTION &&
+			    n < MAX_PIECES_PER_DIRECTION + 64 ; k++) {
+				uint64_t s = (imagesize + k - 1) / k;
+
+				s = (s + gridunits[g] - 1) / gridunits[g] *
+				    gridunits[g];
+				if (s >= imagesize)
+					s = padding && divisor != 0 ?
+					    (imagesize + divisor - 1) /
+					    divisor * divisor : imagesize;
+				else if (divisor != 0 && !padding &&
+				    imagesize % s != 0)
+					continue;
+				if (s != previous)
+					addPieceSizeCandidate(c, &n, s, 0);
+				previous = s;
+				if (s <= gridunits[g])
+					break;
 			}
-
-			computeMaxPieceMemorySize(inimagewidth,
-			    inimagelength, spp, bitspersample,
-			    outwidth, outlength, overlapinpixels,
-			    overlapinpercent,
-			    &outmemorysize, &ouroutmemorysize,
-			    &hnpieces, &vnpieces, &hoverlap, &voverlap);
 		}
-
-	if (outwidth == 0 || outlength == 0) {
-		if (verbose)
-			fprintf(stderr, "File \"%s\": unable to compute"
-				" dimensions of mosaic pieces that will"
-				" satisfy the memory and/or divisor"
-				" requirement(s).\n",
-				infilename);
-		return EXIT_UNABLE_TO_ACHIEVE_PIECE_DIMENSIONS;
 	}
 
-	outbuf= _TIFFmalloc(ouroutmemorysize);
-	while ( outbuf == NULL ) {
-		if (outlength > outwidth && (outlength % 2 == 0 || paddinginy) &&
-		    (requestedpiecelengthdivisor == 0 || paddinginy ||
-		     outlength % requestedpiecelengthdivisor == 0)) {
-                        if (outlength % 2 != 0)
-                                outlength++; /* use padding */
-		        outlength /= 2;
-		        if (requestedpiecelengthdivisor != 0 &&
-	                    outlength % requestedpiecelengthdivisor != 0)
-	                        outlength += requestedpiecelengthdivisor -
-		                    outlength % requestedpiecelengthdivisor; /* use padding */
-		} else if ((outwidth % 2 == 0 || paddinginx ) &&
-		    (requestedpiecewidthdivisor == 0 || paddinginx ||
-		    outwidth % requestedpiecewidthdivisor == 0)) {
-                        if (outwidth % 2 != 0)
-                                outwidth++; /* use padding */
-			outwidth /= 2;
-			if (requestedpiecewidthdivisor != 0 &&
-			  outwidth % requestedpiecewidthdivisor != 0)
-		                outwidth += requestedpiecewidthdivisor -
-		                    outwidth % requestedpiecewidthdivisor; /* use padding */
-		} else
-			break; /* can't divide any dimension by 2 */
-
-		computeMaxPieceMemorySize(inimagewidth,
-		    inimagelength, spp, bitspersample,
-		    outwidth, outlength, overlapinpixels,
-		    overlapinpercent,
-		    &outmemorysize, &ouroutmemorysize,
-		    &hnpieces, &vnpieces, &hoverlap, &voverlap);
-
-		outbuf= _TIFFmalloc(ouroutmemorysize);
-	}
-	if (outbuf == NULL) {
-		if (verbose)
-			fprintf(stderr, "File \"%s\": unable to compute"
-				" dimensions of pieces that will suit"
-				" into memory during mosaic creation.\n",
-				infilename);
-		return EXIT_INSUFFICIENT_MEMORY;
+	for (k = 0 ; k < n ; k++) {
+		uint32_t j, start, span, amountofpadding;
+
+		c[k].overlap = overlapinpercent > 0 ?
+		    lroundl(overlapinpercent * c[k].size / 100) :
+		    overlapinpixels;
+		if (c[k].overlap > c[k].size)
+			c[k].overlap = c[k].size;
+		c[k].npieces = (imagesize + c[k].size - 1) / c[k].size;
+		c[k].maxspan = c[k].size + c[k].overlap *
+		    (c[k].npieces >= 3 ? 2 : c[k].npieces - 1);
+		c[k].decoded = 0;
+		for (j = 0 ; j < c[k].npieces ; j++) {
+			uint32_t end;
+
+			computePieceSpan(j * c[k].size, c[k].size,
+			    c[k].overlap, imagesize, padding, &start, &span,
+			    &amountofpadding);
+			end = start + span - amountofpadding;
+			c[k].decoded += (uint64_t) ((end - 1) / unit -
+			    start / unit + 1) * unit;
+		}
 	}
+	return n;
+}
 
-	if (verbose) {
-		fprintf(stderr, "File \"%s\": decided for "
-			UINT32_FORMAT " x " UINT32_FORMAT " = "
-			UINT32_FORMAT " pieces of " UINT32_FORMAT " x "
-			UINT32_FORMAT " with horiz. overlap of "
-			UINT32_FORMAT " and vert. overlap of "
-			UINT32_FORMAT " pixels that will each take at "
-			"most %.3f MiB of memory (" UINT64_FORMAT
-			" bytes) to open fully.\n",
-			infilename, hnpieces, vnpieces,
-			hnpieces * vnpieces, outwidth,
-			outlength, hoverlap, voverlap,
-			outmemorysize / 1048576.0, outmemorysize);
-	}
 
-	if ((paddinginx || paddinginy) && spp != numberpaddingvalues) {
-		fprintf(stderr, "File \"%s\": number of padding values"
-			" (%u) does not match number of samples per"
-			" pixel (%u).\n",
-			infilename, numberpaddingvalues, spp);
-		free(outbuf);
-		return EXIT_SYNTAX_ERROR;
+	/* Choose the dimensions of the pieces of the mosaic of in when
+	 they are not both requested: among the candidates in both
+	 directions which satisfy the memory limit and the limit of JPEG
+	 files, the pair with the lowest estimated cost, that is the number
+	 of pixels which making the pieces one after another would decode
+	 but not use (because pieces cut through the tiles or strips of in),
+	 plus PIECE_OVERHEAD_PIXELS per piece. Return 0 if no pair fits. */
+static int
+planPieceGeometry(TIFF* in, uint32_t inimagewidth, uint32_t inimagelength,
+	uint16_t spp, uint16_t bitspersample, uint32_t * outwidth,
+	uint32_t * outlength)
+{
+	struct piecesizecandidate * wc, * lc;
+	uint32_t nw, nl, a, b, unitwidth, unitlength, bestw = 0, bestl = 0;
+	uint32_t halvingw = 0, halvingl = 0;
+	uint16_t compression;
+	uint64_t pixelsize = (bitspersample/8) * (uint64_t) (spp == 3 ? 4 :
+	    spp);
+	long double needed, cost, bestcost = 0, halvingcost = 0;
+
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &unitwidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &unitlength);
+	} else {
+		/* strips are decoded whole, scanlines of uncompressed files
+		 are read directly */
+		TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+		unitwidth = inimagewidth;
+		unitlength = 1;
+		if (compression != COMPRESSION_NONE)
+			TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP,
+			    &unitlength);
+		if (unitlength == 0 || unitlength > inimagelength)
+			unitlength = inimagelength;
 	}
-
-	uint16_t bytesperpixel= (bitspersample + 7) / 8;
-	uint8_t paddingbytes[bytesperpixel * spp];
-	uint16_t s;
-	for (s = 0 ; s < spp ; s++) {
-		/* Here we should use sampleformat; instead, we assume 
-		  unsigned integer format uint8_t or uint16_t or... (rather 
-		  than e.g. int16 or float) */
-		switch (paddingvalues[s][0]) {
-			case 'M': {
-				uint16_t b;
-				for (b = 0 ; b < bytesperpixel ; b++)
-					paddingbytes[s * bytesperpixel + b]=
-					    0xff;
-				break;
+	needed = (long double) ((inimagewidth + unitwidth - 1) / unitwidth *
+	    (uint64_t) unitwidth) * ((inimagelength + unitlength - 1) /
+	    unitlength * (uint64_t) unitlength);
+
+	wc = _TIFFmalloc((MAX_PIECES_PER_DIRECTION + 64) * sizeof(*wc));
+	lc = _TIFFmalloc((MAX_PIECES_PER_DIRECTION + 64) * sizeof(*lc));
+	if (wc == NULL || lc == NULL) {
+		_TIFFfree(wc);
+		_TIFFfree(lc);
+		return 0;
+	}
+	/* pieces need not lie on the grid of strips horizontally */
+	nw = pieceSizeCandidates(inimagewidth, requestedpiecewidth,
+	    requestedpiecewidthdivisor, paddinginx,
+	    TIFFIsTiled(in) ? unitwidth : 1, wc);
+	nl = pieceSizeCandidates(inimagelength, requestedpiecelength,
+	    requestedpiecelengthdivisor, paddinginy, unitlength, lc);
+	for (a = 0 ; a < nw ; a++)
+		wc[a].decoded = TIFFIsTiled(in) ? wc[a].decoded :
+		    (uint64_t) wc[a].npieces * inimagewidth;
+
+	for (a = 0 ; a < nw ; a++) {
+		if (output_JPEG_files && wc[a].size >= JPEG_MAX_DIMENSION)
+			continue;
+		for (b = 0 ; b < nl ; b++) {
+			if (output_JPEG_files &&
+			    lc[b].size >= JPEG_MAX_DIMENSION)
+				continue;
+			if (mosaicpiecesize && (long double) wc[a].maxspan *
+			    lc[b].maxspan * pixelsize > mosaicpiecesize)
+				continue;
+			cost = (long double) wc[a].decoded * lc[b].decoded -
+			    needed + (long double) PIECE_OVERHEAD_PIXELS *
+			    wc[a].npieces * lc[b].npieces;
+			/* on ties, prefer pieces close to squares */
+			if (bestw == 0 || cost < bestcost ||
+			    (cost == bestcost && labs((long) wc[a].size -
+			    (long) lc[b].size) < labs((long) bestw -
+			    (long) bestl))) {
+				bestcost = cost;
+				bestw = wc[a].size;
+				bestl = lc[b].size;
 			}
-			default: {
-				unsigned long long u= strtoull(
-				    paddingvalues[s], NULL, 10);
-				uint16_t b;
-				/* Here we should care for endianness ;
-				we write paddingbytes bigendianly */
-				for (b = 0 ; b < bytesperpixel ; b++) {
-					paddingbytes[
-					    (s + 1) * bytesperpixel - 1 - b]=
-						u & 0xff;
-					u >>= 8;
-				}
+			if ((wc[a].halving || requestedpiecewidth) &&
+			    (lc[b].halving || requestedpiecelength) &&
+			    (halvingw == 0 || cost < halvingcost)) {
+				halvingcost = cost;
+				halvingw = wc[a].size;
+				halvingl = lc[b].size;
 			}
-                }
-        }
+		}
+	}
+	_TIFFfree(wc);
+	_TIFFfree(lc);
+
+	if (verbose && bestw != 0) {
+		fprintf(stderr, "Planned pieces of " UINT32_FORMAT " x "
+			UINT32_FORMAT ": estimated cost of %.3f Mpixels"
+			" (decoded but unused pixels, plus %u pixels per"
+			" piece)", bestw, bestl, (double) bestcost / 1e6,
+			PIECE_OVERHEAD_PIXELS);
+		if (halvingw != 0 && halvingcost > bestcost)
+			fprintf(stderr, ", instead of %.3f Mpixels with pieces"
+				" of " UINT32_FORMAT " x " UINT32_FORMAT
+				" obtained by halving (saving %.1f%%)",
+				(double) halvingcost / 1e6, halvingw,
+				halvingl, (double) (100 * (halvingcost -
+				bestcost) / halvingcost));
+		fprintf(stderr, ".\n");
+	}
+	*outwidth = bestw;
+	*outlength = bestl;
+	return bestw != 0;
+}
 
-	/*for (s = 0 ; s < spp ; s++) {
-		fprintf(stderr, "[sample %u] %s", s, paddingvalues[s]);
-		uint16_t b;
-		for (b = 0 ; b < bytesperpixel ; b++)
-			fprintf(stderr, " %d", paddingbytes[s * bytesperpixel + b]);
-		fprintf(stderr, "\n");
-	}*/
 
-	prefix = searchPrefixBeforeLastDot(infilename);
+	/* Geometry of the mosaic of a file, shared by the functions which
+	 write its pieces */
+struct mosaic {
+	const char * prefix; /* of the names of the pieces */
+	uint32_t inimagewidth, inimagelength;
+	uint32_t outwidth, outlength; /* of pieces, without overlap */
+	uint32_t hoverlap, voverlap;
+	uint32_t hnpieces, vnpieces;
+	uint32_t ndigitshtilenumber, ndigitsvtilenumber;
+	uint16_t bytesperpixel;
+	uint8_t * paddingbytes; /* one pixel */
+	uint32_t rowsperstrip; /* of pieces; 0: a single strip */
+	uint32_t outtilewidth, outtilelength; /* of pieces; 0: stripped */
+	int copyrawtiles; /* pieces are made of the compressed tiles of in */
+	uint8_t * backgroundunits; /* for each tile or strip of in, 1 if it
+		is background; NULL if background pieces are not skipped */
+};
+
+
+	/* A piece of the mosaic written row by row */
+struct piecewriter {
+	void * out; /* TIFF* or FILE*; NULL if not open */
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	uint32_t x, y, width, length; /* with overlap and padding */
+	uint32_t rowswritten;
+	tsize_t scanlinesizeinbytes;
+	uint16_t bytesperpixel;
+	uint32_t tilewidth, tilelength; /* tiled TIFF */
+	unsigned char * tileband; /* tiled TIFF: the current row of tiles */
+	unsigned char * tilebuf;
+};
+
+
+static const char *
+outputTIFFMode(TIFF* in)
+{
+	if (big_tiff)
+		return TIFFIsBigEndian(in) ? "wb8" : "wl8";
+	return TIFFIsBigEndian(in) ? "wb" : "wl";
+}
 
-	ndigitshtilenumber = searchNumberOfDigits(hnpieces);
-	ndigitsvtilenumber = searchNumberOfDigits(vnpieces);
-        /* Loop over x, loop over y in that order, so that, when in is 
-         * not tiled, TIFFReadScanline calls are done sequentially from 
-         * 0 to H-1 then 0 to H-1 then... Otherwise (0 to h-1 then 0 to 
-         * h-1 then h to 2*h-1 then... with h<H), reading fails. */
-	for (x = 0 ; x < inimagewidth ; x += outwidth) {
-		uint32_t outwidthwithoverlap;
-		uint32_t y_of_last_read_scanline= 0;
-
-		uint32_t leftoverlap = x < hoverlap ? x : hoverlap;
-		uint32_t xwithleftoverlap = x - leftoverlap;
-
-		uint32_t outwidthwithrightoverlap = outwidth + hoverlap;
-		uint32_t amountofpaddingatright= 0;
-		uint32_t xrightboundary = x + outwidthwithrightoverlap;
-		    /* equal to xwithleftoverlap + outwidth + 2*hoverlap */
-		assert(xrightboundary >= x); /* detect overflows */
-		/* At this point the computed right boundary of the
-		 * piece may lie outside the input image for three
-		 * (mutually nonexclusive) reasons:
-		 * - The user requested a specific piece width which is
-		 * not a divisor of the input image width, and this
-		 * piece is the last piece in the row: x + outwidth >
-		 * inimagewidth. This piece must have a smaller width:
-		 * outwidth must be chosen as inimagewidth-x.
-		 * - The user requested an overlap that is larger than
-		 * the distance between the right boundary of the piece
-		 * without overlap and the right boundary of the input
-		 * image: x + outwidth + hoverlap > inimagewidth. The
-		 * right overlap must be restricted to
-		 * inimagewidth-x-outwidth.
-		 * - We use padding in x to achieve a constraint (e.g. 
-		 * piece width is a multiple of some integer number). This 
-		 * piece must not have a smaller width and we should 
-		 * complete it with padding values.
-		 * In cases 1 and 2, xrightboundary > inimagewidth and
-		 * outwidthwithrightoverlap must be taken equal to
-		 * inimagewidth-x; otherwise, it can be taken equal to
-		 * outwidth+hoverlap. */
-		if (xrightboundary > inimagewidth) {
-			if (paddinginx)
-				amountofpaddingatright=
-				    xrightboundary - inimagewidth;
-			else
-				outwidthwithrightoverlap = inimagewidth - x;
-		}
-		outwidthwithoverlap = leftoverlap + outwidthwithrightoverlap;
 
-		assert(xwithleftoverlap < inimagewidth); /* xwlol would be < 0 */
-		assert(xwithleftoverlap + outwidthwithoverlap <=
-			inimagewidth + amountofpaddingatright);
+	/* Open the output file outfilename of a piece whose top left corner
+	 is (x,y) and size width x length, ready to receive its rows */
+static int
+openPieceWriter(TIFF* in, const struct mosaic * m, struct piecewriter * pw,
+	const char * outfilename, uint32_t x, uint32_t y, uint32_t width,
+	uint32_t length)
+{
+	uint16_t input_compression, bytesperpixel;
 
-		for (y = 0 ; y < inimagelength ; y += outlength) {
-			char * outfilename;
-			void * out; /* TIFF* or FILE* */
-			uint32_t outlengthwithoverlap;
-			int error = 0;
-
-			uint32_t topoverlap = y < voverlap ? y : voverlap;
-			uint32_t ywithtopoverlap = y - topoverlap;
-
-			uint32_t outlengthwithbottomoverlap= outlength + voverlap;
-			uint32_t amountofpaddingatbottom= 0;
-			uint32_t ybottomboundary = y + outlengthwithbottomoverlap;
-			assert(ybottomboundary >= y); /* detect overflows */
-			if (ybottomboundary > inimagelength) {
-				if (paddinginy)
-					amountofpaddingatbottom =
-					    ybottomboundary - inimagelength;
-				else
-					outlengthwithbottomoverlap =
-					    inimagelength - y;
-			}
-			outlengthwithoverlap =
-				topoverlap + outlengthwithbottomoverlap;
+	memset(pw, 0, sizeof(*pw));
+	pw->x = x;
+	pw->y = y;
+	pw->width = width;
+	pw->length = length;
 
-			assert(ywithtopoverlap < inimagelength);
-			 /* ywtol would be < 0 */
-			assert(ywithtopoverlap + outlengthwithoverlap <=
-				inimagelength + amountofpaddingatbottom);
+	pw->out = output_JPEG_files ?
+	    (void *) fopen(outfilename, "wb") :
+	    (void *) TIFFOpen(outfilename, outputTIFFMode(in));
+	if (verbose) {
+		if (pw->out == NULL)
+			fprintf(stderr, "Error: unable to open output file"
+				" \"%s\".\n", outfilename);
+		else
+			fprintf(stderr, "Output file \"%s\" open. Will write"
+				" piece of size " UINT32_FORMAT " x "
+				UINT32_FORMAT ".\n", outfilename, width,
+				length);
+	}
+	if (pw->out == NULL)
+		return EXIT_IO_ERROR;
 
-			if (dryrun)
-				continue;
+	if (output_JPEG_files) {
+		testAndFixParameters(in, 1, &pw->scanlinesizeinbytes, width,
+		    NULL, &input_compression, &bytesperpixel);
+		pw->cinfo.err = jpeg_std_error(&pw->jerr);
+		jpeg_create_compress(&pw->cinfo);
+		jpeg_stdio_dest(&pw->cinfo, pw->out);
+		pw->cinfo.image_width = width;
+		pw->cinfo.image_height = length;
+		pw->cinfo.input_components = m->bytesperpixel; /* # of
+			color components per pixel */
+		pw->cinfo.in_color_space = JCS_RGB; /* colorspace of input
+			image */
+		jpeg_set_defaults(&pw->cinfo);
+		if (verbose)
+			fprintf(stderr, "Quality of produced JPEG will be %d.\n",
+				quality);
+		jpeg_set_quality(&pw->cinfo, quality,
+		    TRUE /* limit to baseline-JPEG values */);
+		jpeg_start_compress(&pw->cinfo, TRUE);
+	} else {
+		tiffCopyFieldsButDimensions(in, pw->out);
+		TIFFSetField(pw->out, TIFFTAG_IMAGEWIDTH, width);
+		TIFFSetField(pw->out, TIFFTAG_IMAGELENGTH, length);
+		if (m->outtilewidth) {
+			pw->tilewidth = m->outtilewidth;
+			pw->tilelength = m->outtilelength;
+			TIFFSetField(pw->out, TIFFTAG_TILEWIDTH,
+			    pw->tilewidth);
+			TIFFSetField(pw->out, TIFFTAG_TILELENGTH,
+			    pw->tilelength);
+		} else
+			TIFFSetField(pw->out, TIFFTAG_ROWSPERSTRIP,
+			    m->rowsperstrip && m->rowsperstrip < length ?
+			    m->rowsperstrip : length);
+		if (!testAndFixParameters(in, 0, &pw->scanlinesizeinbytes,
+		    width, pw->out, &input_compression, &bytesperpixel)) {
+			TIFFClose(pw->out);
+			pw->out = NULL;
+			return EXIT_UNHANDLED_FILE_TYPE;
+		}
+		pw->bytesperpixel = bytesperpixel;
+		if (m->outtilewidth && ((pw->tileband = _TIFFmalloc(
+		    m->outtilelength * pw->scanlinesizeinbytes)) == NULL ||
+		    (pw->tilebuf = _TIFFmalloc(TIFFTileSize(pw->out)))
+		    == NULL)) {
+			TIFFError(TIFFFileName(pw->out),
+			    "Error, can't allocate space for tiles");
+			TIFFClose(pw->out);
+			pw->out = NULL;
+			_TIFFfree(pw->tileband);
+			pw->tileband = NULL;
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
+	}
+	return 0;
+}
+
+
+	/* Encode the row of tiles of a tiled piece which starts at row y and
+	 whose rows 0 to rows-1 are in pw->tileband */
+static int
+writePieceTileRow(struct piecewriter * pw, uint32_t y, uint32_t rows)
+{
+	tsize_t outtilewidthinbytes = TIFFTileRowSize(pw->out);
+	uint32_t x;
+
+	for (x = 0 ; x < pw->width ; x += pw->tilewidth) {
+		uint32_t cols = pw->width - x < pw->tilewidth ?
+		    pw->width - x : pw->tilewidth;
+		tsize_t colsinbytes = (tsize_t) cols * pw->bytesperpixel;
+
+		if (cols < pw->tilewidth || rows < pw->tilelength)
+			memset(pw->tilebuf, 0, TIFFTileSize(pw->out));
+		cpBufToBuf(pw->tilebuf,
+		    pw->tileband + (size_t) x * pw->bytesperpixel, NULL,
+		    rows, 0, cols, 0, pw->bytesperpixel,
+		    outtilewidthinbytes - colsinbytes,
+		    pw->scanlinesizeinbytes - colsinbytes);
+		if (TIFFWriteTile(pw->out, pw->tilebuf, x, y, 0, 0) < 0) {
+			TIFFError(TIFFFileName(pw->out),
+				"Error, can't write tile at " UINT32_FORMAT
+				", " UINT32_FORMAT, x, y);
+			return EXIT_IO_ERROR;
+		}
+	}
+	return 0;
+}
+
+
+	/* Append a row to the piece. Rows of TIFF files are copied to
+	 scratchrow first since libtiff may modify them while encoding. */
+static int
+writePieceRow(struct piecewriter * pw, unsigned char * row,
+	unsigned char * scratchrow)
+{
+	if (output_JPEG_files) {
+		JSAMPROW row_pointer = row;
+
+		jpeg_write_scanlines(&pw->cinfo, &row_pointer, 1);
+	} else if (pw->tileband != NULL) {
+		uint32_t r = pw->rowswritten % pw->tilelength;
+
+		memcpy(pw->tileband + r * pw->scanlinesizeinbytes, row,
+		    pw->scanlinesizeinbytes);
+		if ((r + 1 == pw->tilelength ||
+		    pw->rowswritten + 1 == pw->length) &&
+		    writePieceTileRow(pw, pw->rowswritten - r, r + 1))
+			return EXIT_IO_ERROR;
+	} else {
+		memcpy(scratchrow, row, pw->scanlinesizeinbytes);
+		if (TIFFWriteScanline(pw->out, scratchrow, pw->rowswritten,
+		    0) < 0) {
+			TIFFError(TIFFFileName(pw->out),
+				"Error, can't write scanline " UINT32_FORMAT,
+				pw->rowswritten);
+			return EXIT_IO_ERROR;
+		}
+	}
+	pw->rowswritten++;
+	return 0;
+}
+
+
+static void
+closePieceWriter(struct piecewriter * pw)
+{
+	if (pw->out == NULL)
+		return;
+	if (output_JPEG_files) {
+		if (pw->rowswritten == pw->length)
+			jpeg_finish_compress(&pw->cinfo);
+		else
+			jpeg_abort_compress(&pw->cinfo);
+		fclose(pw->out);
+		jpeg_destroy_compress(&pw->cinfo);
+		if (verbose && pw->rowswritten == pw->length)
+			fprintf(stderr, "Piece written.\n");
+	} else {
+		if (verbose && pw->rowswritten == pw->length)
+			fprintf(stderr, "Piece written to output file "
+				"\"%s\".\n", TIFFFileName(pw->out));
+		TIFFClose(pw->out);
+		_TIFFfree(pw->tileband);
+		_TIFFfree(pw->tilebuf);
+		pw->tileband = NULL;
+		pw->tilebuf = NULL;
+	}
+	pw->out = NULL;
+}
+
+
+	/* Decode the row of tiles starting at row y into band, whose rows
+	 are bandrowsize bytes long, each tile exactly once (only the tiles
+	 whose column is flagged in neededcolumns, if it is not NULL). Tiles
+	 are decoded in parallel, thread number t using handle tins[t] and
+	 buffer tilebufs[t]. */
+static int
+readTileRow(TIFF** tins, unsigned char ** tilebufs, const struct mosaic * m,
+	uint32_t y, uint32_t intilewidth, uint32_t intilelength,
+	const uint8_t * neededcolumns, unsigned char * band,
+	tsize_t bandrowsize)
+{
+	tsize_t intilewidthinbytes = TIFFTileRowSize(tins[0]);
+	int64_t tile, numberoftiles =
+	    (m->inimagewidth + intilewidth - 1) / intilewidth;
+	uint32_t rows = m->inimagelength - y < intilelength ?
+	    m->inimagelength - y : intilelength;
+	int error = 0;
+
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(number_of_threads) \
+	    schedule(dynamic) if (number_of_threads > 1 && numberoftiles > 1)
+#endif
+	for (tile = 0 ; tile < numberoftiles ; tile++) {
+		uint32_t x = tile * intilewidth;
+		uint32_t cols = m->inimagewidth - x < intilewidth ?
+		    m->inimagewidth - x : intilewidth;
+		tsize_t colsinbytes = (tsize_t) cols * m->bytesperpixel;
+		int t = 0;
+
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		if (neededcolumns != NULL && !neededcolumns[tile])
+			continue;
+		if (TIFFReadTile(tins[t], tilebufs[t], x, y, 0, 0) < 0) {
+			TIFFError(TIFFFileName(tins[t]),
+			    "Error, can't read tile at "
+			    UINT32_FORMAT ", " UINT32_FORMAT, x, y);
+			#pragma omp critical (mosaic_error)
+			error = EXIT_IO_ERROR;
+			continue;
+		}
+		cpBufToBuf(band + (size_t) x * m->bytesperpixel, tilebufs[t],
+		    NULL, rows, 0, cols, 0, m->bytesperpixel,
+		    bandrowsize - colsinbytes,
+		    intilewidthinbytes - colsinbytes);
+	}
+	return error;
+}
+
+
+	/* Reader of the rows of a file band by band: rows of tiles of tiled
+	 files, whose tiles are decoded in parallel, thread number t using
+	 handle tins[t] and buffer tilebufs[t]; or bandrows scanlines of
+	 stripped files */
+struct bandreader {
+	TIFF** tins; /* tins[0] is the file itself */
+	unsigned char ** tilebufs;
+	uint32_t intilewidth, intilelength; /* 0: stripped */
+	uint32_t bandrows;
+};
+
+
+static void
+closeBandReader(struct bandreader * br)
+{
+	int t;
+
+	for (t = 0 ; t < number_of_threads ; t++) {
+		if (t > 0 && br->tins[t] != NULL)
+			TIFFClose(br->tins[t]);
+		_TIFFfree(br->tilebufs[t]);
+	}
+	_TIFFfree(br->tins);
+	_TIFFfree(br->tilebufs);
+	br->tins = NULL;
+	br->tilebufs = NULL;
+}
+
+
+static int
+openBandReader(TIFF* in, struct bandreader * br)
+{
+	uint16_t in_compression;
+	int t, return_code = 0;
+
+	memset(br, 0, sizeof(*br));
+	br->bandrows = ROWS_PER_BAND;
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &in_compression);
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &br->intilewidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &br->intilelength);
+		br->bandrows = br->intilelength;
+	}
+
+	br->tins = _TIFFmalloc(number_of_threads * sizeof(*br->tins));
+	br->tilebufs = _TIFFmalloc(number_of_threads *
+	    sizeof(*br->tilebufs));
+	if (br->tins == NULL || br->tilebufs == NULL) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't allocate space for rows");
+		_TIFFfree(br->tins);
+		_TIFFfree(br->tilebufs);
+		return EXIT_INSUFFICIENT_MEMORY;
+	}
+	for (t = 0 ; t < number_of_threads ; t++) {
+		br->tins[t] = NULL;
+		br->tilebufs[t] = NULL;
+	}
+	br->tins[0] = in;
+	for (t = 0 ; t < number_of_threads && !return_code ; t++) {
+		if (t > 0 && !br->intilewidth) /* strips: one handle */
+			break;
+		if (t > 0 &&
+		    (br->tins[t] = TIFFOpen(TIFFFileName(in), "r")) == NULL) {
+			return_code = EXIT_IO_ERROR;
+			break;
+		}
+		if (in_compression == COMPRESSION_JPEG)
+			/* as in testAndFixParameters, before the size of
+			 tiles is computed */
+			TIFFSetField(br->tins[t], TIFFTAG_JPEGCOLORMODE,
+			    JPEGCOLORMODE_RGB);
+		if (br->intilewidth && (br->tilebufs[t] =
+		    _TIFFmalloc(TIFFTileSize(br->tins[t]))) == NULL) {
+			TIFFError(TIFFFileName(in),
+				"Error, can't allocate space for rows");
+			return_code = EXIT_INSUFFICIENT_MEMORY;
+		}
+	}
+	if (return_code)
+		closeBandReader(br);
+	return return_code;
+}
+
+
+	/* Decode the band starting at row y (a multiple of br->bandrows)
+	 into band, whose rows are bandrowsize bytes long (for tiled files,
+	 only the columns of tiles flagged in neededcolumns, if it is not
+	 NULL) */
+static int
+readBand(struct bandreader * br, const struct mosaic * m, uint32_t y,
+	const uint8_t * neededcolumns, unsigned char * band,
+	tsize_t bandrowsize)
+{
+	uint32_t yy;
+
+	if (br->intilewidth)
+		return readTileRow(br->tins, br->tilebufs, m, y,
+		    br->intilewidth, br->intilelength, neededcolumns, band,
+		    bandrowsize);
+	for (yy = y ; yy < y + br->bandrows && yy < m->inimagelength ; yy++)
+		if (TIFFReadScanline(br->tins[0], band + (yy - y) * bandrowsize,
+		    yy, 0) < 0) {
+			TIFFError(TIFFFileName(br->tins[0]),
+			    "Error, can't read scanline at "
+			    UINT32_FORMAT, yy);
+			return EXIT_IO_ERROR;
+		}
+	return 0;
+}
+
+
+	/* Background (option --skip-background): pieces which cover only
+	 tiles or strips of the background colour are not made. The tiles or
+	 strips are classified by a pre-pass over their compressed sizes:
+	 those which compress to a small fraction of their size (or all, if
+	 the file is not compressed) are checked, by decoding them, a tile
+	 whose compressed bytes are those of a tile already checked taking
+	 the same verdict without being decoded; the others are not
+	 background. */
+#define BACKGROUND_MAX_COMPRESSED_FRACTION 16
+#define BACKGROUND_REPRESENTATIVES 16
+
+static uint64_t
+sampleValue(const char * value, uint16_t bytespersample)
+{
+	if (value[0] == 'M')
+		return bytespersample >= 8 ? UINT64_MAX :
+		    ((uint64_t) 1 << (8 * bytespersample)) - 1;
+	return strtoull(value, NULL, 10);
+}
+
+
+	/* Whether the width x rows pixels of buf, whose rows are rowsize
+	 bytes long, all lie within backgroundtolerance of colour */
+static int
+isBackgroundBuffer(const unsigned char * buf, uint32_t width, uint32_t rows,
+	tsize_t rowsize, uint16_t spp, uint16_t bytespersample,
+	const uint64_t * colour)
+{
+	uint32_t y, i;
+
+	for (y = 0 ; y < rows ; y++) {
+		const unsigned char * p = buf + y * rowsize;
+
+		for (i = 0 ; i < width * spp ; i++) {
+			uint64_t v, c = colour[i % spp];
+
+			switch (bytespersample) {
+			case 1: v = p[i]; break;
+			case 2: v = ((const uint16_t *) p)[i]; break;
+			case 4: v = ((const uint32_t *) p)[i]; break;
+			default: return 0;
+			}
+			if ((v > c ? v - c : c - v) > backgroundtolerance)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+	/* Classify the tiles or strips of in; return for each of them 1 if
+	 it is background, or NULL on error */
+static uint8_t *
+classifyBackgroundUnits(TIFF* in, uint16_t spp, uint16_t bitspersample)
+{
+	uint32_t imagewidth, imagelength, unitwidth, unitlength, unitsacross;
+	uint32_t n, u, r, nrepresentatives = 0, nchecked = 0, nbackground = 0;
+	uint16_t compression, bytespersample = bitspersample / 8;
+	uint64_t * bytecounts = NULL, colour[spp], maxcompressed;
+	tsize_t unitsize, rowsize;
+	struct { tsize_t size; unsigned char * raw; uint8_t background; }
+	    representatives[BACKGROUND_REPRESENTATIVES];
+	unsigned char * raw, * buf;
+	uint8_t * units;
+	uint16_t s;
+
+	for (s = 0 ; s < spp ; s++)
+		colour[s] = sampleValue(backgroundvalues[s], bytespersample);
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &imagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &imagelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	if (compression == COMPRESSION_JPEG)
+		/* as in testAndFixParameters, before the size of units is
+		 computed */
+		TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	unitsize = TIFFIsTiled(in) ? TIFFTileSize(in) : TIFFStripSize(in);
+	rowsize = TIFFIsTiled(in) ? TIFFTileRowSize(in) :
+	    TIFFScanlineSize(in);
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &unitwidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &unitlength);
+		TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts);
+		n = TIFFNumberOfTiles(in);
+	} else {
+		unitwidth = imagewidth;
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &unitlength);
+		if (unitlength == 0 || unitlength > imagelength)
+			unitlength = imagelength;
+		TIFFGetField(in, TIFFTAG_STRIPBYTECOUNTS, &bytecounts);
+		n = TIFFNumberOfStrips(in);
+	}
+	unitsacross = (imagewidth + unitwidth - 1) / unitwidth;
+	/* uncompressed units are simply decoded: comparing them raw would
+	 read them twice */
+	maxcompressed = unitsize / BACKGROUND_MAX_COMPRESSED_FRACTION;
+
+	units = _TIFFmalloc(n);
+	buf = _TIFFmalloc(unitsize);
+	raw = compression == COMPRESSION_NONE ? NULL :
+	    _TIFFmalloc(maxcompressed + 1);
+	if (units == NULL || buf == NULL || bytecounts == NULL ||
+	    (raw == NULL && compression != COMPRESSION_NONE)) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't allocate space for background detection");
+		_TIFFfree(units); _TIFFfree(buf); _TIFFfree(raw);
+		return NULL;
+	}
+
+	for (u = 0 ; u < n ; u++) {
+		uint32_t x = (u % unitsacross) * unitwidth;
+		uint32_t y = (u / unitsacross) * unitlength;
+		uint32_t width = imagewidth - x < unitwidth ?
+		    imagewidth - x : unitwidth;
+		uint32_t rows = imagelength - y < unitlength ?
+		    imagelength - y : unitlength;
+		tsize_t size = 0;
+
+		units[u] = 0;
+		if (bytecounts[u] == 0)
+			continue;
+		if (raw != NULL) {
+			if (bytecounts[u] > maxcompressed)
+				continue;
+			size = TIFFIsTiled(in) ?
+			    TIFFReadRawTile(in, u, raw, maxcompressed + 1) :
+			    TIFFReadRawStrip(in, u, raw, maxcompressed + 1);
+			if (size < 0)
+				continue;
+			for (r = 0 ; r < nrepresentatives ; r++)
+				if (representatives[r].size == size &&
+				    memcmp(representatives[r].raw, raw,
+				    size) == 0)
+					break;
+			if (r < nrepresentatives) {
+				units[u] = representatives[r].background;
+				nbackground += units[u];
+				continue;
+			}
+		}
+		if ((TIFFIsTiled(in) ?
+		    TIFFReadEncodedTile(in, u, buf, unitsize) :
+		    TIFFReadEncodedStrip(in, u, buf, unitsize)) < 0)
+			continue;
+		nchecked++;
+		units[u] = isBackgroundBuffer(buf, width, rows, rowsize, spp,
+		    bytespersample, colour);
+		nbackground += units[u];
+		/* tiles at the right or bottom edge hold pixels outside the
+		 image, which may differ */
+		if (raw != NULL &&
+		    nrepresentatives < BACKGROUND_REPRESENTATIVES &&
+		    width == unitwidth && rows == unitlength &&
+		    (representatives[nrepresentatives].raw =
+		    _TIFFmalloc(size)) != NULL) {
+			memcpy(representatives[nrepresentatives].raw, raw,
+			    size);
+			representatives[nrepresentatives].size = size;
+			representatives[nrepresentatives].background =
+			    units[u];
+			nrepresentatives++;
+		}
+	}
+
+	if (verbose)
+		fprintf(stderr, "File \"%s\": " UINT32_FORMAT " of "
+			UINT32_FORMAT " %s are background (" UINT32_FORMAT
+			" decoded to check).\n", TIFFFileName(in),
+			nbackground, n, TIFFIsTiled(in) ? "tiles" : "strips",
+			nchecked);
+	for (r = 0 ; r < nrepresentatives ; r++)
+		_TIFFfree(representatives[r].raw);
+	_TIFFfree(buf);
+	_TIFFfree(raw);
+	return units;
+}
+
+
+	/* Whether the piece of row i and column j covers only background
+	 tiles or strips (its padding, if any, being ignored) */
+static int
+isBackgroundPiece(TIFF* in, const struct mosaic * m, uint32_t i, uint32_t j)
+{
+	uint32_t x, y, width, length, padding, unitwidth, unitlength, ux, uy;
+
+	if (m->backgroundunits == NULL)
+		return 0;
+	computePieceSpan(j * m->outwidth, m->outwidth, m->hoverlap,
+	    m->inimagewidth, paddinginx, &x, &width, &padding);
+	computePieceSpan(i * m->outlength, m->outlength, m->voverlap,
+	    m->inimagelength, paddinginy, &y, &length, &padding);
+	if (x + width > m->inimagewidth)
+		width = m->inimagewidth - x;
+	if (y + length > m->inimagelength)
+		length = m->inimagelength - y;
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &unitwidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &unitlength);
+	} else {
+		unitwidth = m->inimagewidth;
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &unitlength);
+		if (unitlength == 0 || unitlength > m->inimagelength)
+			unitlength = m->inimagelength;
+		x = 0;
+		width = m->inimagewidth;
+	}
+
+	for (uy = y / unitlength ; uy <= (y + length - 1) / unitlength ; uy++)
+		for (ux = x / unitwidth ; ux <= (x + width - 1) / unitwidth ;
+		    ux++)
+			if (!m->backgroundunits[TIFFIsTiled(in) ?
+			    TIFFComputeTile(in, ux * unitwidth,
+			    uy * unitlength, 0, 0) :
+			    TIFFComputeStrip(in, uy * unitlength, 0)])
+				return 0;
+	return 1;
+}
+
+
+	/* Write the list of the pieces which were not made because they
+	 are background to prefix_background.txt */
+static int
+writeBackgroundManifest(TIFF* in, const struct mosaic * m)
+{
+	uint32_t i, j, x, y, width, length, padding;
+	char * manifestname;
+	FILE * f;
+
+	my_asprintf(&manifestname, "%s_background.txt", m->prefix);
+	f = fopen(manifestname, "w");
+	if (f == NULL) {
+		TIFFError(manifestname, "Error, can't open the list of "
+			"background pieces");
+		_TIFFfree(manifestname);
+		return EXIT_IO_ERROR;
+	}
+	fprintf(f, "# pieces of %s made only of background, not written:"
+	    " name x y width length\n", TIFFFileName(in));
+	for (i = 0 ; i < m->vnpieces ; i++)
+		for (j = 0 ; j < m->hnpieces ; j++) {
+			if (!isBackgroundPiece(in, m, i, j))
+				continue;
+			computePieceSpan(j * m->outwidth, m->outwidth,
+			    m->hoverlap, m->inimagewidth, paddinginx,
+			    &x, &width, &padding);
+			computePieceSpan(i * m->outlength, m->outlength,
+			    m->voverlap, m->inimagelength, paddinginy,
+			    &y, &length, &padding);
+			fprintf(f, "%s_i%0*uj%0*u%s " UINT32_FORMAT " "
+			    UINT32_FORMAT " " UINT32_FORMAT " " UINT32_FORMAT
+			    "\n", m->prefix, m->ndigitsvtilenumber, i+1,
+			    m->ndigitshtilenumber, j+1, output_JPEG_files ?
+			    JPEG_SUFFIX : TIFF_SUFFIX, x, y, width, length);
+		}
+	if (fclose(f) != 0) {
+		TIFFError(manifestname, "Error, can't write the list of "
+			"background pieces");
+		_TIFFfree(manifestname);
+		return EXIT_IO_ERROR;
+	}
+	if (verbose)
+		fprintf(stderr, "List of background pieces written to \"%s\".\n",
+			manifestname);
+	_TIFFfree(manifestname);
+	return 0;
+}
+
+
+	/* Number of pieces which makeMosaicRowByRow keeps open at the same
+	 time at most, with bands of bandrows rows: those of the rows of
+	 pieces which start before the end of a band and end after it */
+static uint64_t
+countMaxOpenPieces(const struct mosaic * m, uint32_t bandrows,
+	uint32_t paddedlength)
+{
+	uint32_t y, start, size, padding, first = 0, next = 0, maxrows = 0;
+
+	for (y = 0 ; y < paddedlength ; y += bandrows) {
+		uint32_t yend = paddedlength - y < bandrows ? paddedlength :
+		    y + bandrows;
+
+		for ( ; next < m->vnpieces ; next++) {
+			computePieceSpan(next * m->outlength, m->outlength,
+			    m->voverlap, m->inimagelength, paddinginy, &start,
+			    &size, &padding);
+			if (start >= yend)
+				break;
+		}
+		if (next - first > maxrows)
+			maxrows = next - first;
+		for ( ; first < next ; first++) {
+			computePieceSpan(first * m->outlength, m->outlength,
+			    m->voverlap, m->inimagelength, paddinginy, &start,
+			    &size, &padding);
+			if (start + size > yend)
+				break;
+		}
+	}
+	return (uint64_t) maxrows * m->hnpieces;
+}
+
+
+	/* Check that files files can be open at the same time besides the
+	 input handles and standard streams, raising the soft limit of the
+	 process up to its hard limit if needed. On failure, an error naming
+	 the limit is reported, instead of failing to open a piece after
+	 others have been partly written. */
+static int
+checkOpenFilesLimit(TIFF* in, uint64_t files)
+{
+#ifndef _WIN32
+	struct rlimit rl;
+	uint64_t needed = files + number_of_threads + 3 /* stdin, stdout,
+		stderr */ + 8 /* libraries, manifest */;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY
+	    || needed <= (uint64_t) rl.rlim_cur)
+		return 0;
+	if (rl.rlim_max == RLIM_INFINITY || needed <= (uint64_t) rl.rlim_max) {
+		rl.rlim_cur = needed;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == 0) {
+			if (verbose)
+				fprintf(stderr, "Raised the limit of open files"
+					" to " UINT64_FORMAT ".\n", needed);
+			return 0;
+		}
+	}
+	TIFFError(TIFFFileName(in), "Error, making the pieces row by row "
+		"needs " UINT64_FORMAT " files open at the same time, more than"
+		" the limit of " UINT64_FORMAT " open files (see ulimit -n); "
+		"make fewer pieces per row", needed,
+		(uint64_t) (rl.rlim_max == RLIM_INFINITY ? rl.rlim_cur :
+		rl.rlim_max));
+	return EXIT_IO_ERROR;
+#else
+	return 0;
+#endif
+}
+
+
+	/* Make the mosaic in a single pass over the rows of in, band by
+	 band: all the pieces which cross the current band are open at the
+	 same time, and each row, decoded once, is handed to all of them.
+	 Used for stripped compressed files, which can't be read at random:
+	 making the pieces one after another would decode the file once per
+	 column of pieces; and for tiled files when making the pieces one
+	 after another would decode some tiles several times (because of
+	 overlap, or pieces which do not begin on the grid of tiles): then
+	 bands are rows of tiles, each decoded once. With several threads,
+	 the tiles of a band are decoded in parallel, and the pieces are
+	 encoded in parallel. */
+static int
+makeMosaicRowByRow(TIFF* in, const struct mosaic * m)
+{
+	uint32_t paddedwidth, paddedlength, start, size, padding;
+	uint32_t i, j, y, firstopenrow = 0, nextrowtoopen = 0, bandrows;
+	tsize_t rowsize, inscanlinesize = TIFFScanlineSize(in);
+	int64_t k, numberofactivepieces;
+	struct bandreader br;
+	struct piecewriter ** writers; /* rows of pieces */
+	struct piecewriter ** activepieces; /* crossing the current band */
+	unsigned char * band, * paddingrow;
+	unsigned char ** scratchrows; /* one per thread */
+	uint8_t * neededcolumns = NULL; /* of tiles, if background is skipped */
+	int t, return_code;
+
+	if ((return_code = openBandReader(in, &br)))
+		return return_code;
+	bandrows = br.bandrows;
+
+	computePieceSpan((m->hnpieces-1) * m->outwidth, m->outwidth,
+	    m->hoverlap, m->inimagewidth, paddinginx, &start, &size,
+	    &padding);
+	paddedwidth = start + size > m->inimagewidth ? start + size :
+	    m->inimagewidth;
+	computePieceSpan((m->vnpieces-1) * m->outlength, m->outlength,
+	    m->voverlap, m->inimagelength, paddinginy, &start, &size,
+	    &padding);
+	paddedlength = start + size > m->inimagelength ? start + size :
+	    m->inimagelength;
+	if ((return_code = checkOpenFilesLimit(in,
+	    countMaxOpenPieces(m, bandrows, paddedlength)))) {
+		closeBandReader(&br);
+		return return_code;
+	}
+
+	rowsize = (tsize_t) paddedwidth * m->bytesperpixel;
+	if (rowsize < inscanlinesize)
+		rowsize = inscanlinesize;
+	band = _TIFFmalloc(bandrows * rowsize);
+	paddingrow = _TIFFmalloc(rowsize);
+	writers = _TIFFmalloc(m->vnpieces * sizeof(*writers));
+	activepieces = _TIFFmalloc(m->hnpieces * (uint64_t) m->vnpieces *
+	    sizeof(*activepieces));
+	scratchrows = _TIFFmalloc(number_of_threads * sizeof(*scratchrows));
+	if (m->backgroundunits != NULL && br.intilewidth)
+		neededcolumns = _TIFFmalloc((m->inimagewidth +
+		    br.intilewidth - 1) / br.intilewidth);
+	if (band == NULL || paddingrow == NULL || writers == NULL ||
+	    activepieces == NULL || scratchrows == NULL ||
+	    (m->backgroundunits != NULL && br.intilewidth &&
+	    neededcolumns == NULL)) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't allocate space for rows");
+		_TIFFfree(band); _TIFFfree(paddingrow);
+		_TIFFfree(writers); _TIFFfree(activepieces);
+		_TIFFfree(scratchrows); _TIFFfree(neededcolumns);
+		closeBandReader(&br);
+		return EXIT_INSUFFICIENT_MEMORY;
+	}
+	for (t = 0 ; t < number_of_threads ; t++)
+		scratchrows[t] = NULL;
+	for (t = 0 ; t < number_of_threads && !return_code ; t++)
+		if ((scratchrows[t] = _TIFFmalloc(rowsize)) == NULL) {
+			TIFFError(TIFFFileName(in),
+				"Error, can't allocate space for rows");
+			return_code = EXIT_INSUFFICIENT_MEMORY;
+		}
+	if (paddinginx || paddinginy) {
+		cpBufToBuf(paddingrow, NULL, m->paddingbytes, 0, 1, 0,
+		    paddedwidth, m->bytesperpixel, 0, 0);
+		for (i = 0 ; i < bandrows ; i++) /* right padding */
+			memcpy(band + i * rowsize, paddingrow, rowsize);
+	}
+
+	for (y = 0 ; y < paddedlength && return_code == 0 ; y += bandrows) {
+		uint32_t yend = paddedlength - y < bandrows ? paddedlength :
+		    y + bandrows;
+
+		/* Open the pieces of the rows of pieces starting in the
+		 band */
+		while (nextrowtoopen < m->vnpieces) {
+			computePieceSpan(nextrowtoopen * m->outlength,
+			    m->outlength, m->voverlap, m->inimagelength,
+			    paddinginy, &start, &size, &padding);
+			if (start >= yend)
+				break;
+			writers[nextrowtoopen] = _TIFFmalloc(m->hnpieces *
+			    sizeof(struct piecewriter));
+			if (writers[nextrowtoopen] == NULL) {
+				TIFFError(TIFFFileName(in), "Error, can't "
+					"allocate space for pieces");
+				return_code = EXIT_INSUFFICIENT_MEMORY;
+				break;
+			}
+			for (j = 0 ; j < m->hnpieces ; j++) {
+				uint32_t xstart, width, rightpadding;
+				char * outfilename;
+				int r;
+
+				computePieceSpan(j * m->outwidth, m->outwidth,
+				    m->hoverlap, m->inimagewidth, paddinginx,
+				    &xstart, &width, &rightpadding);
+				if (isBackgroundPiece(in, m, nextrowtoopen,
+				    j)) {
+					memset(&writers[nextrowtoopen][j], 0,
+					    sizeof(struct piecewriter));
+					continue;
+				}
+				my_asprintf(&outfilename, "%s_i%0*uj%0*u%s",
+				    m->prefix, m->ndigitsvtilenumber,
+				    nextrowtoopen+1, m->ndigitshtilenumber,
+				    j+1, output_JPEG_files ? JPEG_SUFFIX :
+				    TIFF_SUFFIX);
+				r = openPieceWriter(in, m,
+				    &writers[nextrowtoopen][j], outfilename,
+				    xstart, start, width, size);
+				_TIFFfree(outfilename);
+				if (r && !return_code)
+					return_code = r;
+			}
+			nextrowtoopen++;
+		}
+		if (return_code)
+			break;
+
+		numberofactivepieces = 0;
+		for (i = firstopenrow ; i < nextrowtoopen ; i++)
+			if (writers[i] != NULL)
+				for (j = 0 ; j < m->hnpieces ; j++)
+					if (writers[i][j].out != NULL)
+						activepieces[
+						    numberofactivepieces++] =
+						    &writers[i][j];
+
+		/* Tiles or bands which only background pieces cross are not
+		 decoded */
+		if (neededcolumns != NULL) {
+			memset(neededcolumns, 0, (m->inimagewidth +
+			    br.intilewidth - 1) / br.intilewidth);
+			for (k = 0 ; k < numberofactivepieces ; k++) {
+				struct piecewriter * pw = activepieces[k];
+				uint32_t xend = pw->x + pw->width;
+
+				if (xend > m->inimagewidth)
+					xend = m->inimagewidth;
+				for (j = pw->x / br.intilewidth ;
+				    pw->x < xend &&
+				    j <= (xend - 1) / br.intilewidth ; j++)
+					neededcolumns[j] = 1;
+			}
+		}
+		if (y < m->inimagelength && numberofactivepieces > 0 &&
+		    (return_code = readBand(&br, m, y, neededcolumns, band,
+		    rowsize)))
+			break;
+
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(number_of_threads) \
+		    schedule(dynamic) \
+		    if (number_of_threads > 1 && numberofactivepieces > 1)
+#endif
+		for (k = 0 ; k < numberofactivepieces ; k++) {
+			struct piecewriter * pw = activepieces[k];
+			uint32_t yy = pw->y + pw->rowswritten;
+			int e = 0, thread = 0;
+
+#ifdef _OPENMP
+			thread = omp_get_thread_num();
+#endif
+			for ( ; yy < yend && pw->rowswritten < pw->length &&
+			    !e ; yy++)
+				e = writePieceRow(pw, (yy < m->inimagelength ?
+				    band + (yy - y) * rowsize : paddingrow) +
+				    (size_t) pw->x * m->bytesperpixel,
+				    scratchrows[thread]);
+			if (e || pw->rowswritten == pw->length)
+				closePieceWriter(pw);
+			if (e) {
+				#pragma omp critical (mosaic_error)
+				if (!return_code)
+					return_code = e;
+			}
+		}
+
+		/* Free the rows of pieces which are complete */
+		for (i = firstopenrow ; i < nextrowtoopen ; i++) {
+			if (writers[i] == NULL)
+				continue;
+			for (j = 0 ; j < m->hnpieces ; j++)
+				if (writers[i][j].out != NULL)
+					break;
+			if (j == m->hnpieces) {
+				_TIFFfree(writers[i]);
+				writers[i] = NULL;
+			}
+		}
+		while (firstopenrow < nextrowtoopen &&
+		    writers[firstopenrow] == NULL)
+			firstopenrow++;
+	}
+
+	for (i = firstopenrow ; i < nextrowtoopen ; i++)
+		if (writers[i] != NULL) {
+			for (j = 0 ; j < m->hnpieces ; j++)
+				closePieceWriter(&writers[i][j]);
+			_TIFFfree(writers[i]);
+		}
+	for (t = 0 ; t < number_of_threads ; t++)
+		_TIFFfree(scratchrows[t]);
+	_TIFFfree(scratchrows);
+	_TIFFfree(neededcolumns);
+	closeBandReader(&br);
+	_TIFFfree(writers);
+	_TIFFfree(activepieces);
+	_TIFFfree(band);
+	_TIFFfree(paddingrow);
+	return return_code;
+}
+
+
+	/* Dry run (option -y): the plan for each file is reported on stdout
+	 as an element of a JSON array, with what it would read from the
+	 file. "Units" are the tiles or strips of the file. */
+struct plancost {
+	uint64_t units; /* touched */
+	uint64_t compressedbytes; /* of the units touched */
+	uint64_t readbytes; /* compressed bytes read: those of each unit
+		once, unless units are decoded each time they are touched */
+	uint64_t decodedpixels;
+	uint64_t redundantdecodes; /* units decoded more than once */
+};
+
+static int reportedfiles = 0;
+
+
+static void
+printJSONString(const char * s)
+{
+	putchar('"');
+	for ( ; *s ; s++)
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", (unsigned) (unsigned char) *s);
+		else
+			putchar(*s);
+	putchar('"');
+}
+
+
+	/* Add to c the units of in which the rectangle of size width x
+	 length at (x,y) touches. If decoded is not NULL, it flags the units
+	 already decoded: a unit is counted as decoded if it was not, or if
+	 eachtime is set (then it is a redundant decode) */
+static void
+addUnitsOfRegion(TIFF* in, uint32_t x, uint32_t y, uint32_t width,
+	uint32_t length, uint8_t * decoded, int eachtime, struct plancost * c)
+{
+	uint32_t imagewidth, imagelength, unitwidth, unitlength, ux, uy;
+	uint64_t * bytecounts = NULL;
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &imagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &imagelength);
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &unitwidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &unitlength);
+		TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts);
+	} else {
+		unitwidth = imagewidth;
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &unitlength);
+		if (unitlength == 0 || unitlength > imagelength)
+			unitlength = imagelength;
+		TIFFGetField(in, TIFFTAG_STRIPBYTECOUNTS, &bytecounts);
+		x = 0;
+		width = imagewidth;
+	}
+	if (x + width > imagewidth)
+		width = imagewidth - x;
+	if (y + length > imagelength)
+		length = imagelength - y;
+
+	for (uy = y / unitlength ; uy <= (y + length - 1) / unitlength ; uy++)
+		for (ux = x / unitwidth ; ux <= (x + width - 1) / unitwidth ;
+		    ux++) {
+			uint32_t unit = TIFFIsTiled(in) ?
+			    TIFFComputeTile(in, ux * unitwidth,
+			    uy * unitlength, 0, 0) :
+			    TIFFComputeStrip(in, uy * unitlength, 0);
+			uint32_t rows = imagelength - uy * unitlength <
+			    unitlength && !TIFFIsTiled(in) ?
+			    imagelength - uy * unitlength : unitlength;
+
+			c->units++;
+			if (bytecounts != NULL) {
+				c->compressedbytes += bytecounts[unit];
+				if (decoded == NULL || !decoded[unit] ||
+				    eachtime)
+					c->readbytes += bytecounts[unit];
+			}
+			if (decoded == NULL)
+				continue;
+			if (!decoded[unit] || eachtime)
+				c->decodedpixels += (uint64_t) unitwidth * rows;
+			if (decoded[unit] && eachtime)
+				c->redundantdecodes++;
+			decoded[unit] = 1;
+		}
+}
+
+
+static uint64_t
+unitSize(TIFF* in)
+{
+	return TIFFIsTiled(in) ? TIFFTileSize(in) : TIFFStripSize(in);
+}
+
+
+	/* Memory taken by the band of the input which makeMosaicRowByRow
+	 reads at once, with, for each thread, the tile or strip it decodes
+	 and the row it hands to libtiff */
+static uint64_t
+bandReaderMemory(TIFF* in, const struct mosaic * m)
+{
+	uint64_t paddedwidth = (uint64_t) m->hnpieces * m->outwidth +
+	    m->hoverlap, rowsize = (paddedwidth > m->inimagewidth ?
+	    paddedwidth : m->inimagewidth) * m->bytesperpixel;
+	uint32_t bandrows = TIFFIsTiled(in) ? 0 : ROWS_PER_BAND;
+
+	if (bandrows == 0)
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &bandrows);
+	return (bandrows + 1) * rowsize + number_of_threads * (rowsize +
+	    unitSize(in));
+}
+
+
+	/* Memory taken by a piece being written, besides what libtiff and
+	 libjpeg need to encode a row or a tile */
+static uint64_t
+pieceWriterMemory(const struct mosaic * m, uint32_t width, uint32_t length)
+{
+	uint64_t rowsize = (uint64_t) width * m->bytesperpixel;
+
+	if (output_JPEG_files) /* libjpeg's MCU rows and its pools */
+		return rowsize * 16 + 65536;
+	if (m->outtilewidth)
+		return rowsize * m->outtilelength + (uint64_t)
+		    m->outtilewidth * m->outtilelength * m->bytesperpixel;
+	/* libtiff holds a whole strip before encoding it */
+	return rowsize * (m->rowsperstrip && m->rowsperstrip < length ?
+	    m->rowsperstrip : length);
+}
+
+
+	/* Memory taken by makeMosaicRowByRow: the band of the input, and
+	 the writers of all the pieces open at the same time */
+static uint64_t
+rowByRowMemory(TIFF* in, const struct mosaic * m)
+{
+	uint32_t bandrows = TIFFIsTiled(in) ? 0 : ROWS_PER_BAND;
+	uint32_t start, size, padding;
+
+	if (bandrows == 0)
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &bandrows);
+	computePieceSpan((m->vnpieces-1) * m->outlength, m->outlength,
+	    m->voverlap, m->inimagelength, paddinginy, &start, &size,
+	    &padding);
+	return bandReaderMemory(in, m) + countMaxOpenPieces(m, bandrows,
+	    start + size > m->inimagelength ? start + size :
+	    m->inimagelength) * pieceWriterMemory(m, m->outwidth +
+	    2 * m->hoverlap, m->outlength + 2 * m->voverlap);
+}
+
+
+	/* Report the plan for in: how its pieces (or, if pyramidtiles is
+	 not zero, the tiles of its pyramid) are made (mode), what each piece
+	 reads, and the totals. If decodeeachpiece is set, pieces are made
+	 one after another and decode their units each time; otherwise, each
+	 unit is decoded once (unless tiles are copied). */
+static void
+reportPlan(TIFF* in, const struct mosaic * m, const char * mode,
+	int decodeeachpiece, uint64_t peakbytes, uint64_t pyramidtiles,
+	uint32_t pyramidlevels)
+{
+	uint32_t i, j, n, x, y, width, length, padding;
+	uint32_t backgroundpieces = 0;
+	uint8_t * decoded;
+	struct plancost total;
+	int copy = m->copyrawtiles;
+
+	memset(&total, 0, sizeof(total));
+	n = TIFFIsTiled(in) ? TIFFNumberOfTiles(in) : TIFFNumberOfStrips(in);
+	if ((decoded = _TIFFmalloc(n)) == NULL) {
+		TIFFError(TIFFFileName(in), "Error, can't allocate space for"
+			" the report");
+		return;
+	}
+	memset(decoded, 0, n);
+
+	printf("%s{\"input\": ", reportedfiles++ ? ",\n" : "[\n");
+	printJSONString(TIFFFileName(in));
+	printf(", \"width\": " UINT32_FORMAT ", \"length\": " UINT32_FORMAT
+	    ", \"units\": \"%s\", \"mode\": \"%s\"", m->inimagewidth,
+	    m->inimagelength, TIFFIsTiled(in) ? "tiles" : "strips", mode);
+	if (pyramidtiles) {
+		addUnitsOfRegion(in, 0, 0, m->inimagewidth, m->inimagelength,
+		    decoded, 0, &total);
+		printf(", \"levels\": %u, \"tiles\": " UINT64_FORMAT,
+		    pyramidlevels, pyramidtiles);
+	} else {
+		printf(", \"pieces\": [");
+		for (i = 0 ; i < m->vnpieces ; i++)
+			for (j = 0 ; j < m->hnpieces ; j++) {
+				struct plancost c;
+				char * name;
+				int background = isBackgroundPiece(in, m, i,
+				    j);
+
+				memset(&c, 0, sizeof(c));
+				computePieceSpan(j * m->outwidth, m->outwidth,
+				    m->hoverlap, m->inimagewidth, paddinginx,
+				    &x, &width, &padding);
+				computePieceSpan(i * m->outlength,
+				    m->outlength, m->voverlap,
+				    m->inimagelength, paddinginy, &y, &length,
+				    &padding);
+				if (background)
+					backgroundpieces++;
+				else
+					addUnitsOfRegion(in, x, y, width,
+					    length, copy ? NULL : decoded,
+					    decodeeachpiece, &c);
+				my_asprintf(&name, "%s_i%0*uj%0*u%s",
+				    m->prefix, m->ndigitsvtilenumber, i+1,
+				    m->ndigitshtilenumber, j+1,
+				    output_JPEG_files ? JPEG_SUFFIX :
+				    TIFF_SUFFIX);
+				printf("%s\n  {\"output\": ",
+				    i || j ? "," : "");
+				printJSONString(name);
+				_TIFFfree(name);
+				printf(", \"x\": " UINT32_FORMAT ", \"y\": "
+				    UINT32_FORMAT ", \"width\": " UINT32_FORMAT
+				    ", \"length\": " UINT32_FORMAT
+				    ", \"units_touched\": " UINT64_FORMAT
+				    ", \"compressed_bytes\": " UINT64_FORMAT
+				    ", \"decoded_pixels\": " UINT64_FORMAT
+				    "%s}", x, y, width, length, c.units,
+				    c.compressedbytes, c.decodedpixels,
+				    background ? ", \"background\": true" : "");
+				total.units += c.units;
+				total.readbytes += c.readbytes;
+				total.decodedpixels += c.decodedpixels;
+				total.redundantdecodes += c.redundantdecodes;
+			}
+		printf("]");
+		if (m->backgroundunits != NULL)
+			printf(",\n \"background_pieces\": " UINT32_FORMAT,
+			    backgroundpieces);
+	}
+	printf(",\n \"units_touched\": " UINT64_FORMAT
+	    ", \"compressed_bytes\": " UINT64_FORMAT
+	    ", \"decoded_pixels\": " UINT64_FORMAT
+	    ", \"redundant_decodes\": " UINT64_FORMAT
+	    ", \"peak_buffer_bytes\": " UINT64_FORMAT "}",
+	    total.units, total.readbytes, total.decodedpixels,
+	    total.redundantdecodes, peakbytes);
+	_TIFFfree(decoded);
+}
+
+
+	/* One level of a Deep Zoom pyramid. Its rows arrive band by band,
+	 from the input file (largest level) or from the level above; they
+	 are handed to the tiles which cross the band, then averaged two by
+	 two into the band of the level below. */
+struct pyramidlevel {
+	uint32_t width, length;
+	uint32_t ncols, nrows; /* of tiles */
+	tsize_t rowsize;
+	unsigned char * band;
+	uint32_t bandsize; /* rows */
+	uint32_t bandstart, bandrows; /* rows currently in band */
+	unsigned char * pendingrow; /* even row paired with the next band */
+	struct piecewriter ** writers; /* rows of tiles */
+	uint32_t firstopenrow, nextrowtoopen;
+};
+
+struct pyramid {
+	TIFF* in;
+	const struct mosaic * m;
+	uint32_t tilesize, overlap;
+	uint32_t nlevels; /* level 0 is 1 x 1, level nlevels-1 full size */
+	struct pyramidlevel * levels;
+	struct piecewriter ** activetiles; /* crossing the current band */
+};
+
+
+	/* Average the 8-bit pixels of row0 and row1 (NULL for the last row
+	 of a level of odd length) two by two into the (inwidth+1)/2 pixels
+	 of out */
+static void
+halveRows(unsigned char * out, const unsigned char * row0,
+	const unsigned char * row1, uint32_t inwidth, uint16_t spp)
+{
+	uint32_t x;
+	uint16_t s;
+
+	if (row1 == NULL)
+		row1 = row0;
+	for (x = 0 ; x + 1 < inwidth ; x += 2, row0 += 2 * spp,
+	    row1 += 2 * spp)
+		for (s = 0 ; s < spp ; s++)
+			*out++ = (row0[s] + row0[spp + s] + row1[s] +
+			    row1[spp + s] + 2) / 4;
+	if (x < inwidth) /* odd width: last column alone */
+		for (s = 0 ; s < spp ; s++)
+			*out++ = (row0[s] + row1[s] + 1) / 2;
+}
+
+
+	/* Write the rows in the band of level l to its tiles, opening the
+	 rows of tiles which start in the band and closing those which end
+	 in it, then average them into the level below */
+static int
+writePyramidBand(struct pyramid * p, uint32_t l)
+{
+	struct pyramidlevel * lv = &p->levels[l];
+	const struct mosaic * m = p->m;
+	uint32_t i, j, start, size, padding, y = lv->bandstart,
+	    yend = lv->bandstart + lv->bandrows;
+	int64_t k, numberofactivetiles = 0;
+	int return_code = 0;
+
+	while (lv->nextrowtoopen < lv->nrows) {
+		computePieceSpan(lv->nextrowtoopen * p->tilesize,
+		    p->tilesize, p->overlap, lv->length, 0, &start, &size,
+		    &padding);
+		if (start >= yend)
+			break;
+		lv->writers[lv->nextrowtoopen] = _TIFFmalloc(lv->ncols *
+		    sizeof(struct piecewriter));
+		if (lv->writers[lv->nextrowtoopen] == NULL) {
+			TIFFError(TIFFFileName(p->in), "Error, can't "
+				"allocate space for tiles");
+			return EXIT_INSUFFICIENT_MEMORY;
+		}
+		for (j = 0 ; j < lv->ncols ; j++) {
+			uint32_t xstart, width, rightpadding;
+			char * outfilename;
+			int r;
+
+			computePieceSpan(j * p->tilesize, p->tilesize,
+			    p->overlap, lv->width, 0, &xstart, &width,
+			    &rightpadding);
+			my_asprintf(&outfilename, "%s_files/%u/%u_%u%s",
+			    m->prefix, l, j, lv->nextrowtoopen, JPEG_SUFFIX);
+			r = openPieceWriter(p->in, m,
+			    &lv->writers[lv->nextrowtoopen][j], outfilename,
+			    xstart, start, width, size);
+			_TIFFfree(outfilename);
+			if (r && !return_code)
+				return_code = r;
+		}
+		lv->nextrowtoopen++;
+		if (return_code)
+			return return_code;
+	}
+
+	for (i = lv->firstopenrow ; i < lv->nextrowtoopen ; i++)
+		if (lv->writers[i] != NULL)
+			for (j = 0 ; j < lv->ncols ; j++)
+				if (lv->writers[i][j].out != NULL)
+					p->activetiles[numberofactivetiles++] =
+					    &lv->writers[i][j];
+
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(number_of_threads) \
+	    schedule(dynamic) \
+	    if (number_of_threads > 1 && numberofactivetiles > 1)
+#endif
+	for (k = 0 ; k < numberofactivetiles ; k++) {
+		struct piecewriter * pw = p->activetiles[k];
+		uint32_t yy = pw->y + pw->rowswritten;
+		int e = 0;
+
+		for ( ; yy < yend && pw->rowswritten < pw->length && !e ;
+		    yy++)
+			e = writePieceRow(pw, lv->band + (yy - y) *
+			    lv->rowsize + (size_t) pw->x * m->bytesperpixel,
+			    NULL);
+		if (e || pw->rowswritten == pw->length)
+			closePieceWriter(pw);
+		if (e) {
+			#pragma omp critical (mosaic_error)
+			if (!return_code)
+				return_code = e;
+		}
+	}
+	if (return_code)
+		return return_code;
+
+	/* Free the rows of tiles which are complete */
+	for (i = lv->firstopenrow ; i < lv->nextrowtoopen ; i++) {
+		if (lv->writers[i] == NULL)
+			continue;
+		for (j = 0 ; j < lv->ncols ; j++)
+			if (lv->writers[i][j].out != NULL)
+				break;
+		if (j == lv->ncols) {
+			_TIFFfree(lv->writers[i]);
+			lv->writers[i] = NULL;
+		}
+	}
+	while (lv->firstopenrow < lv->nextrowtoopen &&
+	    lv->writers[lv->firstopenrow] == NULL)
+		lv->firstopenrow++;
+
+	lv->bandstart = yend;
+	lv->bandrows = 0;
+	if (l == 0)
+		return 0;
+
+	/* Make the rows of the level below, writing its band whenever it
+	 is full */
+	for (i = y ; i < yend && !return_code ; i++) {
+		struct pyramidlevel * below = &p->levels[l-1];
+		unsigned char * row = lv->band + (i - y) * lv->rowsize;
+
+		if (i % 2 == 0 && i + 1 < lv->length) {
+			if (i + 1 == yend)
+				memcpy(lv->pendingrow, row, lv->rowsize);
+			continue;
+		}
+		halveRows(below->band + below->bandrows * below->rowsize,
+		    i % 2 == 0 ? row : i == y ? lv->pendingrow :
+		    row - lv->rowsize, i % 2 == 0 ? NULL : row, lv->width,
+		    m->bytesperpixel);
+		below->bandrows++;
+		if (below->bandrows == below->bandsize ||
+		    below->bandstart + below->bandrows == below->length)
+			return_code = writePyramidBand(p, l-1);
+	}
+	return return_code;
+}
+
+
+static int
+makeDirectory(const char * path)
+{
+	if (mkdir(path, 0777) == 0 || errno == EEXIST)
+		return 0;
+	TIFFError(path, "Error, can't create directory: %s", strerror(errno));
+	return EXIT_IO_ERROR;
+}
+
+
+	/* Make a Deep Zoom pyramid of in: the description m->prefix.dzi and
+	 the tiles of each level in directory m->prefix_files/<level>, with
+	 the given overlap. The file is read once, band by band; each level
+	 only keeps a band of rows and its open rows of tiles in memory. */
+static int
+makePyramid(TIFF* in, const struct mosaic * m, uint32_t tilesize,
+	uint32_t overlap)
+{
+	struct pyramid p;
+	struct bandreader br;
+	struct pyramidlevel * top;
+	uint32_t l, i, j, y, w, h;
+	uint64_t memory = 0, ntiles = 0;
+	char * name;
+	FILE * dzi;
+	int return_code;
+
+	if ((return_code = openBandReader(in, &br)))
+		return return_code;
+
+	p.in = in;
+	p.m = m;
+	p.tilesize = tilesize;
+	p.overlap = overlap;
+	for (p.nlevels = 1, w = m->inimagewidth, h = m->inimagelength ;
+	    w > 1 || h > 1 ; p.nlevels++) {
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+	p.levels = _TIFFmalloc(p.nlevels * sizeof(*p.levels));
+	if (p.levels == NULL) {
+		closeBandReader(&br);
+		return EXIT_INSUFFICIENT_MEMORY;
+	}
+	memset(p.levels, 0, p.nlevels * sizeof(*p.levels));
+	top = &p.levels[p.nlevels-1];
+	w = m->inimagewidth;
+	h = m->inimagelength;
+	for (l = p.nlevels ; l-- > 0 ; w = (w + 1) / 2, h = (h + 1) / 2) {
+		struct pyramidlevel * lv = &p.levels[l];
+
+		lv->width = w;
+		lv->length = h;
+		lv->ncols = (w + tilesize - 1) / tilesize;
+		lv->nrows = (h + tilesize - 1) / tilesize;
+		lv->rowsize = (tsize_t) w * m->bytesperpixel;
+		if (lv == top) {
+			lv->bandsize = br.bandrows;
+			if (lv->rowsize < TIFFScanlineSize(in))
+				lv->rowsize = TIFFScanlineSize(in);
+		} else
+			lv->bandsize = tilesize < h ? tilesize : h;
+		memory += (uint64_t) lv->bandsize * lv->rowsize;
+		ntiles += (uint64_t) lv->ncols * lv->nrows;
+		if (dryrun)
+			continue;
+		lv->band = _TIFFmalloc(lv->bandsize * lv->rowsize);
+		lv->pendingrow = _TIFFmalloc(lv->rowsize);
+		lv->writers = _TIFFmalloc(lv->nrows * sizeof(*lv->writers));
+		for (i = 0 ; lv->writers != NULL && i < lv->nrows ; i++)
+			lv->writers[i] = NULL;
+		if (lv->band == NULL || lv->pendingrow == NULL ||
+		    lv->writers == NULL) {
+			TIFFError(TIFFFileName(in),
+				"Error, can't allocate space for rows");
+			return_code = EXIT_INSUFFICIENT_MEMORY;
+		}
+	}
+	p.activetiles = dryrun ? NULL : _TIFFmalloc(top->ncols *
+	    (uint64_t) top->nrows * sizeof(*p.activetiles));
+	if (!dryrun && p.activetiles == NULL && !return_code) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't allocate space for tiles");
+		return_code = EXIT_INSUFFICIENT_MEMORY;
+	}
+	if (dryrun) {
+		memory += number_of_threads * unitSize(in);
+		for (l = 0 ; l < p.nlevels ; l++) /* two rows of open tiles */
+			memory += 2 * p.levels[l].ncols * pieceWriterMemory(m,
+			    tilesize + 2 * overlap, tilesize + 2 * overlap);
+		reportPlan(in, m, "Deep Zoom pyramid", 0, memory, ntiles,
+		    p.nlevels);
+	}
+	if (verbose)
+		fprintf(stderr, "File \"%s\": Deep Zoom pyramid of %u levels"
+			" and " UINT64_FORMAT " tiles of " UINT32_FORMAT
+			" x " UINT32_FORMAT " with overlap of "
+			UINT32_FORMAT " pixels; will take %.3f MiB of"
+			" memory for the rows of the levels.\n",
+			TIFFFileName(in), p.nlevels, ntiles, tilesize,
+			tilesize, overlap, memory / 1048576.0);
+
+	if (!dryrun && !return_code) {
+		my_asprintf(&name, "%s.dzi", m->prefix);
+		if ((dzi = fopen(name, "w")) == NULL) {
+			TIFFError(name, "Error, can't open file for writing");
+			return_code = EXIT_IO_ERROR;
+		} else {
+			fprintf(dzi, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+				"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+				"  Format=\"jpg\" Overlap=\"" UINT32_FORMAT
+				"\" TileSize=\"" UINT32_FORMAT "\">\n"
+				"  <Size Width=\"" UINT32_FORMAT
+				"\" Height=\"" UINT32_FORMAT "\"/>\n"
+				"</Image>\n", overlap, tilesize,
+				m->inimagewidth, m->inimagelength);
+			if (fclose(dzi) != 0)
+				return_code = EXIT_IO_ERROR;
+		}
+		_TIFFfree(name);
+		my_asprintf(&name, "%s_files", m->prefix);
+		if (!return_code)
+			return_code = makeDirectory(name);
+		_TIFFfree(name);
+		for (l = 0 ; l < p.nlevels && !return_code ; l++) {
+			my_asprintf(&name, "%s_files/%u", m->prefix, l);
+			return_code = makeDirectory(name);
+			_TIFFfree(name);
+		}
+	}
+
+	for (y = 0 ; y < m->inimagelength && !dryrun && !return_code ;
+	    y += br.bandrows) {
+		if ((return_code = readBand(&br, m, y, NULL, top->band,
+		    top->rowsize)))
+			break;
+		top->bandrows = m->inimagelength - y < br.bandrows ?
+		    m->inimagelength - y : br.bandrows;
+		return_code = writePyramidBand(&p, p.nlevels-1);
+	}
+
+	for (l = 0 ; l < p.nlevels ; l++) {
+		struct pyramidlevel * lv = &p.levels[l];
+
+		for (i = 0 ; lv->writers != NULL && i < lv->nrows ; i++)
+			if (lv->writers[i] != NULL) {
+				for (j = 0 ; j < lv->ncols ; j++)
+					closePieceWriter(&lv->writers[i][j]);
+				_TIFFfree(lv->writers[i]);
+			}
+		_TIFFfree(lv->writers);
+		_TIFFfree(lv->band);
+		_TIFFfree(lv->pendingrow);
+	}
+	_TIFFfree(p.levels);
+	_TIFFfree(p.activetiles);
+	closeBandReader(&br);
+	if (verbose && !dryrun && !return_code)
+		fprintf(stderr, "Pyramid written to \"%s.dzi\".\n", m->prefix);
+	return return_code;
+}
+
+
+	/* Tell whether the pieces of the mosaic can be made by copying the
+	 compressed tiles of in: in must be tiled like the pieces, the pieces
+	 must keep its compression (without new options), and they and their
+	 overlaps must lie on its grid of tiles without padding */
+static int
+canCopyRawTiles(TIFF* in, const struct mosaic * m)
+{
+	uint32_t intilewidth, intilelength, start, size, padding;
+	uint16_t compression;
+
+	if (!TIFFIsTiled(in) || output_JPEG_files)
+		return 0;
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+
+	if (compression == COMPRESSION_OJPEG)
+		return 0;
+	if (defcompression != (uint16_t) -1 &&
+	    (defcompression != compression ||
+	     compression == COMPRESSION_JPEG ||
+	     compression == COMPRESSION_CCITTFAX3 ||
+	     defpredictor != (uint16_t) -1 || defpreset != -1))
+		return 0;
+	if (m->outtilewidth != intilewidth || m->outtilelength != intilelength)
+		return 0;
+	if ((m->hnpieces > 1 && (m->outwidth % intilewidth ||
+	      m->hoverlap % intilewidth)) ||
+	    (m->vnpieces > 1 && (m->outlength % intilelength ||
+	      m->voverlap % intilelength)))
+		return 0;
+	computePieceSpan((m->hnpieces-1) * m->outwidth, m->outwidth,
+	    m->hoverlap, m->inimagewidth, paddinginx, &start, &size,
+	    &padding);
+	if (padding)
+		return 0;
+	computePieceSpan((m->vnpieces-1) * m->outlength, m->outlength,
+	    m->voverlap, m->inimagelength, paddinginy, &start, &size,
+	    &padding);
+	return padding == 0;
+}
+
+
+	/* Set the fields of out which are needed to store in it tiles
+	 copied from in without decoding, as in tiffsplittiles */
+static void
+tiffCopyFieldsForRawTiles(TIFF* in, TIFF* out)
+{
+	uint16_t compression, photometric, shortv, shortv2;
+	uint32_t longv;
+	float * floatav;
+
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &photometric);
+	CopyField(TIFFTAG_TILEWIDTH, longv);
+	CopyField(TIFFTAG_TILELENGTH, longv);
+	if (compression == COMPRESSION_JPEG) {
+		uint32_t count = 0;
+		void * table = NULL;
+
+		if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &count, &table) &&
+		    count > 0 && table)
+			TIFFSetField(out, TIFFTAG_JPEGTABLES, count, table);
+	}
+	if (photometric == PHOTOMETRIC_YCBCR) {
+		CopyField2(TIFFTAG_YCBCRSUBSAMPLING, shortv, shortv2);
+		CopyField(TIFFTAG_YCBCRPOSITIONING, shortv);
+		CopyField(TIFFTAG_REFERENCEBLACKWHITE, floatav);
+	}
+}
+
+
+	/* Make the piece whose part without overlap has its top left corner
+	 at (x,y) as a tiled TIFF file, copying the compressed tiles of in
+	 without decoding them */
+static int
+makePieceFromRawTiles(TIFF* in, const struct mosaic * m, uint32_t x,
+	uint32_t y)
+{
+	char * outfilename;
+	TIFF* out;
+	uint32_t xmin, width, ymin, length, padding, tx, ty;
+	uint64_t * bytecounts;
+	tmsize_t bufsize = 0;
+	unsigned char * buf = NULL;
+	int error = 0;
+
+	computePieceSpan(x, m->outwidth, m->hoverlap, m->inimagewidth,
+	    paddinginx, &xmin, &width, &padding);
+	computePieceSpan(y, m->outlength, m->voverlap, m->inimagelength,
+	    paddinginy, &ymin, &length, &padding);
+
+	if (!TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts)) {
+		TIFFError(TIFFFileName(in), "Error, can't get tile sizes");
+		return EXIT_IO_ERROR;
+	}
+
+	my_asprintf(&outfilename, "%s_i%0*uj%0*u%s",
+	    m->prefix, m->ndigitsvtilenumber, y/m->outlength+1,
+	    m->ndigitshtilenumber, x/m->outwidth+1, TIFF_SUFFIX);
+	out = TIFFOpen(outfilename, outputTIFFMode(in));
+	if (verbose) {
+		if (out == NULL)
+			fprintf(stderr, "Error: unable to open output file"
+				" \"%s\".\n", outfilename);
+		else
+			fprintf(stderr, "Output file \"%s\" open. Will copy"
+				" tiles of piece of size " UINT32_FORMAT
+				" x " UINT32_FORMAT ".\n", outfilename,
+				width, length);
+	}
+	_TIFFfree(outfilename);
+	if (out == NULL)
+		return EXIT_IO_ERROR;
+
+	tiffCopyFieldsButDimensions(in, out);
+	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, width);
+	TIFFSetField(out, TIFFTAG_IMAGELENGTH, length);
+	tiffCopyFieldsForRawTiles(in, out);
+
+	for (ty = ymin ; ty < ymin + length && !error ; ty += m->outtilelength)
+		for (tx = xmin ; tx < xmin + width && !error ;
+		    tx += m->outtilewidth) {
+			uint32_t tile = TIFFComputeTile(in, tx, ty, 0, 0);
+			tmsize_t size = bytecounts[tile];
+
+			if (size == 0) /* missing tile */
+				continue;
+			if (size > bufsize) {
+				unsigned char * newbuf =
+				    _TIFFrealloc(buf, size);
+
+				if (newbuf == NULL) {
+					TIFFError(TIFFFileName(in), "Error, "
+					    "can't allocate space for tile");
+					error = EXIT_INSUFFICIENT_MEMORY;
+					break;
+				}
+				buf = newbuf;
+				bufsize = size;
+			}
+			size = TIFFReadRawTile(in, tile, buf, size);
+			if (size < 0) {
+				TIFFError(TIFFFileName(in),
+				    "Error, can't read tile at "
+				    UINT32_FORMAT ", " UINT32_FORMAT, tx, ty);
+				error = EXIT_IO_ERROR;
+			} else if (TIFFWriteRawTile(out, TIFFComputeTile(out,
+			    tx - xmin, ty - ymin, 0, 0), buf, size) < 0) {
+				TIFFError(TIFFFileName(out),
+				    "Error, can't write tile");
+				error = EXIT_IO_ERROR;
+			}
+		}
+
+	if (!error && verbose)
+		fprintf(stderr, "Piece written to output file \"%s\".\n",
+			TIFFFileName(out));
+	TIFFClose(out);
+	_TIFFfree(buf);
+	return error;
+}
+
+
+	/* Make the piece whose part without overlap has its top left corner
+	 at (x,y), using outbuf to hold it */
+static int
+makePiece(TIFF* in, const struct mosaic * m, uint32_t x, uint32_t y,
+	unsigned char * outbuf, uint32_t * y_of_last_read_scanline)
+{
+	char * outfilename;
+	void * out; /* TIFF* or FILE* */
+	uint32_t xwithleftoverlap, outwidthwithoverlap;
+	uint32_t amountofpaddingatright;
+	uint32_t ywithtopoverlap, outlengthwithoverlap;
+	uint32_t amountofpaddingatbottom;
+	int error = 0;
+
+	if (m->copyrawtiles)
+		return makePieceFromRawTiles(in, m, x, y);
+
+	computePieceSpan(x, m->outwidth, m->hoverlap, m->inimagewidth,
+	    paddinginx, &xwithleftoverlap, &outwidthwithoverlap,
+	    &amountofpaddingatright);
+	computePieceSpan(y, m->outlength, m->voverlap, m->inimagelength,
+	    paddinginy, &ywithtopoverlap, &outlengthwithoverlap,
+	    &amountofpaddingatbottom);
+
+	my_asprintf(&outfilename, "%s_i%0*uj%0*u%s",
+	    m->prefix, m->ndigitsvtilenumber,
+	    y/m->outlength+1, m->ndigitshtilenumber,
+	    x/m->outwidth+1,
+	    output_JPEG_files ? JPEG_SUFFIX : TIFF_SUFFIX);
+
+	out = output_JPEG_files ?
+	    (void *) fopen(outfilename, "wb") :
+	    (void *) TIFFOpen(outfilename, outputTIFFMode(in));
+	if (verbose) {
+		if (out == NULL)
+			fprintf(stderr, "Error: unable"
+				" to open output file"
+				" \"%s\".\n",
+				outfilename);
+		else
+			fprintf(stderr, "Output file "
+				"\"%s\" open. Will "
+				"write piece of size "
+				UINT32_FORMAT " x "
+				UINT32_FORMAT ".\n",
+				outfilename,
+				outwidthwithoverlap,
+				outlengthwithoverlap);
+	}
+	_TIFFfree(outfilename);
+	if (out == NULL)
+		return EXIT_IO_ERROR;
+
+	if (output_JPEG_files) {
+		struct jpeg_compress_struct cinfo;
+		struct jpeg_error_mgr jerr;
+
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		jpeg_stdio_dest(&cinfo, out);
+		cinfo.image_width = outwidthwithoverlap;
+		cinfo.image_height = outlengthwithoverlap;
+		cinfo.input_components = m->bytesperpixel; /* # of
+			color components per pixel */
+		cinfo.in_color_space = JCS_RGB; /* colorspace
+			of input image */
+		jpeg_set_defaults(&cinfo);
+		if (verbose)
+			fprintf(stderr, "Quality of produced JPEG will be %d.\n",
+				quality);
+		jpeg_set_quality(&cinfo, quality,
+		    TRUE /* limit to baseline-JPEG values */);
+		jpeg_start_compress(&cinfo, TRUE);
+
+		if (((TIFFIsTiled(in) &&
+		      !(error = cpTiles2Strip(in,
+			    &cinfo, 1,
+			    xwithleftoverlap,
+			    ywithtopoverlap,
+			    outwidthwithoverlap,
+			    outlengthwithoverlap,
+			    amountofpaddingatright,
+			    amountofpaddingatbottom,
+			    m->paddingbytes,
+			    m->inimagewidth, m->inimagelength,
+			    outbuf))) ||
+		     (!TIFFIsTiled(in) &&
+		      !(error = cpStrips2Strip(in, 
+			    &cinfo, 1,
+			    xwithleftoverlap,
+			    ywithtopoverlap,
+			    outwidthwithoverlap,
+			    outlengthwithoverlap,
+			    amountofpaddingatright,
+			    amountofpaddingatbottom,
+			    m->paddingbytes,
+			    outbuf,
+			    y_of_last_read_scanline,
+			    m->inimagelength)))))
+			if (verbose)
+				fprintf(stderr,
+					"Piece written.\n");
+
+		jpeg_finish_compress(&cinfo);
+		fclose(out);
+		jpeg_destroy_compress(&cinfo);
+	} else {
+		tiffCopyFieldsButDimensions(in, out);
+		TIFFSetField(out, TIFFTAG_IMAGEWIDTH,
+			outwidthwithoverlap);
+		TIFFSetField(out, TIFFTAG_IMAGELENGTH,
+			outlengthwithoverlap);
+		TIFFSetField(out, TIFFTAG_ROWSPERSTRIP,
+			outlengthwithoverlap);
+
+		if ((TIFFIsTiled(in) &&
+		      !(error = cpTiles2Strip(in, out,
+			0, xwithleftoverlap,
+			ywithtopoverlap,
+			outwidthwithoverlap,
+			outlengthwithoverlap,
+			amountofpaddingatright,
+			amountofpaddingatbottom,
+			m->paddingbytes,
+			m->inimagewidth, m->inimagelength,
+			outbuf))) ||
+		     (!TIFFIsTiled(in) &&
+		      !(error = cpStrips2Strip(in, out,
+			0, xwithleftoverlap,
+			ywithtopoverlap,
+			outwidthwithoverlap,
+			outlengthwithoverlap,
+			amountofpaddingatright,
+			amountofpaddingatbottom,
+			m->paddingbytes,
+			outbuf,
+			y_of_last_read_scanline,
+			m->inimagelength))))
+			if (verbose)
+				fprintf(stderr, "Piece written"
+					" to output file "
+					"\"%s\".\n",
+				TIFFFileName(out));
+
+		TIFFClose(out);
+	}
+	return error;
+}
+
+
+	/* Make the pieces one after another, each in a buffer of
+	 piecebuffersize bytes (none if pieces are copied from compressed
+	 tiles), with up to numberofthreads threads, each
+	 with its own handle on the input file and its own buffer (the first
+	 one uses in and outbuf) */
+static int
+makeMosaicPieceByPiece(TIFF* in, const struct mosaic * m,
+	unsigned char * outbuf, uint64_t piecebuffersize, int numberofthreads)
+{
+	int64_t numberofpieces = (int64_t) m->hnpieces * m->vnpieces;
+	int return_code = 0;
+
+#ifdef _OPENMP
+	#pragma omp parallel num_threads(numberofthreads) \
+	    if (numberofthreads > 1 && numberofpieces > 1)
+#endif
+	{
+	TIFF* tin = in;
+	unsigned char * buf = outbuf;
+	uint32_t y_of_last_read_scanline = 0;
+	int64_t k;
+	int ready = 1;
+
+#ifdef _OPENMP
+	if (omp_get_thread_num() != 0) {
+		buf = NULL;
+		ready = 0;
+		tin = TIFFOpen(TIFFFileName(in), "r");
+		if (tin == NULL) {
+			#pragma omp critical (mosaic_error)
+			return_code = EXIT_IO_ERROR;
+		} else if (piecebuffersize == 0 ||
+		    (buf = _TIFFmalloc(piecebuffersize)) != NULL)
+			ready = 1;
+		else {
+			TIFFError(TIFFFileName(in),
+			    "Error, can't allocate space for piece");
+			#pragma omp critical (mosaic_error)
+			return_code = EXIT_INSUFFICIENT_MEMORY;
+		}
+	}
+#endif
+
+	/* Pieces are numbered column by column so that, when in is not
+	 tiled, each thread mostly reads scanlines sequentially from 0 to
+	 H-1 then 0 to H-1 then... */
+	#pragma omp for schedule(dynamic)
+	for (k = 0 ; k < numberofpieces ; k++) {
+		int e;
+
+		if (!ready || isBackgroundPiece(tin, m, k % m->vnpieces,
+		    k / m->vnpieces))
+			continue;
+		e = makePiece(tin, m, (k / m->vnpieces) * m->outwidth,
+		    (k % m->vnpieces) * m->outlength, buf,
+		    &y_of_last_read_scanline);
+		if (e) {
+			#pragma omp critical (mosaic_error)
+			if (!return_code) /* error code = 1st error */
+				return_code = e;
+		}
+	}
+
+	if (buf != outbuf)
+		_TIFFfree(buf);
+	if (tin != NULL && tin != in)
+		TIFFClose(tin);
+	}
+
+	return return_code;
+}
+
+
+static int
+makeMosaicFromTIFFFile(char * infilename)
+{
+	TIFF * in;
+	uint32_t inimagewidth, inimagelength, outwidth, outlength;
+	uint32_t hoverlap, voverlap;
+	uint32_t hnpieces, vnpieces;
+	uint32_t ndigitshtilenumber, ndigitsvtilenumber;
+	uint16_t planarconfig, spp, bitspersample, sampleformat;
+	uint16_t in_compression;
+	uint64_t outmemorysize, ouroutmemorysize, budget;
+	char * prefix;
+	unsigned char * outbuf = NULL;
+	struct mosaic m;
+	int rowbyrow, numberofthreads, return_code = 0;
+
+	in = TIFFOpen(infilename, "r");
+	if (in == NULL) {
+		if (verbose)
+			fprintf(stderr, "Unable to open file \"%s\".\n",
+				infilename);
+		return EXIT_IO_ERROR;
+	}
+
+	if (verbose)
+		fprintf(stderr, "File \"%s\" open.\n", infilename);
+
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &inimagewidth);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &inimagelength);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLEFORMAT, &sampleformat);
+
+	if (output_JPEG_files && (bitspersample != 8 || spp != 3)) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't output JPEG files from file with "
+			"bits-per-sample %d (not 8) or "
+			"samples-per-pixel %d (not 3)",
+			bitspersample, spp);
+		TIFFClose(in);
+		return EXIT_UNHANDLED_FILE_TYPE;
+	} else if (bitspersample % 8 != 0) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't deal with file with "
+			"bits-per-sample %d (not a multiple of 8)",
+			bitspersample);
+		TIFFClose(in);
+		return EXIT_UNHANDLED_FILE_TYPE;
+	}
 
-			my_asprintf(&outfilename, "%s_i%0*uj%0*u%s",
-			    prefix, ndigitsvtilenumber,
-			    y/outlength+1, ndigitshtilenumber,
-			    x/outwidth+1,
-			    output_JPEG_files ? JPEG_SUFFIX : TIFF_SUFFIX);
-
-			out = output_JPEG_files ?
-			    (void *) fopen(outfilename, "wb") :
-			    (void *) TIFFOpen(outfilename,
-				TIFFIsBigEndian(in)?"wb":"wl");
-			if (verbose) {
-				if (out == NULL)
-					fprintf(stderr, "Error: unable"
-						" to open output file"
-						" \"%s\".\n",
-						outfilename);
-				else
-					fprintf(stderr, "Output file "
-						"\"%s\" open. Will "
-						"write piece of size "
-						UINT32_FORMAT " x "
-						UINT32_FORMAT ".\n",
-						outfilename,
-						outwidthwithoverlap,
-						outlengthwithoverlap);
-			}
-			_TIFFfree(outfilename);
-			if (out == NULL)
-				continue;
+	if (verbose)
+		fprintf(stderr, "File \"%s\" has %u bits per sample.\n",
+			infilename, (unsigned) bitspersample);
+
+	outwidth= requestedpiecewidth ? requestedpiecewidth : inimagewidth;
+	outlength= requestedpiecelength ? requestedpiecelength :
+		inimagelength;
+	computeMaxPieceMemorySize(inimagewidth, inimagelength, spp,
+		bitspersample, outwidth, outlength, overlapinpixels,
+		overlapinpercent, &outmemorysize, &ouroutmemorysize,
+		&hnpieces, &vnpieces, &hoverlap, &voverlap);
+	if (verbose)
+		fprintf(stderr, "File \"%s\": dimensions " UINT32_FORMAT
+			" x " UINT32_FORMAT "; "
+			"%u bits per sample and %u samples per pixel; "
+			"takes %.3f MiB of memory (" UINT64_FORMAT
+                        " bytes) to open fully.\n",
+			infilename, inimagewidth, inimagelength,
+			bitspersample, spp,
+			outmemorysize / 1048576.0, outmemorysize);
+	if (!output_JPEG_files &&
+	    (requestedpiecewidth == 0 || inimagewidth <= requestedpiecewidth) &&
+	    (requestedpiecelength == 0 ||
+		inimagelength <= requestedpiecelength) &&
+	    (mosaicpiecesize == 0 || outmemorysize <= mosaicpiecesize)) {
+		/* nothing to do */
+		TIFFClose(in);
+		if (verbose) {
+			if (mosaicpiecesize)
+				fprintf(stderr, "File \"%s\": nothing to do. "
+				"Its memory requirement is already "
+				"below the limit %.3f MiB.\n",
+				infilename, mosaicpiecesize / 1048576.0);
+			else
+				fprintf(stderr, "File \"%s\": nothing"
+				" to do.\n", infilename);
+		}
+		return 0;
+	}
 
-			if (quality <= 0) {
-				uint16_t in_compression;
+	TIFFGetField(in, TIFFTAG_PLANARCONFIG, &planarconfig);
+	if (planarconfig != PLANARCONFIG_CONTIG) {
+		TIFFError(TIFFFileName(in),
+			"Error, can't deal with file with "
+			"planar configuration %d (non contiguous)",
+			planarconfig);
+		TIFFClose(in);
+		return EXIT_UNHANDLED_FILE_TYPE;
+	}
 
-				TIFFGetField(in, TIFFTAG_COMPRESSION, &in_compression);
-				if (in_compression == COMPRESSION_JPEG) {
-					uint16_t in_jpegquality;
-					TIFFGetField(in,
-					    TIFFTAG_JPEGQUALITY,
-					    &in_jpegquality);
-					quality = in_jpegquality;
-				} else
-					quality = default_quality;
-			}
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &in_compression);
 
-			if (output_JPEG_files) {
-				struct jpeg_compress_struct cinfo;
-				struct jpeg_error_mgr jerr;
-
-				cinfo.err = jpeg_std_error(&jerr);
-				jpeg_create_compress(&cinfo);
-				jpeg_stdio_dest(&cinfo, out);
-				cinfo.image_width = outwidthwithoverlap;
-				cinfo.image_height = outlengthwithoverlap;
-				cinfo.input_components = spp; /* # of
-					color components per pixel */
-				cinfo.in_color_space = JCS_RGB; /* colorspace
-					of input image */
-				jpeg_set_defaults(&cinfo);
-				if (verbose)
-					fprintf(stderr, "Quality of produced JPEG will be %d.\n",
-						quality);
-				jpeg_set_quality(&cinfo, quality,
-				    TRUE /* limit to baseline-JPEG values */);
-				jpeg_start_compress(&cinfo, TRUE);
-
-				if (((TIFFIsTiled(in) &&
-				      !(error = cpTiles2Strip(in,
-					    &cinfo, 1,
-					    xwithleftoverlap,
-					    ywithtopoverlap,
-					    outwidthwithoverlap,
-					    outlengthwithoverlap,
-					    amountofpaddingatright,
-					    amountofpaddingatbottom,
-					    paddingbytes,
-					    inimagewidth, inimagelength,
-					    outbuf))) ||
-				     (!TIFFIsTiled(in) &&
-				      !(error = cpStrips2Strip(in, 
-					    &cinfo, 1,
-					    xwithleftoverlap,
-					    ywithtopoverlap,
-					    outwidthwithoverlap,
-					    outlengthwithoverlap,
-					    amountofpaddingatright,
-					    amountofpaddingatbottom,
-					    outbuf,
-					    &y_of_last_read_scanline,
-					    inimagelength)))))
-					if (verbose)
-						fprintf(stderr,
-							"Piece written.\n");
-
-				jpeg_finish_compress(&cinfo);
-				fclose(out);
-				jpeg_destroy_compress(&cinfo);
-			} else {
-				tiffCopyFieldsButDimensions(in, out);
-				TIFFSetField(out, TIFFTAG_IMAGEWIDTH,
-					outwidthwithoverlap);
-				TIFFSetField(out, TIFFTAG_IMAGELENGTH,
-					outlengthwithoverlap);
-				TIFFSetField(out, TIFFTAG_ROWSPERSTRIP,
-					outlengthwithoverlap);
-
-				if ((TIFFIsTiled(in) &&
-				      !(error = cpTiles2Strip(in, out,
-					0, xwithleftoverlap,
-					ywithtopoverlap,
-					outwidthwithoverlap,
-					outlengthwithoverlap,
-					amountofpaddingatright,
-					amountofpaddingatbottom,
-					paddingbytes,
-					inimagewidth, inimagelength,
-					outbuf))) ||
-				     (!TIFFIsTiled(in) &&
-				      !(error = cpStrips2Strip(in, out,
-					0, xwithleftoverlap,
-					ywithtopoverlap,
-					outwidthwithoverlap,
-					outlengthwithoverlap,
-					amountofpaddingatright,
-					amountofpaddingatbottom,
-					outbuf,
-					&y_of_last_read_scanline,
-					inimagelength))))
-					if (verbose)
-						fprintf(stderr, "Piece written"
-							" to output file "
-							"\"%s\".\n",
-						TIFFFileName(out));
-
-				TIFFClose(out);
+	if (quality <= 0) {
+		if (in_compression == COMPRESSION_JPEG) {
+			uint16_t in_jpegquality;
+			TIFFGetField(in, TIFFTAG_JPEGQUALITY,
+			    &in_jpegquality);
+			quality = in_jpegquality;
+		} else
+			quality = default_quality;
+	}
+
+	if (dzitilesize) {
+		memset(&m, 0, sizeof(m));
+		m.prefix = prefix = searchPrefixBeforeLastDot(infilename);
+		m.inimagewidth = inimagewidth;
+		m.inimagelength = inimagelength;
+		m.bytesperpixel = spp; /* 8-bit samples, as for JPEG files */
+		hoverlap = overlapinpercent > 0 ?
+		    lroundl(overlapinpercent * dzitilesize / 100) :
+		    overlapinpixels;
+		if (hoverlap > dzitilesize)
+			hoverlap = dzitilesize;
+		return_code = makePyramid(in, &m, dzitilesize, hoverlap);
+		TIFFClose(in);
+		_TIFFfree(prefix);
+		return return_code;
+	}
+
+	if (output_JPEG_files &&
+	    ( (requestedpiecewidth >= JPEG_MAX_DIMENSION) ||
+	      (requestedpiecelength >= JPEG_MAX_DIMENSION) ) ) {
+		if (verbose)
+			fprintf(stderr, "File \"%s\": at least one requested piece dimension is too large for JPEG files.\n",
+				infilename);
+		return EXIT_UNABLE_TO_ACHIEVE_PIECE_DIMENSIONS;
+	}
+
+	if ((requestedpiecewidth == 0 || requestedpiecelength == 0) &&
+	    ((mosaicpiecesize && outmemorysize > mosaicpiecesize) ||
+	    (output_JPEG_files && (outwidth >= JPEG_MAX_DIMENSION ||
+	    outlength >= JPEG_MAX_DIMENSION)))) {
+		if (planPieceGeometry(in, inimagewidth, inimagelength, spp,
+		    bitspersample, &outwidth, &outlength))
+			computeMaxPieceMemorySize(inimagewidth,
+			    inimagelength, spp, bitspersample,
+			    outwidth, outlength, overlapinpixels,
+			    overlapinpercent,
+			    &outmemorysize, &ouroutmemorysize,
+			    &hnpieces, &vnpieces, &hoverlap, &voverlap);
+	}
+
+	if (outwidth == 0 || outlength == 0) {
+		if (verbose)
+			fprintf(stderr, "File \"%s\": unable to compute"
+				" dimensions of mosaic pieces that will"
+				" satisfy the memory and/or divisor"
+				" requirement(s).\n",
+				infilename);
+		return EXIT_UNABLE_TO_ACHIEVE_PIECE_DIMENSIONS;
+	}
+
+	m.inimagewidth = inimagewidth;
+	m.inimagelength = inimagelength;
+	m.bytesperpixel = (bitspersample + 7) / 8 * spp;
+	m.outwidth = outwidth;
+	m.outlength = outlength;
+	m.hoverlap = hoverlap;
+	m.voverlap = voverlap;
+	m.hnpieces = hnpieces;
+	m.vnpieces = vnpieces;
+	m.rowsperstrip = outrowsperstrip;
+	m.outtilewidth = outtilewidth;
+	m.outtilelength = outtilelength;
+	if (copy_tiles && !outtilewidth && !output_JPEG_files &&
+	    TIFFIsTiled(in)) {
+		/* tiled pieces like in */
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &m.outtilewidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &m.outtilelength);
+	}
+	m.copyrawtiles = canCopyRawTiles(in, &m);
+	m.backgroundunits = NULL;
+	if (copy_tiles && verbose)
+		fprintf(stderr, "File \"%s\": %s.\n", infilename,
+			m.copyrawtiles ? "will copy its compressed tiles to"
+			" the pieces" : "can't copy its compressed tiles to"
+			" the pieces (not tiled, different compression, or"
+			" pieces, overlap or padding not on its grid of"
+			" tiles); decoding them");
+
+	/* Stripped compressed files can't be read at random, and tiled
+	 files would have tiles decoded several times if pieces overlap or
+	 do not lie on the grid of tiles: then all the pieces of a row of
+	 pieces are made at the same time, row by row; the memory taken is
+	 that of a band of the input and of a strip (or a row of tiles) of
+	 each open piece */
+	budget = memorybudget != (uint64_t) -1 ? memorybudget :
+	    mosaicpiecesize;
+	if (TIFFIsTiled(in)) {
+		uint32_t intilewidth, intilelength;
+
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &intilewidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &intilelength);
+		rowbyrow = hoverlap || voverlap ||
+		    (hnpieces > 1 && outwidth % intilewidth) ||
+		    (vnpieces > 1 && outlength % intilelength);
+	} else
+		rowbyrow = in_compression != COMPRESSION_NONE;
+
+	/* The band of the input and the pieces open across it must fit in
+	 the memory budget. libtiff holds a strip of each piece: write them
+	 in small strips, or else make them one after another, which decodes
+	 some tiles several times, or a stripped file once per column of
+	 pieces */
+	if (rowbyrow && budget && rowByRowMemory(in, &m) > budget) {
+		if (!output_JPEG_files && !m.outtilewidth && !m.rowsperstrip)
+			m.rowsperstrip = ROWS_PER_BAND;
+		if (rowByRowMemory(in, &m) > budget) {
+			m.rowsperstrip = outrowsperstrip;
+			rowbyrow = 0;
+		}
+		if (verbose)
+			fprintf(stderr, "File \"%s\": the pieces of a row of"
+				" pieces take more than the memory budget;"
+				" will %s.\n", infilename, rowbyrow ?
+				"write them in small strips" : "make the"
+				" pieces one after another");
+	}
+
+	/* Pieces written as multi-strip or tiled TIFF files are streamed
+	 band by band, so that their size is not tied to the memory */
+	if (!output_JPEG_files && (m.outtilewidth || m.rowsperstrip))
+		rowbyrow = 1;
+	/* Copied tiles need no buffer */
+	if (m.copyrawtiles)
+		rowbyrow = 0;
+
+	if (rowbyrow && !dryrun && budget &&
+	    rowByRowMemory(in, &m) > budget) {
+		TIFFError(infilename, "Error, writing the pieces band by band"
+			" needs %.3f MiB for a band of the input file and the"
+			" pieces open across it, more than the memory budget"
+			" of %.3f MiB (options -M and -b)",
+			rowByRowMemory(in, &m) / 1048576.0,
+			budget / 1048576.0);
+		TIFFClose(in);
+		return EXIT_INSUFFICIENT_MEMORY;
+	}
+
+	if (!rowbyrow && !dryrun && !m.copyrawtiles &&
+	    (outbuf = _TIFFmalloc(ouroutmemorysize)) == NULL) {
+		/* No room for a whole piece: stream the pieces instead, in
+		 strips small enough that libtiff does not need a buffer of
+		 the size of a piece either */
+		if (verbose)
+			fprintf(stderr, "File \"%s\": not enough memory to"
+				" hold a piece; will write pieces band by"
+				" band.\n", infilename);
+		rowbyrow = 1;
+		if (!m.outtilewidth && !m.rowsperstrip)
+			m.rowsperstrip = ROWS_PER_BAND;
+	}
+
+	if (verbose) {
+		fprintf(stderr, "File \"%s\": decided for "
+			UINT32_FORMAT " x " UINT32_FORMAT " = "
+			UINT32_FORMAT " pieces of " UINT32_FORMAT " x "
+			UINT32_FORMAT " with horiz. overlap of "
+			UINT32_FORMAT " and vert. overlap of "
+			UINT32_FORMAT " pixels that will each take at "
+			"most %.3f MiB of memory (" UINT64_FORMAT
+			" bytes) to open fully.\n",
+			infilename, hnpieces, vnpieces,
+			hnpieces * vnpieces, outwidth,
+			outlength, hoverlap, voverlap,
+			outmemorysize / 1048576.0, outmemorysize);
+	}
+
+	if ((paddinginx || paddinginy) && spp != numberpaddingvalues) {
+		fprintf(stderr, "File \"%s\": number of padding values"
+			" (%u) does not match number of samples per"
+			" pixel (%u).\n",
+			infilename, numberpaddingvalues, spp);
+		free(outbuf);
+		return EXIT_SYNTAX_ERROR;
+	}
+	if (numberbackgroundvalues && spp != numberbackgroundvalues) {
+		fprintf(stderr, "File \"%s\": number of background values"
+			" (%u) does not match number of samples per"
+			" pixel (%u).\n",
+			infilename, numberbackgroundvalues, spp);
+		free(outbuf);
+		return EXIT_SYNTAX_ERROR;
+	}
+
+	uint16_t bytesperpixel= (bitspersample + 7) / 8;
+	uint8_t paddingbytes[bytesperpixel * spp];
+	uint16_t s;
+	for (s = 0 ; (paddinginx || paddinginy) && s < spp ; s++) {
+		/* Here we should use sampleformat; instead, we assume 
+		  unsigned integer format uint8_t or uint16_t or... (rather 
+		  than e.g. int16 or float) */
+		switch (paddingvalues[s][0]) {
+			case 'M': {
+				uint16_t b;
+				for (b = 0 ; b < bytesperpixel ; b++)
+					paddingbytes[s * bytesperpixel + b]=
+					    0xff;
+				break;
+			}
+			default: {
+				unsigned long long u= strtoull(
+				    paddingvalues[s], NULL, 10);
+				uint16_t b, one = 1;
+				/* libtiff hands out and takes samples in the
+				byte order of the machine */
+				int littleendian = *(uint8_t *) &one;
+				for (b = 0 ; b < bytesperpixel ; b++) {
+					paddingbytes[s * bytesperpixel +
+					    (littleendian ? b :
+					    bytesperpixel - 1 - b)]=
+						u & 0xff;
+					u >>= 8;
+				}
 			}
-			if (error && !return_code) /* error code = 1st error */
-				return_code = error;
-		} /* for y */
-	} /* for x */
+                }
+        }
 
+	/*for (s = 0 ; s < spp ; s++) {
+		fprintf(stderr, "[sample %u] %s", s, paddingvalues[s]);
+		uint16_t b;
+		for (b = 0 ; b < bytesperpixel ; b++)
+			fprintf(stderr, " %d", paddingbytes[s * bytesperpixel + b]);
+		fprintf(stderr, "\n");
+	}*/
+
+	prefix = searchPrefixBeforeLastDot(infilename);
+
+	ndigitshtilenumber = searchNumberOfDigits(hnpieces);
+	ndigitsvtilenumber = searchNumberOfDigits(vnpieces);
+
+	m.prefix = prefix;
+	m.ndigitshtilenumber = ndigitshtilenumber;
+	m.ndigitsvtilenumber = ndigitsvtilenumber;
+	m.paddingbytes = paddingbytes;
+
+	if (numberbackgroundvalues &&
+	    (m.backgroundunits = classifyBackgroundUnits(in, spp,
+	    bitspersample)) == NULL) {
+		TIFFClose(in);
+		_TIFFfree(outbuf);
+		_TIFFfree(prefix);
+		return EXIT_INSUFFICIENT_MEMORY;
+	}
+
+	if (rowbyrow) {
+		if (dryrun)
+			reportPlan(in, &m, "row by row", 0,
+			    rowByRowMemory(in, &m), 0, 0);
+		else
+			return_code = makeMosaicRowByRow(in, &m);
+		if (m.backgroundunits != NULL && !dryrun && !return_code)
+			return_code = writeBackgroundManifest(in, &m);
+		TIFFClose(in);
+		_TIFFfree(m.backgroundunits);
+		_TIFFfree(prefix);
+		return return_code;
+	}
+
+	/* Make as many pieces at the same time as their buffers fit in the
+	 memory budget */
+	numberofthreads = number_of_threads;
+	if (budget && !m.copyrawtiles &&
+	    ouroutmemorysize * numberofthreads > budget) {
+		numberofthreads = budget / ouroutmemorysize;
+		if (numberofthreads < 1)
+			numberofthreads = 1;
+		if (verbose && number_of_threads > 1)
+			fprintf(stderr, "File \"%s\": will make %d pieces at"
+				" the same time to stay within the memory"
+				" budget of %.3f MiB.\n", infilename,
+				numberofthreads, budget / 1048576.0);
+	}
+
+	if (dryrun)
+		reportPlan(in, &m, m.copyrawtiles ? "raw tile copy" :
+		    "piece by piece", 1, numberofthreads * ((m.copyrawtiles ?
+		    0 : ouroutmemorysize) + unitSize(in)), 0, 0);
+	else
+		return_code = makeMosaicPieceByPiece(in, &m, outbuf,
+		    m.copyrawtiles ? 0 : ouroutmemorysize, numberofthreads);
+	if (m.backgroundunits != NULL && !dryrun && !return_code)
+		return_code = writeBackgroundManifest(in, &m);
+
+	TIFFClose(in);
 	_TIFFfree(outbuf);
+	_TIFFfree(m.backgroundunits);
 	_TIFFfree(prefix);
 	return return_code;
 }
@@ -1226,18 +3492,21 @@ usage()
 	fprintf(stderr, "tiffmakemosaic v" PACKAGE_VERSION " license GNU GPL v3 (c) 2012-2021 Christophe Deroulers\n\n");
 	fprintf(stderr, "Quote \"Deroulers et al., Diagnostic Pathology 2013, 8:92\" in your production\n       http://doi.org/10.1186/1746-1596-8-92\n\n");
 	fprintf(stderr, "Usage: tiffmakemosaic [options] file1.tif [file2.tif...]\n");
-	fprintf(stderr, " Produces a mosaic if needed, for each of the given files. A mosaic is a set of one-strip TIFF files of equal size, each of which has bounded size, which reproduce the original file if reassembled contiguously. Options:\n");
+	fprintf(stderr, " Produces a mosaic if needed, for each of the given files. A mosaic is a set of TIFF files (one strip each by default) of equal size, each of which has bounded size, which reproduce the original file if reassembled contiguously. Options:\n");
 	fprintf(stderr, " -v                verbose monitoring\n");
 	fprintf(stderr, " -y                dry run (do not write output file(s))\n");
 	fprintf(stderr, " -T                report TIFF errors/warnings on stderr (no dialog boxes)\n");
 	fprintf(stderr, " -M <size in MiB>  max. memory req. of each piece of the mosaic (default 1024);\n");
 	fprintf(stderr, "                   0 for no limit\n");
+	fprintf(stderr, " -t #              make pieces with # threads\n");
+	fprintf(stderr, " -b <size in MiB>  max. memory for all the pieces made at the same time\n");
+	fprintf(stderr, "                   (default: same as -M)\n");
 	fprintf(stderr, " -m [mw]x[mh]      width resp. height in pixels should be multiples of mw / mh\n");
 	fprintf(stderr, " -g [w]x[h]        width and height in pixels of each piece (overrides -M\n");
 	fprintf(stderr, "                   and/or -m if both width and height are given; 0 or no value\n");
-	fprintf(stderr, "                   for either dimension means default; default are largest\n");
-	fprintf(stderr, "                   dimensions that satisfy -M and/or -m, divide the full image\n");
-	fprintf(stderr, "                   in equal pieces by powers of 2, and are close to each other)\n");
+	fprintf(stderr, "                   for either dimension means default; default are dimensions\n");
+	fprintf(stderr, "                   that satisfy -M and/or -m and cut through the fewest tiles\n");
+	fprintf(stderr, "                   or strips of the input file with the fewest pieces)\n");
 	fprintf(stderr, " -O <overlap>[%%]   overlap of adjacent pieces in pixels [or percent] (default 0)\n");
 	fprintf(stderr, " -P[X][Y] #[,#...] pad image if necessary in direction x and/or y (default:\n");
 	fprintf(stderr, "                   both) to satisfy -M, -m or -g requirements (e.g. so that\n");
@@ -1246,6 +3515,20 @@ usage()
 	fprintf(stderr, "                   sample/pixel) or #,# (if 2 samples per pixels), and so on;\n");
 	fprintf(stderr, "                   M for # means maximum possible value (e.g. 255 for 8-bit)\n");
 	fprintf(stderr, " -j[#]             output JPEG files (with quality #, 0-100, default 75)\n");
+	fprintf(stderr, " --out-tile WxH    output tiled TIFF files with tiles of WxH pixels\n");
+	fprintf(stderr, " --out-strip #     output TIFF files with strips of # rows\n");
+	fprintf(stderr, "                   (with either option, pieces are written band by band)\n");
+	fprintf(stderr, " --copy-tiles      output tiled TIFF files with the tiles of the input file,\n");
+	fprintf(stderr, "                   copied without decoding if pieces lie on its grid of tiles\n");
+	fprintf(stderr, " --dzi #           make a Deep Zoom pyramid (file.dzi and directory\n");
+	fprintf(stderr, "                   file_files) of JPEG tiles of #x# pixels, with overlap -O\n");
+	fprintf(stderr, " --skip-background #[,#...]\n");
+	fprintf(stderr, "                   don't write pieces made only of pixels of this colour (one\n");
+	fprintf(stderr, "                   value per sample, M for maximum, as for -P); they are\n");
+	fprintf(stderr, "                   listed in file_background.txt\n");
+	fprintf(stderr, " --background-tolerance #\n");
+	fprintf(stderr, "                   max. difference of samples from this colour (default 8)\n");
+	fprintf(stderr, " -B                output BigTIFF files\n");
 	fprintf(stderr, " -c none[:opts]    output TIFF files with no compression \n");
 	fprintf(stderr, " -c x[:opts]       output TIFF compressed with encoding x (jpeg, lzw, zip, ...)\n");
 	fprintf(stderr, "Default output is TIFF with same compression as input.\n\n");
@@ -1410,38 +3693,41 @@ processPieceGeometryOptions(char* cp, uint32_t* width, uint32_t* length)
 }
 
 
+	/* Store the sample values (numbers, or M for the maximum) given in
+	 cp, separated by commas, for option */
 static int
-processPaddingValuesOption(char * cp)
+processSampleValuesOption(char * cp, const char * option,
+	uint16_t * numbervalues, char *** values)
 {
 	char * cp2 = cp;
 
 	/* first pass to count the values */
-	numberpaddingvalues= 0;
+	*numbervalues= 0;
 	while (*cp == ' ')
 		cp++;
 	if (*cp != 'M' && (*cp < '0' || *cp > '9')) {
-		fprintf(stderr, "Incorrect padding value(s) argument to"
-		    " option -p: %s\n", cp);
+		fprintf(stderr, "Incorrect value(s) argument to"
+		    " option %s: %s\n", option, cp);
 		return 0;
 	}
-	numberpaddingvalues= 1;
+	*numbervalues= 1;
 	while (*cp != 0) {
 		if (*cp == ',') {
-			(numberpaddingvalues)++;
-			if (numberpaddingvalues == 0) /* overflow */
+			(*numbervalues)++;
+			if (*numbervalues == 0) /* overflow */
 				return 0;
 		}
 		cp++;
 	}
 
-	if ((paddingvalues =
-	    _TIFFmalloc(numberpaddingvalues * sizeof(*paddingvalues))) == NULL) {
-		perror("Insufficient memory for padding values ");
+	if ((*values =
+	    _TIFFmalloc(*numbervalues * sizeof(**values))) == NULL) {
+		perror("Insufficient memory for sample values ");
 		exit(EXIT_INSUFFICIENT_MEMORY);
 	}
 
 	/* second pass to store the values */
-	numberpaddingvalues= 0;
+	*numbervalues= 0;
 	cp = cp2;
 	while (*cp != 0) {
 		while (*cp == ' ')
@@ -1452,19 +3738,19 @@ processPaddingValuesOption(char * cp)
 		        default:
 		                strtoull(cp, &cp, 10);
                 		if (errno) {
-					fprintf(stderr, "Incorrect padding value in argument to option -p:"
-					    "%s\n", cp);
+					fprintf(stderr, "Incorrect value in argument to option %s:"
+					    "%s\n", option, cp);
                 			return 0;
                 		}
                 }
-		paddingvalues[numberpaddingvalues] = cp2;
-		numberpaddingvalues++;
+		(*values)[*numbervalues] = cp2;
+		(*numbervalues)++;
 		while (*cp != 0 && *cp == ' ')
 			cp++;
 		if (*cp != 0) {
 			if (*cp != ',') {
-				fprintf(stderr, "Unexpected char after padding value in argument to option -p:"
-				    "%s\n", cp);
+				fprintf(stderr, "Unexpected char after value in argument to option %s:"
+				    "%s\n", option, cp);
 				return 0;
 			}
 			cp++;
@@ -1502,7 +3788,105 @@ int main(int argc, char * argv[])
 
 	while (arg < argc && argv[arg][0] == '-') {
 
-		if (argv[arg][1] == 'v')
+		if (strcmp(argv[arg], "--out-tile") == 0) {
+			char * end;
+			unsigned long w = 0, l = 0;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --out-tile "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			w = strtoul(argv[arg+1], &end, 10);
+			if (*end == 'x')
+				l = strtoul(end+1, &end, 10);
+			if (*end != 0 || w == 0 || l == 0 || w % 16 != 0 ||
+			    l % 16 != 0 || w > UINT32_MAX || l > UINT32_MAX) {
+				fprintf(stderr, "Expected tile dimensions "
+					"WxH, multiples of 16, after "
+					"--out-tile, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			outtilewidth = w;
+			outtilelength = l;
+			arg++;
+		} else if (strcmp(argv[arg], "--out-strip") == 0) {
+			char * end;
+			unsigned long r;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --out-strip "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			r = strtoul(argv[arg+1], &end, 10);
+			if (*end != 0 || end == argv[arg+1] || r == 0 ||
+			    r > UINT32_MAX) {
+				fprintf(stderr, "Expected a number of rows "
+					"after --out-strip, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			outrowsperstrip = r;
+			arg++;
+		} else if (strcmp(argv[arg], "--dzi") == 0) {
+			char * end;
+			unsigned long u;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --dzi "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			u = strtoul(argv[arg+1], &end, 10);
+			if (*end != 0 || end == argv[arg+1] || u == 0 ||
+			    u >= JPEG_MAX_DIMENSION / 2) {
+				fprintf(stderr, "Expected a tile size in "
+					"pixels after --dzi, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			dzitilesize = u;
+			arg++;
+		} else if (strcmp(argv[arg], "--skip-background") == 0) {
+			if (arg+1 >= argc ||
+			    !processSampleValuesOption(argv[arg+1],
+			    "--skip-background", &numberbackgroundvalues,
+			    &backgroundvalues)) {
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			arg++;
+		} else if (strcmp(argv[arg], "--background-tolerance") == 0) {
+			char * end;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option --background-tolerance "
+					"requires an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			backgroundtolerance = strtoull(argv[arg+1], &end, 10);
+			if (*end != 0 || end == argv[arg+1]) {
+				fprintf(stderr, "Expected a number after "
+					"--background-tolerance, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			arg++;
+		} else if (strcmp(argv[arg], "--copy-tiles") == 0)
+			copy_tiles = 1;
+		else if (argv[arg][1] == 'B')
+			big_tiff = 1;
+		else if (argv[arg][1] == 'v')
 			verbose = 1;
 		else if (argv[arg][1] == 'y')
 			dryrun++;
@@ -1547,6 +3931,51 @@ int main(int argc, char * argv[])
 						    1048576.0);
 			} else
 				mosaicpiecesize = newmosaicpiecesize;
+		} else if (argv[arg][1] == 'b') {
+			long double ld;
+
+			if (arg+1 >= argc) {
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+
+			arg++;
+			ld= strtold(argv[arg], NULL);
+
+			if (errno || !isfinite(ld) || ld < 0 ||
+			    ld * 1048576 >= 18446744073709551615.0L) {
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			memorybudget = (uint64_t) floorl(ld * 1048576);
+		} else if (argv[arg][1] == 't') {
+			long n;
+			char * end;
+
+			if (arg+1 >= argc) {
+				fprintf(stderr, "Option -t requires "
+					"an argument.\n");
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+			n = strtol(argv[arg+1], &end, 10);
+			if (*end != 0 || end == argv[arg+1] || n < 1 ||
+			    n > 4096) {
+				fprintf(stderr, "Expected a positive number "
+					"of threads after -t, got \"%s\"\n",
+					argv[arg+1]);
+				usage();
+				return EXIT_SYNTAX_ERROR;
+			}
+#ifdef _OPENMP
+			number_of_threads = n;
+#else
+			if (n > 1)
+				fprintf(stderr, "Warning: tiffmakemosaic was "
+					"compiled without OpenMP support, "
+					"option -t ignored.\n");
+#endif
+			arg++;
 		} else if (argv[arg][1] == 'm') {
 			if (arg+1 >= argc ||
 			    !processPieceGeometryOptions(argv[arg+1],
@@ -1579,7 +4008,7 @@ int main(int argc, char * argv[])
 					case 'X':
 						paddinginx= -1; break;
 					case 'Y':
-						paddinginx= -1; break;
+						paddinginy= -1; break;
 					default:
 						fprintf(stderr, "Expected x or y for direction of padding after -p, got \"%s\"\n",
 						    &(argv[arg][2]));
@@ -1594,7 +4023,8 @@ int main(int argc, char * argv[])
 			}
 
 			if (arg+1 >= argc ||
-			    !processPaddingValuesOption(argv[arg+1])) {
+			    !processSampleValuesOption(argv[arg+1], "-P",
+			    &numberpaddingvalues, &paddingvalues)) {
 				usage();
 				return EXIT_SYNTAX_ERROR;
 			}
@@ -1666,6 +4096,26 @@ int main(int argc, char * argv[])
 		usage();
 		return EXIT_SYNTAX_ERROR;
 	}
+	if ((outtilewidth || copy_tiles) && outrowsperstrip) {
+		fprintf(stderr, "Options --out-tile or --copy-tiles and "
+			"--out-strip are mutually exclusive. Aborting.\n");
+		return EXIT_SYNTAX_ERROR;
+	}
+	if (dzitilesize && (outtilewidth || copy_tiles || outrowsperstrip ||
+	    defcompression != (uint16_t) -1)) {
+		fprintf(stderr, "Option --dzi writes JPEG tiles and can't be "
+			"used with -c, --out-tile, --out-strip or "
+			"--copy-tiles. Aborting.\n");
+		return EXIT_SYNTAX_ERROR;
+	}
+	if (dzitilesize && numberbackgroundvalues) {
+		fprintf(stderr, "Option --skip-background can't be used with "
+			"--dzi (Deep Zoom viewers need all the tiles). "
+			"Aborting.\n");
+		return EXIT_SYNTAX_ERROR;
+	}
+	if (dzitilesize)
+		output_JPEG_files = 1;
 
 	if (verbose) {
 		if (dryrun)
@@ -1681,12 +4131,15 @@ int main(int argc, char * argv[])
 			fprintf(stderr, "No memory requirement limit "
 				"on produced pieces.\n");
 	}
+	selectFillKernels();
 
 	for (; arg < argc ; arg++) {
 		int r= makeMosaicFromTIFFFile(argv[arg]);
 		if (r && !errorcode) /* Code indicates 1st error */
 			errorcode = r;
 	}
+	if (dryrun)
+		printf(reportedfiles ? "\n]\n" : "[]\n");
 
 	return errorcode;
 }
@@ -14,8 +14,25 @@
 #include <stdio.h>
 #include <stdlib.h> /* exit */
 #include <string.h>
+#include <errno.h>
 #include <tiff.h>
 #include <tiffio.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h> /* mkdir */
+#if defined(__linux__)
+# define HAVE_LINUX_FILE_RANGE_COPY
+# include <unistd.h> /* pread, pwrite */
+# include <sys/sendfile.h>
+# include <sys/syscall.h> /* SYS_copy_file_range */
+#endif
+#ifdef _WIN32
+# include <direct.h>
+# define mkdir(path, mode) _mkdir(path)
+# define fseeko _fseeki64
+#endif
 
 #include "config.h"
 
@@ -24,6 +41,10 @@
 #define EXIT_UNHANDLED_FILE_TYPE 3
 #define EXIT_INSUFFICIENT_MEMORY 4
 
+#define PACK_MAGIC "LTTPACK1"
+#define PACK_HEADER_SIZE 64
+#define PACK_INDEX_ENTRY_SIZE 16
+
 #define CopyField(tag, v) \
     if (TIFFGetField(in, tag, &v)) TIFFSetField(out, tag, v)
 #define CopyField2(tag, v1, v2) \
@@ -139,6 +160,738 @@ static void copyOtherFields(TIFF* in, TIFF* out)
 }
 
 
+/* What is common to all the tiles of the file being split */
+struct tilesplit
+{
+  const char * prefix; /* of the names of the output files */
+  uint32_t imagewidth, imagelength, tilewidth, tilelength;
+  uint16_t compression;
+  int ndigitshoriz, ndigitsvert; /* of the tile numbers */
+  int outputtiled;
+  const char * packpath; /* NULL: one file per tile */
+  const uint64_t * packoffsets; /* of each tile in the pack */
+  unsigned char * jpegheader; /* NULL: TIFF files */
+  size_t jpegheadersize;
+  const char * dzilevelpath; /* NULL: not a level of a Deep Zoom tree */
+};
+
+
+/* Copy the compressed tile of in at (x, y) into its own file, using
+   buf, of bufsize bytes, to hold it. Only in and buf are modified, so
+   that threads with their own handle and buffer can copy tiles at the
+   same time. */
+static int
+splitTile(TIFF* in, const struct tilesplit * s, uint32_t x, uint32_t y,
+          tdata_t buf, tsize_t bufsize)
+{
+  char * outpath;
+  TIFF * out;
+  uint32_t tilenumber= TIFFComputeTile(in, x, y, 0, 0);
+  tsize_t rawsize;
+
+  rawsize= TIFFReadRawTile(in, tilenumber, buf, bufsize);
+  if (rawsize == -1)
+    {
+    TIFFError(TIFFFileName(in), "Error while reading tile #%u", tilenumber);
+    return EXIT_IO_ERROR;
+    }
+
+  my_asprintf(&outpath, "%s_t_i%0*uj%0*u.tif", s->prefix,
+              s->ndigitshoriz, x/s->tilewidth+1,
+              s->ndigitsvert, y/s->tilelength+1);
+  out = TIFFOpen(outpath, "w");
+  if (out == NULL)
+    {
+    TIFFError(outpath, "Error while creating output file");
+    _TIFFfree(outpath);
+    return EXIT_IO_ERROR;
+    }
+  _TIFFfree(outpath);
+
+  TIFFSetField(out, TIFFTAG_IMAGEWIDTH, s->tilewidth);
+  TIFFSetField(out, TIFFTAG_IMAGELENGTH, s->tilelength);
+  TIFFSetField(out, TIFFTAG_COMPRESSION, s->compression);
+  if (s->outputtiled)
+    {
+    TIFFSetField(out, TIFFTAG_TILEWIDTH, s->tilewidth);
+    TIFFSetField(out, TIFFTAG_TILELENGTH, s->tilelength);
+    }
+  if (s->compression == COMPRESSION_JPEG)
+    {
+    uint32_t count = 0;
+    void *table = NULL;
+    uint16_t subsamplinghor, subsamplingver;
+    if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &count, &table)
+        && count > 0 && table)
+      TIFFSetField(out, TIFFTAG_JPEGTABLES, count, table);
+    //TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+    CopyField2(TIFFTAG_YCBCRSUBSAMPLING, subsamplinghor,
+               subsamplingver);
+    }
+  copyOtherFields(in, out);
+
+  if ((s->outputtiled && TIFFWriteRawTile(out, 0, buf, rawsize) == -1) ||
+      (!s->outputtiled && TIFFWriteRawStrip(out, 0, buf, rawsize) == -1))
+    {
+    TIFFError(TIFFFileName(out), "Error while writing tile #%u", tilenumber);
+    TIFFClose(out);
+    return EXIT_IO_ERROR;
+    }
+
+  TIFFClose(out);
+  return 0;
+}
+
+
+/* Pack (option -p): all the compressed tiles in a single file, after
+   a header and an index giving the position and size of each tile, so
+   that a tile is found without reading the others. Integers are
+   little-endian. Header (PACK_HEADER_SIZE bytes):
+     0 magic PACK_MAGIC (8 bytes)
+     8 image width, image length, tile width, tile length, number of
+       tiles across, number of tiles down (32 bits each)
+    32 compression, photometric interpretation, bits per sample,
+       samples per pixel (16 bits each, TIFF codes)
+    40 offset of the JPEG tables of the file (64 bits, 0 if none)
+    48 size of the JPEG tables (32 bits), then 0 (32 bits)
+    56 offset of the index (64 bits)
+   The index has one entry per tile, row by row: offset and size of the
+   tile (64 bits each). Tiles follow, in the same order. */
+static void putLittleEndian(unsigned char * p, uint64_t v, int nbytes)
+{
+  int i;
+  for (i = 0; i < nbytes; i++, v >>= 8)
+    p[i]= v & 0xff;
+}
+
+
+/* Write the header and the index of the pack of the tiles of in, whose
+   compressed sizes are bytecounts, and compute the offsets of the
+   tiles */
+static int
+writePackHeader(TIFF* in, const struct tilesplit * s,
+                const uint64_t * bytecounts, uint64_t * offsets)
+{
+  unsigned char header[PACK_HEADER_SIZE], entry[PACK_INDEX_ENTRY_SIZE];
+  uint32_t tilesacross= (s->imagewidth+s->tilewidth-1)/s->tilewidth;
+  uint32_t tilesdown= (s->imagelength+s->tilelength-1)/s->tilelength;
+  uint32_t tablessize= 0, k, n= TIFFNumberOfTiles(in);
+  uint16_t photometric= 0, bitspersample, samplesperpixel;
+  void * tables= NULL;
+  uint64_t indexoffset, offset;
+  FILE * out;
+
+  if (s->compression == COMPRESSION_JPEG &&
+      !TIFFGetField(in, TIFFTAG_JPEGTABLES, &tablessize, &tables))
+    tablessize= 0;
+  TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric);
+  TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+  TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel);
+  indexoffset= PACK_HEADER_SIZE + tablessize;
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, PACK_MAGIC, 8);
+  putLittleEndian(header+8, s->imagewidth, 4);
+  putLittleEndian(header+12, s->imagelength, 4);
+  putLittleEndian(header+16, s->tilewidth, 4);
+  putLittleEndian(header+20, s->tilelength, 4);
+  putLittleEndian(header+24, tilesacross, 4);
+  putLittleEndian(header+28, tilesdown, 4);
+  putLittleEndian(header+32, s->compression, 2);
+  putLittleEndian(header+34, photometric, 2);
+  putLittleEndian(header+36, bitspersample, 2);
+  putLittleEndian(header+38, samplesperpixel, 2);
+  putLittleEndian(header+40, tablessize ? PACK_HEADER_SIZE : 0, 8);
+  putLittleEndian(header+48, tablessize, 4);
+  putLittleEndian(header+56, indexoffset, 8);
+
+  if ((out = fopen(s->packpath, "wb")) == NULL)
+    {
+    TIFFError(s->packpath, "Error while creating output file");
+    return EXIT_IO_ERROR;
+    }
+  fwrite(header, 1, sizeof(header), out);
+  if (tablessize)
+    fwrite(tables, 1, tablessize, out);
+  offset= indexoffset + (uint64_t) n * PACK_INDEX_ENTRY_SIZE;
+  for (k = 0; k < n; k++)
+    {
+    offsets[k]= offset;
+    putLittleEndian(entry, offset, 8);
+    putLittleEndian(entry+8, bytecounts[k], 8);
+    fwrite(entry, 1, sizeof(entry), out);
+    offset+= bytecounts[k];
+    }
+  if (ferror(out) | fclose(out))
+    {
+    TIFFError(s->packpath, "Error while writing the index");
+    return EXIT_IO_ERROR;
+    }
+  return 0;
+}
+
+
+#ifdef HAVE_LINUX_FILE_RANGE_COPY
+/* Position and size in the file of the compressed tile number k of
+   in. Return 0 if they are unknown. */
+static int
+rawTileRange(TIFF* in, uint32_t k, uint64_t * offset, uint64_t * size)
+{
+  uint64_t * offsets, * bytecounts;
+
+  if (k >= TIFFNumberOfTiles(in) ||
+      !TIFFGetField(in, TIFFTAG_TILEOFFSETS, &offsets) ||
+      !TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts))
+    return 0;
+  *offset= offsets[k];
+  *size= bytecounts[k];
+  return 1;
+}
+
+
+/* Copy size bytes of infd at inoffset to outfd at outoffset without
+   passing them through user memory if possible: copy_file_range lets
+   the kernel (or the file system, by sharing extents) copy them; if it
+   can't between these files, sendfile copies them within the kernel;
+   if this fails too, they are copied through buf, of bufsize bytes,
+   with pread and pwrite. Only offsets given explicitly are used, so
+   that threads may share infd. Return 0 on success, 1 if infd ends
+   before size bytes are copied, -1 on error (errno tells which). */
+static int
+copyFileRange(int infd, uint64_t inoffset, int outfd, uint64_t outoffset,
+              uint64_t size, tdata_t buf, tsize_t bufsize)
+{
+  ssize_t n= 0;
+
+#ifdef SYS_copy_file_range
+  {
+  loff_t inoff= inoffset, outoff= outoffset;
+
+  while (size > 0 &&
+         (n = syscall(SYS_copy_file_range, infd, &inoff, outfd, &outoff,
+                      (size_t) size, 0)) > 0)
+    {
+    size-= n;
+    inoffset+= n;
+    outoffset+= n;
+    }
+  if (size == 0)
+    return 0;
+  if (n == 0)
+    return 1;
+  if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+      errno != EOPNOTSUPP && errno != EBADF)
+    return -1;
+  }
+#endif
+
+  /* sendfile writes at the current position of outfd */
+  if (lseek(outfd, outoffset, SEEK_SET) != (off_t) -1)
+    {
+    off_t inoff= inoffset;
+
+    while (size > 0 &&
+           (n = sendfile(outfd, infd, &inoff,
+                         size < 0x40000000 ? (size_t) size : 0x40000000)) > 0)
+      {
+      size-= n;
+      inoffset+= n;
+      outoffset+= n;
+      }
+    if (size == 0)
+      return 0;
+    if (n == 0)
+      return 1;
+    if (errno != ENOSYS && errno != EINVAL)
+      return -1;
+    }
+
+  while (size > 0)
+    {
+    n= pread(infd, buf, size < (uint64_t) bufsize ? (size_t) size : (size_t) bufsize,
+             inoffset);
+    if (n == 0)
+      return 1;
+    if (n < 0 || (n = pwrite(outfd, buf, n, outoffset)) < 0)
+      return -1;
+    size-= n;
+    inoffset+= n;
+    outoffset+= n;
+    }
+  return 0;
+}
+#endif
+
+
+/* Copy the compressed tile number k of in to its place in the pack,
+   open as out, using buf, of bufsize bytes, to hold it. As for
+   splitTile, only in, out and buf are modified. */
+static int
+packTile(TIFF* in, FILE * out, const struct tilesplit * s, uint32_t k,
+         tdata_t buf, tsize_t bufsize)
+{
+  tsize_t rawsize;
+
+#ifdef HAVE_LINUX_FILE_RANGE_COPY
+  {
+  uint64_t offset, size;
+
+  /* The pack is only written to through its descriptor */
+  if (rawTileRange(in, k, &offset, &size))
+    {
+    int r= copyFileRange(TIFFFileno(in), offset, fileno(out),
+                         s->packoffsets[k], size, buf, bufsize);
+
+    if (r != 0)
+      {
+      TIFFError(s->packpath, "Error while copying tile #%u: %s", k,
+                r < 0 ? strerror(errno) : "unexpected end of file");
+      return EXIT_IO_ERROR;
+      }
+    return 0;
+    }
+  }
+#endif
+  rawsize= TIFFReadRawTile(in, k, buf, bufsize);
+  if (rawsize == -1)
+    {
+    TIFFError(TIFFFileName(in), "Error while reading tile #%u", k);
+    return EXIT_IO_ERROR;
+    }
+  if (fseeko(out, s->packoffsets[k], SEEK_SET) != 0 ||
+      fwrite(buf, 1, rawsize, out) != (size_t) rawsize)
+    {
+    TIFFError(s->packpath, "Error while writing tile #%u", k);
+    return EXIT_IO_ERROR;
+    }
+  return 0;
+}
+
+
+/* JPEG files (option -j): the JPEG-compressed tiles of TIFF files are
+   abbreviated JPEG streams, whose quantisation and Huffman tables are
+   stored once for all in the JPEGTABLES tag. A standalone JPEG file is
+   made of the tile with the tables inserted after its start of image
+   marker, and a marker telling decoders the colour space of the
+   tile: JFIF for YCbCr and greyscale, Adobe (no transform) for RGB. */
+static const unsigned char jfifmarker[] =
+  { 0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00,
+    0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+static const unsigned char adobemarker[] =
+  { 0xff, 0xee, 0x00, 0x0e, 'A', 'd', 'o', 'b', 'e', 0x00, 0x64, 0x00,
+    0x00, 0x00, 0x00, 0x00 };
+
+
+/* Make the beginning of the JPEG files of the tiles of in, up to their
+   first marker after the start of image */
+static int
+makeJPEGHeader(TIFF* in, unsigned char ** header, size_t * headersize)
+{
+  uint32_t tablessize= 0;
+  unsigned char * tables= NULL;
+  uint16_t photometric= PHOTOMETRIC_YCBCR;
+  const unsigned char * marker;
+  size_t markersize;
+
+  TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric);
+  if (photometric == PHOTOMETRIC_YCBCR || photometric == PHOTOMETRIC_MINISBLACK)
+    {
+    marker= jfifmarker;
+    markersize= sizeof(jfifmarker);
+    }
+  else
+    {
+    marker= adobemarker;
+    markersize= sizeof(adobemarker);
+    }
+
+  /* The tables are a stream of their own: strip its start and end of
+    image markers */
+  if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &tablessize, &tables) &&
+      tablessize >= 4)
+    {
+    if (tables[0] != 0xff || tables[1] != 0xd8 ||
+        tables[tablessize-2] != 0xff || tables[tablessize-1] != 0xd9)
+      {
+      TIFFError(TIFFFileName(in), "Unexpected content of the JPEGTABLES tag");
+      return EXIT_UNHANDLED_FILE_TYPE;
+      }
+    tables+= 2;
+    tablessize-= 4;
+    }
+  else
+    tablessize= 0;
+
+  *headersize= 2 + markersize + tablessize;
+  if ((*header = _TIFFmalloc(*headersize)) == NULL)
+    {
+    TIFFError(TIFFFileName(in), "Error: insufficient memory");
+    return EXIT_INSUFFICIENT_MEMORY;
+    }
+  (*header)[0]= 0xff;
+  (*header)[1]= 0xd8;
+  memcpy(*header + 2, marker, markersize);
+  if (tablessize)
+    memcpy(*header + 2 + markersize, tables, tablessize);
+  return 0;
+}
+
+
+/* Write the compressed tile of in at (x, y) as a JPEG file, using buf,
+   of bufsize bytes, to hold it. As for splitTile, only in and buf are
+   modified. */
+static int
+writeJPEGTile(TIFF* in, const struct tilesplit * s, uint32_t x, uint32_t y,
+              tdata_t buf, tsize_t bufsize)
+{
+  char * outpath;
+  FILE * out;
+  uint32_t tilenumber= TIFFComputeTile(in, x, y, 0, 0);
+  unsigned char * tile= buf;
+  tsize_t rawsize;
+  int error= 0;
+#ifdef HAVE_LINUX_FILE_RANGE_COPY
+  uint64_t offset= 0, size= 0;
+  /* Only the start of image marker is read: the rest of the tile is
+    copied from file to file */
+  int copyrange= rawTileRange(in, tilenumber, &offset, &size);
+
+  if (copyrange)
+    rawsize= size < 4 ? (tsize_t) size :
+      pread(TIFFFileno(in), buf, 2, offset) == 2 ? (tsize_t) size : -1;
+  else
+#endif
+  rawsize= TIFFReadRawTile(in, tilenumber, buf, bufsize);
+  if (rawsize == -1)
+    {
+    TIFFError(TIFFFileName(in), "Error while reading tile #%u", tilenumber);
+    return EXIT_IO_ERROR;
+    }
+  if (rawsize < 4 || tile[0] != 0xff || tile[1] != 0xd8)
+    {
+    TIFFError(TIFFFileName(in), "Tile #%u is not a JPEG stream", tilenumber);
+    return EXIT_UNHANDLED_FILE_TYPE;
+    }
+
+  if (s->dzilevelpath != NULL)
+    my_asprintf(&outpath, "%s/%u_%u.jpg", s->dzilevelpath,
+                x/s->tilewidth, y/s->tilelength);
+  else
+    my_asprintf(&outpath, "%s_t_i%0*uj%0*u.jpg", s->prefix,
+                s->ndigitshoriz, x/s->tilewidth+1,
+                s->ndigitsvert, y/s->tilelength+1);
+  if ((out = fopen(outpath, "wb")) == NULL)
+    {
+    TIFFError(outpath, "Error while creating output file");
+    _TIFFfree(outpath);
+    return EXIT_IO_ERROR;
+    }
+  if (fwrite(s->jpegheader, 1, s->jpegheadersize, out) != s->jpegheadersize)
+    error= EXIT_IO_ERROR;
+#ifdef HAVE_LINUX_FILE_RANGE_COPY
+  else if (copyrange)
+    {
+    if (fflush(out) != 0 ||
+        copyFileRange(TIFFFileno(in), offset + 2, fileno(out),
+                      s->jpegheadersize, size - 2, buf, bufsize) != 0)
+      error= EXIT_IO_ERROR;
+    }
+#endif
+  else if (fwrite(tile + 2, 1, rawsize - 2, out) != (size_t) (rawsize - 2))
+    error= EXIT_IO_ERROR;
+  if (fclose(out) != 0)
+    error= EXIT_IO_ERROR;
+  if (error)
+    TIFFError(outpath, "Error while writing tile #%u", tilenumber);
+  _TIFFfree(outpath);
+  return error;
+}
+
+
+/* Size of a buffer holding any raw tile of the current directory of
+   in: compressed tiles may be larger than decoded ones */
+static tsize_t largestRawTileSize(TIFF* in)
+{
+  tsize_t size= TIFFTileSize(in);
+  uint64_t * bytecounts;
+  uint32_t k, n= TIFFNumberOfTiles(in);
+
+  if (TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts))
+    for (k = 0; k < n; k++)
+      if (bytecounts[k] > (uint64_t) size)
+        size= bytecounts[k];
+  return size;
+}
+
+
+/* Copy the tiles of the current directory of in, as set in s, with
+   as many threads as OpenMP gives. Each thread reads the file through
+   its own handle (the first one through in) into its own buffer of
+   bufsize bytes (the first one into buf): libtiff handles can't be
+   shared between threads. An error on a tile is reported and the other
+   tiles are still copied. */
+static int
+splitTiles(TIFF* in, const struct tilesplit * s, tdata_t buf, tsize_t bufsize)
+{
+  int64_t numberoftiles= TIFFNumberOfTiles(in);
+  int64_t tilesacross= (s->imagewidth+s->tilewidth-1)/s->tilewidth;
+  int return_code= 0;
+
+#pragma omp parallel if (numberoftiles > 1)
+  {
+  TIFF* tin = in;
+  tdata_t tbuf = buf;
+  FILE * pack = NULL;
+  int ready = 1;
+  int64_t k;
+
+#ifdef _OPENMP
+  if (omp_get_thread_num() != 0)
+    {
+    int e= 0;
+
+    tbuf = NULL;
+    if ((tin = TIFFOpen(TIFFFileName(in), "r")) == NULL ||
+        !TIFFSetDirectory(tin, TIFFCurrentDirectory(in)))
+      e= EXIT_IO_ERROR;
+    else if ((tbuf = _TIFFmalloc(bufsize)) == NULL)
+      e= EXIT_INSUFFICIENT_MEMORY;
+    if (e)
+      {
+      ready = 0;
+      #pragma omp critical (split_error)
+      if (!return_code)
+        return_code= e;
+      }
+    }
+#endif
+  /* Each thread writes the tiles at their place in the pack through
+    its own stream */
+  if (ready && s->packpath != NULL && (pack = fopen(s->packpath, "r+b")) == NULL)
+    {
+    TIFFError(s->packpath, "Error while opening output file");
+    ready = 0;
+    #pragma omp critical (split_error)
+    if (!return_code)
+      return_code= EXIT_IO_ERROR;
+    }
+
+  #pragma omp for schedule(dynamic)
+  for (k = 0; k < numberoftiles; k++)
+    {
+    uint32_t x= (k % tilesacross) * s->tilewidth;
+    uint32_t y= (k / tilesacross) * s->tilelength;
+    int e;
+
+    if (!ready)
+      continue;
+    if (x == 0)
+      fprintf(stderr, "Dealing with line " UINT32_FORMAT "/" UINT32_FORMAT
+              " y=" UINT32_FORMAT " -> outputimageslength=" UINT32_FORMAT
+              "\n",
+              (y/s->tilelength)+1, s->imagelength/s->tilelength, y,
+              s->tilelength);
+    if (pack != NULL)
+      e= packTile(tin, pack, s, k, tbuf, bufsize);
+    else if (s->jpegheader != NULL)
+      e= writeJPEGTile(tin, s, x, y, tbuf, bufsize);
+    else
+      e= splitTile(tin, s, x, y, tbuf, bufsize);
+    if (e)
+      {
+      #pragma omp critical (split_error)
+      if (!return_code) /* error code = 1st error */
+        return_code= e;
+      }
+    }
+
+  if (pack != NULL && fclose(pack) != 0)
+    {
+    TIFFError(s->packpath, "Error while writing tiles");
+    #pragma omp critical (split_error)
+    if (!return_code)
+      return_code= EXIT_IO_ERROR;
+    }
+  if (tbuf != buf)
+    _TIFFfree(tbuf);
+  if (tin != NULL && tin != in)
+    TIFFClose(tin);
+  }
+
+  return return_code;
+}
+
+
+static int makeDirectory(const char * path)
+{
+  if (mkdir(path, 0777) == 0 || errno == EEXIST)
+    return 0;
+  TIFFError(path, "Error, can't create directory: %s", strerror(errno));
+  return EXIT_IO_ERROR;
+}
+
+
+/* Deep Zoom tree (option -z): whole-slide images store their pyramid
+   as extra directories with the same tiles, each level about half as
+   large as the previous one. The JPEG tiles of every level are written
+   without decoding as prefix_files/<level>/<column>_<row>.jpg, and the
+   image is described by prefix.dzi. A Deep Zoom level is made of whole
+   tiles except on its right and bottom sides, whereas all the tiles of
+   a TIFF file are whole: the size given in the description is that of
+   the first directory rounded up so that every level exported is made
+   of whole tiles. Levels missing from the file are not made. */
+#define DZI_MAX_SCALES 32
+
+static int exportDeepZoom(TIFF* in, const char * prefix)
+{
+  int directoryofscale[DZI_MAX_SCALES]; /* -1: no directory */
+  uint32_t width0, length0, tilesize, tilelength, d, k, maxscale= 0;
+  uint32_t maxlevel;
+  uint64_t unit, width, length;
+  tdir_t ndirectories= TIFFNumberOfDirectories(in);
+  char * name;
+  FILE * dzi;
+  int return_code= 0;
+
+  TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width0);
+  TIFFGetField(in, TIFFTAG_IMAGELENGTH, &length0);
+  TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilesize);
+  TIFFGetField(in, TIFFTAG_TILELENGTH, &tilelength);
+  if (tilelength != tilesize)
+    {
+    TIFFError(TIFFFileName(in), "Provided file has tiles of " UINT32_FORMAT "x" UINT32_FORMAT " pixels -- Deep Zoom tiles must be square", tilesize, tilelength);
+    return EXIT_UNHANDLED_FILE_TYPE;
+    }
+
+  /* Each directory with the same tiles and the dimensions of the first
+    one divided by a power of 2 (rounded either way) is a level */
+  for (k = 0; k < DZI_MAX_SCALES; k++)
+    directoryofscale[k]= -1;
+  for (d = 0; d < ndirectories; d++)
+    {
+    uint32_t w= 0, l= 0, tw= 0, tl= 0;
+    uint16_t compression= 0, planarconfig= 0;
+
+    if (!TIFFSetDirectory(in, d))
+      {
+      TIFFError(TIFFFileName(in), "Error while reading directory %u", d);
+      return EXIT_IO_ERROR;
+      }
+    TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(in, TIFFTAG_IMAGELENGTH, &l);
+    TIFFGetField(in, TIFFTAG_TILEWIDTH, &tw);
+    TIFFGetField(in, TIFFTAG_TILELENGTH, &tl);
+    TIFFGetField(in, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG, &planarconfig);
+    for (k = 0; k < DZI_MAX_SCALES; k++)
+      if (w >= (width0 >> k) && w <= ((uint64_t) width0 + (1u << k) - 1) >> k &&
+          l >= (length0 >> k) && l <= ((uint64_t) length0 + (1u << k) - 1) >> k)
+        break;
+    if (!TIFFIsTiled(in) || tw != tilesize || tl != tilesize ||
+        compression != COMPRESSION_JPEG ||
+        planarconfig != PLANARCONFIG_CONTIG || k == DZI_MAX_SCALES)
+      {
+      if (d == 0)
+        {
+        TIFFError(TIFFFileName(in), "Provided file does not have JPEG-compressed tiles -- I can't write them as JPEG files");
+        return EXIT_UNHANDLED_FILE_TYPE;
+        }
+      fprintf(stderr, "Directory %u (" UINT32_FORMAT "x" UINT32_FORMAT
+              ") is not a level of the pyramid, skipped.\n", d, w, l);
+      }
+    else if (directoryofscale[k] != -1)
+      fprintf(stderr, "Directory %u has the same dimensions as directory %d, skipped.\n",
+              d, directoryofscale[k]);
+    else
+      {
+      directoryofscale[k]= d;
+      if (k > maxscale)
+        maxscale= k;
+      }
+    }
+
+  unit= (uint64_t) tilesize << maxscale;
+  width= (width0 + unit - 1) / unit * unit;
+  length= (length0 + unit - 1) / unit * unit;
+  for (maxlevel = 0, unit = width > length ? width : length; unit > 1;
+       maxlevel++)
+    unit= (unit + 1) / 2;
+
+  my_asprintf(&name, "%s.dzi", prefix);
+  if ((dzi = fopen(name, "w")) == NULL)
+    {
+    TIFFError(name, "Error while creating output file");
+    _TIFFfree(name);
+    return EXIT_IO_ERROR;
+    }
+  fprintf(dzi, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+          "  Format=\"jpg\" Overlap=\"0\" TileSize=\"" UINT32_FORMAT "\">\n"
+          "  <Size Width=\"%llu\" Height=\"%llu\"/>\n"
+          "</Image>\n", tilesize, (unsigned long long) width,
+          (unsigned long long) length);
+  if (ferror(dzi) | fclose(dzi))
+    {
+    TIFFError(name, "Error while writing output file");
+    return_code= EXIT_IO_ERROR;
+    }
+  _TIFFfree(name);
+  my_asprintf(&name, "%s_files", prefix);
+  if (!return_code)
+    return_code= makeDirectory(name);
+  _TIFFfree(name);
+
+  for (k = 0; k <= maxscale && !return_code; k++)
+    {
+    struct tilesplit split;
+    char * levelpath;
+    tsize_t bufsize;
+    tdata_t buf;
+
+    if (directoryofscale[k] == -1)
+      continue;
+    if (!TIFFSetDirectory(in, directoryofscale[k]))
+      {
+      TIFFError(TIFFFileName(in), "Error while reading directory %d",
+                directoryofscale[k]);
+      return_code= EXIT_IO_ERROR;
+      break;
+      }
+    memset(&split, 0, sizeof(split));
+    split.prefix= prefix;
+    TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &split.imagewidth);
+    TIFFGetField(in, TIFFTAG_IMAGELENGTH, &split.imagelength);
+    split.tilewidth= tilesize;
+    split.tilelength= tilesize;
+    split.compression= COMPRESSION_JPEG;
+    my_asprintf(&levelpath, "%s_files/%u", prefix, maxlevel - k);
+    split.dzilevelpath= levelpath;
+    fprintf(stderr, "Directory %d -> level %u\n", directoryofscale[k],
+            maxlevel - k);
+    bufsize= largestRawTileSize(in);
+    if ((return_code = makeDirectory(levelpath)) == 0 &&
+        (return_code = makeJPEGHeader(in, &split.jpegheader,
+                                      &split.jpegheadersize)) == 0)
+      {
+      if ((buf = _TIFFmalloc(bufsize)) == NULL)
+        {
+        TIFFError(TIFFFileName(in), "Error: insufficient memory");
+        return_code= EXIT_INSUFFICIENT_MEMORY;
+        }
+      else
+        {
+        return_code= splitTiles(in, &split, buf, bufsize);
+        _TIFFfree(buf);
+        }
+      }
+    _TIFFfree(split.jpegheader);
+    _TIFFfree(levelpath);
+    }
+
+  return return_code;
+}
+
+
 static void
 stderrErrorHandler(const char* module, const char* fmt, va_list ap)
 {
@@ -167,6 +920,9 @@ static void usage()
   fprintf(stderr, "Usage: tiffsplittiles [options] file.tif\n");
   fprintf(stderr, " Options:\n");
   fprintf(stderr, "  -t  output tiled rather than stripped TIFF files\n");
+  fprintf(stderr, "  -p  output all the tiles into a single file, file_tiles.pack, with an index\n");
+  fprintf(stderr, "  -j  output JPEG files (JPEG-compressed tiles only, copied without decoding)\n");
+  fprintf(stderr, "  -z  output the tiles of all the levels of the pyramid as a Deep Zoom image,\n      file.dzi and directory file_files (JPEG-compressed tiles only)\n");
   fprintf(stderr, "  -T  report TIFF errors/warnings on stderr rather than in dialog boxes\n");
 }
 
@@ -175,21 +931,30 @@ int main(int argc, char * argv[])
 {
 TIFF* in;
 char* inpathbeforelastdot;
-int output_tiled_tiffs = 0, arg = 1;
-int number_digits_horiz_tile_numbers, number_digits_vert_tile_numbers;
+int output_tiled_tiffs = 0, output_pack = 0, output_jpeg = 0, output_dzi = 0;
+int arg = 1;
 uint32_t imagewidth, imagelength;
 uint32_t tilewidth, tilelength;
-uint32_t x, y;
 uint32_t imagedepth;
 uint16_t planarconfig, compression;
+uint64_t * bytecounts = NULL, * packoffsets = NULL;
+char * packpath = NULL;
 tsize_t bufsize;
 tdata_t buf;
-int io_error= 0;
+struct tilesplit split;
+int64_t numberoftiles, tilesacross;
+int return_code= 0;
 
 while (arg < argc && argv[arg][0] == '-')
   {
   if (argv[arg][1] == 't')
     output_tiled_tiffs = 1;
+  else if (argv[arg][1] == 'p')
+    output_pack = 1;
+  else if (argv[arg][1] == 'j')
+    output_jpeg = 1;
+  else if (argv[arg][1] == 'z')
+    output_dzi = 1;
   else if (argv[arg][1] == 'T')
     {
     TIFFSetErrorHandler(stderrErrorHandler);
@@ -204,6 +969,13 @@ while (arg < argc && argv[arg][0] == '-')
   arg++;
   }
 
+if (output_pack + output_jpeg + output_dzi > 1)
+  {
+  fprintf(stderr, "Options -p, -j and -z are mutually exclusive.\n");
+  usage();
+  return EXIT_SYNTAX_ERROR;
+  }
+
 if (arg != argc-1)
   {
   fprintf(stderr, "Exactly one file name should be given on the command line, after options.\n");
@@ -253,7 +1025,22 @@ if (compression == COMPRESSION_JPEG)
   TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);*/
   }
 
-bufsize= TIFFTileSize(in);
+inpathbeforelastdot= searchPrefixBeforeLastDot(argv[arg]);
+
+if (output_dzi)
+  {
+  return_code= exportDeepZoom(in, inpathbeforelastdot);
+  TIFFClose(in);
+  _TIFFfree(inpathbeforelastdot);
+  return return_code;
+  }
+
+numberoftiles= TIFFNumberOfTiles(in);
+tilesacross= (imagewidth+tilewidth-1)/tilewidth;
+
+/* Compressed tiles are read raw: the buffer must hold the largest
+  one, which may be larger than a decoded tile */
+bufsize= largestRawTileSize(in);
 
 /*fprintf(stderr, "Allocating %u bytes; tiles are %ux%u large.\n", 
         bufsize, tilewidth, tilelength);*/
@@ -265,107 +1052,67 @@ if (! (buf = _TIFFmalloc(bufsize)) )
   return EXIT_INSUFFICIENT_MEMORY;
   }
 
-inpathbeforelastdot= searchPrefixBeforeLastDot(argv[arg]);
-number_digits_horiz_tile_numbers=
-  searchNumberOfDigits((imagewidth+tilewidth-1)/tilewidth);
-number_digits_vert_tile_numbers=
+split.prefix= inpathbeforelastdot;
+split.imagewidth= imagewidth;
+split.imagelength= imagelength;
+split.tilewidth= tilewidth;
+split.tilelength= tilelength;
+split.compression= compression;
+split.ndigitshoriz= searchNumberOfDigits(tilesacross);
+split.ndigitsvert=
   searchNumberOfDigits((imagelength+tilelength-1)/tilelength);
+split.outputtiled= output_tiled_tiffs;
+split.packpath= NULL;
+split.packoffsets= NULL;
+split.jpegheader= NULL;
+split.jpegheadersize= 0;
+split.dzilevelpath= NULL;
 
-/* While debugging: */
-/*imagelength= tilelength < imagelength ? tilelength : imagelength;*/
-
-#pragma omp parallel for shared(io_error)
-for (y = 0; y < imagelength; y += tilelength)
+if (output_jpeg)
   {
-  if (! io_error)
-  {
-  uint32_t outputimageslength= tilelength;
-
-fprintf(stderr, "Dealing with line " UINT32_FORMAT "/" UINT32_FORMAT
-        " y=" UINT32_FORMAT " -> outputimageslength=" UINT32_FORMAT
-        "\n",
-        (y/tilelength)+1, imagelength/tilelength, y,
-        outputimageslength);
+  int r;
 
-  for (x = 0; x < imagewidth; x += tilewidth)
+  if (compression != COMPRESSION_JPEG)
     {
-    char * outpath;
-    TIFF * out;
-    uint32_t tilenumber= TIFFComputeTile(in, x, y, 0, 0);
-    uint32_t outputimagewidth= tilewidth;
-
-/*fprintf(stderr, "Reading tile at (%u, %u), which has the number %u -> i%0*uj%0*u\n", 
-        x, y, tilenumber, number_digits_horiz_tile_numbers,
-        x/tilewidth+1, number_digits_vert_tile_numbers, y/tilelength+1);*/
-
-    //TIFFReadTile(in, buf, x, y, 0, 0);
-    if (TIFFReadRawTile(in, tilenumber, buf, bufsize) == -1)
-      {
-      TIFFError(TIFFFileName(in), "Error while reading tile #%u", tilenumber);
-      TIFFClose(in);
-      #pragma omp atomic
-      io_error++;
-      continue;
-      }
-
-    my_asprintf(&outpath, "%s_t_i%0*uj%0*u.tif", inpathbeforelastdot,
-                number_digits_horiz_tile_numbers, x/tilewidth+1,
-                number_digits_vert_tile_numbers, y/tilelength+1);
-    out = TIFFOpen(outpath, "w");
-    if (out == NULL)
-      {
-      TIFFError(TIFFFileName(out), "Error while creating output file %s", TIFFFileName(out));
-      TIFFClose(in);
-      #pragma omp atomic
-      io_error++;
-      continue;
-      }
-
-    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, outputimagewidth);
-    TIFFSetField(out, TIFFTAG_IMAGELENGTH, outputimageslength);
-    TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
-    if (output_tiled_tiffs)
-      {
-      TIFFSetField(out, TIFFTAG_TILEWIDTH, tilewidth);
-      TIFFSetField(out, TIFFTAG_TILELENGTH, tilelength);
-      }
-    if (compression == COMPRESSION_JPEG)
-      {
-      uint32_t count = 0;
-      void *table = NULL;
-      uint16_t subsamplinghor, subsamplingver;
-      if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &count, &table)
-          && count > 0 && table)
-        TIFFSetField(out, TIFFTAG_JPEGTABLES, count, table);
-      //TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
-      CopyField2(TIFFTAG_YCBCRSUBSAMPLING, subsamplinghor,
-                 subsamplingver);
-      }
-    copyOtherFields(in, out);
+    TIFFError(TIFFFileName(in), "Provided file does not have JPEG-compressed tiles -- I can't write them as JPEG files");
+    return EXIT_UNHANDLED_FILE_TYPE;
+    }
+  if ((r = makeJPEGHeader(in, &split.jpegheader, &split.jpegheadersize)))
+    return r;
+  }
 
-    if ((output_tiled_tiffs && TIFFWriteRawTile(out, 0, buf, bufsize) == -1) ||
-        (!output_tiled_tiffs && TIFFWriteRawStrip(out, 0, buf, bufsize) == -1))
-      {
-      TIFFError(TIFFFileName(out), "Error while writing tile #%u", tilenumber);
-      TIFFClose(out);
-      TIFFClose(in);
-      #pragma omp atomic
-      io_error++;
-      continue;
-      }
+if (output_pack)
+  {
+  int r;
 
-    TIFFClose(out);
-    _TIFFfree(outpath);
+  if (!TIFFGetField(in, TIFFTAG_TILEBYTECOUNTS, &bytecounts))
+    {
+    TIFFError(TIFFFileName(in), "Provided file has no TileByteCounts -- I can't pack its tiles");
+    return EXIT_UNHANDLED_FILE_TYPE;
     }
-  } /* if (! io_error) */
-  } /* for y */
+  if ((packoffsets = _TIFFmalloc(numberoftiles * sizeof(uint64_t))) == NULL)
+    {
+    TIFFError(TIFFFileName(in), "Error: insufficient memory");
+    return EXIT_INSUFFICIENT_MEMORY;
+    }
+  my_asprintf(&packpath, "%s_tiles.pack", inpathbeforelastdot);
+  split.packpath= packpath;
+  split.packoffsets= packoffsets;
+  if ((r = writePackHeader(in, &split, bytecounts, packoffsets)))
+    return r;
+  }
 
-if (io_error)
-  return EXIT_IO_ERROR;
+/* While debugging: */
+/*imagelength= tilelength < imagelength ? tilelength : imagelength;*/
+
+return_code= splitTiles(in, &split, buf, bufsize);
 
 TIFFClose(in);
 _TIFFfree(buf);
+_TIFFfree(packoffsets);
+_TIFFfree(packpath);
+_TIFFfree(split.jpegheader);
 _TIFFfree(inpathbeforelastdot);
 
-return 0;
+return return_code;
 }
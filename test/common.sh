@@ -0,0 +1,90 @@
+# LargeTIFFTools Software
+#
+# Sourced by the regression tests: paths of the tools and of the fixture
+# program, a scratch directory named after the test, and helpers.
+#
+# License: GNU General Public License v3
+#
+
+top_builddir=$(cd "${top_builddir:-..}" && pwd) || exit 99
+bindir=${bindir:-$top_builddir/src}
+fixture=${fixture:-$top_builddir/test/tifftestfixture$EXEEXT}
+tifffastcrop=$bindir/tifffastcrop$EXEEXT
+tiffmakemosaic=$bindir/tiffmakemosaic$EXEEXT
+tiffsplittiles=$bindir/tiffsplittiles$EXEEXT
+
+workdir=$(basename "$0" .sh).dir
+rm -rf "$workdir" && mkdir "$workdir" && cd "$workdir" || exit 99
+failures=0
+
+# make_fixture out.tif width length bitspersample spp compression
+#   tilesize rowsperstrip levels texture|background
+# Skip the test if libtiff can't write the file.
+make_fixture () {
+	"$fixture" make "$@"
+	r=$?
+	[ $r -eq 0 ] || exit $r
+}
+
+# crop_and_compare in.tif x y width length [options...]: extract with
+# tifffastcrop and compare with the region of in
+crop_and_compare () {
+	in=$1 x=$2 y=$3 w=$4 l=$5
+	shift 5
+	rm -f out.tif
+	"$tifffastcrop" "$@" -E $x,$y,$w,$l $in out.tif &&
+	    "$fixture" compare $in $x $y out.tif
+}
+
+# check_pieces in.tif width length overlap count [pad,pad...]: the count
+# pieces of the mosaic of in, of width x length pixels besides overlap,
+# written next to in, are its regions, padded with these values
+check_pieces () {
+	base=${1%.tif}
+	check "${base}: $5 pieces" [ $(ls ${base}_i*j*.tif | wc -l) -eq $5 ]
+	for p in ${base}_i*j*.tif ; do
+		[ -f $p ] || continue
+		i=${p#${base}_i}
+		j=${i#*j}
+		i=$(expr ${i%%j*} - 1)
+		j=$(expr ${j%.tif} - 1)
+		x=$((j * $2 > $4 ? j * $2 - $4 : 0))
+		y=$((i * $3 > $4 ? i * $3 - $4 : 0))
+		check "$p" "$fixture" compare $1 $x $y $p $6
+	done
+}
+
+# plan_is mode options... in.tif: tiffmakemosaic plans to make the
+# pieces in this mode (as reported by its dry run, option -y)
+plan_is () {
+	mode=$1
+	shift
+	"$tiffmakemosaic" -y "$@" > plan.json &&
+	    grep -q "\"mode\": \"$mode\"" plan.json
+}
+
+# fails command [arguments...]: the command reports an error
+fails () {
+	! "$@" 2> /dev/null
+}
+
+# check description command [arguments...]
+check () {
+	description=$1
+	shift
+	if ! "$@" ; then
+		echo "FAIL: $description"
+		failures=$((failures + 1))
+	fi
+}
+
+# finish: report, and remove the scratch directory if all checks passed
+finish () {
+	cd ..
+	if [ $failures -ne 0 ] ; then
+		echo "$failures check(s) failed; files kept in $workdir"
+		exit 1
+	fi
+	rm -rf "$workdir"
+	exit 0
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# tifffastcrop: extracts on the grid of tiles are made of the compressed
+# tiles of the input, copied without decoding them (with the fields their
+# decoding needs, such as Group3Options).
+
+. "${srcdir:-.}/common.sh"
+
+# raw_copy in.tif x y width length: the extract is copied, and right
+raw_copy () {
+	rm -f out.tif
+	"$tifffastcrop" -v -E $2,$3,$4,$5 $1 out.tif 2> log.txt &&
+	    grep -q "copying tiles without decoding" log.txt &&
+	    "$fixture" compare $1 $2 $3 out.tif
+}
+
+make_fixture rgb.tif 300 200 8 3 lzw 64 0 1 texture
+make_fixture jpeg.tif 300 200 8 3 jpeg 64 0 1 texture
+make_fixture fax3.tif 300 200 1 1 g3 64 0 1 texture
+make_fixture fax4.tif 300 200 1 1 g4 64 0 1 texture
+
+for f in rgb jpeg fax3 fax4 ; do
+	check "$f: copy of tiles" raw_copy $f.tif 64 64 128 128
+	check "$f: edge tiles" raw_copy $f.tif 192 128 108 72
+done
+# Off the grid, tiles are decoded (and JPEG tiles encoded again, with
+# losses)
+for f in rgb fax3 fax4 ; do
+	check "$f: decoded" crop_and_compare $f.tif 13 7 150 100
+done
+
+finish
@@ -0,0 +1,30 @@
+#!/bin/sh
+# tifffastcrop: several regions with a single open of the input (-R),
+# and the last of several -E options.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture tiled.tif 300 200 8 3 lzw 64 0 1 texture
+make_fixture strips.tif 300 200 16 1 deflate 0 16 1 texture
+
+for f in tiled strips ; do
+	# Regions out of order, overlapping, and a blank line
+	cat > $f.txt <<EOR
+# x,y,w,l[,name]
+10,150,100,50,${f}_1.tif
+0,0,64,64,${f}_2.tif
+
+65,1,7,190,${f}_3.tif
+60,60,100,100,${f}_4.tif
+EOR
+	check "$f: regions file" "$tifffastcrop" -R $f.txt $f.tif
+	check "$f: region 1" "$fixture" compare $f.tif 10 150 ${f}_1.tif
+	check "$f: region 2" "$fixture" compare $f.tif 0 0 ${f}_2.tif
+	check "$f: region 3" "$fixture" compare $f.tif 65 1 ${f}_3.tif
+	check "$f: region 4" "$fixture" compare $f.tif 60 60 ${f}_4.tif
+done
+
+check "last -E wins" crop_and_compare tiled.tif 20 30 40 50 \
+    -E 0,0,10,10
+
+finish
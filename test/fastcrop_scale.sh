@@ -0,0 +1,43 @@
+#!/bin/sh
+# tifffastcrop --scale: box filter along the axes where at least 2
+# source pixels make an extract pixel, bilinear interpolation along the
+# others (checked against a straightforward scalar computation, so that
+# the SIMD kernels are checked against the scalar path); extracts of
+# pyramids made from the lowest sufficient level.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture rgb8.tif 300 200 8 3 lzw 64 0 1 texture
+make_fixture gray16.tif 300 200 16 1 deflate 0 16 1 texture
+
+for f in rgb8 gray16 ; do
+	# x y width length factor
+	for g in "0 0 300 200 1/4" "10 7 233 150 0.3" "5 5 51 60 0.45" \
+	    "2 3 77 41 0.9" "0 0 300 200 0.7" "3 5 1 100 0.3" \
+	    "3 5 100 1 0.25" "1 1 299 9 0.2" ; do
+		set -- $g
+		for t in 1 3 ; do
+			rm -f out.tif
+			check "$f: $g, $t thread(s)" "$tifffastcrop" -t $t \
+			    -E $1,$2,$3,$4 --scale $5 $f.tif out.tif
+			check "$f: $g, $t thread(s), pixels" "$fixture" scale \
+			    $f.tif $1 $2 $3 $4 $5 out.tif
+		done
+	done
+done
+
+# The levels of the fixture are subsampled exactly, so that extracts at
+# their scale are their pixels
+make_fixture pyramid.tif 512 384 8 3 lzw 64 0 3 texture
+for d in 1 2 ; do
+	rm -f level*.tif out.tif
+	# With -d, the name of the extract tells its directory and geometry
+	check "level $d" "$tifffastcrop" -d $d -E 0,0,512,384 pyramid.tif \
+	    level.tif
+	check "scale of level $d" "$tifffastcrop" -E 0,0,512,384 \
+	    --scale 1/$((1 << d)) pyramid.tif out.tif
+	check "scale of level $d, pixels" "$fixture" compare \
+	    level-d$d-*.tif 0 0 out.tif
+done
+
+finish
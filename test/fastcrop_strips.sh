@@ -0,0 +1,20 @@
+#!/bin/sh
+# tifffastcrop: extracts of stripped files read only the strips they
+# overlap, wherever they lie in the file.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture gray16.tif 300 200 16 1 deflate 0 16 1 texture
+make_fixture rgb.tif 300 200 8 3 none 0 7 1 texture
+make_fixture rows.tif 300 200 8 3 lzw 0 1 1 texture
+
+for f in gray16 rgb rows ; do
+	check "$f: whole image" crop_and_compare $f.tif 0 0 300 200
+	check "$f: last row" crop_and_compare $f.tif 0 199 300 1
+	check "$f: bottom right" crop_and_compare $f.tif 250 150 50 50
+	check "$f: across strips" crop_and_compare $f.tif 13 15 150 19
+	check "$f: first strip" crop_and_compare $f.tif 1 0 7 3
+	check "$f: past the edges" crop_and_compare $f.tif 290 190 40 40
+done
+
+finish
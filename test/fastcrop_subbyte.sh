@@ -0,0 +1,20 @@
+#!/bin/sh
+# tifffastcrop: extracts of images with 1, 2 and 4 bits per sample at
+# every bit offset, with rows long enough for the SIMD kernels to be
+# used besides the scalar code for the ends of rows.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture bits1.tif 1000 40 1 1 none 0 8 1 texture
+make_fixture bits2.tif 700 40 2 1 lzw 0 8 1 texture
+make_fixture bits4.tif 500 40 4 1 deflate 64 0 1 texture
+
+for f in bits1 bits2 bits4 ; do
+	for x in 0 1 2 3 4 5 6 7 9 ; do
+		check "$f: x=$x" crop_and_compare $f.tif $x 3 450 30
+		check "$f: x=$x, short rows" crop_and_compare $f.tif $x 3 \
+		    13 5
+	done
+done
+
+finish
@@ -0,0 +1,29 @@
+#!/bin/sh
+# tifffastcrop -t: tiles decoded in parallel, each thread with its own
+# handle on the input, give the same extracts as with one thread.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture rgb.tif 300 200 8 3 lzw 32 0 1 texture
+make_fixture gray16.tif 300 200 16 1 deflate 48 0 1 texture
+make_fixture fax.tif 300 200 1 1 g4 32 0 1 texture
+
+for f in rgb gray16 fax ; do
+	for t in 2 3 8 ; do
+		check "$f: $t threads" crop_and_compare $f.tif 13 7 250 190 \
+		    -t $t
+		check "$f: $t threads, one tile" crop_and_compare $f.tif \
+		    40 40 10 10 -t $t
+	done
+done
+
+# Several regions, each decoded with 3 threads
+cat > regions.txt <<EOR
+0,0,300,200,r1.tif
+17,33,100,100,r2.tif
+EOR
+check "regions" "$tifffastcrop" -t 3 -R regions.txt rgb.tif
+check "region 1" "$fixture" compare rgb.tif 0 0 r1.tif
+check "region 2" "$fixture" compare rgb.tif 17 33 r2.tif
+
+finish
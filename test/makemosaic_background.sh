@@ -0,0 +1,55 @@
+#!/bin/sh
+# tiffmakemosaic --skip-background: pieces made only of the background
+# colour are listed instead of written, the others are unchanged.
+
+. "${srcdir:-.}/common.sh"
+
+# check_skipped in.tif backgroundpieces: compare the pieces made with
+# and without --skip-background (pieces are written next to their input
+# file, and listed with its directory)
+check_skipped () {
+	base=${1%.tif}
+	mkdir all skip
+	ln -s ../$1 all/$1 && ln -s ../$1 skip/$1 || exit 99
+	check "$base: all pieces" "$tiffmakemosaic" -g 64x64 all/$1
+	check "$base: skipping background" "$tiffmakemosaic" -g 64x64 \
+	    --skip-background 240,240,240 skip/$1
+	listed=$(grep -vc '^#' skip/${base}_background.txt)
+	check "$base: background pieces listed" [ "$listed" -eq $2 ]
+	for p in $(cd all && ls ${base}_i*.tif) ; do
+		if grep -q "^skip/$p " skip/${base}_background.txt ; then
+			check "$base: $p not written" [ ! -f skip/$p ]
+			check "$base: $p is background" "$fixture" uniform $1 \
+			    $(grep "^skip/$p " skip/${base}_background.txt |
+			    cut -d' ' -f2-5) 240
+		else
+			check "$base: $p unchanged" cmp -s all/$p skip/$p
+		fi
+	done
+	rm -rf all skip
+}
+
+# Textured top left 128x128 pixels, background elsewhere: 32 of the 36
+# pieces of 64x64 are background; with strips, which cover the whole
+# width, only the 24 pieces below the textured rows are
+make_fixture tiled.tif 384 384 8 3 lzw 64 0 1 background
+make_fixture raw.tif 384 384 8 3 none 64 0 1 background
+make_fixture strips.tif 384 384 8 3 deflate 0 16 1 background
+check_skipped tiled.tif 32
+check_skipped raw.tif 32
+check_skipped strips.tif 24
+
+# background_pieces options...: number of pieces of tiled.tif listed as
+# background with these options
+background_pieces () {
+	rm -f tiled_i*.tif tiled_background.txt
+	"$tiffmakemosaic" -g 64x64 "$@" tiled.tif &&
+	    grep -vc '^#' tiled_background.txt
+}
+
+check "tolerance" [ $(background_pieces --skip-background 250,250,250) \
+    -eq 0 ]
+check "larger tolerance" [ $(background_pieces --skip-background \
+    250,250,250 --background-tolerance 10) -eq 32 ]
+
+finish
@@ -0,0 +1,30 @@
+#!/bin/sh
+# tiffmakemosaic --copy-tiles: pieces on the grid of tiles are made of
+# the compressed tiles of the input, copied without decoding them; the
+# others are decoded.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture deflate.tif 512 384 8 3 deflate 64 0 1 texture
+make_fixture jpeg.tif 512 384 8 3 jpeg 64 0 1 texture
+make_fixture lzw16.tif 512 384 16 1 lzw 64 0 1 texture
+
+for f in deflate jpeg lzw16 ; do
+	rm -f ${f}_i*.tif
+	check "$f: copy of tiles" "$tiffmakemosaic" -v -g 128x128 \
+	    --copy-tiles $f.tif 2> log.txt
+	check "$f: copy of tiles, log" grep -q "will copy its compressed" \
+	    log.txt
+	check "$f: copy of tiles, layout" [ "$("$fixture" layout \
+	    ${f}_i3j4.tif)" = "tiles 64x64" ]
+	check_pieces $f.tif 128 128 0 12
+done
+
+# Off the grid, tiles are decoded
+rm -f deflate_i*.tif
+check "off the grid" "$tiffmakemosaic" -v -g 96x96 --copy-tiles \
+    deflate.tif 2> log.txt
+check "off the grid, log" grep -q "can't copy its compressed" log.txt
+check_pieces deflate.tif 96 96 0 24
+
+finish
@@ -0,0 +1,59 @@
+#!/bin/sh
+# tiffmakemosaic -y and tifffastcrop -y: no file is written, and the plan
+# is printed as JSON with the bytes and pixels each piece or extract
+# needs, and their totals.
+
+. "${srcdir:-.}/common.sh"
+
+# dry_run options... in.tif: make the plan of the mosaic of in into
+# plan.json, checking that no piece is written
+dry_run () {
+	"$tiffmakemosaic" -y "$@" > plan.json || return 1
+	shift $(($# - 1))
+	! ls ${1%.tif}_i*.tif > /dev/null 2>&1
+}
+
+# field name: the total of field name of the plan (the last one)
+field () {
+	sed -n "s/.*\"$1\": \([0-9]*\).*/\1/p" plan.json | tail -1
+}
+
+# pieces_field name: the sum of field name of the pieces of the plan
+pieces_field () {
+	grep '"output"' plan.json |
+	sed "s/.*\"$1\": \([0-9]*\).*/\1/" | awk '{ n += $1 } END { print n }'
+}
+
+make_fixture tiles.tif 1000 700 8 3 lzw 96 0 1 texture
+make_fixture strips.tif 1000 700 8 3 deflate 0 48 1 texture
+
+# Made row by row, each tile or strip is read and decoded once, though
+# pieces share them
+for f in tiles strips ; do
+	check "$f" dry_run -g 300x300 -O 20 $f.tif
+	check "$f: mode" grep -q '"mode": "row by row"' plan.json
+	check "$f: pieces" [ $(grep -c '"output"' plan.json) -eq 12 ]
+	check "$f: bytes read once" [ $(field compressed_bytes) -eq \
+	    $("$fixture" bytes $f.tif) ]
+	check "$f: pixels decoded once" [ $(field decoded_pixels) -eq \
+	    $(pieces_field decoded_pixels) ]
+	check "$f: no redundant decodes" [ $(field redundant_decodes) -eq 0 ]
+done
+
+# Made one after another, each piece reads and decodes its own
+check "piece by piece" dry_run -g 300x300 -O 20 -b 0.3 strips.tif
+check "piece by piece: mode" grep -q '"mode": "piece by piece"' plan.json
+check "piece by piece: bytes" [ $(field compressed_bytes) -eq \
+    $(pieces_field compressed_bytes) ]
+check "piece by piece: redundant decodes" [ $(field redundant_decodes) \
+    -gt 0 ]
+
+check "tifffastcrop" eval '"$tifffastcrop" -y -E 10,10,200,100 tiles.tif \
+    > plan.json'
+check "tifffastcrop: no extract written" eval '! ls tiles-*.tif \
+    > /dev/null 2>&1'
+check "tifffastcrop: extract" grep -q \
+    '"x": 10, "y": 10, "width": 200, "length": 100' plan.json
+check "tifffastcrop: tiles" [ $(field units_touched) -eq 6 ]
+
+finish
@@ -0,0 +1,46 @@
+#!/bin/sh
+# tiffmakemosaic --dzi: a Deep Zoom pyramid with a level for each halving
+# of the image down to 1 x 1, each cut into JPEG tiles with overlap.
+
+. "${srcdir:-.}/common.sh"
+
+# tiles width length tilesize: number of tiles of the pyramid of an
+# image of width x length
+tiles () {
+	w=$1 l=$2 n=0
+	while : ; do
+		n=$((n + ((w + $3 - 1) / $3) * ((l + $3 - 1) / $3)))
+		[ $w -le 1 ] && [ $l -le 1 ] && break
+		w=$(((w + 1) / 2)) l=$(((l + 1) / 2))
+	done
+	echo $n
+}
+
+# dzi in.tif tilesize overlap options...: make the pyramid of in and
+# check its description, its number of tiles and their pixels
+dzi () {
+	in=$1 size=$2 overlap=$3
+	shift 3
+	rm -rf ${in%.tif}.dzi ${in%.tif}_files
+	"$tiffmakemosaic" -j95 --dzi $size -O $overlap "$@" $in || return 1
+	grep -q "Overlap=\"$overlap\" TileSize=\"$size\"" ${in%.tif}.dzi &&
+	grep -q "Width=\"$width\" Height=\"$length\"" ${in%.tif}.dzi &&
+	[ $(find ${in%.tif}_files -name '*.jpg' | wc -l) -eq \
+	    $(tiles $width $length $size) ] &&
+	"$fixture" dzi $in ${in%.tif} $size $overlap 2
+}
+
+width=300 length=200
+make_fixture strips.tif $width $length 8 3 lzw 0 16 1 smooth
+make_fixture tiles.tif $width $length 8 3 deflate 64 0 1 smooth
+
+for f in strips tiles ; do
+	check "$f" dzi $f.tif 64 0
+	check "$f: overlap" dzi $f.tif 64 4
+	check "$f: 3 threads" dzi $f.tif 100 1 -t 3
+done
+check "plan" plan_is "Deep Zoom pyramid" --dzi 64 strips.tif
+check "plan: tiles" grep -q "\"tiles\": $(tiles $width $length 64)," plan.json
+check "-c is refused" fails "$tiffmakemosaic" --dzi 64 -c strips.tif
+
+finish
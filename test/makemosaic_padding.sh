@@ -0,0 +1,45 @@
+#!/bin/sh
+# tiffmakemosaic -P: pieces of stripped files at the right and bottom of
+# the image are padded to the size of the others.
+
+. "${srcdir:-.}/common.sh"
+
+# padded in.tif width length overlap count pad options...: make the
+# mosaic of in in pieces of width x length padded with pad, none of them
+# smaller, and check them
+padded () {
+	in=$1 w=$2 l=$3 o=$4 n=$5 pad=$6
+	shift 6
+	rm -f ${in%.tif}_i*.tif
+	check "$in -P $pad $*" "$tiffmakemosaic" -g ${w}x$l -O $o -P $pad \
+	    "$@" $in
+	"$tiffmakemosaic" -y -g ${w}x$l -O $o -P $pad "$@" $in |
+	    grep '"output"' |
+	    sed 's/.*"width": \([0-9]*\), "length": \([0-9]*\),.*/\1 \2/' \
+	    > sizes.txt
+	check "$in -P $pad $*: no smaller piece" [ $(wc -l < sizes.txt) -eq $n \
+	    -a $(awk "\$1 < $w + ($o > 0) * $o || \$2 < $l + ($o > 0) * $o" \
+	    sizes.txt | wc -l) -eq 0 ]
+	check_pieces $in $w $l $o $n $pad
+}
+
+make_fixture rgb.tif 1000 700 8 3 lzw 0 48 1 texture
+make_fixture gray16.tif 1000 700 16 1 none 0 5 1 texture
+
+padded rgb.tif 300 300 0 12 7,8,9
+check "rgb.tif: plan" plan_is "row by row" -g 300x300 -P 7,8,9 rgb.tif
+padded rgb.tif 300 300 10 12 0,128,255
+padded rgb.tif 300 300 0 12 255,255,255 -b 0.1
+check "rgb.tif -b 0.1: plan" plan_is "piece by piece" -g 300x300 \
+    -P 255,255,255 -b 0.1 rgb.tif
+padded gray16.tif 256 256 0 12 1234
+padded gray16.tif 256 256 5 12 65535 -t 3
+
+# -PX or -PY pad in one direction only
+check "-PX" "$tiffmakemosaic" -g 256x256 -PX 3 gray16.tif
+check "-PX: plan" plan_is "piece by piece" -g 256x256 -PX 3 gray16.tif
+check "-PX: sizes" [ $(grep -c '"width": 256, "length": 188' plan.json) \
+    -eq 4 ]
+check_pieces gray16.tif 256 256 0 12 3
+
+finish
@@ -0,0 +1,49 @@
+#!/bin/sh
+# tiffmakemosaic: without -g, pieces are sized to fit -M and -m while
+# cutting through as few tiles or strips of the file as possible.
+
+. "${srcdir:-.}/common.sh"
+
+# plan in.tif options...: make the mosaic of in with the options, and set
+# width and length to the dimensions of its pieces, count to their number
+plan () {
+	in=$1
+	shift
+	rm -f ${in%.tif}_i*.tif
+	"$tiffmakemosaic" -v "$@" $in 2> log.txt || return 1
+	set -- $(sed -n 's/.*decided for \([0-9]*\) x \([0-9]*\) = [0-9]* pieces of \([0-9]*\) x \([0-9]*\) .*/\1 \2 \3 \4/p' log.txt)
+	[ $# -eq 4 ] || return 1
+	count=$(($1 * $2)) width=$3 length=$4
+	grep -q "saving" log.txt
+}
+
+# on_grid size unit whole: size is a multiple of unit, or the whole image
+on_grid () {
+	[ $(($1 % $2)) -eq 0 ] || [ $1 -eq $3 ]
+}
+
+make_fixture tiles.tif 1000 700 8 3 lzw 96 0 1 texture
+make_fixture strips.tif 1000 700 8 3 lzw 0 48 1 texture
+
+# With -M 0.5, pieces on the grid are cheapest; with -M 0.2, cutting
+# through a column of tiles costs less than another column of pieces
+for M in 0.5 0.2 ; do
+	check "tiles, -M $M" plan tiles.tif -M $M
+	check "tiles, -M $M: memory" [ $((width * length * 4)) -le \
+	    $(awk "BEGIN { print int($M * 1048576) }") ]
+	check_pieces tiles.tif $width $length 0 $count
+	check "strips, -M $M" plan strips.tif -M $M
+	check "strips, -M $M: on the grid" on_grid $length 48 700
+	check_pieces strips.tif $width $length 0 $count
+done
+check "tiles, -M 0.5" plan tiles.tif -M 0.5
+check "tiles, -M 0.5: on the grid" eval 'on_grid $width 96 1000 &&
+    on_grid $length 96 700'
+
+check "divisors" plan tiles.tif -M 0.5 -m 80x80 -P 0,0,0
+check "divisors: multiples" [ $((width % 80)) -eq 0 -a \
+    $((length % 80)) -eq 0 ]
+check "unsatisfiable divisors are refused" fails "$tiffmakemosaic" -y \
+    -M 0.5 -m 80x80 tiles.tif
+
+finish
@@ -0,0 +1,44 @@
+#!/bin/sh
+# tiffmakemosaic --out-tile, --out-strip and -B: pieces streamed band by
+# band as tiled or multi-strip TIFF files, optionally BigTIFF.
+
+. "${srcdir:-.}/common.sh"
+
+# layout_is file.tif layout: the layout of the file, as printed by the
+# fixture program, is layout
+layout_is () {
+	[ "$("$fixture" layout $1)" = "$2" ]
+}
+
+make_fixture tiled.tif 600 400 8 3 lzw 64 0 1 texture
+make_fixture strips.tif 600 400 16 1 deflate 0 16 1 texture
+
+for f in tiled strips ; do
+	rm -f ${f}_i*.tif
+	check "$f: tiles" "$tiffmakemosaic" -g 300x200 --out-tile 64x32 \
+	    $f.tif
+	check "$f: tiles, layout" layout_is ${f}_i1j1.tif "tiles 64x32"
+	check_pieces $f.tif 300 200 0 4
+
+	rm -f ${f}_i*.tif
+	check "$f: strips" "$tiffmakemosaic" -g 250x150 -O 5 \
+	    --out-strip 10 $f.tif
+	check "$f: strips, layout" layout_is ${f}_i2j2.tif "strips 10"
+	check_pieces $f.tif 250 150 5 9
+
+	rm -f ${f}_i*.tif
+	check "$f: BigTIFF" "$tiffmakemosaic" -B -t 2 -g 600x200 \
+	    --out-tile 128x128 $f.tif
+	check "$f: BigTIFF, layout" layout_is ${f}_i2j1.tif \
+	    "tiles 128x128 bigtiff"
+	check_pieces $f.tif 600 200 0 2
+done
+
+# A whole image as one piece, larger than the memory limit of a piece
+rm -f tiled_i*.tif
+check "one large piece" "$tiffmakemosaic" -M 0.1 -b 1 -g 600x400 \
+    --out-strip 16 tiled.tif
+check "one large piece, layout" layout_is tiled_i1j1.tif "strips 16"
+check_pieces tiled.tif 600 400 0 1
+
+finish
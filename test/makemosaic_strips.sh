@@ -0,0 +1,44 @@
+#!/bin/sh
+# tiffmakemosaic: pieces of stripped compressed files are made in a
+# single pass over the file; when the strips held by libtiff for the
+# open pieces don't fit in the memory budget, in small strips, or one
+# after another.
+
+. "${srcdir:-.}/common.sh"
+
+# mosaic in.tif description options...: make the mosaic of in with the
+# options, verbosely, saving the log
+mosaic () {
+	in=$1
+	shift
+	rm -f ${in%.tif}_i*.tif
+	"$tiffmakemosaic" -v "$@" $in 2> log.txt
+}
+
+make_fixture rgb.tif 600 400 8 3 lzw 0 16 1 texture
+make_fixture gray16.tif 600 400 16 1 deflate 0 7 1 texture
+
+for f in rgb gray16 ; do
+	check "$f: single pass" mosaic $f.tif -g 128x128
+	check "$f: single pass, plan" plan_is "row by row" -g 128x128 $f.tif
+	check_pieces $f.tif 128 128 0 20
+	check "$f: overlap" mosaic $f.tif -g 128x128 -O 10
+	check_pieces $f.tif 128 128 10 20
+	check "$f: 3 threads" mosaic $f.tif -t 3 -g 100x150 -O 3
+	check_pieces $f.tif 100 150 3 18
+done
+
+# The 5 pieces of 128 x 400 pixels open at the same time take 750 KiB
+# as single strips, 120 KiB as strips of 64 rows, the band of the file
+# 144 KiB
+check "small strips" mosaic rgb.tif -g 128x400 -b 0.5
+check "small strips, log" grep -q "small strips" log.txt
+check "small strips, plan" plan_is "row by row" -g 128x400 -b 0.5 rgb.tif
+check_pieces rgb.tif 128 400 0 5
+check "one after another" mosaic rgb.tif -g 128x400 -b 0.2
+check "one after another, log" grep -q "one after another" log.txt
+check "one after another, plan" plan_is "piece by piece" -g 128x400 \
+    -b 0.2 rgb.tif
+check_pieces rgb.tif 128 400 0 5
+
+finish
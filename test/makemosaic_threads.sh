@@ -0,0 +1,47 @@
+#!/bin/sh
+# tiffmakemosaic -t: pieces made in parallel (one after another), or
+# tiles decoded and pieces encoded in parallel (row by row), within the
+# memory budget of option -b.
+
+. "${srcdir:-.}/common.sh"
+
+# mosaic in.tif options...: make the mosaic of in, verbosely, saving the
+# log
+mosaic () {
+	in=$1
+	shift
+	rm -f ${in%.tif}_i*.tif
+	"$tiffmakemosaic" -v "$@" $in 2> log.txt
+}
+
+make_fixture tiled.tif 600 400 8 3 lzw 64 0 1 texture
+
+check "on the grid" mosaic tiled.tif -t 3 -g 128x128
+check "on the grid, plan" plan_is "piece by piece" -t 3 -g 128x128 \
+    tiled.tif
+check_pieces tiled.tif 128 128 0 20
+check "pieces in the budget" mosaic tiled.tif -t 4 -g 128x128 -b 0.1
+check "pieces in the budget, log" grep -q "will make 2 pieces at the same" \
+    log.txt
+check_pieces tiled.tif 128 128 0 20
+
+check "off the grid" mosaic tiled.tif -t 3 -g 96x96
+check "off the grid, plan" plan_is "row by row" -t 3 -g 96x96 tiled.tif
+check_pieces tiled.tif 96 96 0 35
+check "overlap" mosaic tiled.tif -t 3 -g 128x128 -O 16
+check_pieces tiled.tif 128 128 16 20
+
+# With overlap, the 3 pieces of about 232 x 400 pixels open at the same
+# time take 815 KiB as single strips, 130 KiB as strips of 64 rows, the
+# band of tiles and the buffers of 3 threads 156 KiB
+check "small strips" mosaic tiled.tif -t 3 -g 200x400 -O 16 -b 0.5
+check "small strips, log" grep -q "small strips" log.txt
+check_pieces tiled.tif 200 400 16 3
+check "one after another" mosaic tiled.tif -t 3 -g 200x400 -O 16 -b 0.25
+check "one after another, plan" plan_is "piece by piece" -t 3 \
+    -g 200x400 -O 16 -b 0.25 tiled.tif
+check_pieces tiled.tif 200 400 16 3
+check "streamed pieces over the budget" fails "$tiffmakemosaic" -t 3 \
+    -g 200x400 -O 16 -b 0.1 --out-strip 64 tiled.tif
+
+finish
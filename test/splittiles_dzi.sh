@@ -0,0 +1,33 @@
+#!/bin/sh
+# tiffsplittiles -z: Deep Zoom image made of the tiles of the levels of
+# a pyramid, copied without decoding them.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture pyramid.tif 512 384 8 3 jpeg 128 0 3 texture
+check "export" "$tiffsplittiles" -z pyramid.tif
+check "descriptor" grep -q 'Width="512" Height="512"' pyramid.dzi
+check "descriptor: tiles" grep -q 'Overlap="0" TileSize="128"' pyramid.dzi
+
+# Directory d (512x384 divided by 2^d) is level 9-d of the Deep Zoom
+# image (512 = 2^9 pixels once rounded to whole tiles of all levels)
+for d in 0 1 2 ; do
+	level=$((9 - d))
+	width=$((512 >> d))
+	length=$((384 >> d))
+	check "level $level: tiles" [ $(ls pyramid_files/$level | wc -l) -eq \
+	    $(((width + 127) / 128 * ((length + 127) / 128))) ]
+	x=0
+	while [ $x -lt $width ] ; do
+		y=0
+		while [ $y -lt $length ] ; do
+			check "level $level: tile $x,$y" "$fixture" jpegtile \
+			    pyramid.tif $d $x $y \
+			    pyramid_files/$level/$((x / 128))_$((y / 128)).jpg
+			y=$((y + 128))
+		done
+		x=$((x + 128))
+	done
+done
+
+finish
@@ -0,0 +1,19 @@
+#!/bin/sh
+# tiffsplittiles -j: each JPEG file decodes to the pixels of its tile.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture jpeg.tif 300 200 8 3 jpeg 64 0 1 texture
+check "split" "$tiffsplittiles" -j jpeg.tif
+
+for i in 1 2 3 4 5 ; do
+	for j in 1 2 3 4 ; do
+		check "tile $i,$j" "$fixture" jpegtile jpeg.tif 0 \
+		    $(((i - 1) * 64)) $(((j - 1) * 64)) jpeg_t_i${i}j${j}.jpg
+	done
+done
+
+make_fixture lzw.tif 300 200 8 3 lzw 64 0 1 texture
+check "tiles not in JPEG are refused" fails "$tiffsplittiles" -j lzw.tif
+
+finish
@@ -0,0 +1,16 @@
+#!/bin/sh
+# tiffsplittiles -p: the pack holds the header, the JPEG tables, the
+# index and each compressed tile of the file.
+
+. "${srcdir:-.}/common.sh"
+
+make_fixture lzw.tif 300 200 8 3 lzw 64 0 1 texture
+check "lzw: pack" "$tiffsplittiles" -p lzw.tif
+check "lzw: contents" "$fixture" pack lzw.tif lzw_tiles.pack
+check "lzw: no tile files" eval '! ls lzw_t_i*.tif > /dev/null 2>&1'
+
+make_fixture jpeg.tif 300 200 8 3 jpeg 64 0 1 texture
+check "jpeg: pack" "$tiffsplittiles" -p jpeg.tif
+check "jpeg: contents" "$fixture" pack jpeg.tif jpeg_tiles.pack
+
+finish
@@ -0,0 +1,948 @@
+/* tifftestfixture
+
+ Makes the small TIFF files used by the regression tests of
+ LargeTIFFTools, and checks what the tools made of them.
+
+ Copyright (c) Christophe Deroulers, 2012-2021
+
+ Distributed under the GNU General Public License v3 -- contact the
+ author for commercial use */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <tiff.h>
+#include <tiffio.h>
+#include <jpeglib.h>
+
+#include "config.h"
+
+#define EXIT_CHECK_FAILED 1
+#define EXIT_SKIP 77 /* automake: test skipped */
+#define EXIT_HARD_ERROR 99 /* automake: test could not run */
+
+#define BACKGROUND_VALUE 240
+
+#define PATTERN_TEXTURE 0
+#define PATTERN_BACKGROUND 1
+#define PATTERN_SMOOTH 2
+
+
+	/* A directory of a TIFF file, decoded: rows of rowsize bytes,
+	 samples packed as in the file (contiguous planar configuration) */
+struct image {
+	uint32_t width, length;
+	uint16_t bitspersample, spp;
+	tsize_t rowsize;
+	unsigned char * data;
+};
+
+
+	/* Value of sample s of pixel (x,y) of the fixtures: a texture which
+	 makes any shift or mix-up of pixels, rows or samples visible. With
+	 pattern "background", only the top left ninth of the image is
+	 textured and the rest is BACKGROUND_VALUE (at most). With pattern
+	 "smooth", slow waves which survive lossy compression. */
+static uint32_t fixtureSample(uint32_t x, uint32_t y, uint16_t s,
+	uint16_t bitspersample, uint32_t width, uint32_t length,
+	int pattern)
+{
+	uint32_t v;
+
+	if (pattern == PATTERN_SMOOTH)
+		return (uint32_t) ((100 + 20 * s + 90 * sin(x / 40.0) *
+		    cos(y / 30.0)) * ((1u << bitspersample) - 1) / 255);
+	if (pattern == PATTERN_BACKGROUND &&
+	    (x >= width / 3 || y >= length / 3))
+		return BACKGROUND_VALUE & ((1u << bitspersample) - 1);
+	if (bitspersample == 16)
+		return ((x * 300 + y * 7 + s * 5000) ^ (x * y)) & 0xffff;
+	v = (x * 3 + y * 7 + s * 50) ^ ((x * y) >> 6);
+	if (bitspersample == 8)
+		return v & 0xff;
+	return (x * 5 + y * 3 + (x / 7) * (y / 5) + s) &
+	    ((1u << bitspersample) - 1);
+}
+
+
+static void setSample(unsigned char * row, uint32_t x, uint16_t s,
+	uint16_t spp, uint16_t bitspersample, uint32_t v)
+{
+	uint64_t bit = ((uint64_t) x * spp + s) * bitspersample;
+
+	if (bitspersample == 8)
+		row[bit / 8] = v;
+	else if (bitspersample == 16)
+		((uint16_t *) row)[bit / 16] = v;
+	else
+		row[bit / 8] |= v << (8 - bit % 8 - bitspersample);
+}
+
+
+static uint32_t getSample(const struct image * im, uint32_t x, uint32_t y,
+	uint16_t s)
+{
+	const unsigned char * row = im->data + (size_t) y * im->rowsize;
+	uint64_t bit = ((uint64_t) x * im->spp + s) * im->bitspersample;
+
+	if (im->bitspersample == 8)
+		return row[bit / 8];
+	if (im->bitspersample == 16)
+		return ((const uint16_t *) row)[bit / 16];
+	return (row[bit / 8] >> (8 - bit % 8 - im->bitspersample)) &
+	    ((1u << im->bitspersample) - 1);
+}
+
+
+static int parseCompression(const char * name, uint16_t * compression)
+{
+	static const struct { const char * name; uint16_t value; } c[] = {
+		{ "none", COMPRESSION_NONE }, { "lzw", COMPRESSION_LZW },
+		{ "deflate", COMPRESSION_ADOBE_DEFLATE },
+		{ "packbits", COMPRESSION_PACKBITS },
+		{ "jpeg", COMPRESSION_JPEG }, { "g3", COMPRESSION_CCITTFAX3 },
+		{ "g4", COMPRESSION_CCITTFAX4 } };
+	size_t i;
+
+	for (i = 0 ; i < sizeof(c) / sizeof(c[0]) ; i++)
+		if (strcmp(name, c[i].name) == 0) {
+			*compression = c[i].value;
+			return 1;
+		}
+	return 0;
+}
+
+
+	/* make out.tif width length bitspersample spp compression tilesize
+	 rowsperstrip levels pattern: tiled with square tiles if tilesize is
+	 not 0, else stripped; levels directories, each half the size of the
+	 previous one, marked as reduced images */
+static int makeFixture(int argc, char * argv[])
+{
+	uint32_t width, length, tilesize, rowsperstrip, level, levels;
+	uint16_t bitspersample, spp, compression;
+	int pattern;
+	TIFF * out;
+
+	if (argc != 12 || !parseCompression(argv[7], &compression)) {
+		fprintf(stderr, "Usage: tifftestfixture make out.tif width "
+			"length bitspersample spp none|lzw|deflate|packbits|"
+			"jpeg|g3|g4 tilesize rowsperstrip levels "
+			"texture|background|smooth\n");
+		return EXIT_HARD_ERROR;
+	}
+	width = atoi(argv[3]);
+	length = atoi(argv[4]);
+	bitspersample = atoi(argv[5]);
+	spp = atoi(argv[6]);
+	tilesize = atoi(argv[8]);
+	rowsperstrip = atoi(argv[9]);
+	levels = atoi(argv[10]);
+	pattern = strcmp(argv[11], "background") == 0 ? PATTERN_BACKGROUND :
+	    strcmp(argv[11], "smooth") == 0 ? PATTERN_SMOOTH : PATTERN_TEXTURE;
+	if (!TIFFIsCODECConfigured(compression)) {
+		fprintf(stderr, "libtiff can't write compression %s.\n",
+			argv[7]);
+		return EXIT_SKIP;
+	}
+
+	out = TIFFOpen(argv[2], "w");
+	if (out == NULL)
+		return EXIT_HARD_ERROR;
+	for (level = 0 ; level < levels ; level++) {
+		uint32_t w = width >> level, l = length >> level, x, y;
+		tsize_t rowsize = ((uint64_t) w * spp * bitspersample + 7) / 8;
+		unsigned char * image = calloc(l, rowsize);
+		uint16_t s;
+
+		if (image == NULL)
+			return EXIT_HARD_ERROR;
+		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, w);
+		TIFFSetField(out, TIFFTAG_IMAGELENGTH, l);
+		TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bitspersample);
+		TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, spp);
+		TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+		TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
+		if (level > 0)
+			TIFFSetField(out, TIFFTAG_SUBFILETYPE,
+			    FILETYPE_REDUCEDIMAGE);
+		if (compression == COMPRESSION_CCITTFAX3)
+			TIFFSetField(out, TIFFTAG_GROUP3OPTIONS,
+			    GROUP3OPT_2DENCODING | GROUP3OPT_FILLBITS);
+		if (compression == COMPRESSION_JPEG && spp == 3) {
+			TIFFSetField(out, TIFFTAG_PHOTOMETRIC,
+			    PHOTOMETRIC_YCBCR);
+			TIFFSetField(out, TIFFTAG_JPEGCOLORMODE,
+			    JPEGCOLORMODE_RGB);
+			TIFFSetField(out, TIFFTAG_JPEGQUALITY, 90);
+		} else if (spp >= 3)
+			TIFFSetField(out, TIFFTAG_PHOTOMETRIC,
+			    PHOTOMETRIC_RGB);
+		else
+			TIFFSetField(out, TIFFTAG_PHOTOMETRIC,
+			    bitspersample == 1 ? PHOTOMETRIC_MINISWHITE :
+			    PHOTOMETRIC_MINISBLACK);
+		if (tilesize) {
+			TIFFSetField(out, TIFFTAG_TILEWIDTH, tilesize);
+			TIFFSetField(out, TIFFTAG_TILELENGTH, tilesize);
+		} else
+			TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
+
+		for (y = 0 ; y < l ; y++)
+			for (x = 0 ; x < w ; x++)
+				for (s = 0 ; s < spp ; s++)
+					setSample(image + (size_t) y * rowsize,
+					    x, s, spp, bitspersample,
+					    fixtureSample(x << level,
+					    y << level, s, bitspersample,
+					    width, length, pattern));
+
+		if (tilesize) {
+			tsize_t tilerowsize = TIFFTileRowSize(out);
+			unsigned char * tile = malloc(TIFFTileSize(out));
+
+			if (tile == NULL)
+				return EXIT_HARD_ERROR;
+			for (y = 0 ; y < l ; y += tilesize)
+				for (x = 0 ; x < w ; x += tilesize) {
+					uint32_t r;
+					tsize_t offset = (uint64_t) x * spp *
+					    bitspersample / 8, n = rowsize -
+					    offset < tilerowsize ? rowsize -
+					    offset : tilerowsize;
+
+					memset(tile, 0, TIFFTileSize(out));
+					for (r = 0 ; r < tilesize &&
+					    y + r < l ; r++)
+						memcpy(tile + r * tilerowsize,
+						    image + (size_t) (y + r) *
+						    rowsize + offset, n);
+					if (TIFFWriteTile(out, tile, x, y, 0,
+					    0) < 0)
+						return EXIT_HARD_ERROR;
+				}
+			free(tile);
+		} else
+			for (y = 0 ; y < l ; y++)
+				if (TIFFWriteScanline(out, image +
+				    (size_t) y * rowsize, y, 0) < 0)
+					return EXIT_HARD_ERROR;
+		free(image);
+		if (!TIFFWriteDirectory(out))
+			return EXIT_HARD_ERROR;
+	}
+	TIFFClose(out);
+	return 0;
+}
+
+
+	/* Decode directory dir of the TIFF file filename into *im */
+static int loadImage(const char * filename, tdir_t dir, struct image * im)
+{
+	TIFF * in = TIFFOpen(filename, "r");
+	uint16_t planarconfig, photometric, compression;
+	uint32_t x, y;
+
+	if (in == NULL)
+		return 0;
+	if (!TIFFSetDirectory(in, dir)) {
+		TIFFClose(in);
+		return 0;
+	}
+	TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &im->width);
+	TIFFGetField(in, TIFFTAG_IMAGELENGTH, &im->length);
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &im->bitspersample);
+	TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &im->spp);
+	TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG, &planarconfig);
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	if (compression == COMPRESSION_JPEG &&
+	    TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric) &&
+	    photometric == PHOTOMETRIC_YCBCR)
+		TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	if (planarconfig != PLANARCONFIG_CONTIG) {
+		TIFFClose(in);
+		return 0;
+	}
+	im->rowsize = ((uint64_t) im->width * im->spp * im->bitspersample +
+	    7) / 8;
+	im->data = calloc(im->length ? im->length : 1, im->rowsize);
+	if (im->data == NULL) {
+		TIFFClose(in);
+		return 0;
+	}
+
+	if (TIFFIsTiled(in)) {
+		uint32_t tw, tl;
+		tsize_t tilerowsize = TIFFTileRowSize(in);
+		unsigned char * tile = malloc(TIFFTileSize(in));
+
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &tw);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &tl);
+		for (y = 0 ; tile != NULL && y < im->length ; y += tl)
+			for (x = 0 ; x < im->width ; x += tw) {
+				tsize_t offset = (uint64_t) x * im->spp *
+				    im->bitspersample / 8, n = im->rowsize -
+				    offset < tilerowsize ? im->rowsize -
+				    offset : tilerowsize;
+				uint32_t r;
+
+				if (TIFFReadTile(in, tile, x, y, 0, 0) < 0) {
+					free(tile);
+					tile = NULL;
+					break;
+				}
+				for (r = 0 ; r < tl && y + r < im->length ;
+				    r++)
+					memcpy(im->data + (size_t) (y + r) *
+					    im->rowsize + offset, tile +
+					    r * tilerowsize, n);
+			}
+		if (tile == NULL) {
+			TIFFClose(in);
+			return 0;
+		}
+		free(tile);
+	} else
+		for (y = 0 ; y < im->length ; y++)
+			if (TIFFReadScanline(in, im->data + (size_t) y *
+			    im->rowsize, y, 0) < 0) {
+				TIFFClose(in);
+				return 0;
+			}
+	TIFFClose(in);
+	return 1;
+}
+
+
+	/* Decode the JPEG file filename into *im */
+static int loadJPEG(const char * filename, struct image * im)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	uint32_t y;
+	FILE * f;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return 0;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	jpeg_start_decompress(&cinfo);
+	im->width = cinfo.output_width;
+	im->length = cinfo.output_height;
+	im->bitspersample = 8;
+	im->spp = cinfo.output_components;
+	im->rowsize = (tsize_t) im->width * im->spp;
+	im->data = malloc((size_t) im->length * im->rowsize);
+	for (y = 0 ; im->data != NULL && y < im->length ; y++) {
+		JSAMPROW row = im->data + (size_t) y * im->rowsize;
+
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	if (im->data != NULL)
+		jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	return im->data != NULL;
+}
+
+
+	/* compare reference.tif x y extract.tif [pad,pad...]: the extract is
+	 the region of the reference whose top left corner is (x,y); with
+	 padding values (one per sample), pixels of the extract beyond the
+	 right or bottom of the reference are these values */
+static int compareRegion(int argc, char * argv[])
+{
+	struct image ref, ext;
+	uint32_t x0, y0, x, y, bad = 0, pad[8], expected;
+	uint16_t s, npad = 0;
+	char * p;
+
+	if (argc != 6 && argc != 7) {
+		fprintf(stderr, "Usage: tifftestfixture compare reference.tif"
+			" x y extract.tif [pad,pad...]\n");
+		return EXIT_HARD_ERROR;
+	}
+	x0 = atoi(argv[3]);
+	y0 = atoi(argv[4]);
+	for (p = argc == 7 ? argv[6] : NULL ; p != NULL &&
+	    npad < sizeof(pad) / sizeof(pad[0]) ; npad++) {
+		pad[npad] = strtoul(p, &p, 10);
+		p = *p == ',' ? p + 1 : NULL;
+	}
+	if (!loadImage(argv[2], 0, &ref) || !loadImage(argv[5], 0, &ext)) {
+		fprintf(stderr, "Can't read \"%s\" or \"%s\".\n", argv[2],
+			argv[5]);
+		return EXIT_CHECK_FAILED;
+	}
+	if (ext.bitspersample != ref.bitspersample || ext.spp != ref.spp ||
+	    (npad != 0 && npad != ref.spp) || (npad == 0 &&
+	    (x0 + ext.width > ref.width || y0 + ext.length > ref.length))) {
+		fprintf(stderr, "\"%s\": unexpected dimensions or samples.\n",
+			argv[5]);
+		return EXIT_CHECK_FAILED;
+	}
+	for (y = 0 ; y < ext.length ; y++)
+		for (x = 0 ; x < ext.width ; x++)
+			for (s = 0 ; s < ext.spp ; s++) {
+				if (x0 + x < ref.width && y0 + y < ref.length)
+					expected = getSample(&ref, x0 + x,
+					    y0 + y, s);
+				else
+					expected = pad[s];
+				if (getSample(&ext, x, y, s) != expected &&
+				    bad++ == 0)
+					fprintf(stderr, "\"%s\": first "
+						"difference at (%u,%u), "
+						"sample %u.\n", argv[5], x, y,
+						s);
+			}
+	return bad ? EXIT_CHECK_FAILED : 0;
+}
+
+
+	/* Range of source pixels along one axis making pixel o of a scaled
+	 extract, as tifffastcrop computes it */
+static void sourceRange(double step, int box, uint32_t sourcesize,
+	uint32_t o, uint32_t * first, uint32_t * second, double * weight)
+{
+	if (box) {
+		double a = o * step;
+
+		*first = (uint32_t) floor(a);
+		*second = (uint32_t) ceil(a + step);
+		if (*first >= sourcesize)
+			*first = sourcesize - 1;
+		if (*second > sourcesize)
+			*second = sourcesize;
+		if (*second <= *first)
+			*second = *first + 1;
+		*weight = 0;
+	} else {
+		double c = (o + 0.5) * step - 0.5;
+
+		if (c < 0)
+			c = 0;
+		if (c > sourcesize - 1)
+			c = sourcesize - 1;
+		*first = (uint32_t) floor(c);
+		*second = *first + 1 < sourcesize ? *first + 1 : *first;
+		*weight = c - *first;
+	}
+}
+
+
+	/* Value of a column of the region, filtered along y */
+static double filteredColumn(const struct image * im, uint32_t x,
+	uint32_t y0, uint32_t first, uint32_t second, double weight,
+	int boxy, uint16_t s)
+{
+	double sum = 0;
+	uint32_t r;
+
+	if (!boxy)
+		return getSample(im, x, y0 + first, s) + weight *
+		    ((double) getSample(im, x, y0 + second, s) -
+		    getSample(im, x, y0 + first, s));
+	for (r = first ; r < second ; r++)
+		sum += getSample(im, x, y0 + r, s);
+	return sum / (second - first);
+}
+
+
+	/* scale source.tif x y width length factor extract.tif: the extract
+	 is the region of the source (a single directory) scaled by factor
+	 as tifffastcrop --scale does it: a box filter along each axis with
+	 at least 2 source pixels per extract pixel, exact with integer
+	 rounding when both axes use it; bilinear interpolation along the
+	 others, where float rounding may differ by 1 */
+static int checkScaledExtract(int argc, char * argv[])
+{
+	struct image src, ext;
+	uint32_t x0, y0, width, length, outwidth, outlength, ox, oy;
+	uint32_t bad = 0, maxdiff = 0;
+	double factor, num, den, stepx, stepy;
+	int boxx, boxy;
+	uint16_t s;
+
+	if (argc != 9) {
+		fprintf(stderr, "Usage: tifftestfixture scale source.tif x y"
+			" width length factor extract.tif\n");
+		return EXIT_HARD_ERROR;
+	}
+	x0 = atoi(argv[3]);
+	y0 = atoi(argv[4]);
+	width = atoi(argv[5]);
+	length = atoi(argv[6]);
+	if (sscanf(argv[7], "%lf/%lf", &num, &den) == 2)
+		factor = num / den;
+	else
+		factor = atof(argv[7]);
+	if (!loadImage(argv[2], 0, &src) || !loadImage(argv[8], 0, &ext)) {
+		fprintf(stderr, "Can't read \"%s\" or \"%s\".\n", argv[2],
+			argv[8]);
+		return EXIT_CHECK_FAILED;
+	}
+	if (width > src.width - x0)
+		width = src.width - x0;
+	if (length > src.length - y0)
+		length = src.length - y0;
+	outwidth = (uint32_t) (width * factor + 0.5);
+	outlength = (uint32_t) (length * factor + 0.5);
+	if (outwidth == 0)
+		outwidth = 1;
+	if (outlength == 0)
+		outlength = 1;
+	if (ext.width != outwidth || ext.length != outlength ||
+	    ext.spp != src.spp || ext.bitspersample != src.bitspersample) {
+		fprintf(stderr, "\"%s\": %ux%u pixels, %ux%u expected.\n",
+			argv[8], ext.width, ext.length, outwidth, outlength);
+		return EXIT_CHECK_FAILED;
+	}
+	stepx = (double) width / outwidth;
+	stepy = (double) length / outlength;
+	boxx = stepx >= 2;
+	boxy = stepy >= 2;
+
+	for (oy = 0 ; oy < outlength ; oy++) {
+		uint32_t r0, r1, c0, c1, c;
+		double wy, wx;
+
+		sourceRange(stepy, boxy, length, oy, &r0, &r1, &wy);
+		for (ox = 0 ; ox < outwidth ; ox++) {
+			sourceRange(stepx, boxx, width, ox, &c0, &c1, &wx);
+			for (s = 0 ; s < src.spp ; s++) {
+				uint32_t expected, got, d;
+
+				if (boxx && boxy) {
+					uint64_t sum = 0, area = (uint64_t)
+					    (c1 - c0) * (r1 - r0);
+					uint32_t r;
+
+					for (r = r0 ; r < r1 ; r++)
+						for (c = c0 ; c < c1 ; c++)
+							sum += getSample(&src,
+							    x0 + c, y0 + r, s);
+					expected = (sum + area / 2) / area;
+				} else if (boxx) {
+					double sum = 0;
+
+					for (c = c0 ; c < c1 ; c++)
+						sum += filteredColumn(&src,
+						    x0 + c, y0, r0, r1, wy,
+						    boxy, s);
+					expected = sum / (c1 - c0) + 0.5;
+				} else {
+					double v0 = filteredColumn(&src,
+					    x0 + c0, y0, r0, r1, wy, boxy, s),
+					    v1 = filteredColumn(&src, x0 + c1,
+					    y0, r0, r1, wy, boxy, s);
+
+					expected = v0 + wx * (v1 - v0) + 0.5;
+				}
+				got = getSample(&ext, ox, oy, s);
+				d = got > expected ? got - expected :
+				    expected - got;
+				if (d > maxdiff)
+					maxdiff = d;
+				if (d > (boxx && boxy ? 0 : 1) && bad++ == 0)
+					fprintf(stderr, "\"%s\": first "
+						"difference at (%u,%u), sample"
+						" %u: %u instead of %u.\n",
+						argv[8], ox, oy, s, got,
+						expected);
+			}
+		}
+	}
+	return bad ? EXIT_CHECK_FAILED : 0;
+}
+
+
+	/* layout file.tif: print how the first directory of the file is
+	 laid out, "tiles WxL" or "strips R" (rows per strip), followed by
+	 " bigtiff" for a BigTIFF file */
+static int printLayout(int argc, char * argv[])
+{
+	uint32_t tilewidth, tilelength, rowsperstrip;
+	TIFF * in;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: tifftestfixture layout file.tif\n");
+		return EXIT_HARD_ERROR;
+	}
+	if ((in = TIFFOpen(argv[2], "r")) == NULL)
+		return EXIT_CHECK_FAILED;
+	if (TIFFIsTiled(in)) {
+		TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth);
+		TIFFGetField(in, TIFFTAG_TILELENGTH, &tilelength);
+		printf("tiles %ux%u", tilewidth, tilelength);
+	} else {
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+		printf("strips %u", rowsperstrip);
+	}
+	printf("%s\n", TIFFIsBigTIFF(in) ? " bigtiff" : "");
+	TIFFClose(in);
+	return 0;
+}
+
+
+	/* bytes file.tif: print the number of bytes of the tiles or strips
+	 of the first directory of the file */
+static int printByteCounts(int argc, char * argv[])
+{
+	uint64_t * bytecounts, total = 0;
+	uint32_t k, n;
+	TIFF * in;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: tifftestfixture bytes file.tif\n");
+		return EXIT_HARD_ERROR;
+	}
+	if ((in = TIFFOpen(argv[2], "r")) == NULL)
+		return EXIT_CHECK_FAILED;
+	n = TIFFIsTiled(in) ? TIFFNumberOfTiles(in) : TIFFNumberOfStrips(in);
+	if (!TIFFGetField(in, TIFFTAG_STRIPBYTECOUNTS, &bytecounts)) {
+		TIFFClose(in);
+		return EXIT_CHECK_FAILED;
+	}
+	for (k = 0 ; k < n ; k++)
+		total += bytecounts[k];
+	printf("%llu\n", (unsigned long long) total);
+	TIFFClose(in);
+	return 0;
+}
+
+
+	/* Span along one direction of the tile of a Deep Zoom level which
+	 starts at start, with overlap, as tiffmakemosaic --dzi makes it */
+static void tileSpan(uint32_t start, uint32_t tilesize, uint32_t overlap,
+	uint32_t levelsize, uint32_t * spanstart, uint32_t * spansize)
+{
+	uint32_t before = start < overlap ? start : overlap;
+	uint32_t after = levelsize - start < tilesize + overlap ?
+	    levelsize - start : tilesize + overlap;
+
+	*spanstart = start - before;
+	*spansize = before + after;
+}
+
+
+	/* dzi in.tif prefix tilesize overlap maxerror: the Deep Zoom pyramid
+	 prefix.dzi, prefix_files made from the 8-bit in has a level for
+	 each halving of in down to 1 x 1, each made by averaging the pixels
+	 of the level above 2 by 2, and each JPEG tile of each level is its
+	 region, with overlap, within a mean absolute error of maxerror */
+static int checkDeepZoom(int argc, char * argv[])
+{
+	struct image level, below;
+	uint32_t tilesize, overlap, nlevels, l, w, h, i, j, x, y;
+	double maxerror;
+	uint16_t s;
+
+	if (argc != 7) {
+		fprintf(stderr, "Usage: tifftestfixture dzi in.tif prefix "
+			"tilesize overlap maxerror\n");
+		return EXIT_HARD_ERROR;
+	}
+	tilesize = atoi(argv[4]);
+	overlap = atoi(argv[5]);
+	maxerror = atof(argv[6]);
+	if (!loadImage(argv[2], 0, &level) || level.bitspersample != 8)
+		return EXIT_HARD_ERROR;
+	for (nlevels = 1, w = level.width, h = level.length ; w > 1 || h > 1 ;
+	    nlevels++) {
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+
+	for (l = nlevels ; l-- > 0 ; ) {
+		for (i = 0 ; i * tilesize < level.length ; i++)
+			for (j = 0 ; j * tilesize < level.width ; j++) {
+				struct image tile;
+				uint32_t x0, y0, width, length;
+				uint64_t error = 0;
+				char name[4096];
+
+				tileSpan(j * tilesize, tilesize, overlap,
+				    level.width, &x0, &width);
+				tileSpan(i * tilesize, tilesize, overlap,
+				    level.length, &y0, &length);
+				snprintf(name, sizeof(name), "%s_files/%u/%u_%u.jpg",
+				    argv[3], l, j, i);
+				if (!loadJPEG(name, &tile)) {
+					fprintf(stderr, "\"%s\" is missing.\n",
+						name);
+					return EXIT_CHECK_FAILED;
+				}
+				if (tile.width != width || tile.length != length ||
+				    tile.spp != level.spp) {
+					fprintf(stderr, "\"%s\": %ux%u pixels, "
+						"%ux%u expected.\n", name,
+						tile.width, tile.length, width,
+						length);
+					return EXIT_CHECK_FAILED;
+				}
+				for (y = 0 ; y < length ; y++)
+					for (x = 0 ; x < width ; x++)
+						for (s = 0 ; s < level.spp ; s++)
+							error += abs((int)
+							    getSample(&tile, x, y, s) -
+							    (int) getSample(&level,
+							    x0 + x, y0 + y, s));
+				free(tile.data);
+				if (error > maxerror * width * length *
+				    level.spp) {
+					fprintf(stderr, "\"%s\": mean error %.2f."
+						"\n", name, (double) error /
+						width / length / level.spp);
+					return EXIT_CHECK_FAILED;
+				}
+			}
+		if (l == 0)
+			break;
+
+		/* The level below: 2 x 2 pixels averaged, 2 x 1 or 1 x 2 at
+		 odd edges, and the last row and column paired with themselves */
+		below = level;
+		below.width = (level.width + 1) / 2;
+		below.length = (level.length + 1) / 2;
+		below.rowsize = (tsize_t) below.width * level.spp;
+		below.data = malloc((size_t) below.length * below.rowsize);
+		if (below.data == NULL)
+			return EXIT_HARD_ERROR;
+		for (y = 0 ; y < below.length ; y++) {
+			uint32_t y1 = 2 * y + 1 < level.length ? 2 * y + 1 :
+			    2 * y;
+
+			for (x = 0 ; x < below.width ; x++)
+				for (s = 0 ; s < level.spp ; s++) {
+					uint32_t x1 = 2 * x + 1;
+
+					below.data[(size_t) y * below.rowsize +
+					    x * level.spp + s] = x1 < level.width ?
+					    (getSample(&level, 2 * x, 2 * y, s) +
+					    getSample(&level, x1, 2 * y, s) +
+					    getSample(&level, 2 * x, y1, s) +
+					    getSample(&level, x1, y1, s) + 2) / 4 :
+					    (getSample(&level, 2 * x, 2 * y, s) +
+					    getSample(&level, 2 * x, y1, s) + 1) / 2;
+				}
+		}
+		free(level.data);
+		level = below;
+	}
+	free(level.data);
+	return 0;
+}
+
+
+	/* uniform in.tif x y width length value: all the samples of the
+	 region of in are value */
+static int checkUniformRegion(int argc, char * argv[])
+{
+	struct image im;
+	uint32_t x0, y0, width, length, value, x, y;
+	uint16_t s;
+
+	if (argc != 8) {
+		fprintf(stderr, "Usage: tifftestfixture uniform in.tif x y "
+			"width length value\n");
+		return EXIT_HARD_ERROR;
+	}
+	x0 = atoi(argv[3]);
+	y0 = atoi(argv[4]);
+	width = atoi(argv[5]);
+	length = atoi(argv[6]);
+	value = atoi(argv[7]);
+	if (!loadImage(argv[2], 0, &im))
+		return EXIT_HARD_ERROR;
+	for (y = y0 ; y < y0 + length && y < im.length ; y++)
+		for (x = x0 ; x < x0 + width && x < im.width ; x++)
+			for (s = 0 ; s < im.spp ; s++)
+				if (getSample(&im, x, y, s) != value) {
+					fprintf(stderr, "\"%s\": (%u,%u) is "
+						"not background.\n", argv[2],
+						x, y);
+					return EXIT_CHECK_FAILED;
+				}
+	return 0;
+}
+
+
+	/* Value of the nbytes bytes at p, least significant first */
+static uint64_t getLittleEndian(const unsigned char * p, int nbytes)
+{
+	uint64_t v = 0;
+
+	while (nbytes-- > 0)
+		v = v << 8 | p[nbytes];
+	return v;
+}
+
+
+	/* pack in.tif in_tiles.pack: the header, the JPEG tables and the
+	 index of the pack made by tiffsplittiles -p match in, and each tile
+	 in the pack is the compressed tile of in */
+static int checkPack(int argc, char * argv[])
+{
+	unsigned char header[64], entry[16], * packed, * raw;
+	uint64_t indexoffset, previousend = 0;
+	uint32_t tablessize = 0, k, n;
+	void * tables;
+	TIFF * in;
+	FILE * f;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: tifftestfixture pack in.tif "
+			"in_tiles.pack\n");
+		return EXIT_HARD_ERROR;
+	}
+	in = TIFFOpen(argv[2], "r");
+	f = fopen(argv[3], "rb");
+	if (in == NULL || f == NULL || fread(header, 1, sizeof(header), f) !=
+	    sizeof(header) || memcmp(header, "LTTPACK1", 8) != 0) {
+		fprintf(stderr, "\"%s\": missing or not a pack.\n", argv[3]);
+		return EXIT_CHECK_FAILED;
+	}
+	n = TIFFNumberOfTiles(in);
+	if (getLittleEndian(header + 24, 4) * getLittleEndian(header + 28, 4)
+	    != n) {
+		fprintf(stderr, "\"%s\": wrong number of tiles.\n", argv[3]);
+		return EXIT_CHECK_FAILED;
+	}
+	if (!TIFFGetField(in, TIFFTAG_JPEGTABLES, &tablessize, &tables))
+		tablessize = 0;
+	if (getLittleEndian(header + 48, 4) != tablessize) {
+		fprintf(stderr, "\"%s\": wrong JPEG tables.\n", argv[3]);
+		return EXIT_CHECK_FAILED;
+	}
+	if (tablessize) {
+		unsigned char * t = malloc(tablessize);
+
+		if (t == NULL || fseek(f, getLittleEndian(header + 40, 8),
+		    SEEK_SET) != 0 || fread(t, 1, tablessize, f) !=
+		    tablessize || memcmp(t, tables, tablessize) != 0) {
+			fprintf(stderr, "\"%s\": wrong JPEG tables.\n",
+				argv[3]);
+			return EXIT_CHECK_FAILED;
+		}
+		free(t);
+	}
+
+	indexoffset = getLittleEndian(header + 56, 8);
+	raw = malloc(TIFFTileSize(in) * 2 + 65536);
+	packed = malloc(TIFFTileSize(in) * 2 + 65536);
+	if (raw == NULL || packed == NULL)
+		return EXIT_HARD_ERROR;
+	for (k = 0 ; k < n ; k++) {
+		uint64_t offset, size;
+		tsize_t rawsize;
+
+		if (fseek(f, indexoffset + 16 * (uint64_t) k, SEEK_SET) != 0 ||
+		    fread(entry, 1, sizeof(entry), f) != sizeof(entry))
+			return EXIT_CHECK_FAILED;
+		offset = getLittleEndian(entry, 8);
+		size = getLittleEndian(entry + 8, 8);
+		rawsize = TIFFReadRawTile(in, k, raw, TIFFTileSize(in) * 2 +
+		    65536);
+		if (rawsize < 0 || (uint64_t) rawsize != size ||
+		    (k > 0 && offset != previousend) ||
+		    fseek(f, offset, SEEK_SET) != 0 ||
+		    fread(packed, 1, size, f) != size ||
+		    memcmp(raw, packed, size) != 0) {
+			fprintf(stderr, "\"%s\": tile #%u differs.\n",
+				argv[3], k);
+			return EXIT_CHECK_FAILED;
+		}
+		previousend = offset + size;
+	}
+	free(raw);
+	free(packed);
+	fclose(f);
+	TIFFClose(in);
+	return 0;
+}
+
+
+	/* jpegtile in.tif dir x y tile.jpg: the JPEG file decodes to the
+	 same pixels as the tile of directory dir of in at (x,y) */
+static int checkJPEGTile(int argc, char * argv[])
+{
+	struct image jpeg;
+	unsigned char * tile;
+	uint32_t tilewidth, tilelength, y, bad = 0;
+	uint16_t photometric;
+	tsize_t rowsize;
+	TIFF * in;
+
+	if (argc != 7) {
+		fprintf(stderr, "Usage: tifftestfixture jpegtile in.tif dir x"
+			" y tile.jpg\n");
+		return EXIT_HARD_ERROR;
+	}
+	in = TIFFOpen(argv[2], "r");
+	if (in == NULL || !TIFFSetDirectory(in, atoi(argv[3])) ||
+	    !TIFFIsTiled(in))
+		return EXIT_HARD_ERROR;
+	TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth);
+	TIFFGetField(in, TIFFTAG_TILELENGTH, &tilelength);
+	if (TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric) &&
+	    photometric == PHOTOMETRIC_YCBCR)
+		TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	rowsize = TIFFTileRowSize(in);
+	tile = malloc(TIFFTileSize(in));
+	if (tile == NULL || TIFFReadTile(in, tile, atoi(argv[4]),
+	    atoi(argv[5]), 0, 0) < 0)
+		return EXIT_HARD_ERROR;
+	if (!loadJPEG(argv[6], &jpeg)) {
+		fprintf(stderr, "\"%s\" is missing.\n", argv[6]);
+		return EXIT_CHECK_FAILED;
+	}
+	if (jpeg.width != tilewidth || jpeg.length != tilelength ||
+	    jpeg.rowsize != rowsize) {
+		fprintf(stderr, "\"%s\": %ux%u pixels, %ux%u expected.\n",
+			argv[6], jpeg.width, jpeg.length, tilewidth,
+			tilelength);
+		return EXIT_CHECK_FAILED;
+	}
+	for (y = 0 ; y < tilelength ; y++)
+		if (memcmp(jpeg.data + y * rowsize, tile + y * rowsize,
+		    rowsize) != 0)
+			bad++;
+	if (bad)
+		fprintf(stderr, "\"%s\": %u rows differ.\n", argv[6], bad);
+	free(jpeg.data);
+	free(tile);
+	TIFFClose(in);
+	return bad ? EXIT_CHECK_FAILED : 0;
+}
+
+
+int main(int argc, char * argv[])
+{
+	TIFFSetWarningHandler(NULL);
+	if (argc >= 2 && strcmp(argv[1], "make") == 0)
+		return makeFixture(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "compare") == 0)
+		return compareRegion(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "scale") == 0)
+		return checkScaledExtract(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "layout") == 0)
+		return printLayout(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "dzi") == 0)
+		return checkDeepZoom(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "bytes") == 0)
+		return printByteCounts(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "uniform") == 0)
+		return checkUniformRegion(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "pack") == 0)
+		return checkPack(argc, argv);
+	if (argc >= 2 && strcmp(argv[1], "jpegtile") == 0)
+		return checkJPEGTile(argc, argv);
+	fprintf(stderr, "Usage: tifftestfixture make|compare|scale|layout|"
+		"dzi|bytes|uniform|pack|jpegtile ...\n");
+	return EXIT_HARD_ERROR;
+}